@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include "adlist.h"
 #include "zmalloc.h"
+#include "slab.h"
 
 /**
  * 创建一个新的list
@@ -34,7 +35,7 @@ void listRelease(List *list) {
         if (list->free) {
             list->free(current->value);
         }
-        zfree(current);
+        slabFree(current);
         current = next;
     }
 
@@ -47,7 +48,7 @@ void listRelease(List *list) {
  * @return list or NULL if no memory space
  */
 List *listAddNodeHead(List *list, void *value) {
-    ListNode *node = zmalloc(sizeof(ListNode));
+    ListNode *node = slabMalloc(sizeof(ListNode));
     if (node == NULL) {
         return NULL;
     }
@@ -70,7 +71,7 @@ List *listAddNodeHead(List *list, void *value) {
  * @return list or NULL if no memory space
  */
 List *listAddNodeTail(List *list, void *value) {
-    ListNode *node = zmalloc(sizeof(ListNode));
+    ListNode *node = slabMalloc(sizeof(ListNode));
     if (node == NULL) {
         return NULL;
     }
@@ -110,7 +111,7 @@ void listDelNode(List *list, ListNode *node) {
         list->free(node->value);
     }
 
-    zfree(node);
+    slabFree(node);
     list->len--;
 }
 
@@ -220,6 +221,19 @@ ListNode *listSearchKey(List *list, void *key) {
 ListNode *listIndex(List *list, int index) {
     ListNode *n;
 
+    // 越界时直接返回, 否则转换之后会从另一端找到一个错误的node
+    if ((index >= 0 && (unsigned long) index >= list->len) ||
+        (index < 0 && (unsigned long) (-(long) index) > list->len)) {
+        return NULL;
+    }
+
+    // 转换成离得更近的一端的下标
+    if (index >= 0 && (unsigned int) index > list->len / 2) {
+        index = index - (int) list->len;
+    } else if (index < 0 && (unsigned int) (-(index + 1)) > list->len / 2) {
+        index = index + (int) list->len;
+    }
+
     if (index < 0) {
         index = (-index) - 1;
         n = list->tail;
@@ -235,6 +249,24 @@ ListNode *listIndex(List *list, int index) {
     return n;
 }
 
+/**
+ * 把尾部的node移动到头部, 用于对list做轮询式的增量处理
+ */
+void listRotate(List *list) {
+    if (list->len <= 1) {
+        return;
+    }
+
+    ListNode *tail = list->tail;
+    list->tail = tail->prev;
+    list->tail->next = NULL;
+
+    tail->prev = NULL;
+    tail->next = list->head;
+    list->head->prev = tail;
+    list->head = tail;
+}
+
 /************************* for debug *******************/
 int *i_dup(int *v) {
     int *p = zmalloc(sizeof(int));
@@ -312,5 +344,17 @@ int main() {
     printList(copy, AL_START_HEAD);
     printList(list, AL_START_HEAD);
 
+    // 越界的下标必须返回NULL, 不能从另一端找到一个node
+    int len = (int) list->len;
+    int indexes[] = {0, len / 2, len - 1, len, len + 1, -1, -len, -len - 1, -len * 2};
+    for (int i = 0; i < (int) (sizeof(indexes) / sizeof(indexes[0])); i++) {
+        node = listIndex(list, indexes[i]);
+        if (node == NULL) {
+            printf("index %d: NULL\n", indexes[i]);
+        } else {
+            printf("index %d: %d\n", indexes[i], *(int*) node->value);
+        }
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -66,6 +66,7 @@ List *listDup(List *origin);
 
 ListNode *listSearchKey(List *list, void *key);
 ListNode *listIndex(List *list, int index);
+void listRotate(List *list);
 
 
 #endif
\ No newline at end of file
@@ -6,6 +6,7 @@
 
 #include "ae.h"
 #include "zmalloc.h"
+#include "slab.h"
 
 AeEventLoop *aeCreateEventLoop(void) {
     AeEventLoop *eventLoop = zmalloc(sizeof(*eventLoop));
@@ -17,6 +18,7 @@ AeEventLoop *aeCreateEventLoop(void) {
     eventLoop->timeEventHead = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
+    eventLoop->beforesleep = NULL;
     return eventLoop;
 }
 
@@ -30,7 +32,7 @@ void aeStop(AeEventLoop *eventLoop) {
 
 int aeCreateFileEvent(AeEventLoop *eventLoop, int fd, int mask, 
                       aeFileProc *proc, void *clientData, aeEventFinalizeProc *finalizeProc) {
-    AeFileEvent *fe = zmalloc(sizeof(*fe));
+    AeFileEvent *fe = slabMalloc(sizeof(*fe));
     if (fe == NULL) {
         return AE_ERR;
     }
@@ -59,7 +61,7 @@ void aeDeleteFileEvent(AeEventLoop *eventLoop, int fd, int mask) {
                 fe->finalizeProc(eventLoop, fe->clientData);
             }
 
-            zfree(fe);
+            slabFree(fe);
             return;
         }
         prev = fe;
@@ -376,6 +378,13 @@ void aeMain(AeEventLoop *eventLoop) {
     // 这样不一下子就跳出了吗
     eventLoop->stop = 0;
     while (!eventLoop->stop) {
+        if (eventLoop->beforesleep != NULL) {
+            eventLoop->beforesleep(eventLoop);
+        }
         aeProcessEvents(eventLoop, AE_ALL_EVENT);
     }
+}
+
+void aeSetBeforeSleepProc(AeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
+    eventLoop->beforesleep = beforesleep;
 }
\ No newline at end of file
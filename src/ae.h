@@ -2,6 +2,7 @@
 #define __AE_H__
 
 struct aeEventLoop;
+struct AeEventLoop;
 
 /** 文件事件和时间事件处理，和事件销毁器，定义函数类型 */
 typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientdata, int mask);
@@ -10,6 +11,8 @@ typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientdata,
  */
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizeProc(struct aeEventLoop *eventLoop, void *clientData);
+/** 每次事件循环处理完事件、准备进入下一次等待之前调用 */
+typedef void aeBeforeSleepProc(struct AeEventLoop *eventLoop);
 
 /** File Event struct */
 typedef struct AeFileEvent {
@@ -39,6 +42,7 @@ typedef struct AeEventLoop {
     AeFileEvent *fileEventHead;
     AeTimeEvent *timeEventHead;
     int stop;
+    aeBeforeSleepProc *beforesleep;
 } AeEventLoop;
 
 #define AE_OK 0
@@ -73,5 +77,6 @@ int aeDeleteTimeEvent(AeEventLoop *eventLoop, long long id);
 int aeProcessEvents(AeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask , long long milliseconds);
 void aeMain(AeEventLoop *eventLoop);
+void aeSetBeforeSleepProc(AeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
 
 #endif
\ No newline at end of file
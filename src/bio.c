@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "bio.h"
+#include "zmalloc.h"
+#include "slab.h"
+
+/** 后台线程的栈, 默认的8MB没有必要 */
+#define BIO_THREAD_STACK_SIZE (1024*1024)
+
+typedef struct BioJob {
+    struct BioJob *next;
+    bioJobProc *proc;
+    void *arg1;
+    void *arg2;
+} BioJob;
+
+typedef struct BioQueue {
+    BioJob *head;
+    BioJob *tail;
+    unsigned long long pending; // 队列中的加上正在执行的
+    pthread_mutex_t mutex;
+    pthread_cond_t newjob;
+    pthread_cond_t stepjob; // 每完成一个任务通知一次
+    pthread_t thread;
+} BioQueue;
+
+static BioQueue queues[BIO_NUM_OPS];
+
+static void *bioProcessBackgroundJobs(void *arg) {
+    BioQueue *q = arg;
+
+    // 信号都由主线程处理
+    sigset_t sigset;
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    slabSetRemoteFreeThread();
+
+    pthread_mutex_lock(&q->mutex);
+    while (1) {
+        if (q->head == NULL) {
+            pthread_cond_wait(&q->newjob, &q->mutex);
+            continue;
+        }
+        BioJob *job = q->head;
+        q->head = job->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        pthread_mutex_unlock(&q->mutex);
+
+        job->proc(job->arg1, job->arg2);
+        zfree(job);
+
+        pthread_mutex_lock(&q->mutex);
+        q->pending--;
+        pthread_cond_broadcast(&q->stepjob);
+    }
+    return NULL;
+}
+
+void bioInit(void) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, BIO_THREAD_STACK_SIZE);
+
+    for (int j = 0; j < BIO_NUM_OPS; j++) {
+        BioQueue *q = &queues[j];
+        q->head = q->tail = NULL;
+        q->pending = 0;
+        pthread_mutex_init(&q->mutex, NULL);
+        pthread_cond_init(&q->newjob, NULL);
+        pthread_cond_init(&q->stepjob, NULL);
+        if (pthread_create(&q->thread, &attr, bioProcessBackgroundJobs, q) != 0) {
+            fprintf(stderr, "Fatal: can't initialize background jobs\n");
+            exit(1);
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void bioSubmitJob(int type, bioJobProc *proc, void *arg1, void *arg2) {
+    BioJob *job = zmalloc(sizeof(*job));
+    if (job == NULL) {
+        // 内存不够时直接在当前线程执行
+        proc(arg1, arg2);
+        return;
+    }
+    job->next = NULL;
+    job->proc = proc;
+    job->arg1 = arg1;
+    job->arg2 = arg2;
+
+    BioQueue *q = &queues[type];
+    pthread_mutex_lock(&q->mutex);
+    if (q->tail != NULL) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+    q->pending++;
+    pthread_cond_signal(&q->newjob);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+unsigned long long bioPendingJobsOfType(int type) {
+    BioQueue *q = &queues[type];
+    pthread_mutex_lock(&q->mutex);
+    unsigned long long pending = q->pending;
+    pthread_mutex_unlock(&q->mutex);
+    return pending;
+}
+
+void bioWaitPendingJobsOfType(int type, unsigned long long n) {
+    BioQueue *q = &queues[type];
+    pthread_mutex_lock(&q->mutex);
+    while (q->pending > n) {
+        pthread_cond_wait(&q->stepjob, &q->mutex);
+    }
+    pthread_mutex_unlock(&q->mutex);
+}
@@ -0,0 +1,40 @@
+#ifndef __BIO_H
+#define __BIO_H
+
+/**
+ * 后台线程: 把会长时间阻塞主线程的操作(释放很大的对象, fsync等)交给后台线程执行
+ *
+ * 每种任务类型一个线程和一个FIFO队列, 同一类型的任务按提交的顺序执行
+ * 任务就是一个函数指针加两个参数, 由提交者决定做什么; 后台线程可以zfree,
+ * slabFree的对象会交还给主线程归还(见slabSetRemoteFreeThread), 但是不能slabMalloc
+ */
+
+#define BIO_LAZY_FREE 0
+/** appendfsync everysec时的fdatasync */
+#define BIO_AOF_FSYNC 1
+/** 加载快照时解码value, 每个线程一种类型: BIO_RDB_DECODE + i */
+#define BIO_RDB_DECODE 2
+#define BIO_RDB_DECODE_THREADS 4
+#define BIO_NUM_OPS (BIO_RDB_DECODE + BIO_RDB_DECODE_THREADS)
+
+typedef void bioJobProc(void *arg1, void *arg2);
+
+/**
+ * 创建所有后台线程, 只能调用一次
+ */
+void bioInit(void);
+
+void bioSubmitJob(int type, bioJobProc *proc, void *arg1, void *arg2);
+
+/**
+ * @return 这种类型还没有执行完的任务个数
+ */
+unsigned long long bioPendingJobsOfType(int type);
+
+/**
+ * 阻塞直到这种类型还没有执行完的任务不超过n个
+ * 任务按提交的顺序执行, 所以n为1时返回说明除了最后提交的那个, 之前的任务都已经完成
+ */
+void bioWaitPendingJobsOfType(int type, unsigned long long n);
+
+#endif
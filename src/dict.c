@@ -3,9 +3,12 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <sys/time.h>
 
 #include "zmalloc.h"
 #include "dict.h"
+#include "dictspec.h"
+#include "slab.h"
 
 /*************************** Utility functions **********************/
 static void _dictPanic(const char *fmt, ...) {
@@ -32,13 +35,18 @@ static void _dictFree(void *ptr) {
 }
 
 /******************* private prototypes **************************/
-static int _dictExpandIfNeeded(Dict *ht);
 static unsigned int _dictNextPower(unsigned int size);
 static int _dictKeyIndex(Dict *ht, const void *key);
 static int _dictInit(Dict *ht, DictType *type, void *privDataPtr);
 
 static int _dictEntryLen(DictEntry *entry);
 
+/**
+ * 有子进程(bgsave)的时候关掉resize: rehash会把整个table和所有entry的next指针都写一遍,
+ * 父进程每写一个页, 内核都要给它复制一份, 见dictDisableResize
+ */
+static int dictCanResize = 1;
+
 /**
  * int型的hash计算函数： Thomas Wang's 32 bit Mix Function
  */
@@ -63,11 +71,7 @@ unsigned int dictIdentityHashFunction(unsigned int key) {
  *  通用的hash计算函数，跟effective java中推荐的算法差不多
  */
 unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = 5381;
-    while (len--) {
-        hash = ((hash << 5) + hash) + (*buf++);
-    }
-    return hash;
+    return dictInlineHashFunction(buf, len);
 }
 
 /********************** API implementation **********************/
@@ -97,6 +101,7 @@ int _dictInit(Dict *ht, DictType *type, void *privDataPtr) {
     _dictReset(ht);
     ht->type = type;
     ht->privdata = privDataPtr;
+    ht->resizePaused = 0;
     // TODO: 不设置size, mask, used?
     return DICT_OK;
 }
@@ -106,6 +111,9 @@ int _dictInit(Dict *ht, DictType *type, void *privDataPtr) {
  * but with the invariant of a USER/BUCKETS ration near to <= 1
  */
 int dictResize(Dict *ht) {
+    if (!dictCanResize || ht->resizePaused) {
+        return DICT_ERR;
+    }
     int minimal = ht->used;
     if (minimal < DICT_INITIAL_SIZE) {
         minimal = DICT_INITIAL_SIZE;
@@ -126,6 +134,7 @@ int dictExpand(Dict *ht, unsigned int size) {
     }
 
     _dictInit(&newHt, ht->type, ht->privdata);
+    newHt.resizePaused = ht->resizePaused;
     newHt.size = realSize;
     newHt.sizemask = realSize - 1;
     newHt.table = _dictAlloc(realSize * sizeof(DictEntry *));
@@ -145,8 +154,8 @@ int dictExpand(Dict *ht, unsigned int size) {
             nextEntry = e->next;
             unsigned int h = dictHashKey(ht, e->key) & newHt.sizemask;
             // 头部插入
-            e->next = newHt.table[i];
-            newHt.table[i] = e;
+            e->next = newHt.table[h];
+            newHt.table[h] = e;
             ht->used--;
             e = nextEntry;
         }
@@ -169,7 +178,10 @@ int dictAdd(Dict *ht, void *key, void *val) {
         return DICT_ERR;
     }
 
-    DictEntry *entry = _dictAlloc(sizeof(*entry));
+    DictEntry *entry = slabMalloc(sizeof(*entry));
+    if (entry == NULL) {
+        _dictPanic("Out of memory");
+    }
     entry->next = ht->table[index];
     ht->table[index] = entry;
 
@@ -220,7 +232,7 @@ static int dictGenericDeleted(Dict *ht, const void *key, int nofree) {
                 dictFreeEntryKey(ht, entry);
                 dictFreeEntryVal(ht, entry);
             }
-            _dictFree(entry);
+            slabFree(entry);
             ht->used--;
             return DICT_OK;
         } else {
@@ -255,7 +267,7 @@ int _dictClear(Dict *ht) {
             nextEntry = entry->next;
             dictFreeEntryKey(ht, entry);
             dictFreeEntryVal(ht, entry);
-            _dictFree(entry);
+            slabFree(entry);
             ht->used--;
             entry = nextEntry;
         }
@@ -271,6 +283,13 @@ void dictRelease(Dict *ht) {
     _dictFree(ht);
 }
 
+Dict *dictDetach(Dict *ht) {
+    Dict *d = _dictAlloc(sizeof(*d));
+    *d = *ht;
+    _dictReset(ht);
+    return d;
+}
+
 /**
  * @return NULL if ht is empty or not found key, else the target entry
  */
@@ -351,14 +370,53 @@ DictEntry *dictGetRandomKey(Dict *ht) {
     return entry;
 }
 
+static unsigned long _dictRev(unsigned long v) {
+    unsigned long s = 8 * sizeof(v);
+    unsigned long mask = ~0UL;
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+unsigned long dictScan(Dict *ht, unsigned long cursor, dictScanFunction *fn, void *privdata) {
+    if (ht->used == 0) {
+        return 0;
+    }
+    unsigned long mask = ht->sizemask;
+    DictEntry **ref = &ht->table[cursor & mask];
+    while (*ref != NULL) {
+        fn(privdata, ref);
+        ref = &(*ref)->next;
+    }
+
+    // 把高位没用到的bit都置1, 然后反转之后加1再反转回来: 相当于从最高位开始加1
+    cursor |= ~mask;
+    cursor = _dictRev(cursor);
+    cursor++;
+    return _dictRev(cursor);
+}
+
 /****************************** private functions *****************************/
 
-static int _dictExpandIfNeeded(Dict *ht) {
+void dictEnableResize(void) {
+    dictCanResize = 1;
+}
+
+void dictDisableResize(void) {
+    dictCanResize = 0;
+}
+
+int dictExpandIfNeeded(Dict *ht) {
     if (ht->size == 0) {
         return dictExpand(ht, DICT_INITIAL_SIZE);
     }
-    if (ht->used == ht->size) {
-        return dictExpand(ht, ht->size * 2);
+    if (ht->resizePaused) {
+        return DICT_OK;
+    }
+    if (ht->used >= ht->size && (dictCanResize || ht->used / ht->size > DICT_FORCE_RESIZE_RATIO)) {
+        return dictExpand(ht, ht->used * 2);
     }
     return DICT_OK;
 }
@@ -380,7 +438,7 @@ static unsigned int _dictNextPower(unsigned int size) {
  * @return the slot index of the key should be store in, or else -1 if key already exists
  */
 static int _dictKeyIndex(Dict *ht, const void *key) {
-    if (_dictExpandIfNeeded(ht) == DICT_ERR) {
+    if (dictExpandIfNeeded(ht) == DICT_ERR) {
         return -1;
     }
 
@@ -399,45 +457,50 @@ void dictEmpty(Dict *ht) {
     _dictClear(ht);
 }
 
-#define DICT_STATS_VECTLEN 50
-void dictPrintStats(Dict *ht) {
-    if (ht->used == 0) {
-        printf("No stats available for empty dictionaries\n");
-        return;
-    }
-
-    unsigned int clvector[DICT_STATS_VECTLEN];
-    for (int i = 0; i < DICT_STATS_VECTLEN; i++) {
-        clvector[i] = 0;
-    }
+/**
+ * 遍历整个table, 统计chain长度分布等信息, O(size)
+ */
+void dictGetStats(Dict *ht, DictStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->size = ht->size;
+    stats->used = ht->used;
+    stats->bytes = dictGetHashTableBytes(ht);
 
-    unsigned int nonEmptySlots = 0;
-    unsigned int maxChainLen = 0;
-    unsigned int totalChainLen = 0;
     for (int i = 0; i < ht->size; i++) {
         if (ht->table[i] != NULL) {
-            nonEmptySlots++;
+            stats->nonEmptySlots++;
         }
-        int chainLen = _dictEntryLen(ht->table[i]);
+        unsigned int chainLen = _dictEntryLen(ht->table[i]);
         int index = chainLen < DICT_STATS_VECTLEN ? chainLen : (DICT_STATS_VECTLEN - 1);
-        clvector[index]++;
-        if (chainLen > maxChainLen) {
-            maxChainLen = chainLen;
+        stats->clvector[index]++;
+        if (chainLen > stats->maxChainLen) {
+            stats->maxChainLen = chainLen;
         }
-        totalChainLen += chainLen;
+        stats->totalChainLen += chainLen;
     }
+}
+
+void dictPrintStats(Dict *ht) {
+    if (ht->used == 0) {
+        printf("No stats available for empty dictionaries\n");
+        return;
+    }
+
+    DictStats stats;
+    dictGetStats(ht, &stats);
 
     printf("Hash table stats:\n");
-    printf("  table size: %d\n", ht->size);
-    printf("  number of elements: %d\n", ht->used);
-    printf("  different slots: %d\n", nonEmptySlots);
-    printf("  max chain length: %d\n", maxChainLen);
-    printf("  avg chain length(counted): %.02f\n", (float) totalChainLen / nonEmptySlots);
-    printf("  avg chain length (computed): %.02f\n", (float)ht->used / nonEmptySlots); // 这两者应该相同吧?
+    printf("  table size: %u\n", stats.size);
+    printf("  number of elements: %u\n", stats.used);
+    printf("  different slots: %u\n", stats.nonEmptySlots);
+    printf("  max chain length: %u\n", stats.maxChainLen);
+    printf("  avg chain length(counted): %.02f\n", (float) stats.totalChainLen / stats.nonEmptySlots);
+    printf("  avg chain length (computed): %.02f\n", (float) stats.used / stats.nonEmptySlots); // 这两者应该相同吧?
+    printf("  bytes used: %zu\n", stats.bytes);
     printf("  Chain length distribution: \n");
     for (int i = 0; i < DICT_STATS_VECTLEN; i++) {
-        if (clvector[i] != 0) {
-            printf("    %s%d: %d(%0.2f%%)\n", (i ==  DICT_STATS_VECTLEN-1) ? ">=" : "", i, clvector[i], ((float)clvector[i]/ht->size) * 100);
+        if (stats.clvector[i] != 0) {
+            printf("    %s%d: %u(%0.2f%%)\n", (i ==  DICT_STATS_VECTLEN-1) ? ">=" : "", i, stats.clvector[i], ((float)stats.clvector[i]/stats.size) * 100);
         }
     }
 }
@@ -543,7 +606,138 @@ void display(Dict *dict) {
     dictReleaseIterator(it);
 }
 
+/*************************** benchmark *****************************/
+/** 对比通用dict(函数指针)和DICT_SPECIALIZE生成的dict的查找/插入/删除开销 */
+
+static unsigned int _benchHash(const void *key) {
+    return dictInlineHashFunction(key, strlen(key));
+}
+
+static int _benchCompare(const void *key1, const void *key2) {
+    return strcmp(key1, key2) == 0;
+}
+
+static void _benchNoFree(void *ptr) {
+    DICT_NOUSED(ptr);
+}
+
+DICT_SPECIALIZE(benchDict, _benchHash, _benchCompare, _benchNoFree, _benchNoFree)
+
+static DictType benchDictType = {
+    _dictStringCopyHTHashFunction,
+    NULL, // key dup
+    NULL, // val dup
+    _dictStringCopyHTKeyCompare,
+    NULL, // key destructor
+    NULL  // val destructor
+};
+
+static long long _benchUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void benchmarkDict(int count) {
+    char **keys = _dictAlloc(sizeof(char*) * count);
+    for (int i = 0; i < count; i++) {
+        keys[i] = _dictAlloc(24);
+        snprintf(keys[i], 24, "key:%d", i);
+    }
+
+    Dict *generic = dictCreate(&benchDictType, NULL);
+    Dict *special = dictCreate(&benchDictType, NULL);
+    long long start, found;
+
+    start = _benchUstime();
+    for (int i = 0; i < count; i++) {
+        dictAdd(generic, keys[i], keys[i]);
+    }
+    printf("generic add:      %lld us\n", _benchUstime() - start);
+    start = _benchUstime();
+    for (int i = 0; i < count; i++) {
+        benchDictAdd(special, keys[i], keys[i]);
+    }
+    printf("specialized add:  %lld us\n", _benchUstime() - start);
+
+    found = 0;
+    start = _benchUstime();
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < count; i++) {
+            found += dictFind(generic, keys[i]) != NULL;
+        }
+    }
+    printf("generic find:     %lld us (%lld found)\n", _benchUstime() - start, found);
+    found = 0;
+    start = _benchUstime();
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < count; i++) {
+            found += benchDictFind(special, keys[i]) != NULL;
+        }
+    }
+    printf("specialized find: %lld us (%lld found)\n", _benchUstime() - start, found);
+
+    start = _benchUstime();
+    for (int i = 0; i < count; i++) {
+        dictDelete(generic, keys[i]);
+    }
+    printf("generic del:      %lld us\n", _benchUstime() - start);
+    start = _benchUstime();
+    for (int i = 0; i < count; i++) {
+        benchDictDelete(special, keys[i]);
+    }
+    printf("specialized del:  %lld us\n", _benchUstime() - start);
+
+    dictRelease(generic);
+    dictRelease(special);
+    for (int i = 0; i < count; i++) {
+        _dictFree(keys[i]);
+    }
+    _dictFree(keys);
+}
+
+/**
+ * 对比slab和glibc malloc分配DictEntry大小对象的吞吐
+ */
+static void benchmarkSlab(int count) {
+    void **ptrs = _dictAlloc(sizeof(void*) * count);
+    long long start;
+
+    start = _benchUstime();
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < count; i++) {
+            ptrs[i] = malloc(sizeof(DictEntry));
+        }
+        for (int i = 0; i < count; i += 2) {
+            free(ptrs[i]);
+        }
+        for (int i = 1; i < count; i += 2) {
+            free(ptrs[i]);
+        }
+    }
+    printf("malloc/free:         %lld us\n", _benchUstime() - start);
+
+    start = _benchUstime();
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < count; i++) {
+            ptrs[i] = slabMalloc(sizeof(DictEntry));
+        }
+        for (int i = 0; i < count; i += 2) {
+            slabFree(ptrs[i]);
+        }
+        for (int i = 1; i < count; i += 2) {
+            slabFree(ptrs[i]);
+        }
+    }
+    printf("slabMalloc/slabFree: %lld us (%zu slabs left)\n", _benchUstime() - start, slabCount());
+
+    _dictFree(ptrs);
+}
+
 int main() {
+    benchmarkDict(1000000);
+    benchmarkSlab(1000000);
+
     void *privdata = _dictAlloc(1);
     Dict *dict = dictCreate(&dictTypeHeapStringCopyKeyValue, privdata);
     dictAdd(dict, "name", "cxy");
@@ -1,6 +1,8 @@
 #ifndef __DICT_H
 #define __DICT_H
 
+#include <stddef.h>
+
 #define DICT_OK 0
 #define DICT_ERR 1
 
@@ -33,6 +35,8 @@ typedef struct Dict {
     unsigned int size;
     unsigned int sizemask;
     unsigned int used;
+    // 大于0时不扩容也不缩容, 见dictPauseResize
+    int resizePaused;
     // what is it?
     void *privdata;
 } Dict;
@@ -45,9 +49,28 @@ typedef struct DictIterator {
     DictEntry *entry, *nextEntry;
 } DictIterator;
 
+/**
+ * dictGetStats的结果, 用来判断是否需要预先扩容以及hash分布是否均匀
+ * 注意: bytes只包含table和entry本身, 不包含key/value指向的内存
+ */
+#define DICT_STATS_VECTLEN 50
+typedef struct DictStats {
+    unsigned int size;
+    unsigned int used;
+    unsigned int nonEmptySlots;
+    unsigned int maxChainLen;
+    unsigned long totalChainLen;
+    // clvector[i]表示chain长度为i的bucket个数, 最后一个是>=DICT_STATS_VECTLEN-1
+    unsigned int clvector[DICT_STATS_VECTLEN];
+    size_t bytes;
+} DictStats;
+
 // dict的默认大小
 #define DICT_INITIAL_SIZE 16
 
+// resize被关掉时, 平均链长超过这个值仍然强制扩容
+#define DICT_FORCE_RESIZE_RATIO 5
+
 /********************************* Macros *****************************/
 /**
  * 1. 对于要设置的(key, value)根据keyDup和valueDup是否为空来决定是否需要进行copy
@@ -92,6 +115,16 @@ typedef struct DictIterator {
 #define dictGetEntryVal(entry) ((entry)->val)
 #define dictGetHashTableSize(ht) ((ht)->size)
 #define dictGetHashTableUsed(ht) ((ht)->used)
+/** table和entry本身占用的内存, 不包含key/value指向的内存, O(1) */
+#define dictGetHashTableBytes(ht) \
+    (sizeof(*(ht)) + (size_t) (ht)->size * sizeof(DictEntry*) + (size_t) (ht)->used * sizeof(DictEntry))
+
+/**
+ * 暂停这个dict的resize(包括DICT_FORCE_RESIZE_RATIO的强制扩容), 元素的bucket编号在恢复之前不会变
+ * 用于别的线程按bucket遍历table的同时继续插入元素; 空的dict第一次插入仍然会分配table
+ */
+#define dictPauseResize(ht) ((ht)->resizePaused++)
+#define dictResumeResize(ht) ((ht)->resizePaused--)
 
 /** api */
 Dict *dictCreate(DictType *type, void *privDataPtr);
@@ -102,15 +135,42 @@ int dictReplace(Dict *ht, void *key, void *val);
 int dictDelete(Dict *ht, const void *key);
 int dictDeleteNoFree(Dict *ht, const void *key);
 void dictRelease(Dict *ht);
+
+/**
+ * 把ht中所有的元素转移到一个新的Dict中返回, ht变成空的(但是仍然可以使用)
+ * 用于在别的地方(后台线程)释放一个不能替换指针的dict的内容
+ */
+Dict *dictDetach(Dict *ht);
 DictEntry *dictFind(Dict *ht, const void *key);
 int dictResize(Dict *ht);
 
+/**
+ * 按需扩容: 空表初始化, 元素个数达到size时翻倍
+ * 关掉resize之后只有元素个数超过size的DICT_FORCE_RESIZE_RATIO倍才会扩容, dictResize直接返回DICT_ERR
+ */
+int dictExpandIfNeeded(Dict *ht);
+void dictEnableResize(void);
+void dictDisableResize(void);
+
 DictIterator *dictGetIterator(Dict *ht);
 DictEntry *dictNext(DictIterator *it);
 void dictReleaseIterator(DictIterator *it);
 
 DictEntry *dictGetRandomKey(Dict *ht);
 
+/**
+ * dictScan的回调, entryRef指向保存entry的那个指针(bucket或者前一个entry的next)
+ * 回调可以把entry换成一个新地址的拷贝(*entryRef = newEntry), 但是不能增删元素
+ */
+typedef void dictScanFunction(void *privdata, DictEntry **entryRef);
+
+/**
+ * 增量遍历: 每次访问cursor对应的一个bucket, 返回下一次的cursor, 返回0表示遍历完了
+ * cursor按高位加1的顺序前进, 两次调用之间table扩容或者缩容了也不会漏掉一直存在的元素(可能重复)
+ */
+unsigned long dictScan(Dict *ht, unsigned long cursor, dictScanFunction *fn, void *privdata);
+
+void dictGetStats(Dict *ht, DictStats *stats);
 void dictPrintStats(Dict *ht);
 
 unsigned int dictGenHashFunction(const unsigned char *buf, int len);
@@ -0,0 +1,127 @@
+#ifndef __DICTSPEC_H
+#define __DICTSPEC_H
+
+#include <stdlib.h>
+
+#include "slab.h"
+#include "dict.h"
+
+/**
+ * 通用的字符串hash函数(djb2), dictGenHashFunction也是用它实现的
+ * 放在头文件里是为了让特化后的dict可以直接inline掉hash计算
+ */
+static inline unsigned int dictInlineHashFunction(const unsigned char *buf, int len) {
+    unsigned int hash = 5381;
+    while (len--) {
+        hash = ((hash << 5) + hash) + (*buf++);
+    }
+    return hash;
+}
+
+/**
+ * 为固定的key/value类型生成专用的查找/插入/删除函数
+ *
+ * 通用的dict每次probe都要经过DictType里的函数指针(hashFunction, keyCompare, destructor),
+ * 编译器没办法inline, 在热点路径上(比如keyspace的查找)开销很明显。
+ * 这里用宏生成一组static inline函数，hash/compare/free都是直接调用，可以被编译器inline
+ *
+ * 生成的函数和通用版本共用同一个Dict结构，因此dictExpand, dictResize, iterator,
+ * dictPrintStats等都可以继续使用。需要注意:
+ *   1. 创建dict时传入的DictType必须和这里的hashFn/cmpFn语义一致，否则rehash后会找不到key
+ *   2. key和value都是原样保存的(不会调用keyDup/valDup)
+ *
+ * @param name    生成的函数前缀，比如name=keyspaceDict会生成keyspaceDictFind, keyspaceDictAdd...
+ * @param hashFn  unsigned int hashFn(const void *key)
+ * @param cmpFn   int cmpFn(const void *key1, const void *key2), 相等时返回1
+ * @param keyFree void keyFree(void *key)
+ * @param valFree void valFree(void *val)
+ */
+#define DICT_SPECIALIZE(name, hashFn, cmpFn, keyFree, valFree) \
+\
+static inline DictEntry *name##Find(Dict *ht, const void *key) { \
+    if (ht->size == 0) { \
+        return NULL; \
+    } \
+    DictEntry *entry = ht->table[hashFn(key) & ht->sizemask]; \
+    while (entry != NULL) { \
+        if (cmpFn(key, entry->key)) { \
+            return entry; \
+        } \
+        entry = entry->next; \
+    } \
+    return NULL; \
+} \
+\
+static inline int name##Add(Dict *ht, void *key, void *val) { \
+    if (ht->size == 0 || ht->used >= ht->size) { \
+        if (dictExpandIfNeeded(ht) == DICT_ERR) { \
+            return DICT_ERR; \
+        } \
+    } \
+    unsigned int h = hashFn(key) & ht->sizemask; \
+    DictEntry *entry = ht->table[h]; \
+    while (entry != NULL) { \
+        if (cmpFn(key, entry->key)) { \
+            return DICT_ERR; \
+        } \
+        entry = entry->next; \
+    } \
+    entry = slabMalloc(sizeof(*entry)); \
+    if (entry == NULL) { \
+        return DICT_ERR; \
+    } \
+    entry->key = key; \
+    entry->val = val; \
+    entry->next = ht->table[h]; \
+    ht->table[h] = entry; \
+    ht->used++; \
+    return DICT_OK; \
+} \
+\
+static inline int name##Replace(Dict *ht, void *key, void *val) { \
+    DictEntry *entry = name##Find(ht, key); \
+    if (entry == NULL) { \
+        return name##Add(ht, key, val); \
+    } \
+    valFree(entry->val); \
+    entry->val = val; \
+    return DICT_OK; \
+} \
+\
+static inline int name##GenericDelete(Dict *ht, const void *key, int nofree) { \
+    if (ht->size == 0) { \
+        return DICT_ERR; \
+    } \
+    unsigned int h = hashFn(key) & ht->sizemask; \
+    DictEntry *entry = ht->table[h]; \
+    DictEntry *prevEntry = NULL; \
+    while (entry != NULL) { \
+        if (cmpFn(key, entry->key)) { \
+            if (prevEntry != NULL) { \
+                prevEntry->next = entry->next; \
+            } else { \
+                ht->table[h] = entry->next; \
+            } \
+            if (!nofree) { \
+                keyFree(entry->key); \
+                valFree(entry->val); \
+            } \
+            slabFree(entry); \
+            ht->used--; \
+            return DICT_OK; \
+        } \
+        prevEntry = entry; \
+        entry = entry->next; \
+    } \
+    return DICT_ERR; \
+} \
+\
+static inline int name##Delete(Dict *ht, const void *key) { \
+    return name##GenericDelete(ht, key, 0); \
+} \
+\
+static inline int name##DeleteNoFree(Dict *ht, const void *key) { \
+    return name##GenericDelete(ht, key, 1); \
+}
+
+#endif
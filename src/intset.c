@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "intset.h"
+#include "zmalloc.h"
+
+/**
+ * 元素按本机字节序保存, intset只存在于内存中, 持久化时会转换成字符串
+ */
+
+static uint8_t intsetValueEncoding(int64_t v) {
+    if (v < INT32_MIN || v > INT32_MAX) {
+        return INTSET_ENC_INT64;
+    } else if (v < INT16_MIN || v > INT16_MAX) {
+        return INTSET_ENC_INT32;
+    }
+    return INTSET_ENC_INT16;
+}
+
+static int64_t intsetGetEncoded(const Intset *is, uint32_t pos, uint8_t enc) {
+    if (enc == INTSET_ENC_INT64) {
+        return ((const int64_t*) is->contents)[pos];
+    } else if (enc == INTSET_ENC_INT32) {
+        return ((const int32_t*) is->contents)[pos];
+    }
+    return ((const int16_t*) is->contents)[pos];
+}
+
+static int64_t intsetGetAt(const Intset *is, uint32_t pos) {
+    return intsetGetEncoded(is, pos, is->encoding);
+}
+
+static void intsetSet(Intset *is, uint32_t pos, int64_t value) {
+    if (is->encoding == INTSET_ENC_INT64) {
+        ((int64_t*) is->contents)[pos] = value;
+    } else if (is->encoding == INTSET_ENC_INT32) {
+        ((int32_t*) is->contents)[pos] = value;
+    } else {
+        ((int16_t*) is->contents)[pos] = value;
+    }
+}
+
+static Intset *intsetResize(Intset *is, uint32_t len) {
+    return zrealloc(is, sizeof(Intset) + (size_t) len * is->encoding);
+}
+
+Intset *intsetNew(void) {
+    Intset *is = zmalloc(sizeof(Intset));
+    if (is == NULL) {
+        return NULL;
+    }
+    is->encoding = INTSET_ENC_INT16;
+    is->length = 0;
+    return is;
+}
+
+void intsetFree(Intset *is) {
+    zfree(is);
+}
+
+/**
+ * 二分查找value
+ * @param pos 找到时设置为value的位置, 没找到时设置为value应该插入的位置
+ * @return 1 if found
+ */
+static int intsetSearch(Intset *is, int64_t value, uint32_t *pos) {
+    if (is->length == 0) {
+        *pos = 0;
+        return 0;
+    }
+    // 比最大的还大或者比最小的还小, 不需要二分
+    if (value > intsetGetAt(is, is->length - 1)) {
+        *pos = is->length;
+        return 0;
+    } else if (value < intsetGetAt(is, 0)) {
+        *pos = 0;
+        return 0;
+    }
+
+    int64_t min = 0;
+    int64_t max = is->length - 1;
+    while (min <= max) {
+        int64_t mid = ((uint64_t) min + (uint64_t) max) >> 1;
+        int64_t cur = intsetGetAt(is, mid);
+        if (value > cur) {
+            min = mid + 1;
+        } else if (value < cur) {
+            max = mid - 1;
+        } else {
+            *pos = mid;
+            return 1;
+        }
+    }
+    *pos = min;
+    return 0;
+}
+
+/**
+ * value需要更宽的编码, 升级之后value一定是最小或者最大的元素
+ */
+static Intset *intsetUpgradeAndAdd(Intset *is, int64_t value) {
+    uint8_t oldenc = is->encoding;
+    int prepend = value < 0 ? 1 : 0;
+    uint32_t length = is->length;
+
+    uint8_t newenc = intsetValueEncoding(value);
+    // 先按新的encoding扩容, 成功之后才修改encoding, 否则失败时原来的intset就按错误的encoding解析了
+    Intset *newis = zrealloc(is, sizeof(Intset) + (size_t) (length + 1) * newenc);
+    if (newis == NULL) {
+        return NULL;
+    }
+    is = newis;
+    is->encoding = newenc;
+
+    // 从后往前拷贝, 不会覆盖还没有处理的元素
+    while (length--) {
+        intsetSet(is, length + prepend, intsetGetEncoded(is, length, oldenc));
+    }
+    if (prepend) {
+        intsetSet(is, 0, value);
+    } else {
+        intsetSet(is, is->length, value);
+    }
+    is->length++;
+    return is;
+}
+
+/**
+ * 把from开始到结尾的元素移动到to处
+ */
+static void intsetMoveTail(Intset *is, uint32_t from, uint32_t to) {
+    size_t bytes = (size_t) (is->length - from) * is->encoding;
+    memmove(is->contents + (size_t) to * is->encoding, is->contents + (size_t) from * is->encoding, bytes);
+}
+
+Intset *intsetAdd(Intset *is, int64_t value, int *success) {
+    if (success != NULL) {
+        *success = 1;
+    }
+    if (intsetValueEncoding(value) > is->encoding) {
+        return intsetUpgradeAndAdd(is, value);
+    }
+
+    uint32_t pos;
+    if (intsetSearch(is, value, &pos)) {
+        if (success != NULL) {
+            *success = 0;
+        }
+        return is;
+    }
+
+    is = intsetResize(is, is->length + 1);
+    if (is == NULL) {
+        return NULL;
+    }
+    if (pos < is->length) {
+        intsetMoveTail(is, pos, pos + 1);
+    }
+    intsetSet(is, pos, value);
+    is->length++;
+    return is;
+}
+
+Intset *intsetRemove(Intset *is, int64_t value, int *success) {
+    uint32_t pos;
+    if (success != NULL) {
+        *success = 0;
+    }
+    if (intsetValueEncoding(value) > is->encoding || !intsetSearch(is, value, &pos)) {
+        return is;
+    }
+
+    if (success != NULL) {
+        *success = 1;
+    }
+    if (pos < is->length - 1) {
+        intsetMoveTail(is, pos + 1, pos);
+    }
+    is->length--;
+    return intsetResize(is, is->length);
+}
+
+int intsetFind(Intset *is, int64_t value) {
+    uint32_t pos;
+    return intsetValueEncoding(value) <= is->encoding && intsetSearch(is, value, &pos);
+}
+
+int intsetGet(Intset *is, uint32_t pos, int64_t *value) {
+    if (pos >= is->length) {
+        return 0;
+    }
+    *value = intsetGetAt(is, pos);
+    return 1;
+}
+
+uint32_t intsetLen(const Intset *is) {
+    return is->length;
+}
+
+size_t intsetBlobLen(Intset *is) {
+    return sizeof(Intset) + (size_t) is->length * is->encoding;
+}
+
+/*------------------------------ intersection ------------------------*/
+
+/**
+ * 两个有序数组的普通merge, 适用于任意编码的组合
+ */
+static uint32_t intsetIntersectScalar(Intset *a, Intset *b, Intset *out) {
+    uint32_t i = 0, j = 0, k = 0;
+    while (i < a->length && j < b->length) {
+        int64_t va = intsetGetAt(a, i);
+        int64_t vb = intsetGetAt(b, j);
+        if (va < vb) {
+            i++;
+        } else if (va > vb) {
+            j++;
+        } else {
+            intsetSet(out, k++, va);
+            i++;
+            j++;
+        }
+    }
+    return k;
+}
+
+/**
+ * SIMD分块merge: 每次取a和b各一个block, 把b的block旋转block大小次并和a比较,
+ * 一次就能得到a的block里哪些元素在b的block中; 然后前进max比较小的那个block。
+ * 剩下不足一个block的部分用普通的merge处理
+ */
+#define INTSET_MERGE_TAIL(type) do { \
+    while (i < la && j < lb) { \
+        if (a[i] < b[j]) { \
+            i++; \
+        } else if (a[i] > b[j]) { \
+            j++; \
+        } else { \
+            out[k++] = a[i]; \
+            i++; \
+            j++; \
+        } \
+    } \
+} while (0)
+
+static uint32_t intsetIntersect16(const int16_t *a, uint32_t la, const int16_t *b, uint32_t lb, int16_t *out) {
+    uint32_t i = 0, j = 0, k = 0;
+#if defined(__SSE2__)
+#define ROT16(v, n) _mm_or_si128(_mm_srli_si128(v, 2 * (n)), _mm_slli_si128(v, 16 - 2 * (n)))
+    while (i + 8 <= la && j + 8 <= lb) {
+        __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*) (b + j));
+        __m128i m = _mm_cmpeq_epi16(va, vb);
+        m = _mm_or_si128(m, _mm_cmpeq_epi16(va, ROT16(vb, 1)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi16(va, ROT16(vb, 2)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi16(va, ROT16(vb, 3)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi16(va, ROT16(vb, 4)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi16(va, ROT16(vb, 5)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi16(va, ROT16(vb, 6)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi16(va, ROT16(vb, 7)));
+        int mask = _mm_movemask_epi8(m);
+        for (int t = 0; mask != 0; t++, mask >>= 2) {
+            if (mask & 1) {
+                out[k++] = a[i + t];
+            }
+        }
+        int16_t amax = a[i + 7];
+        int16_t bmax = b[j + 7];
+        if (amax <= bmax) {
+            i += 8;
+        }
+        if (bmax <= amax) {
+            j += 8;
+        }
+    }
+#undef ROT16
+#endif
+    INTSET_MERGE_TAIL(int16_t);
+    return k;
+}
+
+static uint32_t intsetIntersect32(const int32_t *a, uint32_t la, const int32_t *b, uint32_t lb, int32_t *out) {
+    uint32_t i = 0, j = 0, k = 0;
+#if defined(__SSE2__)
+    while (i + 4 <= la && j + 4 <= lb) {
+        __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*) (b + j));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+        for (int t = 0; mask != 0; t++, mask >>= 1) {
+            if (mask & 1) {
+                out[k++] = a[i + t];
+            }
+        }
+        int32_t amax = a[i + 3];
+        int32_t bmax = b[j + 3];
+        if (amax <= bmax) {
+            i += 4;
+        }
+        if (bmax <= amax) {
+            j += 4;
+        }
+    }
+#endif
+    INTSET_MERGE_TAIL(int32_t);
+    return k;
+}
+
+static uint32_t intsetIntersect64(const int64_t *a, uint32_t la, const int64_t *b, uint32_t lb, int64_t *out) {
+    uint32_t i = 0, j = 0, k = 0;
+    INTSET_MERGE_TAIL(int64_t);
+    return k;
+}
+
+Intset *intsetIntersect(Intset *a, Intset *b) {
+    Intset *out = intsetNew();
+    if (out == NULL) {
+        return NULL;
+    }
+    // 交集中的元素在两边都放得下, 用比较窄的编码就够了
+    out->encoding = a->encoding < b->encoding ? a->encoding : b->encoding;
+    out = intsetResize(out, a->length < b->length ? a->length : b->length);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    uint32_t len;
+    if (a->encoding != b->encoding) {
+        len = intsetIntersectScalar(a, b, out);
+    } else if (a->encoding == INTSET_ENC_INT16) {
+        len = intsetIntersect16((int16_t*) a->contents, a->length, (int16_t*) b->contents, b->length,
+            (int16_t*) out->contents);
+    } else if (a->encoding == INTSET_ENC_INT32) {
+        len = intsetIntersect32((int32_t*) a->contents, a->length, (int32_t*) b->contents, b->length,
+            (int32_t*) out->contents);
+    } else {
+        len = intsetIntersect64((int64_t*) a->contents, a->length, (int64_t*) b->contents, b->length,
+            (int64_t*) out->contents);
+    }
+    out->length = len;
+    return intsetResize(out, len);
+}
+
+/*------------------------------ debug -------------------------------*/
+
+static long long ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void benchmarkIntersect(int n, int64_t stride) {
+    Intset *a = intsetNew();
+    Intset *b = intsetNew();
+    // a是stride的倍数, b是2*stride的倍数再错开一半, 大约一半的a在交集中
+    for (int64_t i = 0; i < n; i++) {
+        a = intsetAdd(a, i * stride, NULL);
+        b = intsetAdd(b, (i % 2 == 0) ? i * stride : i * stride + 1, NULL);
+    }
+
+    int rounds = 20;
+    long long start = ustime();
+    Intset *r = NULL;
+    for (int i = 0; i < rounds; i++) {
+        if (r != NULL) {
+            intsetFree(r);
+        }
+        r = intsetIntersect(a, b);
+    }
+    long long simd = ustime() - start;
+
+    Intset *s = intsetNew();
+    s->encoding = a->encoding;
+    s = intsetResize(s, n);
+    start = ustime();
+    uint32_t slen = 0;
+    for (int i = 0; i < rounds; i++) {
+        slen = intsetIntersectScalar(a, b, s);
+    }
+    long long scalar = ustime() - start;
+
+    printf("intersect %d x %d (%u-bit): result %u/%u, block merge %.2fms, scalar merge %.2fms\n",
+        n, n, a->encoding * 8, r->length, slen, simd / 1000.0 / rounds, scalar / 1000.0 / rounds);
+    for (uint32_t i = 0; i < slen; i++) {
+        if (intsetGetAt(r, i) != intsetGetAt(s, i)) {
+            printf("mismatch at %u\n", i);
+            break;
+        }
+    }
+    intsetFree(a);
+    intsetFree(b);
+    intsetFree(r);
+    intsetFree(s);
+}
+
+int main(void) {
+    Intset *is = intsetNew();
+    int success;
+    is = intsetAdd(is, 5, &success);
+    is = intsetAdd(is, 6, &success);
+    is = intsetAdd(is, 4, &success);
+    is = intsetAdd(is, 4, &success);
+    printf("add dup: %d, len: %u, encoding: %u\n", success, intsetLen(is), is->encoding);
+    is = intsetAdd(is, 65535, NULL);
+    printf("after 65535 encoding: %u\n", is->encoding);
+    is = intsetAdd(is, -4294967296LL, NULL);
+    printf("after -2^32 encoding: %u\n", is->encoding);
+    is = intsetRemove(is, 5, &success);
+    printf("remove 5: %d, find 5: %d, find 6: %d, find 65535: %d\n",
+        success, intsetFind(is, 5), intsetFind(is, 6), intsetFind(is, 65535));
+    int64_t v;
+    for (uint32_t i = 0; intsetGet(is, i, &v); i++) {
+        printf("%lld ", (long long) v);
+    }
+    printf("\n");
+    intsetFree(is);
+
+    benchmarkIntersect(10000, 3);
+    benchmarkIntersect(1000000, 3);
+    benchmarkIntersect(1000000, 1LL << 33);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef __INTSET_H
+#define __INTSET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * intset: 有序的整数数组, 用来保存只包含整数的小集合
+ *
+ * 所有元素使用同样的宽度(16/32/64bit)保存, 插入一个放不下的值时整体升级到更宽的编码,
+ * 查找是二分查找。每个元素只占2/4/8个字节, 相比dict每个元素一个DictEntry + Robj小得多
+ */
+
+#define INTSET_ENC_INT16 (sizeof(int16_t))
+#define INTSET_ENC_INT32 (sizeof(int32_t))
+#define INTSET_ENC_INT64 (sizeof(int64_t))
+
+typedef struct Intset {
+    uint32_t encoding; // 每个元素的字节数
+    uint32_t length;
+    int8_t contents[];
+} Intset;
+
+Intset *intsetNew(void);
+void intsetFree(Intset *is);
+
+/**
+ * @param success 不为NULL时, 插入成功设置为1, 已经存在设置为0
+ * @return 新的intset指针, 可能和is不同; 没有内存时返回NULL, 原来的is保持不变
+ */
+Intset *intsetAdd(Intset *is, int64_t value, int *success);
+Intset *intsetRemove(Intset *is, int64_t value, int *success);
+int intsetFind(Intset *is, int64_t value);
+
+/**
+ * @return pos越界时返回0
+ */
+int intsetGet(Intset *is, uint32_t pos, int64_t *value);
+uint32_t intsetLen(const Intset *is);
+size_t intsetBlobLen(Intset *is);
+
+/**
+ * 求a和b的交集, 结果是一个新的intset
+ * 两边编码相同时使用SIMD做分块的merge, 否则退化成普通的merge
+ */
+Intset *intsetIntersect(Intset *a, Intset *b);
+
+#endif
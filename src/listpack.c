@@ -0,0 +1,674 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "listpack.h"
+#include "zmalloc.h"
+#include "util.h"
+
+#define LP_HDR_SIZE 6 // 4字节total bytes + 2字节元素个数
+#define LP_HDR_NUMELE_UNKNOWN UINT16_MAX
+#define LP_EOF 0xFF
+#define LP_MAX_INT_ENCODING_LEN 9
+#define LP_MAX_BACKLEN_SIZE 5
+
+/**
+ * encoding:
+ *   0xxxxxxx                      7bit无符号整数
+ *   10xxxxxx                      长度小于64的字符串
+ *   110xxxxx yyyyyyyy             13bit有符号整数
+ *   1110xxxx yyyyyyyy             长度小于4096的字符串
+ *   11110000 + 4字节长度           长字符串
+ *   11110001/2/3/4 + 2/3/4/8字节   16/24/32/64bit有符号整数(小端)
+ */
+#define LP_ENCODING_7BIT_UINT 0
+#define LP_ENCODING_7BIT_UINT_MASK 0x80
+#define LP_ENCODING_6BIT_STR 0x80
+#define LP_ENCODING_6BIT_STR_MASK 0xC0
+#define LP_ENCODING_13BIT_INT 0xC0
+#define LP_ENCODING_13BIT_INT_MASK 0xE0
+#define LP_ENCODING_12BIT_STR 0xE0
+#define LP_ENCODING_12BIT_STR_MASK 0xF0
+#define LP_ENCODING_32BIT_STR 0xF0
+#define LP_ENCODING_16BIT_INT 0xF1
+#define LP_ENCODING_24BIT_INT 0xF2
+#define LP_ENCODING_32BIT_INT 0xF3
+#define LP_ENCODING_64BIT_INT 0xF4
+
+#define LP_ENCODING_INT 0
+#define LP_ENCODING_STRING 1
+
+/*------------------------------ header ------------------------------*/
+
+static uint32_t lpGetTotalBytes(unsigned char *lp) {
+    return (uint32_t) lp[0] | (uint32_t) lp[1] << 8 | (uint32_t) lp[2] << 16 | (uint32_t) lp[3] << 24;
+}
+
+static void lpSetTotalBytes(unsigned char *lp, uint32_t v) {
+    lp[0] = v & 0xff;
+    lp[1] = (v >> 8) & 0xff;
+    lp[2] = (v >> 16) & 0xff;
+    lp[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t lpGetNumElements(unsigned char *lp) {
+    return (uint32_t) lp[4] | (uint32_t) lp[5] << 8;
+}
+
+static void lpSetNumElements(unsigned char *lp, uint32_t v) {
+    lp[4] = v & 0xff;
+    lp[5] = (v >> 8) & 0xff;
+}
+
+unsigned char *lpNew(void) {
+    unsigned char *lp = zmalloc(LP_HDR_SIZE + 1);
+    if (lp == NULL) {
+        return NULL;
+    }
+    lpSetTotalBytes(lp, LP_HDR_SIZE + 1);
+    lpSetNumElements(lp, 0);
+    lp[LP_HDR_SIZE] = LP_EOF;
+    return lp;
+}
+
+void lpFree(unsigned char *lp) {
+    zfree(lp);
+}
+
+size_t lpBytes(unsigned char *lp) {
+    return lpGetTotalBytes(lp);
+}
+
+/*------------------------------ encoding ----------------------------*/
+
+/**
+ * 把整数v编码到buf中
+ * @return 编码后的长度
+ */
+static uint64_t lpEncodeInt(unsigned char *buf, int64_t v) {
+    if (v >= 0 && v <= 127) {
+        buf[0] = v;
+        return 1;
+    } else if (v >= -4096 && v <= 4095) {
+        uint64_t uv = (v < 0) ? ((uint64_t) 1 << 13) + v : (uint64_t) v;
+        buf[0] = (uv >> 8) | LP_ENCODING_13BIT_INT;
+        buf[1] = uv & 0xff;
+        return 2;
+    }
+
+    int bytes;
+    if (v >= -32768 && v <= 32767) {
+        buf[0] = LP_ENCODING_16BIT_INT;
+        bytes = 2;
+    } else if (v >= -8388608 && v <= 8388607) {
+        buf[0] = LP_ENCODING_24BIT_INT;
+        bytes = 3;
+    } else if (v >= INT32_MIN && v <= INT32_MAX) {
+        buf[0] = LP_ENCODING_32BIT_INT;
+        bytes = 4;
+    } else {
+        buf[0] = LP_ENCODING_64BIT_INT;
+        bytes = 8;
+    }
+    // 负数用bytes*8位的补码表示
+    uint64_t uv = (uint64_t) v;
+    for (int i = 0; i < bytes; i++) {
+        buf[1 + i] = (uv >> (8 * i)) & 0xff;
+    }
+    return 1 + bytes;
+}
+
+/**
+ * 判断ele应该用什么方式编码
+ * 整数时把编码结果写到intenc中, *enclen为encoding+data的长度
+ */
+static int lpEncodeGetType(unsigned char *ele, uint32_t size, unsigned char *intenc, uint64_t *enclen) {
+    long long v;
+    if (size <= 20 && string2ll((char*) ele, size, &v)) {
+        *enclen = lpEncodeInt(intenc, v);
+        return LP_ENCODING_INT;
+    }
+
+    if (size < 64) {
+        *enclen = 1 + size;
+    } else if (size < 4096) {
+        *enclen = 2 + size;
+    } else {
+        *enclen = 5 + (uint64_t) size;
+    }
+    return LP_ENCODING_STRING;
+}
+
+static void lpEncodeString(unsigned char *buf, unsigned char *s, uint32_t len) {
+    if (len < 64) {
+        buf[0] = len | LP_ENCODING_6BIT_STR;
+        memcpy(buf + 1, s, len);
+    } else if (len < 4096) {
+        buf[0] = (len >> 8) | LP_ENCODING_12BIT_STR;
+        buf[1] = len & 0xff;
+        memcpy(buf + 2, s, len);
+    } else {
+        buf[0] = LP_ENCODING_32BIT_STR;
+        buf[1] = len & 0xff;
+        buf[2] = (len >> 8) & 0xff;
+        buf[3] = (len >> 16) & 0xff;
+        buf[4] = (len >> 24) & 0xff;
+        memcpy(buf + 5, s, len);
+    }
+}
+
+/**
+ * 编码backlen: 高位在前，除了第一个字节之外都设置最高位，这样从最后一个字节往前解析时
+ * 遇到没有设置最高位的字节就结束了, 每个字节保存7bit, 所以1~5个字节
+ * @param buf 为NULL时只计算长度
+ */
+static unsigned long lpEncodeBacklen(unsigned char *buf, uint64_t l) {
+    unsigned long len;
+    if (l <= 127) {
+        len = 1;
+    } else if (l <= 16383) {
+        len = 2;
+    } else if (l <= 2097151) {
+        len = 3;
+    } else if (l <= 268435455) {
+        len = 4;
+    } else {
+        len = 5;
+    }
+
+    if (buf != NULL) {
+        for (unsigned long i = 0; i < len; i++) {
+            unsigned char b = (l >> (7 * (len - 1 - i))) & 127;
+            buf[i] = (i == 0) ? b : (b | 128);
+        }
+    }
+    return len;
+}
+
+/**
+ * @param p 指向backlen的最后一个字节
+ */
+static uint64_t lpDecodeBacklen(unsigned char *p) {
+    uint64_t val = 0;
+    uint64_t shift = 0;
+    do {
+        val |= (uint64_t) (p[0] & 127) << shift;
+        if (!(p[0] & 128)) {
+            break;
+        }
+        shift += 7;
+        p--;
+    } while (shift < 35);
+    return val;
+}
+
+/**
+ * @return p处元素encoding+data的长度
+ */
+static uint32_t lpCurrentEncodedSize(unsigned char *p) {
+    if ((p[0] & LP_ENCODING_7BIT_UINT_MASK) == LP_ENCODING_7BIT_UINT) {
+        return 1;
+    }
+    if ((p[0] & LP_ENCODING_6BIT_STR_MASK) == LP_ENCODING_6BIT_STR) {
+        return 1 + (p[0] & 0x3f);
+    }
+    if ((p[0] & LP_ENCODING_13BIT_INT_MASK) == LP_ENCODING_13BIT_INT) {
+        return 2;
+    }
+    if ((p[0] & LP_ENCODING_12BIT_STR_MASK) == LP_ENCODING_12BIT_STR) {
+        return 2 + (((p[0] & 0xf) << 8) | p[1]);
+    }
+    switch (p[0]) {
+        case LP_ENCODING_16BIT_INT: return 3;
+        case LP_ENCODING_24BIT_INT: return 4;
+        case LP_ENCODING_32BIT_INT: return 5;
+        case LP_ENCODING_64BIT_INT: return 9;
+        case LP_ENCODING_32BIT_STR:
+            return 5 + ((uint32_t) p[1] | (uint32_t) p[2] << 8 | (uint32_t) p[3] << 16 | (uint32_t) p[4] << 24);
+        case LP_EOF: return 1;
+    }
+    assert(0 != 0);
+    return 0;
+}
+
+/**
+ * @return p后面一个位置, 可能是EOF
+ */
+static unsigned char *lpSkip(unsigned char *p) {
+    uint32_t entrylen = lpCurrentEncodedSize(p);
+    entrylen += lpEncodeBacklen(NULL, entrylen);
+    return p + entrylen;
+}
+
+/*------------------------------ iteration ---------------------------*/
+
+unsigned char *lpFirst(unsigned char *lp) {
+    unsigned char *p = lp + LP_HDR_SIZE;
+    return (p[0] == LP_EOF) ? NULL : p;
+}
+
+unsigned char *lpNext(unsigned char *lp, unsigned char *p) {
+    (void) lp;
+    p = lpSkip(p);
+    return (p[0] == LP_EOF) ? NULL : p;
+}
+
+unsigned char *lpPrev(unsigned char *lp, unsigned char *p) {
+    if (p == lp + LP_HDR_SIZE) {
+        return NULL;
+    }
+    p--;
+    uint64_t prevlen = lpDecodeBacklen(p);
+    prevlen += lpEncodeBacklen(NULL, prevlen);
+    return p - prevlen + 1;
+}
+
+unsigned char *lpLast(unsigned char *lp) {
+    // 从EOF往前找
+    return lpPrev(lp, lp + lpGetTotalBytes(lp) - 1);
+}
+
+unsigned long lpLength(unsigned char *lp) {
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) {
+        return numele;
+    }
+
+    // 元素太多时header里记不下，只能遍历
+    unsigned long count = 0;
+    unsigned char *p = lpFirst(lp);
+    while (p != NULL) {
+        count++;
+        p = lpNext(lp, p);
+    }
+    if (count < LP_HDR_NUMELE_UNKNOWN) {
+        lpSetNumElements(lp, count);
+    }
+    return count;
+}
+
+unsigned char *lpSeek(unsigned char *lp, long index) {
+    long numele = lpLength(lp);
+    if (index < 0) {
+        index += numele;
+    }
+    if (index < 0 || index >= numele) {
+        return NULL;
+    }
+
+    // 从离得近的一端开始找
+    unsigned char *p;
+    if (index <= numele / 2) {
+        p = lpFirst(lp);
+        while (index--) {
+            p = lpNext(lp, p);
+        }
+    } else {
+        p = lpLast(lp);
+        index = numele - 1 - index;
+        while (index--) {
+            p = lpPrev(lp, p);
+        }
+    }
+    return p;
+}
+
+unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf) {
+    uint64_t uval;
+    uint64_t negstart; // uval >= negstart时是负数
+    uint64_t negmax;
+
+    if ((p[0] & LP_ENCODING_7BIT_UINT_MASK) == LP_ENCODING_7BIT_UINT) {
+        uval = p[0] & 0x7f;
+        negstart = UINT64_MAX;
+        negmax = 0;
+    } else if ((p[0] & LP_ENCODING_6BIT_STR_MASK) == LP_ENCODING_6BIT_STR) {
+        *count = p[0] & 0x3f;
+        return p + 1;
+    } else if ((p[0] & LP_ENCODING_13BIT_INT_MASK) == LP_ENCODING_13BIT_INT) {
+        uval = ((uint64_t) (p[0] & 0x1f) << 8) | p[1];
+        negstart = (uint64_t) 1 << 12;
+        negmax = 8191;
+    } else if ((p[0] & LP_ENCODING_12BIT_STR_MASK) == LP_ENCODING_12BIT_STR) {
+        *count = ((p[0] & 0xf) << 8) | p[1];
+        return p + 2;
+    } else if (p[0] == LP_ENCODING_32BIT_STR) {
+        *count = (uint32_t) p[1] | (uint32_t) p[2] << 8 | (uint32_t) p[3] << 16 | (uint32_t) p[4] << 24;
+        return p + 5;
+    } else {
+        int bytes;
+        switch (p[0]) {
+            case LP_ENCODING_16BIT_INT: bytes = 2; break;
+            case LP_ENCODING_24BIT_INT: bytes = 3; break;
+            case LP_ENCODING_32BIT_INT: bytes = 4; break;
+            default: bytes = 8; break;
+        }
+        uval = 0;
+        for (int i = 0; i < bytes; i++) {
+            uval |= (uint64_t) p[1 + i] << (8 * i);
+        }
+        if (bytes == 8) {
+            negstart = (uint64_t) 1 << 63;
+            negmax = UINT64_MAX;
+        } else {
+            negstart = (uint64_t) 1 << (bytes * 8 - 1);
+            negmax = ((uint64_t) 1 << (bytes * 8)) - 1;
+        }
+    }
+
+    int64_t val;
+    if (uval >= negstart) {
+        // 补码转换成负数
+        uval = negmax - uval;
+        val = uval;
+        val = -val - 1;
+    } else {
+        val = uval;
+    }
+
+    if (intbuf != NULL) {
+        *count = ll2string((char*) intbuf, LP_INTBUF_SIZE, val);
+        return intbuf;
+    }
+    *count = val;
+    return NULL;
+}
+
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    // s能转换成整数时, 只可能和整数编码的元素相等
+    long long sval;
+    int sIsInt = slen <= 20 && string2ll((char*) s, slen, &sval);
+
+    while (p != NULL) {
+        int64_t count;
+        unsigned char *value = lpGet(p, &count, NULL);
+        if (value != NULL) {
+            if (!sIsInt && count == slen && memcmp(value, s, slen) == 0) {
+                return p;
+            }
+        } else if (sIsInt && count == sval) {
+            return p;
+        }
+
+        p = lpNext(lp, p);
+        for (unsigned int i = 0; i < skip && p != NULL; i++) {
+            p = lpNext(lp, p);
+        }
+    }
+    return NULL;
+}
+
+/*------------------------------ modification ------------------------*/
+
+unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size,
+                        unsigned char *p, int where, unsigned char **newp) {
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+    unsigned char backlen[LP_MAX_BACKLEN_SIZE];
+    uint64_t enclen = 0;
+    int enctype = LP_ENCODING_STRING;
+
+    // 删除就是用NULL替换
+    if (ele == NULL) {
+        where = LP_REPLACE;
+    }
+    // 插入到p后面等价于插入到p的下一个元素前面
+    if (where == LP_AFTER) {
+        p = lpSkip(p);
+        where = LP_BEFORE;
+    }
+
+    unsigned long poff = p - lp;
+    unsigned long backlenSize = 0;
+    if (ele != NULL) {
+        enctype = lpEncodeGetType(ele, size, intenc, &enclen);
+        backlenSize = lpEncodeBacklen(backlen, enclen);
+    }
+
+    uint64_t oldBytes = lpGetTotalBytes(lp);
+    uint32_t replacedLen = 0;
+    if (where == LP_REPLACE) {
+        replacedLen = lpCurrentEncodedSize(p);
+        replacedLen += lpEncodeBacklen(NULL, replacedLen);
+    }
+
+    uint64_t newBytes = oldBytes + enclen + backlenSize - replacedLen;
+    if (newBytes > UINT32_MAX) {
+        return NULL;
+    }
+
+    // 变大时先realloc再memmove, 变小时先memmove再realloc
+    unsigned char *dst = lp + poff;
+    if (newBytes > oldBytes) {
+        lp = zrealloc(lp, newBytes);
+        if (lp == NULL) {
+            return NULL;
+        }
+        dst = lp + poff;
+    }
+    if (where == LP_BEFORE) {
+        memmove(dst + enclen + backlenSize, dst, oldBytes - poff);
+    } else {
+        long lendiff = (long) (enclen + backlenSize) - (long) replacedLen;
+        memmove(dst + replacedLen + lendiff, dst + replacedLen, oldBytes - poff - replacedLen);
+    }
+    if (newBytes < oldBytes) {
+        lp = zrealloc(lp, newBytes);
+        dst = lp + poff;
+    }
+
+    if (newp != NULL) {
+        *newp = dst;
+        if (ele == NULL && dst[0] == LP_EOF) {
+            *newp = NULL;
+        }
+    }
+    if (ele != NULL) {
+        if (enctype == LP_ENCODING_INT) {
+            memcpy(dst, intenc, enclen);
+        } else {
+            lpEncodeString(dst, ele, size);
+        }
+        dst += enclen;
+        memcpy(dst, backlen, backlenSize);
+    }
+
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) {
+        if (where == LP_BEFORE) {
+            numele++;
+        } else if (ele == NULL) {
+            numele--;
+        }
+        lpSetNumElements(lp, numele);
+    }
+    lpSetTotalBytes(lp, newBytes);
+    return lp;
+}
+
+unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *eof = lp + lpGetTotalBytes(lp) - 1;
+    return lpInsert(lp, ele, size, eof, LP_BEFORE, NULL);
+}
+
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    return lpInsert(lp, ele, size, lp + LP_HDR_SIZE, LP_BEFORE, NULL);
+}
+
+unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp) {
+    return lpInsert(lp, NULL, 0, p, LP_REPLACE, newp);
+}
+
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *first = lpSeek(lp, index);
+    if (first == NULL || num == 0) {
+        return lp;
+    }
+
+    unsigned char *last = first;
+    unsigned long deleted = 0;
+    while (deleted < num && last[0] != LP_EOF) {
+        last = lpSkip(last);
+        deleted++;
+    }
+
+    uint32_t totalBytes = lpGetTotalBytes(lp);
+    unsigned long removed = last - first;
+    memmove(first, last, totalBytes - (last - lp));
+    lp = zrealloc(lp, totalBytes - removed);
+    lpSetTotalBytes(lp, totalBytes - removed);
+
+    uint32_t numele = lpGetNumElements(lp);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) {
+        lpSetNumElements(lp, numele - deleted);
+    }
+    return lp;
+}
+
+unsigned char *lpMerge(unsigned char *first, unsigned char *second) {
+    uint32_t firstBytes = lpGetTotalBytes(first);
+    uint32_t secondBytes = lpGetTotalBytes(second);
+    // entry只记录自己的长度, 直接把second的所有entry拷贝到first的EOF处就可以了
+    uint64_t entriesBytes = secondBytes - LP_HDR_SIZE - 1;
+    uint64_t newBytes = firstBytes + entriesBytes;
+    if (newBytes > UINT32_MAX) {
+        return NULL;
+    }
+    unsigned char *lp = zrealloc(first, newBytes);
+    if (lp == NULL) {
+        return NULL;
+    }
+    memcpy(lp + firstBytes - 1, second + LP_HDR_SIZE, entriesBytes);
+    lp[newBytes - 1] = LP_EOF;
+    lpSetTotalBytes(lp, newBytes);
+
+    uint32_t firstNum = lpGetNumElements(lp);
+    uint32_t secondNum = lpGetNumElements(second);
+    if (firstNum == LP_HDR_NUMELE_UNKNOWN || secondNum == LP_HDR_NUMELE_UNKNOWN ||
+        firstNum + secondNum >= LP_HDR_NUMELE_UNKNOWN) {
+        lpSetNumElements(lp, LP_HDR_NUMELE_UNKNOWN);
+    } else {
+        lpSetNumElements(lp, firstNum + secondNum);
+    }
+    return lp;
+}
+
+/** debug */
+static int checkEntry(unsigned char *p, const char *expect, size_t len) {
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int64_t count;
+    unsigned char *v = lpGet(p, &count, intbuf);
+    return (size_t) count == len && memcmp(v, expect, len) == 0;
+}
+
+/**
+ * 覆盖所有整数和字符串编码, 正向读出来必须和写入的一样, 再用backlen反向走一遍
+ */
+static void testRoundtrip(void) {
+    char *cases[] = {"0", "127", "128", "-1", "4095", "-4096", "4096", "-4097", "32767", "-32768",
+        "32768", "8388607", "-8388608", "8388608", "2147483647", "-2147483648", "2147483648",
+        "9223372036854775807", "-9223372036854775808", "9223372036854775808",
+        "007", "+1", "-0", " 1", "", "a", "hello"};
+    int ncases = sizeof(cases) / sizeof(cases[0]);
+    // 长度正好在6/12/32bit字符串编码的边界上, 最后一个的backlen需要3个字节
+    size_t biglens[] = {63, 64, 4095, 4096, 70000};
+    int nbig = sizeof(biglens) / sizeof(biglens[0]);
+    int total = ncases + nbig;
+    char **vals = malloc(sizeof(char*) * total);
+    size_t *lens = malloc(sizeof(size_t) * total);
+
+    unsigned char *lp = lpNew();
+    for (int i = 0; i < ncases; i++) {
+        vals[i] = cases[i];
+        lens[i] = strlen(cases[i]);
+        lp = lpAppend(lp, (unsigned char*) vals[i], lens[i]);
+    }
+    for (int i = 0; i < nbig; i++) {
+        vals[ncases + i] = malloc(biglens[i]);
+        lens[ncases + i] = biglens[i];
+        for (size_t j = 0; j < biglens[i]; j++) {
+            vals[ncases + i][j] = 'a' + (i + j) % 26;
+        }
+        lp = lpAppend(lp, (unsigned char*) vals[ncases + i], lens[ncases + i]);
+    }
+
+    int ok = lpLength(lp) == (unsigned long) total;
+    int i = 0;
+    for (unsigned char *p = lpFirst(lp); p != NULL; p = lpNext(lp, p), i++) {
+        if (i >= total || !checkEntry(p, vals[i], lens[i])) {
+            printf("forward: entry %d FAIL\n", i);
+            ok = 0;
+            break;
+        }
+    }
+    ok = ok && i == total;
+    printf("forward %d entries, %zu bytes: %s\n", total, lpBytes(lp), ok ? "ok" : "FAIL");
+
+    ok = 1;
+    i = total - 1;
+    for (unsigned char *p = lpLast(lp); p != NULL; p = lpPrev(lp, p), i--) {
+        if (i < 0 || !checkEntry(p, vals[i], lens[i])) {
+            printf("backward: entry %d FAIL\n", i);
+            ok = 0;
+            break;
+        }
+    }
+    ok = ok && i == -1;
+    printf("backward via backlen: %s\n", ok ? "ok" : "FAIL");
+
+    ok = 1;
+    for (i = 0; i < total; i++) {
+        if (!checkEntry(lpSeek(lp, i), vals[i], lens[i]) || !checkEntry(lpSeek(lp, i - total), vals[i], lens[i])) {
+            ok = 0;
+        }
+    }
+    ok = ok && lpSeek(lp, total) == NULL && lpSeek(lp, -total - 1) == NULL;
+    printf("seek: %s\n", ok ? "ok" : "FAIL");
+
+    unsigned char *p = lpFind(lp, lpFirst(lp), (unsigned char*) "-8388608", 8, 0);
+    printf("find: %s\n", p != NULL && checkEntry(p, "-8388608", 8) ? "ok" : "FAIL");
+
+    // 删掉中间一段, 两边剩下的元素前后都还能正常遍历
+    lp = lpDeleteRange(lp, 3, ncases - 3);
+    ok = lpLength(lp) == (unsigned long) (3 + nbig);
+    i = 0;
+    for (p = lpLast(lp); p != NULL; p = lpPrev(lp, p)) {
+        i++;
+    }
+    ok = ok && i == 3 + nbig && checkEntry(lpSeek(lp, 2), vals[2], lens[2])
+        && checkEntry(lpSeek(lp, 3), vals[ncases], lens[ncases]);
+    printf("delete range: %s\n", ok ? "ok" : "FAIL");
+
+    lpFree(lp);
+    for (i = 0; i < nbig; i++) {
+        free(vals[ncases + i]);
+    }
+    free(vals);
+    free(lens);
+}
+
+/**
+ * backlen的每种长度(1~5字节)编码之后都能从最后一个字节解回来
+ */
+static void testBacklen(void) {
+    uint64_t cases[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 268435455, 268435456, UINT32_MAX};
+    // 每个字节7bit, 所以每个边界值都要用最少的字节数
+    unsigned long sizes[] = {1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5};
+    int ok = 1;
+    for (int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        unsigned char buf[LP_MAX_BACKLEN_SIZE];
+        unsigned long n = lpEncodeBacklen(buf, cases[i]);
+        if (n != sizes[i] || n != lpEncodeBacklen(NULL, cases[i]) ||
+            lpDecodeBacklen(buf + n - 1) != cases[i]) {
+            printf("backlen %llu FAIL\n", (unsigned long long) cases[i]);
+            ok = 0;
+        }
+    }
+    printf("backlen: %s\n", ok ? "ok" : "FAIL");
+}
+
+int main(void) {
+    testBacklen();
+    testRoundtrip();
+    return 0;
+}
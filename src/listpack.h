@@ -0,0 +1,76 @@
+#ifndef __LISTPACK_H
+#define __LISTPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * listpack: 把一组字符串/整数紧凑地保存在一块连续内存中
+ *
+ * 布局: [total bytes: 4][num elements: 2][entry]...[entry][0xFF]
+ * entry: [encoding + data][backlen]
+ *   - encoding的第一个字节决定了类型和长度, 小整数最少只需要1个字节
+ *   - backlen是encoding+data的长度, 按7bit变长编码且可以从后往前解析，用来反向遍历
+ *
+ * 适合元素少并且元素比较短的场景, 插入和删除都需要memmove整个后半部分
+ */
+
+#define LP_INTBUF_SIZE 21 // 整数转成字符串需要的最大空间
+
+#define LP_BEFORE 0
+#define LP_AFTER 1
+#define LP_REPLACE 2
+
+unsigned char *lpNew(void);
+void lpFree(unsigned char *lp);
+
+/**
+ * 在p的前面/后面插入或者替换掉p, ele == NULL时表示删除p
+ * @param newp 如果不为NULL, 会被设置为插入的元素(删除时为删除位置的下一个元素)
+ * @return 新的listpack指针, 可能和lp不同
+ */
+unsigned char *lpInsert(unsigned char *lp, unsigned char *ele, uint32_t size,
+    unsigned char *p, int where, unsigned char **newp);
+unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size);
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size);
+unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **newp);
+/**
+ * 删除从index开始的num个元素(index可以是负数), 只需要一次memmove
+ */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num);
+
+/**
+ * 把second的所有元素追加到first的后面, second不会被修改也不会被释放
+ * @return 新的listpack指针, 失败时返回NULL, first保持不变
+ */
+unsigned char *lpMerge(unsigned char *first, unsigned char *second);
+
+unsigned char *lpFirst(unsigned char *lp);
+unsigned char *lpLast(unsigned char *lp);
+unsigned char *lpNext(unsigned char *lp, unsigned char *p);
+unsigned char *lpPrev(unsigned char *lp, unsigned char *p);
+
+/**
+ * index可以是负数, -1表示最后一个元素
+ * @return NULL if out of range
+ */
+unsigned char *lpSeek(unsigned char *lp, long index);
+
+/**
+ * 读取p处的元素
+ * 字符串: 返回指向数据的指针, *count为长度
+ * 整数: intbuf不为NULL时转成字符串写入intbuf并返回intbuf; 否则返回NULL, *count为整数值
+ */
+unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf);
+
+/**
+ * 从p开始查找和s相等的元素, 每比较一个元素之后跳过skip个元素
+ * 比如field/value交替保存时skip=1就只比较field
+ * @return 找到的元素, 没找到返回NULL
+ */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip);
+
+unsigned long lpLength(unsigned char *lp);
+size_t lpBytes(unsigned char *lp);
+
+#endif
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "lzf.h"
+
+#define LZF_MAX_LIT (1 << 5)
+#define LZF_MAX_OFF (1 << 13)
+#define LZF_MAX_REF ((1 << 8) + (1 << 3))
+
+/**
+ * hash表最大2^14项; 短的输入用小一些的表, 清零hash表的开销和输入长度成正比
+ */
+#define LZF_HASH_LOG_MIN 8
+#define LZF_HASH_LOG_MAX 14
+
+static inline unsigned int lzfHash(const unsigned char *p, unsigned int hlog) {
+    uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - hlog);
+}
+
+size_t lzfCompress(const void *in, size_t inlen, void *out, size_t outlen) {
+    const unsigned char *base = in;
+    const unsigned char *ip = base;
+    const unsigned char *iend = base + inlen;
+    unsigned char *op = out;
+    unsigned char *oend = op + outlen;
+    if (inlen == 0 || outlen == 0) {
+        return 0;
+    }
+
+    // hash表记录的是3个字节最近出现的位置
+    unsigned int hlog = LZF_HASH_LOG_MIN;
+    while (hlog < LZF_HASH_LOG_MAX && ((size_t) 1 << hlog) < inlen) {
+        hlog++;
+    }
+    uint32_t htab[1 << LZF_HASH_LOG_MAX];
+    memset(htab, 0, sizeof(uint32_t) << hlog);
+
+    // 当前字面量段的控制字节, 段结束时才知道长度
+    unsigned char *lp = op++;
+    int lit = 0;
+    // 连续没有匹配的字节数: 超过64之后每4个位置才查一次hash表, 不可压缩的数据快很多
+    size_t misses = 0;
+    while (ip < iend) {
+        if (ip + 2 < iend && (misses < 64 || (misses & 3) == 0)) {
+            unsigned int h = lzfHash(ip, hlog);
+            const unsigned char *ref = base + htab[h];
+            htab[h] = ip - base;
+            size_t off = ip - ref - 1;
+            if (ref < ip && off < LZF_MAX_OFF && ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+                size_t maxlen = iend - ip;
+                if (maxlen > LZF_MAX_REF) {
+                    maxlen = LZF_MAX_REF;
+                }
+                size_t len = 3;
+                while (len < maxlen && ref[len] == ip[len]) {
+                    len++;
+                }
+
+                // 结束当前的字面量段, 没有字面量的话去掉预留的控制字节
+                if (lit == 0) {
+                    op--;
+                } else {
+                    *lp = lit - 1;
+                }
+                // 引用最多3个字节, 再加上下一段的控制字节
+                if (op + 4 > oend) {
+                    return 0;
+                }
+                len -= 2;
+                if (len < 7) {
+                    *op++ = (off >> 8) + (len << 5);
+                } else {
+                    *op++ = (off >> 8) + (7 << 5);
+                    *op++ = len - 7;
+                }
+                *op++ = off & 0xff;
+                ip += len + 2;
+
+                // 匹配结尾的两个位置也加到hash表中, 对重复度高的数据压缩率好很多
+                if (ip + 2 < iend) {
+                    htab[lzfHash(ip - 2, hlog)] = ip - 2 - base;
+                    htab[lzfHash(ip - 1, hlog)] = ip - 1 - base;
+                }
+                lp = op++;
+                lit = 0;
+                misses = 0;
+                continue;
+            }
+        }
+
+        if (op >= oend) {
+            return 0;
+        }
+        *op++ = *ip++;
+        misses++;
+        if (++lit == LZF_MAX_LIT) {
+            *lp = lit - 1;
+            if (op >= oend) {
+                return 0;
+            }
+            lp = op++;
+            lit = 0;
+        }
+    }
+
+    if (lit == 0) {
+        op--;
+    } else {
+        *lp = lit - 1;
+    }
+    return op - (unsigned char*) out;
+}
+
+size_t lzfDecompress(const void *in, size_t inlen, void *out, size_t outlen) {
+    const unsigned char *ip = in;
+    const unsigned char *iend = ip + inlen;
+    unsigned char *op = out;
+    unsigned char *oend = op + outlen;
+
+    while (ip < iend) {
+        unsigned int ctrl = *ip++;
+        if (ctrl < LZF_MAX_LIT) {
+            // 字面量
+            size_t len = ctrl + 1;
+            if (op + len > oend || ip + len > iend) {
+                return 0;
+            }
+            memcpy(op, ip, len);
+            op += len;
+            ip += len;
+            continue;
+        }
+
+        // 引用
+        size_t len = ctrl >> 5;
+        if (len == 7) {
+            if (ip >= iend) {
+                return 0;
+            }
+            len += *ip++;
+        }
+        len += 2;
+        if (ip >= iend) {
+            return 0;
+        }
+        size_t off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+        if (off > (size_t) (op - (unsigned char*) out) || op + len > oend) {
+            return 0;
+        }
+        // 源和目标重叠时(比如重复的单个字符)数据以off为周期重复, 已经复制出来的部分可以作为下一次的源, 每次翻倍
+        const unsigned char *ref = op - off;
+        while (len > 0) {
+            size_t n = (size_t) (op - ref) < len ? (size_t) (op - ref) : len;
+            memcpy(op, ref, n);
+            op += n;
+            len -= n;
+        }
+    }
+    return op - (unsigned char*) out;
+}
+
+/** debug */
+static long long ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void roundtrip(const char *name, const unsigned char *data, size_t len) {
+    // 不可压缩的数据每32个字节多一个控制字节
+    size_t complen = len + len / 32 + 64;
+    unsigned char *comp = malloc(complen);
+    unsigned char *decomp = malloc(len + 1);
+    long long start = ustime();
+    size_t clen = lzfCompress(data, len, comp, complen);
+    long long ctime = ustime() - start;
+    start = ustime();
+    size_t dlen = clen > 0 ? lzfDecompress(comp, clen, decomp, len) : 0;
+    long long dtime = ustime() - start;
+    int ok = clen > 0 && dlen == len && memcmp(data, decomp, len) == 0;
+    printf("%-10s len %8zu -> %8zu (%.1f%%) %s compress %lld us decompress %lld us\n",
+        name, len, clen, len ? clen * 100.0 / len : 0, ok ? "ok" : "FAIL", ctime, dtime);
+    // 输出空间不够时必须失败, 不能越界
+    if (clen > 1 && lzfCompress(data, len, comp, clen - 1) != 0) {
+        printf("%-10s FAIL: compressed into a smaller buffer\n", name);
+    }
+    if (clen > 1 && len > 0 && lzfDecompress(comp, clen, decomp, len - 1) != 0) {
+        printf("%-10s FAIL: decompressed into a smaller buffer\n", name);
+    }
+    free(comp);
+    free(decomp);
+}
+
+int main(void) {
+    size_t len = 4 * 1024 * 1024;
+    unsigned char *buf = malloc(len);
+
+    size_t n = 0;
+    for (int i = 0; n + 128 < len; i++) {
+        n += snprintf((char*) buf + n, len - n, "{\"id\":%d,\"name\":\"user%d\",\"active\":true,\"tags\":[\"a\",\"b\"]},", i, i % 1000);
+    }
+    roundtrip("json", buf, n);
+
+    memset(buf, 'x', len);
+    roundtrip("same", buf, len);
+
+    srandom(1);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = random();
+    }
+    roundtrip("random", buf, len);
+    roundtrip("tiny", (const unsigned char*) "abcabcabcabc", 12);
+    roundtrip("one", (const unsigned char*) "a", 1);
+
+    // 错误的输入不能越界
+    unsigned char bad[] = {0xe0, 0x10, 0x05};
+    printf("bad ref: %zu\n", lzfDecompress(bad, sizeof(bad), buf, len));
+    free(buf);
+    return 0;
+}
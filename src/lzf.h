@@ -0,0 +1,29 @@
+#ifndef __LZF_H
+#define __LZF_H
+
+#include <stddef.h>
+
+/**
+ * LZF压缩: 只有字面量和向前引用两种指令, 没有熵编码, 压缩和解压都只是简单的字节复制,
+ * 速度接近memcpy, 适合快照这种数据量大、对压缩率要求不高的场景
+ *
+ * 指令格式(第一个字节的高3位区分):
+ *   000LLLLL                   后面跟L+1个字面量
+ *   LLLooooo oooooooo          复制L+2个字节, 距离当前位置o+1
+ *   111ooooo LLLLLLLL oooooooo 复制L+9个字节, 距离当前位置o+1
+ * 最远引用8KB之前的数据, 一次最多复制264个字节
+ */
+
+/**
+ * @param outlen out的大小, 压缩结果超过outlen时放弃
+ * @return 压缩后的长度, 0表示放不下(数据不可压缩)或者inlen为0
+ */
+size_t lzfCompress(const void *in, size_t inlen, void *out, size_t outlen);
+
+/**
+ * @param outlen out的大小, 一般就是压缩之前的长度
+ * @return 解压之后的长度, 0表示数据格式错误或者out放不下
+ */
+size_t lzfDecompress(const void *in, size_t inlen, void *out, size_t outlen);
+
+#endif
@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "quicklist.h"
+#include "listpack.h"
+#include "zmalloc.h"
+#include "slab.h"
+
+/** 一个元素在listpack中最多额外占用的字节数(encoding + backlen) */
+#define QUICKLIST_ENTRY_OVERHEAD 11
+
+Quicklist *quicklistCreate(unsigned int fill) {
+    Quicklist *ql = slabMalloc(sizeof(*ql));
+    if (ql == NULL) {
+        return NULL;
+    }
+    ql->head = ql->tail = NULL;
+    ql->count = 0;
+    ql->len = 0;
+    ql->fill = fill == 0 ? 1 : fill;
+    return ql;
+}
+
+static QuicklistNode *quicklistCreateNode(unsigned char *lp) {
+    QuicklistNode *node = slabMalloc(sizeof(*node));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->prev = node->next = NULL;
+    node->entry = lp != NULL ? lp : lpNew();
+    if (node->entry == NULL) {
+        slabFree(node);
+        return NULL;
+    }
+    node->sz = lpBytes(node->entry);
+    node->count = lpLength(node->entry);
+    return node;
+}
+
+static void quicklistFreeNode(QuicklistNode *node) {
+    lpFree(node->entry);
+    slabFree(node);
+}
+
+void quicklistRelease(Quicklist *ql) {
+    QuicklistNode *current = ql->head;
+    while (current != NULL) {
+        QuicklistNode *next = current->next;
+        quicklistFreeNode(current);
+        current = next;
+    }
+    slabFree(ql);
+}
+
+/**
+ * 把node插入到old的前面(after == 0)或者后面, old为NULL表示quicklist是空的
+ */
+static void quicklistInsertNode(Quicklist *ql, QuicklistNode *old, QuicklistNode *node, int after) {
+    if (old == NULL) {
+        ql->head = ql->tail = node;
+    } else if (after) {
+        node->prev = old;
+        node->next = old->next;
+        if (old->next != NULL) {
+            old->next->prev = node;
+        }
+        old->next = node;
+        if (ql->tail == old) {
+            ql->tail = node;
+        }
+    } else {
+        node->next = old;
+        node->prev = old->prev;
+        if (old->prev != NULL) {
+            old->prev->next = node;
+        }
+        old->prev = node;
+        if (ql->head == old) {
+            ql->head = node;
+        }
+    }
+    ql->len++;
+    ql->count += node->count;
+}
+
+static void quicklistDelNode(Quicklist *ql, QuicklistNode *node) {
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        ql->head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        ql->tail = node->prev;
+    }
+    ql->len--;
+    ql->count -= node->count;
+    quicklistFreeNode(node);
+}
+
+/**
+ * node是否还能再放下一个长度为sz的元素
+ * 空的node总是可以插入, 这样超过QUICKLIST_MAX_NODE_BYTES的大元素会单独占一个node
+ */
+static int quicklistNodeAllowInsert(Quicklist *ql, QuicklistNode *node, size_t sz) {
+    if (node == NULL) {
+        return 0;
+    }
+    if (node->count == 0) {
+        return 1;
+    }
+    if (node->count >= ql->fill) {
+        return 0;
+    }
+    return node->sz + sz + QUICKLIST_ENTRY_OVERHEAD <= QUICKLIST_MAX_NODE_BYTES;
+}
+
+/**
+ * a和b相邻时, 合并之后是否还满足node的元素个数和大小限制
+ */
+static int quicklistNodeAllowMerge(Quicklist *ql, QuicklistNode *a, QuicklistNode *b) {
+    if (a == NULL || b == NULL) {
+        return 0;
+    }
+    return a->count + b->count <= ql->fill && a->sz + b->sz <= QUICKLIST_MAX_NODE_BYTES;
+}
+
+/**
+ * 把b(a的下一个node)合并到a中并删除b
+ * @return 0表示内存不足没有合并, 两个node都保持不变
+ */
+static int quicklistMergeNodes(Quicklist *ql, QuicklistNode *a, QuicklistNode *b) {
+    unsigned char *lp = lpMerge(a->entry, b->entry);
+    if (lp == NULL) {
+        return 0;
+    }
+    a->entry = lp;
+    a->sz = lpBytes(lp);
+    a->count += b->count;
+    // quicklistDelNode会减去b->count, 而元素总数不变
+    ql->count += b->count;
+    quicklistDelNode(ql, b);
+    return 1;
+}
+
+/**
+ * 删除元素之后被删了一部分的node可能只剩下很少的元素, 从from到stop(不包括)从左往右能合并就合并,
+ * 避免留下一串很小的node. 合并只会让node变大, 所以已经比较过的相邻node不需要再比较
+ */
+static void quicklistMergeRange(Quicklist *ql, QuicklistNode *from, QuicklistNode *stop) {
+    QuicklistNode *node = from;
+    while (node != NULL && node->next != stop) {
+        if (!quicklistNodeAllowMerge(ql, node, node->next) || !quicklistMergeNodes(ql, node, node->next)) {
+            node = node->next;
+        }
+    }
+}
+
+int quicklistPushHead(Quicklist *ql, void *value, size_t sz) {
+    QuicklistNode *node = ql->head;
+    if (!quicklistNodeAllowInsert(ql, node, sz)) {
+        node = quicklistCreateNode(NULL);
+        if (node == NULL) {
+            return 0;
+        }
+        quicklistInsertNode(ql, ql->head, node, 0);
+    }
+    unsigned char *lp = lpPrepend(node->entry, value, sz);
+    if (lp == NULL) {
+        // 失败时原来的listpack不变, 只需要去掉刚才新建的空node
+        if (node->count == 0) {
+            quicklistDelNode(ql, node);
+        }
+        return 0;
+    }
+    node->entry = lp;
+    node->sz = lpBytes(node->entry);
+    node->count++;
+    ql->count++;
+    return 1;
+}
+
+int quicklistPushTail(Quicklist *ql, void *value, size_t sz) {
+    QuicklistNode *node = ql->tail;
+    if (!quicklistNodeAllowInsert(ql, node, sz)) {
+        node = quicklistCreateNode(NULL);
+        if (node == NULL) {
+            return 0;
+        }
+        quicklistInsertNode(ql, ql->tail, node, 1);
+    }
+    unsigned char *lp = lpAppend(node->entry, value, sz);
+    if (lp == NULL) {
+        if (node->count == 0) {
+            quicklistDelNode(ql, node);
+        }
+        return 0;
+    }
+    node->entry = lp;
+    node->sz = lpBytes(node->entry);
+    node->count++;
+    ql->count++;
+    return 1;
+}
+
+int quicklistPush(Quicklist *ql, void *value, size_t sz, int where) {
+    if (where == QUICKLIST_HEAD) {
+        return quicklistPushHead(ql, value, sz);
+    }
+    return quicklistPushTail(ql, value, sz);
+}
+
+int quicklistAppendListpack(Quicklist *ql, unsigned char *lp) {
+    QuicklistNode *node = quicklistCreateNode(lp);
+    if (node == NULL) {
+        return 0;
+    }
+    if (node->count == 0) {
+        quicklistFreeNode(node);
+        return 1;
+    }
+    quicklistInsertNode(ql, ql->tail, node, 1);
+    return 1;
+}
+
+/**
+ * 根据entry->p填充value/sz/longval
+ */
+static void quicklistEntryLoad(QuicklistEntry *entry) {
+    int64_t count;
+    entry->value = lpGet(entry->p, &count, NULL);
+    if (entry->value == NULL) {
+        entry->longval = count;
+        entry->sz = 0;
+    } else {
+        entry->sz = count;
+    }
+}
+
+int quicklistIndex(Quicklist *ql, long index, QuicklistEntry *entry) {
+    int forward = index >= 0;
+    unsigned long idx = forward ? (unsigned long) index : (unsigned long) (-(index + 1));
+    if (idx >= ql->count) {
+        return 0;
+    }
+
+    // 从离得近的一端开始找, 整个node整个node地跳过
+    if (idx > ql->count / 2) {
+        forward = !forward;
+        idx = ql->count - 1 - idx;
+    }
+    QuicklistNode *n = forward ? ql->head : ql->tail;
+    unsigned long accum = 0;
+    while (accum + n->count <= idx) {
+        accum += n->count;
+        n = forward ? n->next : n->prev;
+    }
+
+    entry->node = n;
+    entry->offset = forward ? (long) (idx - accum) : (long) (n->count - 1 - (idx - accum));
+    entry->p = lpSeek(n->entry, entry->offset);
+    quicklistEntryLoad(entry);
+    return 1;
+}
+
+int quicklistReplaceAtIndex(Quicklist *ql, long index, void *data, size_t sz) {
+    QuicklistEntry entry;
+    if (!quicklistIndex(ql, index, &entry)) {
+        return 0;
+    }
+    QuicklistNode *node = entry.node;
+    unsigned char *lp = lpInsert(node->entry, data, sz, entry.p, LP_REPLACE, NULL);
+    if (lp == NULL) {
+        return -1;
+    }
+    node->entry = lp;
+    node->sz = lpBytes(node->entry);
+    return 1;
+}
+
+unsigned long quicklistDelRange(Quicklist *ql, long start, unsigned long count) {
+    QuicklistEntry entry;
+    if (count == 0 || !quicklistIndex(ql, start, &entry)) {
+        return 0;
+    }
+
+    unsigned long extent = count;
+    QuicklistNode *node = entry.node;
+    QuicklistNode *before = node->prev; // 不会被删除
+    unsigned long offset = entry.offset;
+    while (extent > 0 && node != NULL) {
+        QuicklistNode *next = node->next;
+        unsigned long del = node->count - offset;
+        if (del > extent) {
+            del = extent;
+        }
+
+        if (del == node->count) {
+            // 整个node都要删掉
+            quicklistDelNode(ql, node);
+        } else {
+            node->entry = lpDeleteRange(node->entry, offset, del);
+            node->sz = lpBytes(node->entry);
+            node->count -= del;
+            ql->count -= del;
+        }
+        extent -= del;
+        node = next;
+        offset = 0;
+    }
+
+    // 删除范围两端的node可能只剩下一部分, 和before以及后面的第一个node一起尝试合并
+    quicklistMergeRange(ql, before != NULL ? before : ql->head, node != NULL ? node->next : NULL);
+    return count - extent;
+}
+
+QuicklistIter *quicklistGetIteratorAtIdx(Quicklist *ql, int direction, long index) {
+    QuicklistEntry entry;
+    if (!quicklistIndex(ql, index, &entry)) {
+        return NULL;
+    }
+    QuicklistIter *iter = zmalloc(sizeof(*iter));
+    if (iter == NULL) {
+        return NULL;
+    }
+    iter->ql = ql;
+    iter->current = entry.node;
+    iter->p = entry.p;
+    iter->direction = direction;
+    return iter;
+}
+
+int quicklistNext(QuicklistIter *iter, QuicklistEntry *entry) {
+    if (iter->p == NULL) {
+        return 0;
+    }
+
+    entry->node = iter->current;
+    entry->p = iter->p;
+    quicklistEntryLoad(entry);
+
+    // 移动到下一个元素, 当前node遍历完了就换到相邻的node
+    unsigned char *lp = iter->current->entry;
+    if (iter->direction == AL_START_HEAD) {
+        iter->p = lpNext(lp, iter->p);
+        if (iter->p == NULL && iter->current->next != NULL) {
+            iter->current = iter->current->next;
+            iter->p = lpFirst(iter->current->entry);
+        }
+    } else {
+        iter->p = lpPrev(lp, iter->p);
+        if (iter->p == NULL && iter->current->prev != NULL) {
+            iter->current = iter->current->prev;
+            iter->p = lpLast(iter->current->entry);
+        }
+    }
+    return 1;
+}
+
+void quicklistReleaseIterator(QuicklistIter *iter) {
+    zfree(iter);
+}
+
+/** debug */
+static int entryEquals(QuicklistEntry *entry, const char *expect) {
+    char buf[32];
+    if (entry->value == NULL) {
+        snprintf(buf, sizeof(buf), "%lld", entry->longval);
+        return strcmp(buf, expect) == 0;
+    }
+    return entry->sz == strlen(expect) && memcmp(entry->value, expect, entry->sz) == 0;
+}
+
+/**
+ * 检查node链表和计数, 然后正向/反向迭代并按下标读出所有元素和expect比较
+ */
+static int checkList(Quicklist *ql, char **expect, long n) {
+    unsigned long count = 0;
+    unsigned long len = 0;
+    QuicklistNode *prev = NULL;
+    for (QuicklistNode *node = ql->head; node != NULL; node = node->next) {
+        if (node->prev != prev || node->count == 0 || node->count != lpLength(node->entry) ||
+            node->sz != lpBytes(node->entry) || (node->count > ql->fill && node->count != 1)) {
+            printf("node %lu FAIL\n", len);
+            return 0;
+        }
+        count += node->count;
+        len++;
+        prev = node;
+    }
+    if (prev != ql->tail || count != ql->count || len != ql->len || count != (unsigned long) n) {
+        printf("count %lu/%lu len %lu/%lu FAIL\n", count, ql->count, len, ql->len);
+        return 0;
+    }
+    if (n == 0) {
+        return 1;
+    }
+
+    QuicklistEntry entry;
+    QuicklistIter *iter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, 0);
+    long i = 0;
+    while (quicklistNext(iter, &entry)) {
+        if (i >= n || !entryEquals(&entry, expect[i])) {
+            printf("forward %ld FAIL\n", i);
+            return 0;
+        }
+        i++;
+    }
+    quicklistReleaseIterator(iter);
+    iter = quicklistGetIteratorAtIdx(ql, AL_START_TAIL, -1);
+    while (quicklistNext(iter, &entry)) {
+        i--;
+        if (i < 0 || !entryEquals(&entry, expect[i])) {
+            printf("backward %ld FAIL\n", i);
+            return 0;
+        }
+    }
+    quicklistReleaseIterator(iter);
+    if (i != 0) {
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!quicklistIndex(ql, i, &entry) || !entryEquals(&entry, expect[i]) ||
+            !quicklistIndex(ql, i - n, &entry) || !entryEquals(&entry, expect[i])) {
+            printf("index %ld FAIL\n", i);
+            return 0;
+        }
+    }
+    return !quicklistIndex(ql, n, &entry) && !quicklistIndex(ql, -n - 1, &entry);
+}
+
+/**
+ * 删除expect中从start开始的count个元素
+ */
+static long delExpect(char **expect, long n, long start, long count) {
+    memmove(expect + start, expect + start + count, sizeof(char*) * (n - start - count));
+    return n - count;
+}
+
+int main(void) {
+    int fill = 16;
+    long total = 1000;
+    char **vals = malloc(sizeof(char*) * (total + 1));
+    char **expect = malloc(sizeof(char*) * (total + 1));
+    for (long i = 0; i < total; i++) {
+        vals[i] = malloc(32);
+        // 整数和字符串交替, 两种编码都会经过quicklistEntryLoad
+        snprintf(vals[i], 32, i % 2 ? "%ld" : "item:%ld", i);
+    }
+
+    // 一半从头部一半从尾部插入, node满了之后拆分到新的node
+    Quicklist *ql = quicklistCreate(fill);
+    long n = 0;
+    for (long i = 0; i < total / 2; i++) {
+        quicklistPushTail(ql, vals[total / 2 + i], strlen(vals[total / 2 + i]));
+        quicklistPushHead(ql, vals[total / 2 - 1 - i], strlen(vals[total / 2 - 1 - i]));
+    }
+    for (long i = 0; i < total; i++) {
+        expect[n++] = vals[i];
+    }
+    int ok = checkList(ql, expect, n) && ql->len >= (unsigned long) (total / fill);
+    printf("split on push: %lu nodes: %s\n", ql->len, ok ? "ok" : "FAIL");
+
+    // 超过QUICKLIST_MAX_NODE_BYTES的元素单独占一个node
+    char *big = malloc(QUICKLIST_MAX_NODE_BYTES * 2);
+    memset(big, 'x', QUICKLIST_MAX_NODE_BYTES * 2 - 1);
+    big[QUICKLIST_MAX_NODE_BYTES * 2 - 1] = '\0';
+    quicklistPushTail(ql, big, strlen(big));
+    expect[n++] = big;
+    ok = checkList(ql, expect, n) && ql->tail->count == 1 && ql->tail->prev->count > 0;
+    printf("big element in its own node: %s\n", ok ? "ok" : "FAIL");
+    quicklistDelRange(ql, -1, 1);
+    n--;
+
+    ok = quicklistReplaceAtIndex(ql, 17, "replaced", 8) == 1 && quicklistReplaceAtIndex(ql, n, "x", 1) == 0;
+    expect[17] = "replaced";
+    ok = ok && checkList(ql, expect, n);
+    printf("replace: %s\n", ok ? "ok" : "FAIL");
+
+    // 删除中间的大部分元素, 两端剩下的小node合并成一个
+    quicklistDelRange(ql, 5, n - 10);
+    n = delExpect(expect, n, 5, n - 10);
+    ok = checkList(ql, expect, n) && ql->len == 1;
+    printf("merge after delete range: %lu nodes: %s\n", ql->len, ok ? "ok" : "FAIL");
+    quicklistRelease(ql);
+
+    // 像LTRIM一样反复从两端删除, 每次删除之后相邻的node都不能再合并
+    ql = quicklistCreate(fill);
+    n = 0;
+    for (long i = 0; i < total; i++) {
+        quicklistPushTail(ql, vals[i], strlen(vals[i]));
+        expect[n++] = vals[i];
+    }
+    ok = 1;
+    srandom(1);
+    while (n > 0 && ok) {
+        long start = random() % n;
+        long count = 1 + random() % (fill * 2);
+        if (start + count > n) {
+            count = n - start;
+        }
+        ok = quicklistDelRange(ql, start, count) == (unsigned long) count;
+        n = delExpect(expect, n, start, count);
+        ok = ok && checkList(ql, expect, n);
+        for (QuicklistNode *node = ql->head; ok && node != NULL; node = node->next) {
+            ok = !quicklistNodeAllowMerge(ql, node, node->next);
+        }
+    }
+    printf("random delete ranges: %s\n", ok ? "ok" : "FAIL");
+    quicklistRelease(ql);
+
+    for (long i = 0; i < total; i++) {
+        free(vals[i]);
+    }
+    free(vals);
+    free(expect);
+    free(big);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef __QUICKLIST_H
+#define __QUICKLIST_H
+
+#include <stddef.h>
+
+#include "adlist.h"
+
+/**
+ * quicklist: 由listpack组成的双向链表，用来保存比较大的list
+ *
+ * 每个node是一个listpack并记录了自己的元素个数，按下标查找时可以整块跳过node,
+ * 并且从离index更近的一端开始找, 复杂度是O(n / 每个node的元素个数)
+ * 相比adlist每个元素一个ListNode + Robj, 内存也紧凑得多
+ */
+
+#define QUICKLIST_HEAD 0
+#define QUICKLIST_TAIL 1
+
+/** 单个node的listpack超过这个大小时不再往里插入(单个大元素除外) */
+#define QUICKLIST_MAX_NODE_BYTES 8192
+
+typedef struct QuicklistNode {
+    struct QuicklistNode *prev;
+    struct QuicklistNode *next;
+    unsigned char *entry; // listpack
+    size_t sz;            // listpack的字节数
+    unsigned int count;   // listpack中的元素个数
+} QuicklistNode;
+
+typedef struct Quicklist {
+    QuicklistNode *head;
+    QuicklistNode *tail;
+    unsigned long count; // 所有node的元素总数
+    unsigned long len;   // node的个数
+    unsigned int fill;   // 每个node最多保存的元素个数
+} Quicklist;
+
+/**
+ * 指向quicklist中的一个元素
+ * 字符串时value/sz有效, 整数时value为NULL, 值保存在longval中
+ */
+typedef struct QuicklistEntry {
+    QuicklistNode *node;
+    unsigned char *p; // 元素在node->entry中的位置
+    unsigned char *value;
+    unsigned int sz;
+    long long longval;
+    long offset;      // 元素在node中的下标
+} QuicklistEntry;
+
+typedef struct QuicklistIter {
+    Quicklist *ql;
+    QuicklistNode *current;
+    unsigned char *p; // 下一个要返回的元素, NULL表示迭代结束
+    int direction;
+} QuicklistIter;
+
+#define quicklistCount(ql) ((ql)->count)
+
+Quicklist *quicklistCreate(unsigned int fill);
+void quicklistRelease(Quicklist *ql);
+
+/**
+ * @return 1表示成功, 0表示内存不足, 此时quicklist保持不变
+ */
+int quicklistPush(Quicklist *ql, void *value, size_t sz, int where);
+int quicklistPushHead(Quicklist *ql, void *value, size_t sz);
+int quicklistPushTail(Quicklist *ql, void *value, size_t sz);
+
+/**
+ * 把一个listpack整个作为一个node追加到尾部, 成功之后lp归quicklist所有
+ * @return 0表示内存不足, lp仍然归调用者所有
+ */
+int quicklistAppendListpack(Quicklist *ql, unsigned char *lp);
+
+/**
+ * index可以是负数, -1表示最后一个元素
+ * @return 1表示找到并填充了entry, 0表示越界
+ */
+int quicklistIndex(Quicklist *ql, long index, QuicklistEntry *entry);
+/**
+ * @return 1表示替换成功, 0表示越界, -1表示内存不足
+ */
+int quicklistReplaceAtIndex(Quicklist *ql, long index, void *data, size_t sz);
+
+/**
+ * 删除从start开始(可以是负数)的count个元素
+ * @return 实际删除的元素个数
+ */
+unsigned long quicklistDelRange(Quicklist *ql, long start, unsigned long count);
+
+/**
+ * 从index处开始迭代, direction为AL_START_HEAD/AL_START_TAIL
+ * @return index越界时返回NULL
+ */
+QuicklistIter *quicklistGetIteratorAtIdx(Quicklist *ql, int direction, long index);
+int quicklistNext(QuicklistIter *iter, QuicklistEntry *entry);
+void quicklistReleaseIterator(QuicklistIter *iter);
+
+#endif
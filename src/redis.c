@@ -12,18 +12,32 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "ae.h"
 #include "sds.h"
 #include "anet.h"
 #include "dict.h"
+#include "dictspec.h"
 #include "adlist.h"
 #include "zmalloc.h"
+#include "slab.h"
+#include "util.h"
+#include "listpack.h"
+#include "quicklist.h"
+#include "intset.h"
+#include "zskiplist.h"
+#include "bio.h"
+#include "lzf.h"
 
 #define REDIS_OK 0
 #define REDIS_ERR 1
@@ -36,8 +50,10 @@
 #define REDIS_MAX_ARGS 16
 #define REDIS_DEFAULT_DBNUM 16
 #define REDIS_CONFIGLINE_MAX 1024
-#define REDIS_OBJFREELIST_MAX 1000000 // max number of objects to cache, cache what?
 #define REDIS_MAX_SYNC_TIME 60  // slave can't take more to sync
+#define REDIS_QUERYBUF_SHRINK_MIN (1024*32) // querybuf的free空间超过这个值才考虑收缩
+#define REDIS_QUERYBUF_IDLE_TIME 2 // client空闲这么多秒后收缩querybuf
+#define REDIS_CLIENTS_CRON_MIN_ITERATIONS 50 // 每次cron至少检查这么多client
 
 /** Hash table parameters */
 #define REDIS_HT_MINFILL 10 // minimal hash table fill 10%
@@ -46,15 +62,183 @@
 /** Command flags: 干嘛的? */
 #define REDIS_CMD_BULK 1
 #define REDIS_CMD_INLINE 2
+#define REDIS_CMD_DENYOOM 4 // 可能增加内存的写命令, 超过maxmemory并且淘汰不出空间时拒绝执行
 
 /** Object types */
 #define REDIS_STRING 0
 #define REDIS_LIST 1
 #define REDIS_SET 2
 #define REDIS_HASH 3
+#define REDIS_ZSET 4
+
+/**
+ * Object encoding: 同一种type的对象在内存中可以有不同的表示
+ * REDIS_ENCODING_INT: 字符串是一个long范围内的整数，直接保存在ptr中，不需要sds
+ * REDIS_ENCODING_EMBSTR: 短字符串，sds紧跟在Robj后面，和Robj在同一块内存里，不可修改
+ */
+#define REDIS_ENCODING_RAW 0
+#define REDIS_ENCODING_INT 1
+#define REDIS_ENCODING_EMBSTR 2
+
+/**
+ * List的encoding
+ * REDIS_ENCODING_LISTPACK: 元素少且短的list保存在一个listpack中
+ * REDIS_ENCODING_QUICKLIST: 由listpack组成的双向链表, 每个node最多listMaxListpackEntries个元素
+ */
+#define REDIS_ENCODING_QUICKLIST 3
+#define REDIS_ENCODING_LISTPACK 4
+
+/**
+ * Set/Hash的encoding
+ * REDIS_ENCODING_HT: dict, set的key是成员, value为NULL; hash的key是field, value是值
+ * REDIS_ENCODING_INTSET: 只包含整数并且元素不多的集合, 保存在一个有序的整数数组中
+ * Hash元素少的时候使用REDIS_ENCODING_LISTPACK, field和value交替保存
+ */
+#define REDIS_ENCODING_HT 5
+#define REDIS_ENCODING_INTSET 6
+
+/** intset编码的set超过这个元素个数时转换成dict, 可以在配置文件中修改 */
+#define REDIS_SET_MAX_INTSET_ENTRIES 512
+
+/** listpack编码的hash超过这些限制时转换成dict, 可以在配置文件中修改 */
+#define REDIS_HASH_MAX_LISTPACK_ENTRIES 128
+#define REDIS_HASH_MAX_LISTPACK_VALUE 64
+
+/**
+ * Sorted set的encoding
+ * REDIS_ENCODING_SKIPLIST: 跳表 + dict(member -> score)
+ * 元素少的时候使用REDIS_ENCODING_LISTPACK, member和score交替保存并且按score排好序
+ */
+#define REDIS_ENCODING_SKIPLIST 7
+
+/** listpack编码的zset超过这些限制时转换成跳表, 可以在配置文件中修改 */
+#define REDIS_ZSET_MAX_LISTPACK_ENTRIES 128
+#define REDIS_ZSET_MAX_LISTPACK_VALUE 64
+
+/** double转换成字符串需要的最大空间 */
+#define REDIS_DOUBLE_STR_SIZE 32
+
+/** maxmemory-policy: 内存超过maxmemory时怎么选择淘汰的key */
+#define REDIS_MAXMEMORY_VOLATILE_LRU 0
+#define REDIS_MAXMEMORY_ALLKEYS_LRU 1
+#define REDIS_MAXMEMORY_ALLKEYS_LFU 2
+#define REDIS_MAXMEMORY_ALLKEYS_RANDOM 3
+#define REDIS_MAXMEMORY_NO_EVICTION 4
+#define REDIS_DEFAULT_MAXMEMORY_SAMPLES 5
+
+/** 淘汰池: 每次采样的key都和池中的候选比较, 池中保留最应该淘汰的这些key */
+#define REDIS_EVICTION_POOL_SIZE 16
+
+/**
+ * Robj.lru的两种用法
+ * LRU: 最后一次访问的时间, 单位是REDIS_LRU_CLOCK_RESOLUTION毫秒, 只保留低REDIS_LRU_BITS位
+ * LFU: 高16位是上次衰减的时间(分钟), 低8位是对数增长的访问计数
+ */
+#define REDIS_LRU_BITS 24
+#define REDIS_LRU_CLOCK_MAX ((1 << REDIS_LRU_BITS) - 1)
+#define REDIS_LRU_CLOCK_RESOLUTION 1000
+#define REDIS_LFU_INIT_VAL 5 // 新对象的计数, 避免刚写入就被淘汰
+#define REDIS_LFU_LOG_FACTOR 10 // 越大计数增长越慢, 10的时候大约一百万次访问才到255
+#define REDIS_LFU_DECAY_TIME 1 // 每过这么多分钟没有访问, 计数减1
+
+/**
+ * 释放代价(大约是要free的块数)超过这个值的value交给后台线程释放, 可以在配置文件中修改
+ * UNLINK, FLUSHDB/FLUSHALL ASYNC和过期删除使用
+ */
+#define REDIS_LAZYFREE_THRESHOLD 64
+
+/** serverCron的调用间隔(毫秒) */
+#define REDIS_CRON_PERIOD 1000
+
+/**
+ * 主动过期: 每个db每轮随机检查这么多个设置了过期时间的key, 累计过期的超过1/4就继续下一轮
+ * 整个过期周期最多占用cron间隔的REDIS_EXPIRE_CYCLE_TIME_PERC%
+ */
+#define REDIS_EXPIRE_LOOKUPS_PER_LOOP 20
+#define REDIS_EXPIRE_CYCLE_TIME_PERC 25
+
+/**
+ * 主动碎片整理的默认配置, 可以在配置文件中修改:
+ * 可以回收的碎片超过REDIS_DEFRAG_IGNORE_BYTES并且超过used memory的REDIS_DEFRAG_THRESHOLD%时开始整理,
+ * 每次serverCron最多占用cron间隔的REDIS_DEFRAG_CYCLE_PERC%
+ */
+#define REDIS_DEFRAG_IGNORE_BYTES (100*1024*1024)
+#define REDIS_DEFRAG_THRESHOLD 10
+#define REDIS_DEFRAG_CYCLE_PERC 10
+
+/**
+ * listpack编码的list超过这些限制时转换成quicklist, 可以在配置文件中修改
+ * entries同时也是quicklist中每个node的元素个数上限
+ */
+#define REDIS_LIST_MAX_LISTPACK_ENTRIES 128
+#define REDIS_LIST_MAX_LISTPACK_VALUE 64
+
+/** 不超过这个长度的字符串使用EMBSTR编码, 这样Robj + sdshdr8 + buf刚好是64字节 */
+#define REDIS_ENCODING_EMBSTR_SIZE_LIMIT 44
+
+/**
+ * 共享对象的refcount, incrRefCount/decrRefCount遇到它时什么也不做
+ * 这样bgsave fork之后父进程addReply(c, shared.ok)之类的调用不会写共享对象所在的页, 不会触发COW
+ */
+#define REDIS_SHARED_REFCOUNT INT_MAX
+
+/** 共享的整数对象[0, REDIS_SHARED_INTEGERS) */
+#define REDIS_SHARED_INTEGERS 10000
+
+/** 快照文件(RDB)的格式 */
+#define REDIS_RDB_SIGNATURE "REDIS0001"
+#define REDIS_RESIZEDB 251 // 后面是db中key的个数和有过期时间的key的个数, 加载时一次分配好table
+#define REDIS_EXPIRETIME_MS 252
 #define REDIS_SELECTDB 254
 #define REDIS_EOF 255
 
+/** 快照中value的类型 */
+#define REDIS_RDB_TYPE_STRING 0
+#define REDIS_RDB_TYPE_LIST_QUICKLIST 1
+#define REDIS_RDB_TYPE_SET 2
+#define REDIS_RDB_TYPE_HASH 3
+#define REDIS_RDB_TYPE_ZSET 4
+#define REDIS_RDB_TYPE_LIST_LISTPACK 10
+#define REDIS_RDB_TYPE_SET_INTSET 11 // intset按主机字节序保存, 只能在相同字节序的机器间使用
+#define REDIS_RDB_TYPE_HASH_LISTPACK 12
+#define REDIS_RDB_TYPE_ZSET_LISTPACK 13
+
+/** 长度的编码, 保存在第一个字节的高两位 */
+#define REDIS_RDB_6BITLEN 0
+#define REDIS_RDB_14BITLEN 1
+#define REDIS_RDB_32BITLEN 0x80
+#define REDIS_RDB_64BITLEN 0x81
+#define REDIS_RDB_ENCVAL 3
+#define REDIS_RDB_LENERR UINT64_MAX
+
+/** REDIS_RDB_ENCVAL时低6位表示字符串的特殊编码 */
+#define REDIS_RDB_ENC_INT8 0
+#define REDIS_RDB_ENC_INT16 1
+#define REDIS_RDB_ENC_INT32 2
+#define REDIS_RDB_ENC_LZF 3 // 后面是[len: 压缩后的长度][len: 原来的长度][LZF压缩的数据]
+
+/** snapshot-mode: bgsave怎么拿到某一时刻的数据 */
+#define REDIS_SNAPSHOT_FORK 0 // fork子进程, 靠COW隔离父进程之后的修改
+#define REDIS_SNAPSHOT_THREAD 1 // 不fork, 后台线程序列化, 主线程修改之前先把旧的值序列化掉, 见saveDbThreadBackground
+
+/** appendfsync: AOF什么时候fsync */
+#define REDIS_AOF_FSYNC_NO 0 // 交给操作系统写回
+#define REDIS_AOF_FSYNC_ALWAYS 1 // 每次事件循环write之后立刻fsync, 回复client时命令已经落盘
+#define REDIS_AOF_FSYNC_EVERYSEC 2 // 后台线程每秒fsync一次
+
+/** everysec时后台fsync太慢, 最多推迟这么多秒write */
+#define REDIS_AOF_MAX_POSTPONE 2
+
+/** aofBuf的空间不超过这个值时write之后留着下次用, 否则释放掉 */
+#define REDIS_AOF_BUF_REUSE_MAX (64*1024)
+
+/** AOF rewrite */
+#define REDIS_AOF_REWRITE_ITEMS_PER_CMD (REDIS_MAX_ARGS - 2) // RPUSH/SADD一条命令最多带的元素个数, 受client的argv大小限制
+#define REDIS_AOF_REWRITE_DIFF_KEYS 1024 // 子进程每写这么多个key读一次父进程发来的diff
+#define REDIS_AOF_REWRITE_BUF_COMPACT (1024*1024) // 已经发给子进程的部分超过这个值并且超过一半时从rewrite buffer中去掉
+#define REDIS_AOF_REWRITE_PERC 100
+#define REDIS_AOF_REWRITE_MIN_SIZE (64*1024*1024)
+
 /** Client flags */
 #define REDIS_CLOSE 1 
 #define REDIS_SLAVE 2
@@ -89,11 +273,31 @@
 /*------------------- Data Types --------------------*/
 /** A redis object, that is a type able to hold a string / list / set */
 typedef struct RedisObject {
-    int type;
-    void *ptr;
+    unsigned type:4;
+    unsigned encoding:4; // REDIS_ENCODING_*
+    unsigned lru:REDIS_LRU_BITS; // LRU时间或者LFU计数, 和type/encoding共用一个int
     int refcount;
+    void *ptr;
 } Robj;
 
+/**
+ * 跳表按score排序, dict用来O(1)地根据member找到score
+ * dict的key就是跳表节点里的ele, value指向节点里的score
+ */
+typedef struct Zset {
+    Dict *dict;
+    ZSkiplist *zsl;
+} Zset;
+
+/**
+ * 淘汰池中的候选key, 按idle从小到大排列, 没有使用的位置key为NULL并且都在右边
+ */
+typedef struct EvictionPoolEntry {
+    unsigned long long idle; // LRU: 空闲的毫秒数, LFU: 255 - 访问计数; 越大越应该淘汰
+    sds key; // key的拷贝, 淘汰之前需要确认它还在db中
+    int dbid;
+} EvictionPoolEntry;
+
 /**
  * with multiplexing we need to take per-client state
  * clients are taken in a liked list
@@ -125,13 +329,13 @@ struct RedisServer {
     int port;
     int fd;
     Dict **dict;
+    Dict **expires; // 每个db中设置了过期时间的key -> 过期的unix时间(毫秒)
     long long dirty; // changes to db from the last save
     List *clients;
     List *slaves;
     char neterr[ANET_ERR_LEN];
     AeEventLoop *el;
     int cronloops; // number of times the cron function run
-    List *objFreeList; // A list of freed objects to avoid malloc()
     time_t lastsave; // unix time of last save successed
     int usedmemory; // used memory in megabytes
     
@@ -139,6 +343,51 @@ struct RedisServer {
     time_t stat_starttime;  // server start time
     long long stat_numcommands;  // number of processed commands
     long long stat_numconnections; // number of connections received
+    size_t stat_bgsave_cow_bytes; // COW bytes of the last bgsave child
+    long long stat_bgsave_start_us; // 上一次bgsave启动(fork或者创建线程)时主线程阻塞的时间
+    long long stat_snapshot_main_buckets; // snapshot-mode thread: 主线程在修改之前自己序列化的bucket个数
+    long long stat_snapshot_main_us; // 主线程序列化bucket累计用的时间
+    long long stat_snapshot_main_max_us; // 单次最长的时间, 包括等待后台线程写完同一个bucket
+    int childInfoPipe[2]; // bgsave子进程通过它把COW字节数告诉父进程
+    long long stat_evictedkeys; // number of keys evicted because of maxmemory
+    long long stat_expiredkeys; // number of keys deleted because of expire
+    long long stat_expire_cycle_time_used; // 主动过期累计用掉的时间(微秒)
+    long long stat_expire_cycle_last_us; // 上一次主动过期用掉的时间
+    long long stat_expire_cycle_max_us;
+    long long stat_expire_cycle_time_cap_reached; // 因为时间用完提前结束的次数
+    long long stat_lazyfreed_objects; // 后台线程释放的对象个数, 由后台线程原子地更新
+    long long stat_active_defrag_hits; // 搬动了的分配
+    long long stat_active_defrag_misses; // 检查过但是不需要搬动的分配
+    long long stat_active_defrag_scanned; // 碎片整理检查过的key
+    long long stat_active_defrag_time_used; // 碎片整理累计用掉的时间(微秒)
+    long long stat_aof_delayed_fsync; // 因为后台fsync太慢, 没等它结束就write的次数
+    int defragRunning; // 正在进行一轮碎片整理
+    int defragDb; // 碎片整理进行到的db, 在走它的dict(0)还是expires(1), 以及dictScan的cursor
+    int defragExpires;
+    unsigned long defragCursor;
+    unsigned int lruclock; // serverCron中更新的LRU时钟, 对象的访问时间都取这个值
+    EvictionPoolEntry *evictionPool;
+
+    /** AOF */
+    int aofFd; // 没有开启AOF时为-1
+    int aofSelectedDb; // aofBuf中最后一条命令的db, -1表示下一条命令之前一定要写SELECT
+    sds aofBuf; // 这一轮事件循环中执行的写命令, 进入等待之前一次write
+    long long aofCurrentSize;
+    long long aofFsyncSize; // 已经交给fsync的文件长度
+    time_t aofLastFsync;
+    time_t aofFlushPostponedStart; // everysec时因为后台fsync没有结束开始推迟write的时间, 0表示没有推迟
+    pid_t aofChildPid; // BGREWRITEAOF的子进程, -1表示没有
+    int aofRewriteScheduled; // 有bgsave子进程时BGREWRITEAOF推迟到它结束之后
+    long long aofRewriteBaseSize; // 启动或者上一次rewrite之后AOF的大小, 自动rewrite按照相对它的增长判断
+    sds aofRewriteBuf; // rewrite期间的写命令, 在rewrite结束时追加到新文件
+    size_t aofRewriteBufSent; // aofRewriteBuf中已经通过pipe发给子进程的部分
+    int aofPipeToChild[2]; // 父进程把rewrite期间的写命令(diff)发给子进程
+    int aofPipeAckToParent[2]; // 子进程请父进程停止发送diff
+    int aofPipeAckToChild[2]; // 父进程确认已经停止发送
+    int aofStopSendingDiff;
+    time_t aofRewriteTimeStart;
+    time_t aofRewriteTimeLast; // 上一次rewrite用的秒数, -1表示还没有rewrite过
+    int loading; // 启动时正在加载AOF或者快照
 
     /** 配置 */
     int verbosity;
@@ -146,12 +395,36 @@ struct RedisServer {
     int maxIdleTime;
     int dbnum;
     int daemonize;
-    int bgsaveInProgress;
+    int bgsaveInProgress; // fork和thread两种模式都是1
+    long long dirtyBeforeBgsave; // bgsave开始时的dirty, 结束之后只减掉这一部分
+    struct Snapshot *snapshot; // snapshot-mode thread正在进行的快照, NULL表示没有
     struct SaveParam *saveParams;
     int saveParamLens;
     char *logfile;
     char *bindaddr;
     char *dbfilename;
+    int rdbCompression; // 快照中较长的字符串和listpack/intset是否用LZF压缩
+    int snapshotMode; // REDIS_SNAPSHOT_*
+    int appendonly;
+    char *appendfilename;
+    int appendfsync; // REDIS_AOF_FSYNC_*
+    int autoAofRewritePerc; // AOF比上一次rewrite之后增长了这么多百分比时自动rewrite, 0表示关闭
+    long long autoAofRewriteMinSize; // AOF小于这个大小时不自动rewrite
+    unsigned int listMaxListpackEntries;
+    unsigned int listMaxListpackValue;
+    unsigned int setMaxIntsetEntries;
+    unsigned int hashMaxListpackEntries;
+    unsigned int hashMaxListpackValue;
+    unsigned int zsetMaxListpackEntries;
+    unsigned int zsetMaxListpackValue;
+    unsigned long long maxmemory; // 0表示不限制
+    int maxmemoryPolicy;
+    int maxmemorySamples; // 每个db每次采样的key的个数
+    unsigned long lazyfreeThreshold;
+    int activeDefrag;
+    size_t activeDefragIgnoreBytes;
+    int activeDefragThreshold; // 碎片占used memory的百分比
+    int activeDefragCyclePerc;
 
     /** Replication related */
     int isslave;
@@ -191,36 +464,67 @@ typedef struct _RedisSortOperation {
  * 用一个结构体把一些常量包起来？
  */
 struct SharedObjectStruct {
-    Robj *crlf, *ok, *err, *zerobulk, *nil, *zero, *one, *pong, *space,
+    Robj *crlf, *ok, *err, *zerobulk, *nil, *zero, *one, *pong, *space, *del,
     *minus1, *minus2, *minus3, *minus4,
-    *wrongTypeErr, *noKeyErr, *wrongTypeErrBulk, *noKeyErrBulk,
-    *syntaxErr, *syntaxErrBulk,
+    *wrongTypeErr, *noKeyErr, *wrongTypeErrBulk, *noKeyErrBulk, *outOfRangeErr, *notFloatErr, *nanErr,
+    *syntaxErr, *syntaxErrBulk, *notIntErr, *oomErr, *invalidExpireErr,
     *select0, *select1, *select2, *select3, *select4, 
     *select5, *select6, *select7, *select8, *select9;
+    Robj *integers[REDIS_SHARED_INTEGERS];
 } shared; // 这种语法是创建了一个实例，名字叫shared
 
 /**------------------------- Prototypes -------------------*/
 static void freeStringObject(Robj *o);
 static void freeListObject(Robj *o);
 static void freeSetObject(Robj *o);
-static void descRefCount(void *o);
+static void freeHashObject(Robj *o);
+static void freeZsetObject(Robj *o);
+static void decrRefCount(void *o);
 static Robj *createObject(int type, void *ptr);
 static void freeClient(RedisClient *c);
 static int loadDb(char *filename);
 static void addReply(RedisClient *c, Robj *obj);
 static void addReplaySds(RedisClient *c, sds s);
 static void incrRefCount(Robj *o);
+static Robj *makeObjectShared(Robj *o);
+static unsigned int getLRUClock(void);
+static EvictionPoolEntry *evictionPoolAlloc(void);
+static void activeExpireCycle(void);
+static void activeDefragCycle(void);
 static int saveDbBackground(char *filename);
+static void rdbTempFileName(char *buf, size_t len, pid_t pid);
+static void openChildInfoPipe(void);
+static void closeChildInfoPipe(void);
+static void sendChildCowInfo(void);
 static Robj *createStringObject(char *ptr, size_t len);
+static Robj *getDecodedObject(Robj *o);
+static struct RedisCommand *lookupCommand(char *name);
+static void processCommand(RedisClient *c);
+static void propagateDeletion(int dbid, Robj *key);
+static void beforeSleep(AeEventLoop *eventLoop);
+static int rewriteAppendOnlyFileBackground(void);
+static void backgroundRewriteDoneHandler(int ok);
+static void snapshotBeforeWrite(int dbid, Robj *key);
+static void snapshotBeforeEmptyDb(int dbid);
+static void snapshotLockExpires(void);
+static void snapshotUnlockExpires(void);
+static void waitBgsaveThreadFinish(void);
 static void replicationFeedSlaves(struct RedisCommand *cmd, int dictid, Robj **argv, int argc);
 static int syncWithMaster(void);
 
 static void pingCommand(RedisClient *c);
 static void echoCommand(RedisClient *c);
 static void setCommand(RedisClient *c);
+static void expireCommand(RedisClient *c);
+static void pexpireCommand(RedisClient *c);
+static void pexpireatCommand(RedisClient *c);
+static void ttlCommand(RedisClient *c);
+static void pttlCommand(RedisClient *c);
+static void persistCommand(RedisClient *c);
 static void setnxCommand(RedisClient *c);
 static void getCommand(RedisClient *c);
 static void delCommand(RedisClient *c);
+static void unlinkCommand(RedisClient *c);
 static void existsComand(RedisClient *c);
 static void incrCommand(RedisClient *c);
 static void decrCommand(RedisClient *c);
@@ -231,6 +535,7 @@ static void dbsizeCommand(RedisClient *c);
 static void lastsaveCommand(RedisClient *c);
 static void saveCommand(RedisClient *c);
 static void bgsaveCommand(RedisClient *c);
+static void bgrewriteaofCommand(RedisClient *c);
 static void shutdownCommand(RedisClient *c);
 static void moveCommand(RedisClient *c); // move what
 static void renameCommand(RedisClient *c);
@@ -251,40 +556,103 @@ static void sismemberCommand(RedisClient *c);
 static void scardCommand(RedisClient *c);
 static void sinterCommand(RedisClient *c);
 static void sinterstoreCommand(RedisClient *c);
+static void hsetCommand(RedisClient *c);
+static void hgetCommand(RedisClient *c);
+static void hmgetCommand(RedisClient *c);
+static void hgetallCommand(RedisClient *c);
+static void hincrbyCommand(RedisClient *c);
+static void hdelCommand(RedisClient *c);
+static void zaddCommand(RedisClient *c);
+static void zincrbyCommand(RedisClient *c);
+static void zrangeCommand(RedisClient *c);
+static void zrangebyscoreCommand(RedisClient *c);
+static void zrankCommand(RedisClient *c);
+static void zremCommand(RedisClient *c);
 static void syncCommand(RedisClient *c);
 static void flushdbCommand(RedisClient *c);
 static void flushallCommand(RedisClient *c);
 static void sortCommand(RedisClient *c);
 static void lremCommand(RedisClient *c);
 static void infoCommand(RedisClient *c);
+static void debugCommand(RedisClient *c);
 
 /** --------------------------- Globals -------------------------------- */
 static struct RedisServer server;
 static struct RedisCommand cmdTable[] = {
     {"get", getCommand, 2, REDIS_CMD_INLINE},
-    {"set", setCommand, 3, REDIS_CMD_BULK},
-    {"setnx", setnxCommand, 3, REDIS_CMD_BULK},
-    {"del", delCommand, 2, REDIS_CMD_INLINE},
+    {"set", setCommand, -3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"setnx", setnxCommand, 3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"del", delCommand, -2, REDIS_CMD_INLINE},
+    {"unlink", unlinkCommand, -2, REDIS_CMD_INLINE},
     {"exists", existsComand, 2, REDIS_CMD_INLINE},
-    {"incr", incrCommand, 2, REDIS_CMD_INLINE},
-    {"decr", decrCommand, 2, REDIS_CMD_INLINE},
-    {"rpush", rpushCommand, 3, REDIS_CMD_BULK},
-    {"lpush", lpushCommand, 3, REDIS_CMD_BULK},
+    {"expire", expireCommand, 3, REDIS_CMD_INLINE},
+    {"pexpire", pexpireCommand, 3, REDIS_CMD_INLINE},
+    {"pexpireat", pexpireatCommand, 3, REDIS_CMD_INLINE},
+    {"ttl", ttlCommand, 2, REDIS_CMD_INLINE},
+    {"pttl", pttlCommand, 2, REDIS_CMD_INLINE},
+    {"persist", persistCommand, 2, REDIS_CMD_INLINE},
+    {"incr", incrCommand, 2, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"decr", decrCommand, 2, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"rpush", rpushCommand, -3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"lpush", lpushCommand, -3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"rpop", rpopCommand, 2, REDIS_CMD_INLINE},
     {"lpop", lpopCommand, 2, REDIS_CMD_INLINE},
     {"llen", llenCommand, 2, REDIS_CMD_INLINE},
     {"lindex", lindexCommand, 3, REDIS_CMD_INLINE},
-    {"lset", lsetCommand, 4, REDIS_CMD_BULK},
+    {"lset", lsetCommand, 4, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"lrange", lrangeCommand, 4, REDIS_CMD_INLINE},
     {"ltrim", ltrimCommand, 4, REDIS_CMD_INLINE},
     {"lrem", lremCommand, 4, REDIS_CMD_BULK},
-    {"sadd", saddCommand, 3, REDIS_CMD_BULK},
+    {"sadd", saddCommand, -3, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
     {"srem", sremCommand, 3, REDIS_CMD_BULK},
     {"sismember", sismemberCommand, 3, REDIS_CMD_BULK},
-    {"scard", scardCommand, 2, REDIS_CMD_INLINE}
+    {"scard", scardCommand, 2, REDIS_CMD_INLINE},
+    {"sinter", sinterCommand, -2, REDIS_CMD_INLINE},
+    {"sinterstore", sinterstoreCommand, -3, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"hset", hsetCommand, 4, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"hget", hgetCommand, 3, REDIS_CMD_BULK},
+    {"hmget", hmgetCommand, -3, REDIS_CMD_INLINE},
+    {"hgetall", hgetallCommand, 2, REDIS_CMD_INLINE},
+    {"hincrby", hincrbyCommand, 4, REDIS_CMD_INLINE|REDIS_CMD_DENYOOM},
+    {"hdel", hdelCommand, 3, REDIS_CMD_BULK},
+    {"zadd", zaddCommand, 4, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"zincrby", zincrbyCommand, 4, REDIS_CMD_BULK|REDIS_CMD_DENYOOM},
+    {"zrange", zrangeCommand, -4, REDIS_CMD_INLINE},
+    {"zrangebyscore", zrangebyscoreCommand, -4, REDIS_CMD_INLINE},
+    {"zrank", zrankCommand, 3, REDIS_CMD_BULK},
+    {"zrem", zremCommand, 3, REDIS_CMD_BULK},
+    {"flushdb", flushdbCommand, -1, REDIS_CMD_INLINE},
+    {"flushall", flushallCommand, -1, REDIS_CMD_INLINE},
+    {"save", saveCommand, 1, REDIS_CMD_INLINE},
+    {"bgsave", bgsaveCommand, 1, REDIS_CMD_INLINE},
+    {"bgrewriteaof", bgrewriteaofCommand, 1, REDIS_CMD_INLINE},
+    {"lastsave", lastsaveCommand, 1, REDIS_CMD_INLINE},
+    {"info", infoCommand, 1, REDIS_CMD_INLINE},
+    {"debug", debugCommand, 3, REDIS_CMD_INLINE}
 };
 
 /*-------------------- 工具函数 ------------------*/
+static long long ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static long long mstime(void) {
+    return ustime() / 1000;
+}
+
+/**
+ * 只需要数据落盘, 文件长度以外的元数据不用同步的时候fdatasync更快
+ */
+static int redisFsync(int fd) {
+#if defined(__linux__)
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
 int stringMatchLen(const char *pattern, int patternLen, const char *string, int stringLen, int nocase) {
     // TODO: 补充完整
     if (patternLen == 0 && stringLen == 0) {
@@ -361,6 +729,25 @@ static DictType setDictType = {
     NULL                       // value destructor
 };
 
+/**
+ * key直接是sds(不是Robj)
+ */
+static unsigned int dictSdsKeyHash(const void *key) {
+    return dictGenHashFunction(key, sdslen((sds) key));
+}
+
+/**
+ * zset的dict: key是跳表节点中的sds, value指向节点中的score, 都由跳表负责释放
+ */
+static DictType zsetDictType = {
+    dictSdsKeyHash, // hash function
+    NULL, // key dup
+    NULL, // value dup
+    sdsDictKeyCompare, // key compare
+    NULL, // key destructor
+    NULL  // value destructor
+};
+
 static DictType hashDictType = {
     dictSdsHash, // hash function
     NULL, // key dup
@@ -370,6 +757,40 @@ static DictType hashDictType = {
     dictRedisObjectDestructor, // value destructor
 };
 
+/**
+ * expires: key和keyspace中的key是同一个Robj(增加了引用计数), value直接保存过期时间(毫秒)
+ */
+static DictType expiresDictType = {
+    dictSdsHash, // hash function
+    NULL, // key dup
+    NULL, // value dup
+    dictSdsKeyCompare, // key compare
+    dictRedisObjectDestructor, // key destructor
+    NULL, // value destructor
+};
+
+/**
+ * keyspace专用的dict操作(keyspaceDictFind/Add/Replace/Delete), 语义和hashDictType完全一致,
+ * 但是hash和compare都是inline的，不需要经过DictType的函数指针
+ */
+static inline unsigned int keyspaceHash(const void *key) {
+    const Robj *o = key;
+    return dictInlineHashFunction(o->ptr, sdslen((sds) o->ptr));
+}
+
+static inline int keyspaceKeyCompare(const void *key1, const void *key2) {
+    const Robj *o1 = key1;
+    const Robj *o2 = key2;
+    size_t l1 = sdslen((sds) o1->ptr);
+    return l1 == sdslen((sds) o2->ptr) && memcmp(o1->ptr, o2->ptr, l1) == 0;
+}
+
+static inline void keyspaceObjectFree(void *o) {
+    dictRedisObjectDestructor(NULL, o);
+}
+
+DICT_SPECIALIZE(keyspaceDict, keyspaceHash, keyspaceKeyCompare, keyspaceObjectFree, keyspaceObjectFree)
+
 /*------------------------------ random utility functions ---------------------*/
 /**
  * 通常情况下resi是不会cover oom这种异常，由于发送给client的数据的send buffer也依赖heap，
@@ -402,6 +823,111 @@ void closeTimeoutClients(void) {
     listReleaseIterator(it);
 }
 
+/**
+ * 收缩空闲client的querybuf: 一次大的请求之后querybuf会一直保留很大的空间
+ * 1. free空间小于REDIS_QUERYBUF_SHRINK_MIN的不处理
+ * 2. client空闲超过REDIS_QUERYBUF_IDLE_TIME, 或者free空间超过了数据本身，就释放free空间
+ */
+static void clientsCronResizeQueryBuffer(RedisClient *c, time_t now) {
+    size_t avail = sdsavail(c->querybuf);
+    if (avail < REDIS_QUERYBUF_SHRINK_MIN) {
+        return;
+    }
+    if ((now - c->lastInteraction) >= REDIS_QUERYBUF_IDLE_TIME || avail > sdslen(c->querybuf)) {
+        c->querybuf = sdsRemoveFreeSpace(c->querybuf);
+    }
+}
+
+/**
+ * 增量地处理client: 每次只检查一部分client, 避免client很多时cron阻塞太久
+ * 每处理一个client就把尾部的client转到头部，下次cron会接着处理剩下的
+ */
+static void clientsCron(void) {
+    int numclients = listLength(server.clients);
+    int iterations = numclients / 10;
+    if (iterations < REDIS_CLIENTS_CRON_MIN_ITERATIONS) {
+        iterations = (numclients < REDIS_CLIENTS_CRON_MIN_ITERATIONS) ? numclients : REDIS_CLIENTS_CRON_MIN_ITERATIONS;
+    }
+
+    time_t now = time(NULL);
+    while (listLength(server.clients) && iterations--) {
+        listRotate(server.clients);
+        RedisClient *c = listNodeValue(listFirst(server.clients));
+        clientsCronResizeQueryBuffer(c, now);
+    }
+}
+
+/**
+ * 回复一个整数行 "<value>\r\n"，不经过printf
+ */
+static void addReplyLongLong(RedisClient *c, long long value) {
+    char buf[SDS_LLSTR_SIZE + 2];
+    int len = ll2string(buf, SDS_LLSTR_SIZE, value);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    addReplaySds(c, sdsnewlen(buf, len));
+}
+
+/**
+ * 回复bulk数据的长度行 "<len>\r\n"
+ */
+static void addReplyBulkLen(RedisClient *c, size_t bulklen) {
+    addReplyLongLong(c, (long long) bulklen);
+}
+
+/**
+ * 以bulk的形式回复一个字符串对象: "<len>\r\n<data>\r\n"
+ */
+static void addReplyBulk(RedisClient *c, Robj *obj) {
+    obj = getDecodedObject(obj);
+    addReplyBulkLen(c, sdslen(obj->ptr));
+    addReply(c, obj);
+    addReply(c, shared.crlf);
+    decrRefCount(obj);
+}
+
+static void addReplyBulkCBuffer(RedisClient *c, void *p, size_t len) {
+    addReplyBulkLen(c, len);
+    addReplaySds(c, sdsnewlen(p, len));
+    addReply(c, shared.crlf);
+}
+
+/**
+ * 以bulk的形式回复一个double
+ */
+static void addReplyDouble(RedisClient *c, double value) {
+    char buf[REDIS_DOUBLE_STR_SIZE];
+    int len = d2string(buf, sizeof(buf), value);
+    addReplyBulkCBuffer(c, buf, len);
+}
+
+/**
+ * 以bulk的形式回复一个整数, 不需要先创建Robj
+ */
+static void addReplyBulkLongLong(RedisClient *c, long long value) {
+    char buf[SDS_LLSTR_SIZE];
+    int len = ll2string(buf, sizeof(buf), value);
+    addReplyBulkCBuffer(c, buf, len);
+}
+
+/**
+ * fork模式的bgsave和AOF rewrite的子进程, 同时最多只有一个
+ */
+static int hasActiveChildProcess(void) {
+    return (server.bgsaveInProgress && server.snapshot == NULL) || server.aofChildPid != -1;
+}
+
+/**
+ * 有子进程时关掉dict的resize, 避免rehash把大量页写脏; 子进程退出后再打开
+ */
+static void updateDictResizePolicy(void) {
+    if (hasActiveChildProcess()) {
+        dictDisableResize();
+    } else {
+        dictEnableResize();
+    }
+}
+
 /** 如果HT的使用量超过REDIS_HT_MINFILL, rehash以节省内存空间; 
  * TODO: rehash怎么节省内存空间了，是减少了链表吗 
  */
@@ -410,7 +936,7 @@ static void rehashIfNeed(int loops) {
         int size = dictGetHashTableSize(server.dict[j]);
         int used = dictGetHashTableUsed(server.dict[j]);
         if ((loops % 5 == 0) && used > 0) {
-            redisLog(REDIS_DEBUG, "DB %d: %d keys in %d slots HT", j, used, size);
+            redisLog(REDIS_DEBUG, "DB %d: %d keys in %d slots HT (fill %d%%)", j, used, size, used*100/size);
         }
         if (size > 0 && used > 0 && size > REDIS_HT_MINSLOTS && (used*100/size < REDIS_HT_MINFILL)) {
             redisLog(REDIS_NOTICE, "The hash table %d is too sparse, resize it...", j);
@@ -421,22 +947,84 @@ static void rehashIfNeed(int loops) {
 }
 
 /**
- * 等待正在进行的bgsave完整，并更新server中跟bgsave相关的参数
+ * 打开子进程信息的pipe, 在fork之前调用; 失败时只是拿不到COW统计, 不影响bgsave
+ */
+static void openChildInfoPipe(void) {
+    if (pipe(server.childInfoPipe) == -1) {
+        server.childInfoPipe[0] = server.childInfoPipe[1] = -1;
+        return;
+    }
+    // 父进程读的时候不能阻塞住事件循环
+    fcntl(server.childInfoPipe[0], F_SETFL, O_NONBLOCK);
+}
+
+static void closeChildInfoPipe(void) {
+    if (server.childInfoPipe[0] != -1) {
+        close(server.childInfoPipe[0]);
+        close(server.childInfoPipe[1]);
+    }
+    server.childInfoPipe[0] = server.childInfoPipe[1] = -1;
+}
+
+/**
+ * 子进程写完db之后调用, 把自己的Private_Dirty发给父进程
+ */
+static void sendChildCowInfo(void) {
+    if (server.childInfoPipe[1] == -1) {
+        return;
+    }
+    size_t cow = zmalloc_get_private_dirty();
+    if (cow > 0) {
+        redisLog(REDIS_NOTICE, "Background saving used %zu MB of memory by copy-on-write", cow / (1024*1024));
+    }
+    if (write(server.childInfoPipe[1], &cow, sizeof(cow)) != sizeof(cow)) {
+        redisLog(REDIS_WARNING, "Unable to send copy-on-write info to the parent: %s", strerror(errno));
+    }
+}
+
+static void receiveChildCowInfo(void) {
+    size_t cow;
+    if (server.childInfoPipe[0] == -1) {
+        return;
+    }
+    if (read(server.childInfoPipe[0], &cow, sizeof(cow)) == sizeof(cow)) {
+        server.stat_bgsave_cow_bytes = cow;
+    }
+}
+
+/**
+ * 等待正在进行的bgsave或者AOF rewrite子进程结束，并更新server中跟它相关的参数
  */
 static void waitBgsaveFinish() {
     int statloc;
     // 等待直到指定的子pid状态改变，这不是posix的接口，不过所有系统都提供
-    if (wait4(-1, &statloc, WNOHANG, NULL)) {
-        int exitcode = WEXITSTATUS(statloc);
-        if (exitcode == 0) {
+    // 返回0表示子进程还在运行, -1表示出错, 都不能当成子进程结束
+    pid_t pid = wait4(-1, &statloc, WNOHANG, NULL);
+    if (pid <= 0) {
+        return;
+    }
+    // 被信号杀掉的子进程WEXITSTATUS也是0, 不能当成成功
+    int ok = WIFEXITED(statloc) && WEXITSTATUS(statloc) == 0;
+    if (pid == server.aofChildPid) {
+        backgroundRewriteDoneHandler(ok);
+    } else {
+        if (ok) {
             redisLog(REDIS_NOTICE, "Background saving terminated with success");
-            server.dirty = 0;
+            // bgsave期间的修改不在快照中
+            server.dirty = server.dirty > server.dirtyBeforeBgsave ? server.dirty - server.dirtyBeforeBgsave : 0;
             server.lastsave = time(NULL);
         } else {
             redisLog(REDIS_WARNING, "Background saving error");
+            // 子进程失败时可能留下了没写完的临时文件
+            char tmpfile[256];
+            rdbTempFileName(tmpfile, sizeof(tmpfile), pid);
+            unlink(tmpfile);
         }
+        receiveChildCowInfo();
+        closeChildInfoPipe();
         server.bgsaveInProgress = 0;
     }
+    updateDictResizePolicy();
 }
 
 /**
@@ -457,15 +1045,39 @@ static void startNewBgsaveIfNeed() {
 }
 
 /**
- *  1. 如果当前正在bgsave，则等它成功，否则
- *  2. 如果修改次数和时间达到要求，则启动一个新的bgsave
+ * AOF比上一次rewrite之后增长了autoAofRewritePerc时自动rewrite, 太小的文件不值得rewrite
+ */
+static void startAofRewriteIfNeed() {
+    if (server.aofRewriteScheduled) {
+        rewriteAppendOnlyFileBackground();
+        return;
+    }
+    if (server.aofFd == -1 || server.autoAofRewritePerc == 0 || server.aofCurrentSize < server.autoAofRewriteMinSize) {
+        return;
+    }
+    long long base = server.aofRewriteBaseSize > 0 ? server.aofRewriteBaseSize : 1;
+    long long growth = server.aofCurrentSize * 100 / base - 100;
+    if (growth >= server.autoAofRewritePerc) {
+        redisLog(REDIS_NOTICE, "Starting automatic rewriting of AOF on %lld%% growth", growth);
+        rewriteAppendOnlyFileBackground();
+    }
+}
+
+/**
+ *  1. 如果当前正在bgsave或者AOF rewrite，则等它成功，否则
+ *  2. 如果修改次数和时间达到要求，则启动一个新的bgsave, 没有启动bgsave时再看是否需要AOF rewrite
  */
 static void waitBgsaveOrStartNewIfNeed() {
-    // 是否有background saving
-    if (server.bgsaveInProgress) {
+    // 是否有background saving或者AOF rewrite
+    if (server.snapshot != NULL) {
+        waitBgsaveThreadFinish();
+    } else if (hasActiveChildProcess()) {
         waitBgsaveFinish();
     } else {
         startNewBgsaveIfNeed();
+        if (!server.bgsaveInProgress) {
+            startAofRewriteIfNeed();
+        }
     }
 }
 
@@ -474,8 +1086,9 @@ static void waitBgsaveOrStartNewIfNeed() {
  * 1. rehash
  * 2. 打印client信息
  * 3. 关闭超时client
- * 4. bgsave
- * 5. sync with master if its replicator
+ * 4. 收缩空闲client的querybuf
+ * 5. bgsave
+ * 6. sync with master if its replicator
  * @return 1000是什么意思？
  */
 int serverCron(struct AeEventLoop *eventLoop, long long id, void *clientData) {
@@ -485,9 +1098,23 @@ int serverCron(struct AeEventLoop *eventLoop, long long id, void *clientData) {
 
     // 更新全局memory used
     server.usedmemory = zmalloc_used_memory();
+    server.lruclock = getLRUClock();
     int loops = server.cronloops;
 
-    rehashIfNeed(loops);
+    // 有子进程时不做可选的rehash, 否则父进程会把整个table都复制一遍; 快照线程在遍历keyspace的table, expires也不能动
+    updateDictResizePolicy();
+    if (!hasActiveChildProcess() && server.snapshot == NULL) {
+        rehashIfNeed(loops);
+    }
+
+    // 删除一部分已经过期的key, 没有被访问的过期key只能靠它回收
+    activeExpireCycle();
+
+    // 后台线程释放的slab对象, 没有新的slabMalloc时在这里归还
+    slabDrainRemoteFrees();
+
+    // 碎片太多时把稀疏的页中的对象搬走
+    activeDefragCycle();
 
     // 打印连接的client的信息
     if (loops % 5 == 0) {
@@ -500,6 +1127,9 @@ int serverCron(struct AeEventLoop *eventLoop, long long id, void *clientData) {
         closeTimeoutClients();
     }
 
+    // 增量收缩空闲client的buffer
+    clientsCron();
+
     // 处理bgsave
     waitBgsaveOrStartNewIfNeed();
     
@@ -510,13 +1140,16 @@ int serverCron(struct AeEventLoop *eventLoop, long long id, void *clientData) {
         }
     }
 
-    // why return 1000;
-    return 1000;
+    // 返回值是下一次调用的间隔(毫秒)
+    return REDIS_CRON_PERIOD;
 }
 
 
+/**
+ * shared中的对象都是不朽的, 见makeObjectShared
+ */
 static Robj *createObjectUseString(char *v) {
-    return createObject(REDIS_STRING, sdsnew(v));
+    return makeObjectShared(createObject(REDIS_STRING, sdsnew(v)));
 }
 static void createShareObjects(void) {
     shared.crlf = createObjectUseString("\r\n");
@@ -527,6 +1160,7 @@ static void createShareObjects(void) {
     shared.zero = createObjectUseString("0\r\n");
     shared.one = createObjectUseString("1\r\n");
     shared.space = createObjectUseString(" ");
+    shared.del = createObjectUseString("DEL");
     // no such key
     shared.minus1 = createObjectUseString("-1\r\n");
     // operation against key holding a value of the wrong type
@@ -537,25 +1171,36 @@ static void createShareObjects(void) {
     shared.minus4 = createObjectUseString("-4\r\n");
     shared.pong = createObjectUseString("+PONG\r\n");
     shared.wrongTypeErr = createObjectUseString("-ERR Operation against a key holding the wrong kind of value\r\n");
-    shared.wrongTypeErrBulk = createObject(REDIS_STRING, sdscatprintf(sdsempty(), "%d\r\n%s", 
-                                -sdslen(shared.wrongTypeErr->ptr) + 2, shared.wrongTypeErr->ptr));
+    shared.wrongTypeErrBulk = makeObjectShared(createObject(REDIS_STRING, sdscatfmt(sdsempty(), "%i\r\n%S",
+                            -(int) sdslen(shared.wrongTypeErr->ptr) + 2, shared.wrongTypeErr->ptr)));
     shared.noKeyErr = createObjectUseString("-ERR no suck key\r\n");
-    shared.noKeyErrBulk = createObject(REDIS_STRING, sdscatprintf(sdsempty(), "%d\r\n%s", 
-                            -sdslen(shared.noKeyErr->ptr) + 2, shared.noKeyErr->ptr));
+    shared.noKeyErrBulk = makeObjectShared(createObject(REDIS_STRING, sdscatfmt(sdsempty(), "%i\r\n%S",
+                            -(int) sdslen(shared.noKeyErr->ptr) + 2, shared.noKeyErr->ptr)));
     shared.syntaxErr = createObjectUseString("-ERR syntax error\r\n");
-    shared.syntaxErrBulk = createObject(REDIS_STRING, sdscatprintf(sdsempty(), "%d\r\n%s", 
-                            -sdslen(shared.syntaxErr->ptr) + 2, shared.syntaxErr->ptr));
+    shared.outOfRangeErr = createObjectUseString("-ERR index out of range\r\n");
+    shared.notFloatErr = createObjectUseString("-ERR value is not a valid float\r\n");
+    shared.nanErr = createObjectUseString("-ERR resulting score is not a number (NaN)\r\n");
+    shared.notIntErr = createObjectUseString("-ERR value is not an integer or out of range\r\n");
+    shared.invalidExpireErr = createObjectUseString("-ERR invalid expire time\r\n");
+    shared.oomErr = createObjectUseString("-ERR command not allowed when used memory > 'maxmemory'\r\n");
+    shared.syntaxErrBulk = makeObjectShared(createObject(REDIS_STRING, sdscatfmt(sdsempty(), "%i\r\n%S",
+                            -(int) sdslen(shared.syntaxErr->ptr) + 2, shared.syntaxErr->ptr)));
     
-    shared.select0 = createStringObject("select 0\r\n", 10);
-    shared.select1 = createStringObject("select 1\r\n", 10);
-    shared.select2 = createStringObject("select 2\r\n", 10);
-    shared.select3 = createStringObject("select 3\r\n", 10);
-    shared.select4 = createStringObject("select 4\r\n", 10);
-    shared.select5 = createStringObject("select 5\r\n", 10);
-    shared.select6 = createStringObject("select 6\r\n", 10);
-    shared.select7 = createStringObject("select 7\r\n", 10);
-    shared.select8 = createStringObject("select 8\r\n", 10);
-    shared.select9 = createStringObject("select 9\r\n", 10);
+    shared.select0 = makeObjectShared(createStringObject("select 0\r\n", 10));
+    shared.select1 = makeObjectShared(createStringObject("select 1\r\n", 10));
+    shared.select2 = makeObjectShared(createStringObject("select 2\r\n", 10));
+    shared.select3 = makeObjectShared(createStringObject("select 3\r\n", 10));
+    shared.select4 = makeObjectShared(createStringObject("select 4\r\n", 10));
+    shared.select5 = makeObjectShared(createStringObject("select 5\r\n", 10));
+    shared.select6 = makeObjectShared(createStringObject("select 6\r\n", 10));
+    shared.select7 = makeObjectShared(createStringObject("select 7\r\n", 10));
+    shared.select8 = makeObjectShared(createStringObject("select 8\r\n", 10));
+    shared.select9 = makeObjectShared(createStringObject("select 9\r\n", 10));
+
+    for (long j = 0; j < REDIS_SHARED_INTEGERS; j++) {
+        shared.integers[j] = makeObjectShared(createObject(REDIS_STRING, (void*) j));
+        shared.integers[j]->encoding = REDIS_ENCODING_INT;
+    }
 }
 
 static void appendServerSaveParams(time_t seconds, int changes) {
@@ -570,7 +1215,7 @@ static void appendServerSaveParams(time_t seconds, int changes) {
 
 static void resetServerSaveParams() {
     zfree(server.saveParams);
-    server.saveParams == NULL;
+    server.saveParams = NULL;
     server.saveParamLens = 0;
 }
 
@@ -585,6 +1230,28 @@ static void initServerConfig() {
     server.glueOutputBuf = 1;
     server.daemonize = 0;
     server.dbfilename = "dump.rdb";
+    server.rdbCompression = 1;
+    server.snapshotMode = REDIS_SNAPSHOT_FORK;
+    server.appendonly = 0;
+    server.appendfilename = "appendonly.aof";
+    server.appendfsync = REDIS_AOF_FSYNC_EVERYSEC;
+    server.autoAofRewritePerc = REDIS_AOF_REWRITE_PERC;
+    server.autoAofRewriteMinSize = REDIS_AOF_REWRITE_MIN_SIZE;
+    server.listMaxListpackEntries = REDIS_LIST_MAX_LISTPACK_ENTRIES;
+    server.listMaxListpackValue = REDIS_LIST_MAX_LISTPACK_VALUE;
+    server.setMaxIntsetEntries = REDIS_SET_MAX_INTSET_ENTRIES;
+    server.hashMaxListpackEntries = REDIS_HASH_MAX_LISTPACK_ENTRIES;
+    server.hashMaxListpackValue = REDIS_HASH_MAX_LISTPACK_VALUE;
+    server.zsetMaxListpackEntries = REDIS_ZSET_MAX_LISTPACK_ENTRIES;
+    server.zsetMaxListpackValue = REDIS_ZSET_MAX_LISTPACK_VALUE;
+    server.maxmemory = 0;
+    server.maxmemoryPolicy = REDIS_MAXMEMORY_NO_EVICTION;
+    server.maxmemorySamples = REDIS_DEFAULT_MAXMEMORY_SAMPLES;
+    server.lazyfreeThreshold = REDIS_LAZYFREE_THRESHOLD;
+    server.activeDefrag = 0;
+    server.activeDefragIgnoreBytes = REDIS_DEFRAG_IGNORE_BYTES;
+    server.activeDefragThreshold = REDIS_DEFRAG_THRESHOLD;
+    server.activeDefragCyclePerc = REDIS_DEFRAG_CYCLE_PERC;
     resetServerSaveParams();
 
     // 梯次配置save rdb时机
@@ -605,11 +1272,11 @@ static void initServer() {
 
     server.clients = listCreate();
     server.slaves = listCreate();
-    server.objFreeList = listCreate();
     createShareObjects();
     server.el = aeCreateEventLoop();
     server.dict = zmalloc(sizeof(Dict*) * server.dbnum);
-    if (server.dict == NULL || server.clients == NULL || server.slaves == NULL || server.objFreeList == NULL) {
+    server.expires = zmalloc(sizeof(Dict*) * server.dbnum);
+    if (server.dict == NULL || server.expires == NULL || server.clients == NULL || server.slaves == NULL) {
         oom("server initialization");
     }
     server.fd = anetTcpServer(server.neterr, server.port, server.bindaddr);
@@ -621,88 +1288,5787 @@ static void initServer() {
     // 创建每个db保存数据的ht
     for (int i = 0; i < server.dbnum; i++) {
         server.dict[i] = dictCreate(&hashDictType, NULL);
-        if (server.dict[i] == NULL) {
+        server.expires[i] = dictCreate(&expiresDictType, NULL);
+        if (server.dict[i] == NULL || server.expires[i] == NULL) {
             oom("dictCreate");
         }
     }
 
     server.cronloops = 0;
     server.bgsaveInProgress = 0;
+    server.dirtyBeforeBgsave = 0;
+    server.snapshot = NULL;
     server.lastsave = time(NULL);
     server.dirty = 0;
     server.usedmemory = 0;
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_starttime = time(NULL);
+    server.stat_bgsave_cow_bytes = 0;
+    server.stat_bgsave_start_us = 0;
+    server.stat_snapshot_main_buckets = 0;
+    server.stat_snapshot_main_us = 0;
+    server.stat_snapshot_main_max_us = 0;
+    server.childInfoPipe[0] = server.childInfoPipe[1] = -1;
+    server.stat_evictedkeys = 0;
+    server.stat_expiredkeys = 0;
+    server.stat_expire_cycle_time_used = 0;
+    server.stat_expire_cycle_last_us = 0;
+    server.stat_expire_cycle_max_us = 0;
+    server.stat_expire_cycle_time_cap_reached = 0;
+    server.stat_lazyfreed_objects = 0;
+    server.stat_active_defrag_hits = 0;
+    server.stat_active_defrag_misses = 0;
+    server.stat_active_defrag_scanned = 0;
+    server.stat_active_defrag_time_used = 0;
+    server.defragRunning = 0;
+    server.defragDb = 0;
+    server.defragExpires = 0;
+    server.defragCursor = 0;
+    server.stat_aof_delayed_fsync = 0;
+    server.lruclock = getLRUClock();
+    server.evictionPool = evictionPoolAlloc();
+    server.aofFd = -1;
+    server.aofSelectedDb = -1;
+    server.aofBuf = sdsempty();
+    server.aofCurrentSize = 0;
+    server.aofFsyncSize = 0;
+    server.aofLastFsync = time(NULL);
+    server.aofFlushPostponedStart = 0;
+    server.aofChildPid = -1;
+    server.aofRewriteScheduled = 0;
+    server.aofRewriteBaseSize = 0;
+    server.aofRewriteBuf = sdsempty();
+    server.aofRewriteBufSent = 0;
+    server.aofPipeToChild[0] = server.aofPipeToChild[1] = -1;
+    server.aofPipeAckToParent[0] = server.aofPipeAckToParent[1] = -1;
+    server.aofPipeAckToChild[0] = server.aofPipeAckToChild[1] = -1;
+    server.aofStopSendingDiff = 0;
+    server.aofRewriteTimeStart = -1;
+    server.aofRewriteTimeLast = -1;
+    server.loading = 0;
+    bioInit();
+
+    if (server.appendonly) {
+        server.aofFd = open(server.appendfilename, O_WRONLY|O_APPEND|O_CREAT, 0644);
+        if (server.aofFd == -1) {
+            redisLog(REDIS_WARNING, "Can't open the append-only file: %s", strerror(errno));
+            exit(1);
+        }
+    }
 
     // 创建server端的定时任务，用来处理过期的client, 进行bgsave, rehash db的ht等
-    aeCreateTimeEvent(server.el, 1000, serverCron, NULL, NULL);
+    aeCreateTimeEvent(server.el, REDIS_CRON_PERIOD, serverCron, NULL, NULL);
+    aeSetBeforeSleepProc(server.el, beforeSleep);
+}
+
+/**
+ * 后台线程中释放FLUSHDB/FLUSHALL ASYNC清空的db
+ */
+static void lazyfreeFreeDb(void *dict, void *expires) {
+    unsigned long used = dictGetHashTableUsed((Dict*) dict);
+    // expires中的key也在dict中, 先释放expires
+    dictRelease(expires);
+    dictRelease(dict);
+    __atomic_add_fetch(&server.stat_lazyfreed_objects, used, __ATOMIC_RELAXED);
+}
+
+/**
+ * 和dbAsyncDelete一样, 还被别的地方引用的value(比如在client的回复链表中)不能交给后台线程,
+ * 否则两个线程会同时修改它的refcount. 在主线程释放掉这个引用, 换成不朽的共享对象,
+ * 后台线程对共享对象调用decrRefCount什么都不做
+ */
+static void lazyfreeReleaseSharedValues(Dict *dict) {
+    DictIterator *di = dictGetIterator(dict);
+    if (di == NULL) {
+        oom("dictGetIterator");
+    }
+    DictEntry *de;
+    while ((de = dictNext(di)) != NULL) {
+        Robj *val = dictGetEntryVal(de);
+        if (val->refcount != 1 && val->refcount != REDIS_SHARED_REFCOUNT) {
+            decrRefCount(val);
+            dictSetHashVal(dict, de, shared.nil);
+        }
+    }
+    dictReleaseIterator(di);
+}
+
+/**
+ * 清空一个db
+ * @param async 为1时把db中的内容转移出来交给后台线程释放, 主线程只需要遍历一遍value的refcount
+ */
+static void emptyDbIndex(int dbid, int async) {
+    snapshotBeforeEmptyDb(dbid);
+    if (async && dictGetHashTableUsed(server.dict[dbid]) > 0) {
+        lazyfreeReleaseSharedValues(server.dict[dbid]);
+        // 不能直接换掉server.dict[dbid], client的c->dict指向它
+        Dict *dict = dictDetach(server.dict[dbid]);
+        Dict *expires = dictDetach(server.expires[dbid]);
+        bioSubmitJob(BIO_LAZY_FREE, lazyfreeFreeDb, dict, expires);
+        return;
+    }
+    dictEmpty(server.expires[dbid]);
+    dictEmpty(server.dict[dbid]);
 }
 
 /**
  * 清空整个redis的数据
  */
-static void emptyDb() {
+static void emptyDb(int async) {
     for (int i = 0; i < server.dbnum; i++) {
-        dictEmpty(server.dict[i]);
+        emptyDbIndex(i, async);
     }
 }
 
+/*------------------------------ LRU/LFU clock ----------------------*/
+
+static unsigned int getLRUClock(void) {
+    return (mstime() / REDIS_LRU_CLOCK_RESOLUTION) & REDIS_LRU_CLOCK_MAX;
+}
+
 /**
- * 一个比较初级的用来从文件中读取配置的实现
+ * LFU中使用的分钟级时间, 只保留16位
  */
-static void loadServerConfig(char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) {
-        redisLog(REDIS_WARNING, "Fatal error, can't open config file");
-        exit(1);
+static unsigned long lfuTimeInMinutes(void) {
+    return (time(NULL) / 60) & 65535;
+}
+
+/**
+ * 按照maxmemory-policy初始化对象的访问信息
+ */
+static unsigned int objectInitialLru(void) {
+    if (server.maxmemoryPolicy == REDIS_MAXMEMORY_ALLKEYS_LFU) {
+        return (lfuTimeInMinutes() << 8) | REDIS_LFU_INIT_VAL;
     }
+    return server.lruclock;
+}
 
-    char buf[REDIS_CONFIGLINE_MAX+1];
-    char *err = NULL;
-    int linenum = 0;
-    sds line = NULL;
-    while (fget(buf, REDIS_CONFIGLINE_MAX+1, fp) != NULL) {
-        linenum++;
-        line = sdsnew(buf);
-        line = sdstrim(line, "\t\r\n");
-        if (line[0] == '#' || line[0] == '\0') {
-            sdsfree(line);
-            continue;
-        }
+/**
+ * 按LRU/LFU淘汰时每个value都需要自己的访问信息, 这时不能把共享的整数对象当作value
+ */
+static int canUseSharedIntegers(void) {
+    return server.maxmemory == 0 ||
+        server.maxmemoryPolicy == REDIS_MAXMEMORY_NO_EVICTION ||
+        server.maxmemoryPolicy == REDIS_MAXMEMORY_ALLKEYS_RANDOM;
+}
 
-        int argc;
-        sds *argv = sdssplitlen(line, sdslen(line), " ", 1, &argc);
-        sdstolower(argv[0]);
+/*------------------------------ Redis objects implementation ----------*/
 
-        if (strcmp(argv[0], "timeout") && argc == 2) {
-            server.maxIdleTime = atoi(argv[1]);
-            if (server.maxIdleTime < 1) {
-                err = "Invalid timeout value";
-                goto loaderr;
-            }
-        } else if (strcmp(argv[0], "port") == 0 && argc == 2) {
-            server.port = atoi(argv[1]);
-            if (server.port < 1 || server.port > 65535) {
-                err = "Invalid port";
-                goto loaderr;
-            } 
-        } else if (strcmp(argv[0], "bind") == 0 && argc == 2) {
-            server.bindaddr = zstrdup(argv[1]);
-        } else if (strcmp(argv[0], "save") == 0 && argc == 3) {
-            int seconds = atoi(argv[1]);
-            int changes = atoi(argv[2]);
+static Robj *createObject(int type, void *ptr) {
+    Robj *o = slabMalloc(sizeof(*o));
+    if (o == NULL) {
+        oom("createObject");
+    }
+    o->type = type;
+    o->encoding = REDIS_ENCODING_RAW;
+    o->ptr = ptr;
+    o->refcount = 1;
+    o->lru = objectInitialLru();
+    return o;
+}
+
+/**
+ * 一次分配Robj和sds: [Robj][sdshdr8][buf], 最大是64字节，同样从slab中分配
+ * 它的sds不能被修改或者单独free
+ */
+static Robj *createEmbeddedStringObject(char *ptr, size_t len) {
+    Robj *o = slabMalloc(sizeof(Robj) + sizeof(struct sdshdr8) + len + 1);
+    if (o == NULL) {
+        oom("createEmbeddedStringObject");
+    }
+    struct sdshdr8 *sh = (void*) (o + 1);
+
+    o->type = REDIS_STRING;
+    o->encoding = REDIS_ENCODING_EMBSTR;
+    o->ptr = sh->buf;
+    o->refcount = 1;
+    o->lru = objectInitialLru();
+
+    sh->len = len;
+    sh->alloc = len;
+    sh->flags = SDS_TYPE_8;
+    if (ptr != NULL) {
+        memcpy(sh->buf, ptr, len);
+    } else {
+        memset(sh->buf, 0, len);
+    }
+    sh->buf[len] = '\0';
+    return o;
+}
+
+static Robj *createStringObject(char *ptr, size_t len) {
+    if (len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT) {
+        return createEmbeddedStringObject(ptr, len);
+    }
+    return createObject(REDIS_STRING, sdsnewlen(ptr, len));
+}
+
+/**
+ * 创建一个整数字符串对象, [0, REDIS_SHARED_INTEGERS)范围内的直接使用共享对象
+ */
+static Robj *createStringObjectFromLongLong(long long value) {
+    if (value >= 0 && value < REDIS_SHARED_INTEGERS && canUseSharedIntegers()) {
+        incrRefCount(shared.integers[value]);
+        return shared.integers[value];
+    }
+    if (value >= LONG_MIN && value <= LONG_MAX) {
+        Robj *o = createObject(REDIS_STRING, (void*) (long) value);
+        o->encoding = REDIS_ENCODING_INT;
+        return o;
+    }
+    return createObject(REDIS_STRING, sdsfromlonglong(value));
+}
+
+static void freeStringObject(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_RAW) {
+        sdsfree(o->ptr);
+    }
+}
+
+static void freeListObject(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        lpFree(o->ptr);
+    } else {
+        quicklistRelease((Quicklist*) o->ptr);
+    }
+}
+
+static void freeSetObject(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_INTSET) {
+        intsetFree(o->ptr);
+    } else {
+        dictRelease((Dict*) o->ptr);
+    }
+}
+
+static void freeHashObject(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        lpFree(o->ptr);
+    } else {
+        dictRelease((Dict*) o->ptr);
+    }
+}
+
+static void freeZsetObject(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        lpFree(o->ptr);
+    } else {
+        Zset *zs = o->ptr;
+        dictRelease(zs->dict);
+        zslFree(zs->zsl);
+        zfree(zs);
+    }
+}
+
+/**
+ * 把o变成不朽的共享对象: 不再修改refcount, 也永远不会被释放
+ */
+static Robj *makeObjectShared(Robj *o) {
+    assert(o->refcount == 1);
+    o->refcount = REDIS_SHARED_REFCOUNT;
+    return o;
+}
+
+static void incrRefCount(Robj *o) {
+    if (o->refcount != REDIS_SHARED_REFCOUNT) {
+        o->refcount++;
+    }
+}
+
+static void decrRefCount(void *obj) {
+    Robj *o = obj;
+    if (o->refcount == REDIS_SHARED_REFCOUNT) {
+        return;
+    }
+    if (--(o->refcount) == 0) {
+        switch (o->type) {
+            case REDIS_STRING:
+                freeStringObject(o);
+                break;
+            case REDIS_LIST:
+                freeListObject(o);
+                break;
+            case REDIS_SET:
+                freeSetObject(o);
+                break;
+            case REDIS_HASH:
+                freeHashObject(o);
+                break;
+            case REDIS_ZSET:
+                freeZsetObject(o);
+                break;
+            default:
+                assert(0 != 0);
+                break;
+        }
+        slabFree(o);
+    }
+}
+
+/**
+ * 尝试用更省内存的方式编码字符串对象, 用于保存到keyspace中的value
+ * 1. 整数: 使用共享对象或者INT编码
+ * 2. 短字符串: 转成EMBSTR
+ * 3. RAW字符串: 释放掉free空间
+ * 被共享的对象(refcount > 1)不能修改，原样返回
+ * @return 编码后的对象, 可能是o本身，也可能是新的对象(此时o已经被释放)
+ */
+static Robj *tryObjectEncoding(Robj *o) {
+    long long value;
+    if (o->type != REDIS_STRING || o->encoding == REDIS_ENCODING_INT || o->refcount > 1) {
+        return o;
+    }
+
+    size_t len = sdslen(o->ptr);
+    if (string2ll(o->ptr, len, &value) && value >= LONG_MIN && value <= LONG_MAX) {
+        if (value >= 0 && value < REDIS_SHARED_INTEGERS && canUseSharedIntegers()) {
+            decrRefCount(o);
+            incrRefCount(shared.integers[value]);
+            return shared.integers[value];
+        }
+        if (o->encoding == REDIS_ENCODING_RAW) {
+            sdsfree(o->ptr);
+            o->encoding = REDIS_ENCODING_INT;
+            o->ptr = (void*) (long) value;
+            return o;
+        }
+        decrRefCount(o);
+        return createStringObjectFromLongLong(value);
+    }
+
+    if (o->encoding == REDIS_ENCODING_EMBSTR) {
+        return o;
+    }
+    if (len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT) {
+        Robj *emb = createEmbeddedStringObject(o->ptr, len);
+        decrRefCount(o);
+        return emb;
+    }
+    o->ptr = sdsRemoveFreeSpace(o->ptr);
+    return o;
+}
+
+/**
+ * @return 一个ptr为sds的对象(RAW或者EMBSTR, 引用计数已经加1), 用于需要sds的地方，比如回复客户端
+ */
+static Robj *getDecodedObject(Robj *o) {
+    if (o->encoding != REDIS_ENCODING_INT) {
+        incrRefCount(o);
+        return o;
+    }
+    return createObject(REDIS_STRING, sdsfromlonglong((long) o->ptr));
+}
+
+/**
+ * 把字符串对象的值解析为整数
+ * @return REDIS_OK or REDIS_ERR if o is not a valid integer
+ */
+static int getLongLongFromObject(Robj *o, long long *target) {
+    if (o->encoding == REDIS_ENCODING_INT) {
+        *target = (long) o->ptr;
+        return REDIS_OK;
+    }
+    return string2ll(o->ptr, sdslen(o->ptr), target) ? REDIS_OK : REDIS_ERR;
+}
+
+/**
+ * 严格地解析double: 不允许空字符串、前后空格、多余的字符和NaN
+ */
+static int getDoubleFromObject(Robj *o, double *target) {
+    if (o->encoding == REDIS_ENCODING_INT) {
+        *target = (long) o->ptr;
+        return REDIS_OK;
+    }
+    char *s = o->ptr;
+    if (sdslen(s) == 0 || isspace((unsigned char) s[0])) {
+        return REDIS_ERR;
+    }
+    char *eptr;
+    errno = 0;
+    double value = strtod(s, &eptr);
+    if (eptr[0] != '\0' || (size_t) (eptr - s) != sdslen(s) || (errno == ERANGE && value == 0) || isnan(value)) {
+        return REDIS_ERR;
+    }
+    *target = value;
+    return REDIS_OK;
+}
+
+/*------------------------------ Keyspace access and eviction ---------*/
+
+/**
+ * 两次衰减之间过去了多少分钟, 考虑了16位时间的回绕
+ */
+static unsigned long lfuElapsedMinutes(unsigned long ldt) {
+    unsigned long now = lfuTimeInMinutes();
+    if (now >= ldt) {
+        return now - ldt;
+    }
+    return 65535 - ldt + now;
+}
+
+/**
+ * 按照没有访问的时间衰减计数, 只计算不修改对象
+ */
+static unsigned long lfuDecrAndReturn(Robj *o) {
+    unsigned long ldt = o->lru >> 8;
+    unsigned long counter = o->lru & 255;
+    unsigned long periods = lfuElapsedMinutes(ldt) / REDIS_LFU_DECAY_TIME;
+    if (periods > 0) {
+        counter = periods > counter ? 0 : counter - periods;
+    }
+    return counter;
+}
+
+/**
+ * 对数增长: 计数越大, 再加1的概率越小, 8位就可以区分从几次到上百万次的访问
+ */
+static unsigned long lfuLogIncr(unsigned long counter) {
+    if (counter == 255) {
+        return 255;
+    }
+    double r = (double) random() / RAND_MAX;
+    double baseval = counter > REDIS_LFU_INIT_VAL ? counter - REDIS_LFU_INIT_VAL : 0;
+    if (r < 1.0 / (baseval * REDIS_LFU_LOG_FACTOR + 1)) {
+        counter++;
+    }
+    return counter;
+}
+
+/**
+ * 对象多久没有被访问了(毫秒), 只有REDIS_LRU_CLOCK_RESOLUTION的精度
+ */
+static unsigned long long estimateObjectIdleTime(Robj *o) {
+    unsigned int now = server.lruclock;
+    if (now >= o->lru) {
+        return (unsigned long long) (now - o->lru) * REDIS_LRU_CLOCK_RESOLUTION;
+    }
+    return (unsigned long long) (now + (REDIS_LRU_CLOCK_MAX - o->lru)) * REDIS_LRU_CLOCK_RESOLUTION;
+}
+
+/**
+ * @return key的过期时间(毫秒), 没有设置时返回-1
+ */
+static long long getExpire(int dbid, Robj *key) {
+    if (dictGetHashTableUsed(server.expires[dbid]) == 0) {
+        return -1;
+    }
+    DictEntry *de = dictFind(server.expires[dbid], key);
+    if (de == NULL) {
+        return -1;
+    }
+    return (long long) (intptr_t) dictGetEntryVal(de);
+}
+
+/**
+ * key必须已经在db中, expires中使用keyspace里的那个key对象
+ */
+static void setExpire(int dbid, Robj *key, long long when) {
+    snapshotBeforeWrite(dbid, key);
+    DictEntry *de = keyspaceDictFind(server.dict[dbid], key);
+    assert(de != NULL);
+    Robj *kobj = dictGetEntryKey(de);
+    snapshotLockExpires();
+    if (dictAdd(server.expires[dbid], kobj, (void*) (intptr_t) when) == DICT_OK) {
+        incrRefCount(kobj);
+    } else {
+        dictReplace(server.expires[dbid], kobj, (void*) (intptr_t) when);
+    }
+    snapshotUnlockExpires();
+}
+
+/**
+ * @return 1 if the key had an expire
+ */
+static int removeExpire(int dbid, Robj *key) {
+    if (dictGetHashTableUsed(server.expires[dbid]) == 0) {
+        return 0;
+    }
+    snapshotBeforeWrite(dbid, key);
+    snapshotLockExpires();
+    int deleted = dictDelete(server.expires[dbid], key) == DICT_OK;
+    snapshotUnlockExpires();
+    return deleted;
+}
+
+/**
+ * 从db中删除key, 包括它的过期时间
+ * @return 1 if the key existed
+ */
+static int dbDelete(int dbid, Robj *key) {
+    snapshotBeforeWrite(dbid, key);
+    removeExpire(dbid, key);
+    return keyspaceDictDelete(server.dict[dbid], key) == DICT_OK;
+}
+
+/**
+ * 释放o大约需要free多少块内存, 只是估计, O(1)
+ */
+static unsigned long lazyfreeGetFreeEffort(Robj *o) {
+    if (o->type == REDIS_LIST && o->encoding == REDIS_ENCODING_QUICKLIST) {
+        return ((Quicklist*) o->ptr)->len;
+    } else if (o->type == REDIS_SET && o->encoding == REDIS_ENCODING_HT) {
+        return dictGetHashTableSize((Dict*) o->ptr);
+    } else if (o->type == REDIS_HASH && o->encoding == REDIS_ENCODING_HT) {
+        return dictGetHashTableSize((Dict*) o->ptr);
+    } else if (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_SKIPLIST) {
+        return ((Zset*) o->ptr)->zsl->length;
+    }
+    // 字符串, listpack, intset都只是一块内存
+    return 1;
+}
+
+static void lazyfreeFreeObject(void *o, void *unused) {
+    REDIS_NOTUSED(unused);
+    decrRefCount(o);
+    __atomic_add_fetch(&server.stat_lazyfreed_objects, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * 和dbDelete一样, 但是释放代价超过lazyfree-threshold的value从keyspace中摘下来之后交给后台线程释放
+ * 只有没有被别的地方引用的value(refcount == 1)才能交给后台线程
+ * @return 1 if the key existed
+ */
+static int dbAsyncDelete(int dbid, Robj *key) {
+    snapshotBeforeWrite(dbid, key);
+    removeExpire(dbid, key);
+    DictEntry *de = keyspaceDictFind(server.dict[dbid], key);
+    if (de == NULL) {
+        return 0;
+    }
+    Robj *val = dictGetEntryVal(de);
+    if (val->refcount != 1 || lazyfreeGetFreeEffort(val) <= server.lazyfreeThreshold) {
+        return keyspaceDictDelete(server.dict[dbid], key) == DICT_OK;
+    }
+
+    Robj *kobj = dictGetEntryKey(de);
+    keyspaceDictDeleteNoFree(server.dict[dbid], key);
+    decrRefCount(kobj);
+    bioSubmitJob(BIO_LAZY_FREE, lazyfreeFreeObject, val, NULL);
+    return 1;
+}
+
+/**
+ * 惰性过期: 访问key之前检查, 已经过期就删掉
+ * @return 1 if the key was expired and deleted
+ */
+static int expireIfNeeded(int dbid, Robj *key) {
+    long long when = getExpire(dbid, key);
+    if (when < 0 || mstime() <= when) {
+        return 0;
+    }
+    // 重放AOF时不删除, 当初执行时删除它的DEL就在后面, 提前删掉会让中间的命令结果不一样
+    if (server.loading) {
+        return 0;
+    }
+    server.stat_expiredkeys++;
+    // 不能增加dirty, 否则call()会把碰到过期key的只读命令也写进AOF
+    propagateDeletion(dbid, key);
+    return dbAsyncDelete(dbid, key);
+}
+
+/**
+ * 命令读写key都通过它查找: 已经过期的key当作不存在, 顺便更新value的访问信息
+ * 有子进程时不更新, 否则每次读都会让父进程复制一个页; 共享对象也不更新, 见makeObjectShared
+ * @param write 调用者会原地修改找到的value: 快照线程还没有写到的先序列化, 见snapshotBeforeWrite
+ *              只读时不序列化, 相应地快照线程运行期间也不更新访问信息, lru和type/encoding在同一个int中, 后台线程可能正在读
+ */
+static DictEntry *lookupKey(int dbid, Robj *key, int write) {
+    if (write) {
+        snapshotBeforeWrite(dbid, key);
+    }
+    expireIfNeeded(dbid, key);
+    DictEntry *de = keyspaceDictFind(server.dict[dbid], key);
+    if (de == NULL) {
+        return NULL;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (!hasActiveChildProcess() && (write || server.snapshot == NULL) && o->refcount != REDIS_SHARED_REFCOUNT) {
+        if (server.maxmemoryPolicy == REDIS_MAXMEMORY_ALLKEYS_LFU) {
+            o->lru = (lfuTimeInMinutes() << 8) | lfuLogIncr(lfuDecrAndReturn(o));
+        } else {
+            o->lru = server.lruclock;
+        }
+    }
+    return de;
+}
+
+static DictEntry *lookupKeyRead(int dbid, Robj *key) {
+    return lookupKey(dbid, key, 0);
+}
+
+static DictEntry *lookupKeyWrite(int dbid, Robj *key) {
+    return lookupKey(dbid, key, 1);
+}
+
+static EvictionPoolEntry *evictionPoolAlloc(void) {
+    EvictionPoolEntry *pool = zmalloc(sizeof(*pool) * REDIS_EVICTION_POOL_SIZE);
+    if (pool == NULL) {
+        oom("evictionPoolAlloc");
+    }
+    for (int j = 0; j < REDIS_EVICTION_POOL_SIZE; j++) {
+        pool[j].idle = 0;
+        pool[j].key = NULL;
+        pool[j].dbid = 0;
+    }
+    return pool;
+}
+
+/**
+ * 从哪个dict中采样淘汰的key: volatile-lru只淘汰设置了过期时间的key
+ */
+static Dict *evictionSampleDict(int dbid) {
+    if (server.maxmemoryPolicy == REDIS_MAXMEMORY_VOLATILE_LRU) {
+        return server.expires[dbid];
+    }
+    return server.dict[dbid];
+}
+
+/**
+ * 从sampledict中随机取maxmemory-samples个key, 比池中的候选更应该淘汰的放进池中
+ * 池满了的时候挤掉idle最小的那个
+ */
+static void evictionPoolPopulate(int dbid, Dict *sampledict, EvictionPoolEntry *pool) {
+    for (int j = 0; j < server.maxmemorySamples; j++) {
+        DictEntry *de = dictGetRandomKey(sampledict);
+        if (de == NULL) {
+            return;
+        }
+        Robj *key = dictGetEntryKey(de);
+        if (sampledict != server.dict[dbid]) {
+            de = keyspaceDictFind(server.dict[dbid], key);
+        }
+        Robj *o = dictGetEntryVal(de);
+        unsigned long long idle;
+        if (server.maxmemoryPolicy == REDIS_MAXMEMORY_ALLKEYS_LFU) {
+            idle = 255 - lfuDecrAndReturn(o);
+        } else {
+            idle = estimateObjectIdleTime(o);
+        }
+
+        // 找到第一个idle不小于它的位置
+        int k = 0;
+        while (k < REDIS_EVICTION_POOL_SIZE && pool[k].key != NULL && pool[k].idle < idle) {
+            k++;
+        }
+        if (k == 0 && pool[REDIS_EVICTION_POOL_SIZE - 1].key != NULL) {
+            // 比池中所有的候选都新, 池也满了
+            continue;
+        } else if (k < REDIS_EVICTION_POOL_SIZE && pool[k].key == NULL) {
+            // 插入到空位
+        } else if (pool[REDIS_EVICTION_POOL_SIZE - 1].key == NULL) {
+            // 右边还有空位, k之后的整体右移
+            memmove(pool + k + 1, pool + k, sizeof(*pool) * (REDIS_EVICTION_POOL_SIZE - k - 1));
+        } else {
+            // 池满了, 丢掉idle最小的, k之前的整体左移
+            k--;
+            sdsfree(pool[0].key);
+            memmove(pool, pool + 1, sizeof(*pool) * k);
+        }
+        pool[k].key = sdsnewlen(key->ptr, sdslen(key->ptr));
+        pool[k].idle = idle;
+        pool[k].dbid = dbid;
+    }
+}
+
+/**
+ * 从池中取出最应该淘汰、并且还在db中的key, 池中没有合适的候选时返回NULL
+ * @return 取出的key由调用者释放
+ */
+static sds evictionPoolPop(EvictionPoolEntry *pool, int *dbid) {
+    for (int k = REDIS_EVICTION_POOL_SIZE - 1; k >= 0; k--) {
+        if (pool[k].key == NULL) {
+            continue;
+        }
+        sds key = pool[k].key;
+        *dbid = pool[k].dbid;
+        memmove(pool + k, pool + k + 1, sizeof(*pool) * (REDIS_EVICTION_POOL_SIZE - k - 1));
+        pool[REDIS_EVICTION_POOL_SIZE - 1].key = NULL;
+
+        Robj keyobj = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1, .ptr = key};
+        if (keyspaceDictFind(server.dict[*dbid], &keyobj) != NULL) {
+            return key;
+        }
+        sdsfree(key);
+    }
+    return NULL;
+}
+
+/**
+ * 和maxmemory比较的内存用量: slab中空闲的对象还会被复用, 不算在内
+ */
+static size_t usedMemoryForMaxmemory(void) {
+    size_t used = zmalloc_used_memory();
+    size_t slabfree = slabFreeBytes();
+    return used > slabfree ? used - slabfree : 0;
+}
+
+/**
+ * 内存超过maxmemory时按maxmemory-policy淘汰key, 直到回到maxmemory以内
+ * @return REDIS_ERR 如果policy是noeviction或者没有可以淘汰的key
+ */
+static int freeMemoryIfNeeded(void) {
+    static int nextdb = 0;
+    if (server.maxmemory == 0) {
+        return REDIS_OK;
+    }
+    size_t used = usedMemoryForMaxmemory();
+    if (used <= server.maxmemory) {
+        return REDIS_OK;
+    }
+    if (server.maxmemoryPolicy == REDIS_MAXMEMORY_NO_EVICTION) {
+        return REDIS_ERR;
+    }
+
+    while (used > server.maxmemory) {
+        sds bestkey = NULL;
+        int bestdb = -1;
+        if (server.maxmemoryPolicy == REDIS_MAXMEMORY_ALLKEYS_RANDOM) {
+            // 轮流从每个db中随机选一个
+            for (int i = 0; i < server.dbnum && bestkey == NULL; i++) {
+                int j = nextdb;
+                nextdb = (nextdb + 1) % server.dbnum;
+                Dict *d = evictionSampleDict(j);
+                DictEntry *de = d != NULL ? dictGetRandomKey(d) : NULL;
+                if (de != NULL) {
+                    Robj *key = dictGetEntryKey(de);
+                    bestkey = sdsnewlen(key->ptr, sdslen(key->ptr));
+                    bestdb = j;
+                }
+            }
+        } else {
+            while (bestkey == NULL) {
+                unsigned long keys = 0;
+                for (int j = 0; j < server.dbnum; j++) {
+                    Dict *d = evictionSampleDict(j);
+                    if (d != NULL && dictGetHashTableUsed(d) > 0) {
+                        keys += dictGetHashTableUsed(d);
+                        evictionPoolPopulate(j, d, server.evictionPool);
+                    }
+                }
+                if (keys == 0) {
+                    break;
+                }
+                bestkey = evictionPoolPop(server.evictionPool, &bestdb);
+            }
+        }
+        if (bestkey == NULL) {
+            return REDIS_ERR;
+        }
+
+        Robj keyobj = {.type = REDIS_STRING, .encoding = REDIS_ENCODING_RAW, .refcount = 1, .ptr = bestkey};
+        propagateDeletion(bestdb, &keyobj);
+        dbDelete(bestdb, &keyobj);
+        sdsfree(bestkey);
+        server.stat_evictedkeys++;
+        server.dirty++;
+        used = usedMemoryForMaxmemory();
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 主动过期, 每次serverCron调用一次
+ * 每个db每轮随机检查REDIS_EXPIRE_LOOKUPS_PER_LOOP个设置了过期时间的key, 删掉其中已经过期的;
+ * 这个db累计检查过的key中过期的超过1/4, 说明还有很多过期的key, 继续下一轮。
+ * 用累计的比例而不是单轮的, 否则过期比例很高时也会因为某一轮碰巧命中得少而提前停下
+ * 时间用完时记住停在哪个db, 下次从那里继续
+ */
+static void activeExpireCycle(void) {
+    static int currentDb = 0;
+    long long start = ustime();
+    long long timelimit = (long long) REDIS_CRON_PERIOD * 1000 * REDIS_EXPIRE_CYCLE_TIME_PERC / 100;
+    int timelimitExit = 0;
+    int iteration = 0;
+
+    for (int j = 0; j < server.dbnum && !timelimitExit; j++) {
+        int dbid = currentDb;
+        currentDb = (currentDb + 1) % server.dbnum;
+        Dict *expires = server.expires[dbid];
+        long long sampled = 0;
+        long long expired = 0;
+        do {
+            unsigned int num = dictGetHashTableUsed(expires);
+            unsigned int slots = dictGetHashTableSize(expires);
+            if (num == 0) {
+                break;
+            }
+            // 太稀疏的时候随机取key要扫很多空bucket, 等rehashIfNeed缩小之后再处理
+            if (slots > DICT_INITIAL_SIZE && (num * 100 / slots < 1)) {
+                break;
+            }
+            if (num > REDIS_EXPIRE_LOOKUPS_PER_LOOP) {
+                num = REDIS_EXPIRE_LOOKUPS_PER_LOOP;
+            }
+
+            long long now = mstime();
+            sampled += num;
+            while (num--) {
+                DictEntry *de = dictGetRandomKey(expires);
+                if (now > (long long) (intptr_t) dictGetEntryVal(de)) {
+                    Robj *key = dictGetEntryKey(de);
+                    incrRefCount(key);
+                    propagateDeletion(dbid, key);
+                    dbAsyncDelete(dbid, key);
+                    decrRefCount(key);
+                    server.stat_expiredkeys++;
+                    server.dirty++;
+                    expired++;
+                }
+            }
+
+            // 每16轮检查一次时间, 避免频繁调用gettimeofday
+            iteration++;
+            if ((iteration & 0xf) == 0 && ustime() - start > timelimit) {
+                timelimitExit = 1;
+                server.stat_expire_cycle_time_cap_reached++;
+                break;
+            }
+        } while (expired * 4 > sampled);
+    }
+
+    long long elapsed = ustime() - start;
+    server.stat_expire_cycle_time_used += elapsed;
+    server.stat_expire_cycle_last_us = elapsed;
+    if (elapsed > server.stat_expire_cycle_max_us) {
+        server.stat_expire_cycle_max_us = elapsed;
+    }
+}
+
+/*------------------------------ Active defrag ----------------------*/
+
+/**
+ * 能通过搬动对象回收的碎片: slab中空闲的对象, 有jemalloc时再加上它的页里的空洞
+ */
+static size_t activeDefragFragBytes(void) {
+    size_t frag = slabFreeBytes();
+#ifdef HAVE_DEFRAG
+    size_t allocated, active, resident;
+    if (zmalloc_get_allocator_info(&allocated, &active, &resident) && active > allocated) {
+        frag += active - allocated;
+    }
+#endif
+    return frag;
+}
+
+/**
+ * 从slab中分配的对象(Robj, DictEntry, EMBSTR)
+ * @return 新的地址, ptr已经释放; 不需要搬动时返回NULL
+ */
+static void *activeDefragSlab(void *ptr) {
+    void *newptr = slabDefragAlloc(ptr);
+    if (newptr == NULL) {
+        server.stat_active_defrag_misses++;
+    } else {
+        server.stat_active_defrag_hits++;
+    }
+    return newptr;
+}
+
+/**
+ * zmalloc分配的内存, 只有allocator能告诉我们它所在的页有多空(jemalloc)时才搬
+ */
+static void *activeDefragHeap(void *ptr) {
+#ifdef HAVE_DEFRAG
+    void *newptr = zmalloc_defrag_move(ptr);
+    if (newptr == NULL) {
+        server.stat_active_defrag_misses++;
+    } else {
+        server.stat_active_defrag_hits++;
+    }
+    return newptr;
+#else
+    REDIS_NOTUSED(ptr);
+    return NULL;
+#endif
+}
+
+/**
+ * 整理一个只被keyspace引用的对象: Robj本身, 以及字符串的sds, listpack, intset这些单块的内存
+ * 集合内部的节点(quicklist node, dict entry, skiplist node)不处理
+ * @return o的新地址(可能不变), 调用者负责更新引用它的地方
+ */
+static Robj *activeDefragObject(Robj *o) {
+    Robj *moved = activeDefragSlab(o);
+    if (moved != NULL) {
+        // EMBSTR的sds和Robj在同一块内存中
+        if (moved->encoding == REDIS_ENCODING_EMBSTR) {
+            moved->ptr = ((struct sdshdr8*) (moved + 1))->buf;
+        }
+        o = moved;
+    }
+
+    if (o->type == REDIS_STRING && o->encoding == REDIS_ENCODING_RAW) {
+        void *sh = sdsAllocPtr(o->ptr);
+        void *newsh = activeDefragHeap(sh);
+        if (newsh != NULL) {
+            o->ptr = (char*) newsh + ((char*) o->ptr - (char*) sh);
+        }
+    } else if (o->encoding == REDIS_ENCODING_LISTPACK || o->encoding == REDIS_ENCODING_INTSET) {
+        void *ptr = activeDefragHeap(o->ptr);
+        if (ptr != NULL) {
+            o->ptr = ptr;
+        }
+    }
+    return o;
+}
+
+/**
+ * dictScan的回调: 只整理entry本身, 用于expires, 它的key在整理keyspace时已经处理了
+ */
+static void activeDefragEntry(void *privdata, DictEntry **entryRef) {
+    REDIS_NOTUSED(privdata);
+    DictEntry *de = activeDefragSlab(*entryRef);
+    if (de != NULL) {
+        *entryRef = de;
+    }
+}
+
+/**
+ * dictScan的回调: 整理keyspace的一个entry, 它的key和value
+ * key同时被expires引用, 搬动之后两边都要更新; 被别的地方引用的对象不能搬
+ */
+static void activeDefragKeyspaceEntry(void *privdata, DictEntry **entryRef) {
+    int dbid = (int) (long) privdata;
+    DictEntry *de = activeDefragSlab(*entryRef);
+    if (de != NULL) {
+        *entryRef = de;
+    } else {
+        de = *entryRef;
+    }
+    server.stat_active_defrag_scanned++;
+
+    Robj *key = dictGetEntryKey(de);
+    DictEntry *exde = NULL;
+    if (dictGetHashTableUsed(server.expires[dbid]) > 0) {
+        exde = dictFind(server.expires[dbid], key);
+    }
+    if (key->refcount == 1 + (exde != NULL)) {
+        key = activeDefragObject(key);
+        de->key = key;
+        if (exde != NULL) {
+            exde->key = key;
+        }
+    }
+
+    Robj *val = dictGetEntryVal(de);
+    if (val->refcount == 1) {
+        de->val = activeDefragObject(val);
+    }
+}
+
+/**
+ * 主动碎片整理, 每次serverCron调用一次
+ * 可以回收的碎片超过阈值时开始一轮: 用dictScan依次走遍每个db, 把稀疏的页中的对象搬到更满的页中,
+ * 稀疏的页空出来之后就可以还给系统。时间用完时记住db和cursor, 下次继续; 走完一轮之后重新检查碎片。
+ * 有子进程时不整理, 搬动对象会让父进程复制大量的页; 快照线程在读的对象也不能搬
+ */
+static void activeDefragCycle(void) {
+    if (!server.activeDefrag || hasActiveChildProcess() || server.snapshot != NULL) {
+        return;
+    }
+    if (!server.defragRunning) {
+        size_t frag = activeDefragFragBytes();
+        size_t used = zmalloc_used_memory();
+        if (frag < server.activeDefragIgnoreBytes || frag * 100 < used * server.activeDefragThreshold) {
+            return;
+        }
+        redisLog(REDIS_NOTICE, "Starting active defrag, %zu bytes fragmented of %zu used", frag, used);
+        server.defragRunning = 1;
+        server.defragDb = 0;
+        server.defragExpires = 0;
+        server.defragCursor = 0;
+    }
+
+    long long start = ustime();
+    long long timelimit = (long long) REDIS_CRON_PERIOD * 1000 * server.activeDefragCyclePerc / 100;
+    int iteration = 0;
+    while (server.defragDb < server.dbnum) {
+        if (!server.defragExpires) {
+            server.defragCursor = dictScan(server.dict[server.defragDb], server.defragCursor,
+                activeDefragKeyspaceEntry, (void*) (long) server.defragDb);
+        } else {
+            server.defragCursor = dictScan(server.expires[server.defragDb], server.defragCursor,
+                activeDefragEntry, NULL);
+        }
+        // 一个db先走dict再走expires
+        if (server.defragCursor == 0) {
+            if (server.defragExpires) {
+                server.defragDb++;
+            }
+            server.defragExpires = !server.defragExpires;
+        }
+        // 每16个bucket检查一次时间
+        iteration++;
+        if ((iteration & 0xf) == 0 && ustime() - start > timelimit) {
+            break;
+        }
+    }
+    server.stat_active_defrag_time_used += ustime() - start;
+
+    if (server.defragDb == server.dbnum) {
+        server.defragRunning = 0;
+        zmalloc_release_free_memory();
+        redisLog(REDIS_NOTICE, "Active defrag done, %zu bytes fragmented of %zu used",
+            activeDefragFragBytes(), zmalloc_used_memory());
+    }
+}
+
+/**
+ * processCommand在执行命令之前调用: 设置了maxmemory时, 会增加内存的写命令先尝试淘汰,
+ * 还是超过maxmemory的话拒绝执行
+ * @return 0表示不能执行这个命令, 已经回复了错误
+ */
+static int checkMaxmemoryBeforeCommand(RedisClient *c, struct RedisCommand *cmd) {
+    if (server.maxmemory == 0 || !(cmd->flags & REDIS_CMD_DENYOOM)) {
+        return 1;
+    }
+    if (freeMemoryIfNeeded() == REDIS_ERR) {
+        addReply(c, shared.oomErr);
+        return 0;
+    }
+    return 1;
+}
+
+/*------------------------------ List type ---------------------------*/
+
+static Robj *createQuicklistObject(void) {
+    Quicklist *ql = quicklistCreate(server.listMaxListpackEntries);
+    if (ql == NULL) {
+        oom("quicklistCreate");
+    }
+    Robj *o = createObject(REDIS_LIST, ql);
+    o->encoding = REDIS_ENCODING_QUICKLIST;
+    return o;
+}
+
+static Robj *createListpackListObject(void) {
+    unsigned char *lp = lpNew();
+    if (lp == NULL) {
+        oom("lpNew");
+    }
+    Robj *o = createObject(REDIS_LIST, lp);
+    o->encoding = REDIS_ENCODING_LISTPACK;
+    return o;
+}
+
+static unsigned long listTypeLength(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        return lpLength(o->ptr);
+    }
+    return quicklistCount((Quicklist*) o->ptr);
+}
+
+/**
+ * listpack -> quicklist, 原来的listpack直接作为quicklist的第一个node, 不需要拷贝元素
+ */
+static void listTypeConvert(Robj *o) {
+    assert(o->encoding == REDIS_ENCODING_LISTPACK);
+    Quicklist *ql = quicklistCreate(server.listMaxListpackEntries);
+    if (ql == NULL) {
+        oom("quicklistCreate");
+    }
+    if (!quicklistAppendListpack(ql, o->ptr)) {
+        oom("quicklistAppendListpack");
+    }
+    o->ptr = ql;
+    o->encoding = REDIS_ENCODING_QUICKLIST;
+}
+
+/**
+ * 元素个数或者要插入的元素长度超过限制时, 转换成quicklist
+ */
+static void listTypeTryConversion(Robj *o, Robj *value) {
+    if (o->encoding != REDIS_ENCODING_LISTPACK) {
+        return;
+    }
+    if (lpLength(o->ptr) >= server.listMaxListpackEntries ||
+        (value->encoding != REDIS_ENCODING_INT && sdslen(value->ptr) > server.listMaxListpackValue)) {
+        listTypeConvert(o);
+    }
+}
+
+static void listTypePush(Robj *o, Robj *value, int where) {
+    listTypeTryConversion(o, value);
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        value = getDecodedObject(value);
+        if (where == REDIS_HEAD) {
+            o->ptr = lpPrepend(o->ptr, (unsigned char*) value->ptr, sdslen(value->ptr));
+        } else {
+            o->ptr = lpAppend(o->ptr, (unsigned char*) value->ptr, sdslen(value->ptr));
+        }
+        if (o->ptr == NULL) {
+            oom("listTypePush");
+        }
+        decrRefCount(value);
+    } else {
+        value = getDecodedObject(value);
+        if (!quicklistPush(o->ptr, value->ptr, sdslen(value->ptr),
+                where == REDIS_HEAD ? QUICKLIST_HEAD : QUICKLIST_TAIL)) {
+            oom("listTypePush");
+        }
+        decrRefCount(value);
+    }
+}
+
+/**
+ * 以bulk的形式回复listpack中p处的元素
+ */
+static void addReplyListpackEntry(RedisClient *c, unsigned char *p) {
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int64_t count;
+    unsigned char *s = lpGet(p, &count, intbuf);
+    addReplyBulkCBuffer(c, s, count);
+}
+
+static void addReplyQuicklistEntry(RedisClient *c, QuicklistEntry *entry) {
+    if (entry->value == NULL) {
+        addReplyBulkLongLong(c, entry->longval);
+    } else {
+        addReplyBulkCBuffer(c, entry->value, entry->sz);
+    }
+}
+
+/*------------------------------ Set type ----------------------------*/
+
+static Robj *createSetObject(void) {
+    Dict *d = dictCreate(&setDictType, NULL);
+    if (d == NULL) {
+        oom("dictCreate");
+    }
+    Robj *o = createObject(REDIS_SET, d);
+    o->encoding = REDIS_ENCODING_HT;
+    return o;
+}
+
+static Robj *createIntsetObject(void) {
+    Intset *is = intsetNew();
+    if (is == NULL) {
+        oom("intsetNew");
+    }
+    Robj *o = createObject(REDIS_SET, is);
+    o->encoding = REDIS_ENCODING_INTSET;
+    return o;
+}
+
+/**
+ * 根据第一个要加入的元素决定新set的编码
+ */
+static Robj *setTypeCreate(Robj *value) {
+    long long ll;
+    if (getLongLongFromObject(value, &ll) == REDIS_OK) {
+        return createIntsetObject();
+    }
+    return createSetObject();
+}
+
+static unsigned long setTypeSize(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_INTSET) {
+        return intsetLen(o->ptr);
+    }
+    return dictGetHashTableUsed((Dict*) o->ptr);
+}
+
+/**
+ * intset -> dict
+ */
+static void setTypeConvert(Robj *o) {
+    assert(o->encoding == REDIS_ENCODING_INTSET);
+    Intset *is = o->ptr;
+    Dict *d = dictCreate(&setDictType, NULL);
+    if (d == NULL || dictExpand(d, intsetLen(is)) == DICT_ERR) {
+        oom("setTypeConvert");
+    }
+
+    int64_t ll;
+    for (uint32_t i = 0; intsetGet(is, i, &ll); i++) {
+        dictAdd(d, createObject(REDIS_STRING, sdsfromlonglong(ll)), NULL);
+    }
+    intsetFree(is);
+    o->ptr = d;
+    o->encoding = REDIS_ENCODING_HT;
+}
+
+/**
+ * @return 1 if added, 0 if already member
+ */
+static int setTypeAdd(Robj *o, Robj *value) {
+    long long ll;
+    if (o->encoding == REDIS_ENCODING_INTSET) {
+        if (getLongLongFromObject(value, &ll) == REDIS_OK) {
+            int success;
+            o->ptr = intsetAdd(o->ptr, ll, &success);
+            if (o->ptr == NULL) {
+                oom("intsetAdd");
+            }
+            if (success && intsetLen(o->ptr) > server.setMaxIntsetEntries) {
+                setTypeConvert(o);
+            }
+            return success;
+        }
+        // 不是整数, 只能用dict保存了
+        setTypeConvert(o);
+    }
+
+    // dict的key必须是sds编码的
+    value = getDecodedObject(value);
+    if (dictAdd(o->ptr, value, NULL) == DICT_OK) {
+        return 1;
+    }
+    decrRefCount(value);
+    return 0;
+}
+
+static int setTypeRemove(Robj *o, Robj *value) {
+    long long ll;
+    if (o->encoding == REDIS_ENCODING_INTSET) {
+        int success = 0;
+        if (getLongLongFromObject(value, &ll) == REDIS_OK) {
+            o->ptr = intsetRemove(o->ptr, ll, &success);
+        }
+        return success;
+    }
+
+    value = getDecodedObject(value);
+    int deleted = dictDelete(o->ptr, value) == DICT_OK;
+    decrRefCount(value);
+    return deleted;
+}
+
+static int setTypeIsMember(Robj *o, Robj *value) {
+    long long ll;
+    if (o->encoding == REDIS_ENCODING_INTSET) {
+        return getLongLongFromObject(value, &ll) == REDIS_OK && intsetFind(o->ptr, ll);
+    }
+
+    value = getDecodedObject(value);
+    int found = dictFind(o->ptr, value) != NULL;
+    decrRefCount(value);
+    return found;
+}
+
+typedef struct SetTypeIterator {
+    Robj *subject;
+    uint32_t ii; // intset的下标
+    DictIterator *di;
+} SetTypeIterator;
+
+static SetTypeIterator *setTypeInitIterator(Robj *o) {
+    SetTypeIterator *si = zmalloc(sizeof(*si));
+    if (si == NULL) {
+        oom("setTypeInitIterator");
+    }
+    si->subject = o;
+    si->ii = 0;
+    si->di = NULL;
+    if (o->encoding == REDIS_ENCODING_HT) {
+        si->di = dictGetIterator(o->ptr);
+        if (si->di == NULL) {
+            oom("dictGetIterator");
+        }
+    }
+    return si;
+}
+
+static void setTypeReleaseIterator(SetTypeIterator *si) {
+    if (si->di != NULL) {
+        dictReleaseIterator(si->di);
+    }
+    zfree(si);
+}
+
+/**
+ * intset的元素保存在*llele中, dict的元素保存在*objele中(不增加引用计数)
+ * @return 元素所在set的编码, 遍历结束时返回-1
+ */
+static int setTypeNext(SetTypeIterator *si, Robj **objele, int64_t *llele) {
+    if (si->subject->encoding == REDIS_ENCODING_INTSET) {
+        if (!intsetGet(si->subject->ptr, si->ii++, llele)) {
+            return -1;
+        }
+        return REDIS_ENCODING_INTSET;
+    }
+
+    DictEntry *de = dictNext(si->di);
+    if (de == NULL) {
+        return -1;
+    }
+    *objele = dictGetEntryKey(de);
+    return REDIS_ENCODING_HT;
+}
+
+/*------------------------------ Hash type ---------------------------*/
+
+static Robj *createHashObject(void) {
+    unsigned char *lp = lpNew();
+    if (lp == NULL) {
+        oom("lpNew");
+    }
+    Robj *o = createObject(REDIS_HASH, lp);
+    o->encoding = REDIS_ENCODING_LISTPACK;
+    return o;
+}
+
+static unsigned long hashTypeLength(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        return lpLength(o->ptr) / 2;
+    }
+    return dictGetHashTableUsed((Dict*) o->ptr);
+}
+
+/**
+ * 把listpack中p处的元素转换成sds编码的字符串对象, 可以作为dict的key
+ */
+static Robj *listpackGetStringObject(unsigned char *p) {
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int64_t count;
+    unsigned char *s = lpGet(p, &count, intbuf);
+    return createStringObject((char*) s, count);
+}
+
+/**
+ * listpack -> dict
+ */
+static void hashTypeConvert(Robj *o) {
+    assert(o->encoding == REDIS_ENCODING_LISTPACK);
+    Dict *d = dictCreate(&hashDictType, NULL);
+    if (d == NULL || dictExpand(d, hashTypeLength(o)) == DICT_ERR) {
+        oom("hashTypeConvert");
+    }
+
+    unsigned char *lp = o->ptr;
+    unsigned char *fptr = lpFirst(lp);
+    while (fptr != NULL) {
+        unsigned char *vptr = lpNext(lp, fptr);
+        dictAdd(d, listpackGetStringObject(fptr), listpackGetStringObject(vptr));
+        fptr = lpNext(lp, vptr);
+    }
+    lpFree(lp);
+    o->ptr = d;
+    o->encoding = REDIS_ENCODING_HT;
+}
+
+/**
+ * argv[start..end]中有超过长度限制的字符串时转换成dict
+ */
+static void hashTypeTryConversion(Robj *o, Robj **argv, int start, int end) {
+    if (o->encoding != REDIS_ENCODING_LISTPACK) {
+        return;
+    }
+    for (int i = start; i <= end; i++) {
+        if (argv[i]->encoding != REDIS_ENCODING_INT && sdslen(argv[i]->ptr) > server.hashMaxListpackValue) {
+            hashTypeConvert(o);
+            return;
+        }
+    }
+}
+
+/**
+ * @return listpack中field所在的位置, value紧跟在后面; 没找到返回NULL
+ */
+static unsigned char *hashTypeListpackFind(unsigned char *lp, Robj *field) {
+    unsigned char *fptr = lpFirst(lp);
+    if (fptr == NULL) {
+        return NULL;
+    }
+    field = getDecodedObject(field);
+    fptr = lpFind(lp, fptr, (unsigned char*) field->ptr, sdslen(field->ptr), 1);
+    decrRefCount(field);
+    return fptr;
+}
+
+/**
+ * @return field对应的value(增加了引用计数), 不存在时返回NULL
+ */
+static Robj *hashTypeGetValueObject(Robj *o, Robj *field) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *fptr = hashTypeListpackFind(o->ptr, field);
+        if (fptr == NULL) {
+            return NULL;
+        }
+        return listpackGetStringObject(lpNext(o->ptr, fptr));
+    }
+
+    field = getDecodedObject(field);
+    DictEntry *de = dictFind(o->ptr, field);
+    decrRefCount(field);
+    if (de == NULL) {
+        return NULL;
+    }
+    Robj *value = dictGetEntryVal(de);
+    incrRefCount(value);
+    return value;
+}
+
+/**
+ * 设置field的值, 不会接管field和value的引用
+ * @return 1表示新增了field, 0表示更新了已有的field
+ */
+static int hashTypeSet(Robj *o, Robj *field, Robj *value) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *lp = o->ptr;
+        unsigned char *fptr = hashTypeListpackFind(lp, field);
+        value = getDecodedObject(value);
+        int update = fptr != NULL;
+        if (update) {
+            lp = lpInsert(lp, (unsigned char*) value->ptr, sdslen(value->ptr), lpNext(lp, fptr), LP_REPLACE, NULL);
+        } else {
+            field = getDecodedObject(field);
+            lp = lpAppend(lp, (unsigned char*) field->ptr, sdslen(field->ptr));
+            if (lp != NULL) {
+                lp = lpAppend(lp, (unsigned char*) value->ptr, sdslen(value->ptr));
+            }
+            decrRefCount(field);
+        }
+        decrRefCount(value);
+        if (lp == NULL) {
+            oom("hashTypeSet");
+        }
+        o->ptr = lp;
+        if (hashTypeLength(o) > server.hashMaxListpackEntries) {
+            hashTypeConvert(o);
+        }
+        return !update;
+    }
+
+    // dict的key必须是sds编码的
+    field = getDecodedObject(field);
+    incrRefCount(value);
+    DictEntry *de = dictFind(o->ptr, field);
+    if (de != NULL) {
+        dictFreeEntryVal((Dict*) o->ptr, de);
+        dictSetHashVal((Dict*) o->ptr, de, value);
+        decrRefCount(field);
+        return 0;
+    }
+    dictAdd(o->ptr, field, value);
+    return 1;
+}
+
+/**
+ * @return 1 if deleted
+ */
+static int hashTypeDelete(Robj *o, Robj *field) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *fptr = hashTypeListpackFind(o->ptr, field);
+        if (fptr == NULL) {
+            return 0;
+        }
+        // 删除field之后fptr指向value, 再删除一次
+        o->ptr = lpDelete(o->ptr, fptr, &fptr);
+        if (o->ptr == NULL) {
+            oom("hashTypeDelete");
+        }
+        o->ptr = lpDelete(o->ptr, fptr, NULL);
+        if (o->ptr == NULL) {
+            oom("hashTypeDelete");
+        }
+        return 1;
+    }
+
+    field = getDecodedObject(field);
+    int deleted = dictDelete(o->ptr, field) == DICT_OK;
+    decrRefCount(field);
+    return deleted;
+}
+
+/**
+ * 查找hash类型的key, 不存在时创建一个新的
+ * @return 类型不对时回复错误并返回NULL
+ */
+static Robj *hashTypeLookupWriteOrCreate(RedisClient *c, Robj *key) {
+    DictEntry *de = lookupKeyWrite(c->dictid, key);
+    if (de == NULL) {
+        Robj *o = createHashObject();
+        keyspaceDictAdd(c->dict, key, o);
+        incrRefCount(key);
+        return o;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_HASH) {
+        addReply(c, shared.wrongTypeErr);
+        return NULL;
+    }
+    return o;
+}
+
+/**
+ * 以bulk的形式回复field的值, 不存在时回复nil; listpack编码时不需要创建Robj
+ */
+static void addHashFieldToReply(RedisClient *c, Robj *o, Robj *field) {
+    if (o == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *fptr = hashTypeListpackFind(o->ptr, field);
+        if (fptr == NULL) {
+            addReply(c, shared.nil);
+        } else {
+            addReplyListpackEntry(c, lpNext(o->ptr, fptr));
+        }
+        return;
+    }
+
+    field = getDecodedObject(field);
+    DictEntry *de = dictFind(o->ptr, field);
+    decrRefCount(field);
+    if (de == NULL) {
+        addReply(c, shared.nil);
+    } else {
+        addReplyBulk(c, dictGetEntryVal(de));
+    }
+}
+
+/*------------------------------ Sorted set type ---------------------*/
+
+/**
+ * listpack编码: [member][score][member][score]..., 按(score, member)从小到大排序
+ */
+static Robj *createZsetListpackObject(void) {
+    unsigned char *lp = lpNew();
+    if (lp == NULL) {
+        oom("lpNew");
+    }
+    Robj *o = createObject(REDIS_ZSET, lp);
+    o->encoding = REDIS_ENCODING_LISTPACK;
+    return o;
+}
+
+static Robj *createZsetObject(void) {
+    Zset *zs = zmalloc(sizeof(*zs));
+    if (zs == NULL) {
+        oom("createZsetObject");
+    }
+    zs->dict = dictCreate(&zsetDictType, NULL);
+    zs->zsl = zslCreate();
+    if (zs->dict == NULL || zs->zsl == NULL) {
+        oom("createZsetObject");
+    }
+    Robj *o = createObject(REDIS_ZSET, zs);
+    o->encoding = REDIS_ENCODING_SKIPLIST;
+    return o;
+}
+
+static unsigned long zsetLength(Robj *o) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        return lpLength(o->ptr) / 2;
+    }
+    return ((Zset*) o->ptr)->zsl->length;
+}
+
+static double zzlGetScore(unsigned char *sptr) {
+    int64_t count;
+    unsigned char *v = lpGet(sptr, &count, NULL);
+    if (v == NULL) {
+        return (double) count;
+    }
+    char buf[REDIS_DOUBLE_STR_SIZE * 4];
+    if ((size_t) count >= sizeof(buf)) {
+        count = sizeof(buf) - 1;
+    }
+    memcpy(buf, v, count);
+    buf[count] = '\0';
+    return strtod(buf, NULL);
+}
+
+/**
+ * 按字典序比较eptr处的member和ele
+ */
+static int zzlCompareElements(unsigned char *eptr, sds ele) {
+    unsigned char intbuf[LP_INTBUF_SIZE];
+    int64_t count;
+    unsigned char *v = lpGet(eptr, &count, intbuf);
+    size_t elelen = sdslen(ele);
+    size_t minlen = (size_t) count < elelen ? (size_t) count : elelen;
+    int cmp = memcmp(v, ele, minlen);
+    if (cmp == 0) {
+        return (size_t) count < elelen ? -1 : ((size_t) count > elelen ? 1 : 0);
+    }
+    return cmp;
+}
+
+/**
+ * @return member所在的位置, score紧跟在后面; 没找到返回NULL
+ */
+static unsigned char *zzlFind(unsigned char *lp, sds ele, double *score) {
+    unsigned char *eptr = lpFirst(lp);
+    if (eptr == NULL) {
+        return NULL;
+    }
+    eptr = lpFind(lp, eptr, (unsigned char*) ele, sdslen(ele), 1);
+    if (eptr != NULL) {
+        *score = zzlGetScore(lpNext(lp, eptr));
+    }
+    return eptr;
+}
+
+/**
+ * 删除eptr处的member和score
+ * @return 新的listpack, 没有内存时返回NULL
+ */
+static unsigned char *zzlDelete(unsigned char *lp, unsigned char *eptr) {
+    lp = lpDelete(lp, eptr, &eptr);
+    if (lp == NULL) {
+        return NULL;
+    }
+    return lpDelete(lp, eptr, NULL);
+}
+
+/**
+ * 按顺序插入, 调用之前需要保证ele不在listpack中, 没有内存时返回NULL
+ */
+static unsigned char *zzlInsert(unsigned char *lp, sds ele, double score) {
+    char scorebuf[REDIS_DOUBLE_STR_SIZE];
+    int scorelen = d2string(scorebuf, sizeof(scorebuf), score);
+
+    unsigned char *eptr = lpFirst(lp);
+    while (eptr != NULL) {
+        unsigned char *sptr = lpNext(lp, eptr);
+        double s = zzlGetScore(sptr);
+        if (s > score || (s == score && zzlCompareElements(eptr, ele) > 0)) {
+            break;
+        }
+        eptr = lpNext(lp, sptr);
+    }
+
+    if (eptr == NULL) {
+        lp = lpAppend(lp, (unsigned char*) ele, sdslen(ele));
+        if (lp == NULL) {
+            return NULL;
+        }
+        return lpAppend(lp, (unsigned char*) scorebuf, scorelen);
+    }
+    unsigned char *newp;
+    lp = lpInsert(lp, (unsigned char*) ele, sdslen(ele), eptr, LP_BEFORE, &newp);
+    if (lp == NULL) {
+        return NULL;
+    }
+    return lpInsert(lp, (unsigned char*) scorebuf, scorelen, newp, LP_AFTER, NULL);
+}
+
+/**
+ * listpack -> 跳表 + dict
+ */
+static void zsetConvert(Robj *o) {
+    assert(o->encoding == REDIS_ENCODING_LISTPACK);
+    Robj *zobj = createZsetObject();
+    Zset *zs = zobj->ptr;
+    unsigned char *lp = o->ptr;
+    unsigned char *eptr = lpFirst(lp);
+    while (eptr != NULL) {
+        unsigned char intbuf[LP_INTBUF_SIZE];
+        int64_t count;
+        unsigned char *v = lpGet(eptr, &count, intbuf);
+        unsigned char *sptr = lpNext(lp, eptr);
+        sds ele = sdsnewlen(v, count);
+        ZSkiplistNode *node = zslInsert(zs->zsl, zzlGetScore(sptr), ele);
+        dictAdd(zs->dict, ele, &node->score);
+        eptr = lpNext(lp, sptr);
+    }
+    lpFree(lp);
+    o->ptr = zs;
+    o->encoding = REDIS_ENCODING_SKIPLIST;
+    // 只释放Robj本身, Zset已经转移给o了
+    slabFree(zobj);
+}
+
+/**
+ * 添加member或者修改它的score
+ * @param incr 为1时score是增量
+ * @param newscore 不为NULL时设置为最终的score
+ * @return 1表示新增, 0表示更新, -1表示结果是NaN(不做任何修改)
+ */
+static int zsetAdd(Robj *o, double score, sds ele, int incr, double *newscore) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK && sdslen(ele) > server.zsetMaxListpackValue) {
+        zsetConvert(o);
+    }
+
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        double curscore;
+        unsigned char *eptr = zzlFind(o->ptr, ele, &curscore);
+        if (eptr != NULL) {
+            if (incr) {
+                score += curscore;
+                if (isnan(score)) {
+                    return -1;
+                }
+            }
+            if (newscore != NULL) {
+                *newscore = score;
+            }
+            // score变了需要重新排序, 删除之后重新插入
+            if (score != curscore) {
+                o->ptr = zzlDelete(o->ptr, eptr);
+                if (o->ptr == NULL) {
+                    oom("zzlDelete");
+                }
+                o->ptr = zzlInsert(o->ptr, ele, score);
+                if (o->ptr == NULL) {
+                    oom("zzlInsert");
+                }
+            }
+            return 0;
+        }
+
+        o->ptr = zzlInsert(o->ptr, ele, score);
+        if (o->ptr == NULL) {
+            oom("zzlInsert");
+        }
+        if (zsetLength(o) > server.zsetMaxListpackEntries) {
+            zsetConvert(o);
+        }
+        if (newscore != NULL) {
+            *newscore = score;
+        }
+        return 1;
+    }
+
+    Zset *zs = o->ptr;
+    DictEntry *de = dictFind(zs->dict, ele);
+    if (de != NULL) {
+        double curscore = *(double*) dictGetEntryVal(de);
+        if (incr) {
+            score += curscore;
+            if (isnan(score)) {
+                return -1;
+            }
+        }
+        if (newscore != NULL) {
+            *newscore = score;
+        }
+        if (score != curscore) {
+            ZSkiplistNode *node = zslUpdateScore(zs->zsl, curscore, dictGetEntryKey(de), score);
+            if (node == NULL) {
+                oom("zslUpdateScore");
+            }
+            // 节点可能被重新创建了, dict中的key和value都要指向新节点
+            de->key = node->ele;
+            de->val = &node->score;
+        }
+        return 0;
+    }
+
+    ele = sdsdup(ele);
+    ZSkiplistNode *node = zslInsert(zs->zsl, score, ele);
+    if (node == NULL || dictAdd(zs->dict, ele, &node->score) != DICT_OK) {
+        oom("zsetAdd");
+    }
+    if (newscore != NULL) {
+        *newscore = score;
+    }
+    return 1;
+}
+
+/**
+ * @return 1 if deleted
+ */
+static int zsetDel(Robj *o, sds ele) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        double score;
+        unsigned char *eptr = zzlFind(o->ptr, ele, &score);
+        if (eptr == NULL) {
+            return 0;
+        }
+        o->ptr = zzlDelete(o->ptr, eptr);
+        if (o->ptr == NULL) {
+            oom("zzlDelete");
+        }
+        return 1;
+    }
+
+    Zset *zs = o->ptr;
+    DictEntry *de = dictFind(zs->dict, ele);
+    if (de == NULL) {
+        return 0;
+    }
+    double score = *(double*) dictGetEntryVal(de);
+    // 先从dict中删除, 节点里的sds由zslDelete释放
+    dictDelete(zs->dict, ele);
+    zslDelete(zs->zsl, score, ele, NULL);
+    return 1;
+}
+
+/**
+ * @return 0-based的rank, 不存在时返回-1
+ */
+static long zsetRank(Robj *o, sds ele) {
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *lp = o->ptr;
+        long rank = 0;
+        for (unsigned char *eptr = lpFirst(lp); eptr != NULL; eptr = lpNext(lp, lpNext(lp, eptr))) {
+            if (zzlCompareElements(eptr, ele) == 0) {
+                return rank;
+            }
+            rank++;
+        }
+        return -1;
+    }
+
+    Zset *zs = o->ptr;
+    DictEntry *de = dictFind(zs->dict, ele);
+    if (de == NULL) {
+        return -1;
+    }
+    return (long) zslGetRank(zs->zsl, *(double*) dictGetEntryVal(de), ele) - 1;
+}
+
+/**
+ * 解析ZRANGEBYSCORE的min/max, "("开头表示开区间, 支持-inf/+inf
+ */
+static int zslParseRange(Robj *min, Robj *max, ZRangeSpec *spec) {
+    Robj *bounds[2] = {min, max};
+    double *values[2] = {&spec->min, &spec->max};
+    int *exclusive[2] = {&spec->minex, &spec->maxex};
+
+    for (int j = 0; j < 2; j++) {
+        *exclusive[j] = 0;
+        if (bounds[j]->encoding == REDIS_ENCODING_INT) {
+            *values[j] = (long) bounds[j]->ptr;
+            continue;
+        }
+        char *s = bounds[j]->ptr;
+        if (s[0] == '(') {
+            *exclusive[j] = 1;
+            s++;
+        }
+        char *eptr;
+        *values[j] = strtod(s, &eptr);
+        if (s[0] == '\0' || eptr[0] != '\0' || isnan(*values[j])) {
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 查找zset类型的key
+ * @param write 调用者是否会修改这个zset, 见lookupKey
+ * @return 不存在时返回NULL; 类型不对时回复错误并设置*wrongtype
+ */
+static Robj *zsetLookup(RedisClient *c, Robj *key, int write, int *wrongtype) {
+    *wrongtype = 0;
+    DictEntry *de = lookupKey(c->dictid, key, write);
+    if (de == NULL) {
+        return NULL;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_ZSET) {
+        *wrongtype = 1;
+        return NULL;
+    }
+    return o;
+}
+
+/*------------------------------ Snapshot (RDB) -----------------------*/
+
+/**
+ * 文件格式:
+ *   "REDIS0001"
+ *   [REDIS_SELECTDB][len: dbid][REDIS_RESIZEDB][len: key的个数][len: 有过期时间的key的个数]
+ *   [REDIS_EXPIRETIME_MS][8字节小端序的过期时间]? [type][key][value] ...
+ *   [REDIS_EOF]
+ * len的前两个bit表示格式: 00后6bit, 01后14bit, 10后面跟4或8字节大端序, 11表示特殊编码的字符串
+ * 字符串: [len][bytes], 能表示成32位整数的写成[11 + INT8/16/32][整数],
+ *   开启rdbcompression时较长的字符串写成[11 + LZF][len: 压缩后的长度][len: 原来的长度][压缩的数据]
+ * 小对象的listpack/intset直接整块写出, 加载时也整块读回, 不需要逐个元素编码和解码
+ */
+
+/** 超过这个长度的字符串才尝试压缩, 太短的压缩不了多少 */
+#define REDIS_RDB_COMPRESS_MIN_LEN 20
+
+/** 写缓冲, 写满了才调用write */
+#define REDIS_RDB_BUFFER_SIZE (4*1024*1024)
+
+/**
+ * 每写这么多字节fdatasync一次: 脏页平稳地写回磁盘,
+ * 否则几十GB的脏页堆在page cache里, 最后一次fsync会卡很久, 还会挤掉别的进程的page cache
+ */
+#define REDIS_RDB_AUTOSYNC_BYTES (32*1024*1024)
+
+typedef struct RdbWriter {
+    int fd;
+    char *buf;
+    size_t len;
+    long long written; // 已经write的字节数
+    long long synced;  // 已经fdatasync的字节数
+    char *cbuf;        // 压缩用的缓冲, 按需扩大
+    size_t cbuflen;
+    sds mem;           // 不为NULL时追加到这里而不是写fd
+} RdbWriter;
+
+static void rdbTempFileName(char *buf, size_t len, pid_t pid) {
+    snprintf(buf, len, "temp-%d.rdb", (int) pid);
+}
+
+static int rdbWriteFully(RdbWriter *w, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t nwritten = write(w->fd, p, len);
+        if (nwritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return REDIS_ERR;
+        }
+        p += nwritten;
+        len -= nwritten;
+        w->written += nwritten;
+    }
+    if (w->written - w->synced >= REDIS_RDB_AUTOSYNC_BYTES) {
+        if (redisFsync(w->fd) == -1) {
+            return REDIS_ERR;
+        }
+        w->synced = w->written;
+    }
+    return REDIS_OK;
+}
+
+static int rdbFlush(RdbWriter *w) {
+    if (w->len == 0) {
+        return REDIS_OK;
+    }
+    int ret = rdbWriteFully(w, w->buf, w->len);
+    w->len = 0;
+    return ret;
+}
+
+static int rdbWrite(RdbWriter *w, const void *p, size_t len) {
+    if (w->mem != NULL) {
+        sds mem = sdscatlen(w->mem, (void*) p, len);
+        if (mem == NULL) {
+            return REDIS_ERR;
+        }
+        w->mem = mem;
+        return REDIS_OK;
+    }
+    if (w->len + len > REDIS_RDB_BUFFER_SIZE) {
+        if (rdbFlush(w) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        // 大块数据(比如大的字符串)不经过缓冲直接写
+        if (len >= REDIS_RDB_BUFFER_SIZE) {
+            return rdbWriteFully(w, p, len);
+        }
+    }
+    memcpy(w->buf + w->len, p, len);
+    w->len += len;
+    return REDIS_OK;
+}
+
+static int rdbSaveType(RdbWriter *w, unsigned char type) {
+    return rdbWrite(w, &type, 1);
+}
+
+static int rdbSaveLen(RdbWriter *w, uint64_t len) {
+    unsigned char buf[9];
+    size_t n;
+    if (len < (1 << 6)) {
+        buf[0] = (REDIS_RDB_6BITLEN << 6) | len;
+        n = 1;
+    } else if (len < (1 << 14)) {
+        buf[0] = (REDIS_RDB_14BITLEN << 6) | (len >> 8);
+        buf[1] = len & 0xff;
+        n = 2;
+    } else if (len <= UINT32_MAX) {
+        buf[0] = REDIS_RDB_32BITLEN;
+        uint32_t len32 = htonl((uint32_t) len);
+        memcpy(buf + 1, &len32, 4);
+        n = 5;
+    } else {
+        buf[0] = REDIS_RDB_64BITLEN;
+        for (int i = 0; i < 8; i++) {
+            buf[1 + i] = (len >> (56 - 8 * i)) & 0xff;
+        }
+        n = 9;
+    }
+    return rdbWrite(w, buf, n);
+}
+
+static int rdbSaveMillisecondTime(RdbWriter *w, long long t) {
+    unsigned char buf[8];
+    for (int i = 0; i < 8; i++) {
+        buf[i] = ((uint64_t) t >> (8 * i)) & 0xff;
+    }
+    return rdbWrite(w, buf, 8);
+}
+
+/**
+ * 能放进32位的整数写成[11 + INT8/16/32][小端序的整数]
+ * @return 写出的字节数, 0表示放不下
+ */
+static int rdbEncodeInteger(long long value, unsigned char *enc) {
+    if (value >= INT8_MIN && value <= INT8_MAX) {
+        enc[0] = (REDIS_RDB_ENCVAL << 6) | REDIS_RDB_ENC_INT8;
+        enc[1] = value & 0xff;
+        return 2;
+    } else if (value >= INT16_MIN && value <= INT16_MAX) {
+        enc[0] = (REDIS_RDB_ENCVAL << 6) | REDIS_RDB_ENC_INT16;
+        enc[1] = value & 0xff;
+        enc[2] = (value >> 8) & 0xff;
+        return 3;
+    } else if (value >= INT32_MIN && value <= INT32_MAX) {
+        enc[0] = (REDIS_RDB_ENCVAL << 6) | REDIS_RDB_ENC_INT32;
+        enc[1] = value & 0xff;
+        enc[2] = (value >> 8) & 0xff;
+        enc[3] = (value >> 16) & 0xff;
+        enc[4] = (value >> 24) & 0xff;
+        return 5;
+    }
+    return 0;
+}
+
+static int rdbSaveLongLongAsString(RdbWriter *w, long long value) {
+    unsigned char enc[5];
+    int enclen = rdbEncodeInteger(value, enc);
+    if (enclen > 0) {
+        return rdbWrite(w, enc, enclen);
+    }
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), value);
+    if (rdbSaveLen(w, len) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+    return rdbWrite(w, buf, len);
+}
+
+/**
+ * 尝试LZF压缩, 至少要省下4个字节才使用压缩的结果
+ * @return 1表示已经压缩写出, 0表示没有压缩(压缩不了或者内存不够), 调用者按原样写出, -1表示写出错
+ */
+static int rdbSaveLzfString(RdbWriter *w, const void *s, size_t len) {
+    size_t outlen = len - 4;
+    if (w->cbuflen < outlen) {
+        char *cbuf = zrealloc(w->cbuf, outlen);
+        if (cbuf == NULL) {
+            return 0;
+        }
+        w->cbuf = cbuf;
+        w->cbuflen = outlen;
+    }
+    size_t comprlen = lzfCompress(s, len, w->cbuf, outlen);
+    if (comprlen == 0) {
+        return 0;
+    }
+    if (rdbSaveType(w, (REDIS_RDB_ENCVAL << 6) | REDIS_RDB_ENC_LZF) == REDIS_ERR ||
+        rdbSaveLen(w, comprlen) == REDIS_ERR || rdbSaveLen(w, len) == REDIS_ERR ||
+        rdbWrite(w, w->cbuf, comprlen) == REDIS_ERR) {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * 开启rdbcompression时超过REDIS_RDB_COMPRESS_MIN_LEN的字符串先尝试压缩, 压缩不了的原样写出
+ */
+static int rdbSaveBytes(RdbWriter *w, const void *s, size_t len) {
+    if (server.rdbCompression && len > REDIS_RDB_COMPRESS_MIN_LEN) {
+        int ret = rdbSaveLzfString(w, s, len);
+        if (ret != 0) {
+            return ret == 1 ? REDIS_OK : REDIS_ERR;
+        }
+    }
+    if (rdbSaveLen(w, len) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+    return len == 0 ? REDIS_OK : rdbWrite(w, s, len);
+}
+
+static int rdbSaveRawString(RdbWriter *w, const unsigned char *s, size_t len) {
+    // 看起来像整数的短字符串按整数写, 只有转换回去完全一样时才可以
+    long long value;
+    if (len > 0 && len <= 11 && string2ll((const char*) s, len, &value)) {
+        unsigned char enc[5];
+        int enclen = rdbEncodeInteger(value, enc);
+        if (enclen > 0) {
+            return rdbWrite(w, enc, enclen);
+        }
+    }
+    return rdbSaveBytes(w, s, len);
+}
+
+static int rdbSaveStringObject(RdbWriter *w, Robj *o) {
+    if (o->encoding == REDIS_ENCODING_INT) {
+        return rdbSaveLongLongAsString(w, (long) o->ptr);
+    }
+    return rdbSaveRawString(w, o->ptr, sdslen(o->ptr));
+}
+
+/**
+ * listpack/intset这种连续的一块内存, 当作普通的字符串整块写出(也会压缩)
+ */
+static int rdbSaveBlob(RdbWriter *w, const void *p, size_t len) {
+    return rdbSaveBytes(w, p, len);
+}
+
+/**
+ * double按8字节的IEEE 754(小端序)写出, 不需要格式化成字符串
+ */
+static int rdbSaveBinaryDouble(RdbWriter *w, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    unsigned char buf[8];
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (bits >> (8 * i)) & 0xff;
+    }
+    return rdbWrite(w, buf, 8);
+}
+
+static int rdbSaveObjectType(RdbWriter *w, Robj *o) {
+    switch (o->type) {
+        case REDIS_STRING:
+            return rdbSaveType(w, REDIS_RDB_TYPE_STRING);
+        case REDIS_LIST:
+            return rdbSaveType(w, o->encoding == REDIS_ENCODING_LISTPACK ?
+                REDIS_RDB_TYPE_LIST_LISTPACK : REDIS_RDB_TYPE_LIST_QUICKLIST);
+        case REDIS_SET:
+            return rdbSaveType(w, o->encoding == REDIS_ENCODING_INTSET ?
+                REDIS_RDB_TYPE_SET_INTSET : REDIS_RDB_TYPE_SET);
+        case REDIS_HASH:
+            return rdbSaveType(w, o->encoding == REDIS_ENCODING_LISTPACK ?
+                REDIS_RDB_TYPE_HASH_LISTPACK : REDIS_RDB_TYPE_HASH);
+        case REDIS_ZSET:
+            return rdbSaveType(w, o->encoding == REDIS_ENCODING_LISTPACK ?
+                REDIS_RDB_TYPE_ZSET_LISTPACK : REDIS_RDB_TYPE_ZSET);
+        default:
+            return REDIS_ERR;
+    }
+}
+
+static int rdbSaveObject(RdbWriter *w, Robj *o) {
+    if (o->type == REDIS_STRING) {
+        return rdbSaveStringObject(w, o);
+    }
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        return rdbSaveBlob(w, o->ptr, lpBytes(o->ptr));
+    }
+    if (o->encoding == REDIS_ENCODING_INTSET) {
+        return rdbSaveBlob(w, o->ptr, intsetBlobLen(o->ptr));
+    }
+
+    if (o->type == REDIS_LIST) {
+        // quicklist的每个node就是一个listpack
+        Quicklist *ql = o->ptr;
+        if (rdbSaveLen(w, ql->len) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        for (QuicklistNode *node = ql->head; node != NULL; node = node->next) {
+            if (rdbSaveBlob(w, node->entry, node->sz) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+        }
+        return REDIS_OK;
+    }
+
+    if (o->type == REDIS_SET || o->type == REDIS_HASH) {
+        Dict *d = o->ptr;
+        if (rdbSaveLen(w, dictGetHashTableUsed(d)) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        DictIterator *it = dictGetIterator(d);
+        DictEntry *de;
+        int ret = REDIS_OK;
+        while (ret == REDIS_OK && (de = dictNext(it)) != NULL) {
+            ret = rdbSaveStringObject(w, dictGetEntryKey(de));
+            if (ret == REDIS_OK && o->type == REDIS_HASH) {
+                ret = rdbSaveStringObject(w, dictGetEntryVal(de));
+            }
+        }
+        dictReleaseIterator(it);
+        return ret;
+    }
+
+    if (o->type == REDIS_ZSET) {
+        // 从跳表的尾部开始写, 加载时每次都插入在跳表的头部, 不需要查找
+        ZSkiplist *zsl = ((Zset*) o->ptr)->zsl;
+        if (rdbSaveLen(w, zsl->length) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        for (ZSkiplistNode *node = zsl->tail; node != NULL; node = node->backward) {
+            if (rdbSaveRawString(w, (unsigned char*) node->ele, sdslen(node->ele)) == REDIS_ERR ||
+                rdbSaveBinaryDouble(w, node->score) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+        }
+        return REDIS_OK;
+    }
+    return REDIS_ERR;
+}
+
+/**
+ * [过期时间][value的类型][key][value], expire为-1表示不过期
+ */
+static int rdbSaveKeyValuePair(RdbWriter *w, Robj *key, Robj *val, long long expire) {
+    if (expire != -1) {
+        if (rdbSaveType(w, REDIS_EXPIRETIME_MS) == REDIS_ERR || rdbSaveMillisecondTime(w, expire) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+    }
+    if (rdbSaveObjectType(w, val) == REDIS_ERR || rdbSaveStringObject(w, key) == REDIS_ERR ||
+        rdbSaveObject(w, val) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 把所有db写到临时文件, 成功之后rename成filename: rename是原子的, filename要么是旧的快照要么是完整的新快照
+ * 在bgsave的子进程中调用, 也可以由SAVE在主进程中调用
+ */
+static int saveDb(char *filename) {
+    char tmpfile[256];
+    rdbTempFileName(tmpfile, sizeof(tmpfile), getpid());
+    int fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        redisLog(REDIS_WARNING, "Failed saving the DB: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    RdbWriter w = {.fd = fd, .buf = zmalloc(REDIS_RDB_BUFFER_SIZE), .len = 0, .written = 0, .synced = 0, .cbuf = NULL, .cbuflen = 0};
+    if (w.buf == NULL) {
+        close(fd);
+        unlink(tmpfile);
+        redisLog(REDIS_WARNING, "Failed saving the DB: out of memory");
+        return REDIS_ERR;
+    }
+
+    long long now = mstime();
+    if (rdbWrite(&w, REDIS_RDB_SIGNATURE, 9) == REDIS_ERR) {
+        goto werr;
+    }
+    for (int j = 0; j < server.dbnum; j++) {
+        Dict *d = server.dict[j];
+        if (dictGetHashTableUsed(d) == 0) {
+            continue;
+        }
+        if (rdbSaveType(&w, REDIS_SELECTDB) == REDIS_ERR || rdbSaveLen(&w, j) == REDIS_ERR) {
+            goto werr;
+        }
+        if (rdbSaveType(&w, REDIS_RESIZEDB) == REDIS_ERR || rdbSaveLen(&w, dictGetHashTableUsed(d)) == REDIS_ERR ||
+            rdbSaveLen(&w, dictGetHashTableUsed(server.expires[j])) == REDIS_ERR) {
+            goto werr;
+        }
+
+        DictIterator *it = dictGetIterator(d);
+        DictEntry *de;
+        while ((de = dictNext(it)) != NULL) {
+            Robj *key = dictGetEntryKey(de);
+            long long expire = getExpire(j, key);
+            // 已经过期的key不用写
+            if (expire != -1 && expire < now) {
+                continue;
+            }
+            if (rdbSaveKeyValuePair(&w, key, dictGetEntryVal(de), expire) == REDIS_ERR) {
+                dictReleaseIterator(it);
+                goto werr;
+            }
+        }
+        dictReleaseIterator(it);
+    }
+    if (rdbSaveType(&w, REDIS_EOF) == REDIS_ERR || rdbFlush(&w) == REDIS_ERR) {
+        goto werr;
+    }
+
+    // 确保数据落盘之后再rename
+    if (redisFsync(fd) == -1) {
+        goto werr;
+    }
+    if (close(fd) == -1) {
+        // close失败时fd也已经释放了, 不能再close一次
+        fd = -1;
+        goto werr;
+    }
+    fd = -1;
+    zfree(w.buf);
+    zfree(w.cbuf);
+    if (rename(tmpfile, filename) == -1) {
+        redisLog(REDIS_WARNING, "Error moving temp DB file on the final destination: %s", strerror(errno));
+        unlink(tmpfile);
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE, "DB saved on disk");
+    server.dirty = 0;
+    server.lastsave = time(NULL);
+    return REDIS_OK;
+
+werr:
+    redisLog(REDIS_WARNING, "Write error saving DB on disk: %s", strerror(errno));
+    if (fd != -1) {
+        close(fd);
+    }
+    unlink(tmpfile);
+    zfree(w.buf);
+    zfree(w.cbuf);
+    return REDIS_ERR;
+}
+
+/**
+ * snapshot-mode thread: 不fork, 后台线程按bucket遍历keyspace的table写快照
+ * 主线程修改一个key之前, 如果它所在的bucket还没有写过, 先在主线程把整个bucket序列化到pending, 由后台线程按顺序写到文件里;
+ * 相当于把fork的COW从页粒度换成了bucket粒度, "复制"的是序列化之后的字节, 不需要复制对象
+ *
+ * 快照期间keyspace的table不能扩容/缩容(bucket编号不能变), expires的修改要和后台线程的getExpire互斥;
+ * rdb中key的顺序和fork模式不同, 主线程提前写的bucket先出现在文件里, 加载时没有区别
+ */
+#define REDIS_SNAPSHOT_BUCKET_PENDING 0
+#define REDIS_SNAPSHOT_BUCKET_BUSY 1 // 正在被某个线程序列化
+#define REDIS_SNAPSHOT_BUCKET_DONE 2
+#define REDIS_SNAPSHOT_DRAIN_MASK 1023 // 后台线程每1024个bucket把主线程写的pending取走一次
+
+typedef struct SnapshotDb {
+    DictEntry **table;
+    unsigned int size; // 0表示这个db不在快照中
+    unsigned int sizemask;
+    unsigned char *state; // 每个bucket的REDIS_SNAPSHOT_BUCKET_*
+    unsigned int done; // DONE的bucket个数
+    unsigned long keys;
+    unsigned long expires;
+    sds pending; // 主线程序列化好还没有写到文件的数据, pendingLock保护
+    int paused; // 是否暂停了keyspace的resize
+} SnapshotDb;
+
+typedef struct Snapshot {
+    char *filename;
+    char tmpfile[256];
+    pthread_t thread;
+    long long now; // 快照开始的时间, 这之前过期的key不写
+    SnapshotDb *dbs;
+    pthread_mutex_t pendingLock;
+    pthread_mutex_t expiresLock;
+    char *cbuf; // 主线程序列化时压缩用的缓冲
+    size_t cbuflen;
+    int failed; // 主线程序列化时内存不够, 快照作废
+    int finished;
+    int result;
+} Snapshot;
+
+static int snapshotSaveBucket(RdbWriter *w, Snapshot *s, int dbid, DictEntry *de, int lockExpires) {
+    for (; de != NULL; de = de->next) {
+        Robj *key = dictGetEntryKey(de);
+        if (lockExpires) {
+            pthread_mutex_lock(&s->expiresLock);
+        }
+        long long expire = getExpire(dbid, key);
+        if (lockExpires) {
+            pthread_mutex_unlock(&s->expiresLock);
+        }
+        if (expire != -1 && expire < s->now) {
+            continue;
+        }
+        if (rdbSaveKeyValuePair(w, key, dictGetEntryVal(de), expire) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 把主线程序列化好的数据写到文件
+ */
+static int snapshotDrainPending(RdbWriter *w, Snapshot *s, SnapshotDb *sd) {
+    pthread_mutex_lock(&s->pendingLock);
+    sds pending = sd->pending;
+    sd->pending = NULL;
+    pthread_mutex_unlock(&s->pendingLock);
+    if (pending == NULL) {
+        return REDIS_OK;
+    }
+    int ret = rdbWrite(w, pending, sdslen(pending));
+    sdsfree(pending);
+    return ret;
+}
+
+static void *snapshotThreadMain(void *arg) {
+    Snapshot *s = arg;
+    int ok = 0;
+    int fd = open(s->tmpfile, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    RdbWriter w = {.fd = fd, .buf = zmalloc(REDIS_RDB_BUFFER_SIZE)};
+    if (fd == -1 || w.buf == NULL) {
+        goto done;
+    }
+    int err = rdbWrite(&w, REDIS_RDB_SIGNATURE, 9) == REDIS_ERR;
+    for (int j = 0; j < server.dbnum; j++) {
+        SnapshotDb *sd = &s->dbs[j];
+        if (sd->size == 0) {
+            continue;
+        }
+        if (!err && (rdbSaveType(&w, REDIS_SELECTDB) == REDIS_ERR || rdbSaveLen(&w, j) == REDIS_ERR ||
+            rdbSaveType(&w, REDIS_RESIZEDB) == REDIS_ERR || rdbSaveLen(&w, sd->keys) == REDIS_ERR ||
+            rdbSaveLen(&w, sd->expires) == REDIS_ERR)) {
+            err = 1;
+        }
+        // 出错之后也要把每个bucket标成DONE, 否则主线程修改时会一直等
+        for (unsigned int b = 0; b < sd->size; b++) {
+            unsigned char expected = REDIS_SNAPSHOT_BUCKET_PENDING;
+            if (__atomic_compare_exchange_n(&sd->state[b], &expected, REDIS_SNAPSHOT_BUCKET_BUSY, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                if (!err && snapshotSaveBucket(&w, s, j, sd->table[b], 1) == REDIS_ERR) {
+                    err = 1;
+                }
+                __atomic_store_n(&sd->state[b], REDIS_SNAPSHOT_BUCKET_DONE, __ATOMIC_RELEASE);
+                __atomic_add_fetch(&sd->done, 1, __ATOMIC_RELEASE);
+            }
+            if ((b & REDIS_SNAPSHOT_DRAIN_MASK) == 0 && !err && snapshotDrainPending(&w, s, sd) == REDIS_ERR) {
+                err = 1;
+            }
+        }
+        // 主线程可能还在写最后几个bucket
+        while (__atomic_load_n(&sd->done, __ATOMIC_ACQUIRE) != sd->size) {
+            sched_yield();
+        }
+        if (!err && snapshotDrainPending(&w, s, sd) == REDIS_ERR) {
+            err = 1;
+        }
+    }
+    if (err || __atomic_load_n(&s->failed, __ATOMIC_ACQUIRE) || rdbSaveType(&w, REDIS_EOF) == REDIS_ERR || rdbFlush(&w) == REDIS_ERR) {
+        goto done;
+    }
+    // 确保数据落盘之后再rename
+    if (redisFsync(fd) == -1) {
+        goto done;
+    }
+    if (close(fd) == -1) {
+        // close失败时fd也已经释放了, 不能再close一次
+        fd = -1;
+        goto done;
+    }
+    fd = -1;
+    if (rename(s->tmpfile, s->filename) == -1) {
+        goto done;
+    }
+    ok = 1;
+
+done:
+    if (!ok) {
+        redisLog(REDIS_WARNING, "Write error saving DB on disk: %s", strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        unlink(s->tmpfile);
+    }
+    zfree(w.buf);
+    zfree(w.cbuf);
+    s->result = ok ? REDIS_OK : REDIS_ERR;
+    __atomic_store_n(&s->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * 主线程在后台线程之前把bucket序列化到pending; 后台线程正在写这个bucket时等它写完
+ */
+static void snapshotSaveBucketFromMain(Snapshot *s, int dbid, unsigned int b) {
+    SnapshotDb *sd = &s->dbs[dbid];
+    long long start = ustime();
+    unsigned char expected = REDIS_SNAPSHOT_BUCKET_PENDING;
+    if (!__atomic_compare_exchange_n(&sd->state[b], &expected, REDIS_SNAPSHOT_BUCKET_BUSY, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        while (__atomic_load_n(&sd->state[b], __ATOMIC_ACQUIRE) != REDIS_SNAPSHOT_BUCKET_DONE) {
+            sched_yield();
+        }
+    } else {
+        pthread_mutex_lock(&s->pendingLock);
+        RdbWriter w = {.fd = -1, .cbuf = s->cbuf, .cbuflen = s->cbuflen};
+        w.mem = sd->pending != NULL ? sd->pending : sdsempty();
+        // 写了一半的bucket不能留在pending里, 内存不够时整个快照作废
+        if (w.mem == NULL || snapshotSaveBucket(&w, s, dbid, sd->table[b], 0) == REDIS_ERR) {
+            __atomic_store_n(&s->failed, 1, __ATOMIC_RELEASE);
+        } else {
+            sd->pending = w.mem;
+        }
+        s->cbuf = w.cbuf;
+        s->cbuflen = w.cbuflen;
+        pthread_mutex_unlock(&s->pendingLock);
+        __atomic_store_n(&sd->state[b], REDIS_SNAPSHOT_BUCKET_DONE, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&sd->done, 1, __ATOMIC_RELEASE);
+        server.stat_snapshot_main_buckets++;
+    }
+    long long elapsed = ustime() - start;
+    server.stat_snapshot_main_us += elapsed;
+    if (elapsed > server.stat_snapshot_main_max_us) {
+        server.stat_snapshot_main_max_us = elapsed;
+    }
+}
+
+/**
+ * 修改key之前调用(包括新增key, 会插入到同一个bucket), 保证快照中是修改之前的值
+ */
+static void snapshotBeforeWrite(int dbid, Robj *key) {
+    Snapshot *s = server.snapshot;
+    if (s == NULL || s->dbs[dbid].size == 0) {
+        return;
+    }
+    SnapshotDb *sd = &s->dbs[dbid];
+    unsigned int b = keyspaceHash(key) & sd->sizemask;
+    if (__atomic_load_n(&sd->state[b], __ATOMIC_ACQUIRE) != REDIS_SNAPSHOT_BUCKET_DONE) {
+        snapshotSaveBucketFromMain(s, dbid, b);
+    }
+}
+
+/**
+ * FLUSHDB/FLUSHALL之前把剩下的bucket都写掉, 之后table可以被释放或替换
+ */
+static void snapshotBeforeEmptyDb(int dbid) {
+    Snapshot *s = server.snapshot;
+    if (s == NULL || s->dbs[dbid].size == 0) {
+        return;
+    }
+    SnapshotDb *sd = &s->dbs[dbid];
+    for (unsigned int b = 0; b < sd->size; b++) {
+        if (__atomic_load_n(&sd->state[b], __ATOMIC_ACQUIRE) != REDIS_SNAPSHOT_BUCKET_DONE) {
+            snapshotSaveBucketFromMain(s, dbid, b);
+        }
+    }
+    if (sd->paused) {
+        dictResumeResize(server.dict[dbid]);
+        sd->paused = 0;
+    }
+}
+
+static void snapshotLockExpires(void) {
+    if (server.snapshot != NULL) {
+        pthread_mutex_lock(&server.snapshot->expiresLock);
+    }
+}
+
+static void snapshotUnlockExpires(void) {
+    if (server.snapshot != NULL) {
+        pthread_mutex_unlock(&server.snapshot->expiresLock);
+    }
+}
+
+static void snapshotRelease(Snapshot *s) {
+    for (int j = 0; j < server.dbnum; j++) {
+        SnapshotDb *sd = &s->dbs[j];
+        if (sd->paused) {
+            dictResumeResize(server.dict[j]);
+        }
+        zfree(sd->state);
+        if (sd->pending != NULL) {
+            sdsfree(sd->pending);
+        }
+    }
+    pthread_mutex_destroy(&s->pendingLock);
+    pthread_mutex_destroy(&s->expiresLock);
+    zfree(s->cbuf);
+    zfree(s->dbs);
+    zfree(s->filename);
+    zfree(s);
+}
+
+/**
+ * 启动时只记录每个db的table, 不复制任何数据; 快照的内容是这一刻的keyspace
+ */
+static int saveDbThreadBackground(char *filename) {
+    long long start = ustime();
+    Snapshot *s = zmalloc(sizeof(*s));
+    SnapshotDb *dbs = zmalloc(sizeof(SnapshotDb) * server.dbnum);
+    char *fname = zmalloc(strlen(filename) + 1);
+    if (s == NULL || dbs == NULL || fname == NULL) {
+        zfree(s);
+        zfree(dbs);
+        zfree(fname);
+        return REDIS_ERR;
+    }
+    memset(s, 0, sizeof(*s));
+    memset(dbs, 0, sizeof(SnapshotDb) * server.dbnum);
+    memcpy(fname, filename, strlen(filename) + 1);
+    s->filename = fname;
+    s->dbs = dbs;
+    s->now = mstime();
+    rdbTempFileName(s->tmpfile, sizeof(s->tmpfile), getpid());
+    pthread_mutex_init(&s->pendingLock, NULL);
+    pthread_mutex_init(&s->expiresLock, NULL);
+    for (int j = 0; j < server.dbnum; j++) {
+        Dict *d = server.dict[j];
+        if (dictGetHashTableUsed(d) == 0) {
+            continue;
+        }
+        SnapshotDb *sd = &dbs[j];
+        sd->state = zmalloc(d->size);
+        if (sd->state == NULL) {
+            snapshotRelease(s);
+            return REDIS_ERR;
+        }
+        memset(sd->state, REDIS_SNAPSHOT_BUCKET_PENDING, d->size);
+        sd->table = d->table;
+        sd->size = d->size;
+        sd->sizemask = d->sizemask;
+        sd->keys = dictGetHashTableUsed(d);
+        sd->expires = dictGetHashTableUsed(server.expires[j]);
+        dictPauseResize(d);
+        sd->paused = 1;
+    }
+
+    server.snapshot = s;
+    int err = pthread_create(&s->thread, NULL, snapshotThreadMain, s);
+    if (err != 0) {
+        redisLog(REDIS_WARNING, "Can't save in background: pthread_create: %s", strerror(err));
+        server.snapshot = NULL;
+        snapshotRelease(s);
+        return REDIS_ERR;
+    }
+    server.bgsaveInProgress = 1;
+    server.dirtyBeforeBgsave = server.dirty;
+    server.stat_bgsave_start_us = ustime() - start;
+    redisLog(REDIS_NOTICE, "Background saving started by thread");
+    return REDIS_OK;
+}
+
+/**
+ * 在serverCron中检查后台线程是否写完
+ */
+static void waitBgsaveThreadFinish(void) {
+    Snapshot *s = server.snapshot;
+    if (!__atomic_load_n(&s->finished, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_join(s->thread, NULL);
+    if (s->result == REDIS_OK) {
+        redisLog(REDIS_NOTICE, "Background saving terminated with success");
+        // bgsave期间的修改不在快照中
+        server.dirty = server.dirty > server.dirtyBeforeBgsave ? server.dirty - server.dirtyBeforeBgsave : 0;
+        server.lastsave = time(NULL);
+    } else {
+        redisLog(REDIS_WARNING, "Background saving error");
+    }
+    server.snapshot = NULL;
+    snapshotRelease(s);
+    server.bgsaveInProgress = 0;
+}
+
+/**
+ * fork一个子进程写快照, 父进程继续处理请求; 子进程看到的是fork那一刻的内存, 父进程之后的修改通过COW隔离
+ * 子进程结束由serverCron中的waitBgsaveFinish处理; snapshot-mode thread时不fork, 见saveDbThreadBackground
+ */
+static int saveDbBackground(char *filename) {
+    if (server.bgsaveInProgress || hasActiveChildProcess()) {
+        return REDIS_ERR;
+    }
+    if (server.snapshotMode == REDIS_SNAPSHOT_THREAD) {
+        return saveDbThreadBackground(filename);
+    }
+    long long start = ustime();
+    openChildInfoPipe();
+    pid_t childpid = fork();
+    if (childpid == 0) {
+        // 子进程: 不需要监听端口
+        close(server.fd);
+        if (saveDb(filename) == REDIS_OK) {
+            sendChildCowInfo();
+            _exit(0);
+        }
+        _exit(1);
+    }
+    if (childpid == -1) {
+        redisLog(REDIS_WARNING, "Can't save in background: fork: %s", strerror(errno));
+        closeChildInfoPipe();
+        return REDIS_ERR;
+    }
+    server.stat_bgsave_start_us = ustime() - start;
+    redisLog(REDIS_NOTICE, "Background saving started by pid %d", (int) childpid);
+    server.bgsaveInProgress = 1;
+    server.dirtyBeforeBgsave = server.dirty;
+    updateDictResizePolicy();
+    return REDIS_OK;
+}
+
+/**
+ * 加载时整个文件mmap进来, 读就是移动指针, 字符串可以直接指向文件中的数据
+ */
+typedef struct RdbReader {
+    const unsigned char *p;
+    const unsigned char *end;
+} RdbReader;
+
+/**
+ * @return 指向文件中len个字节的指针, 不够len个字节时返回NULL
+ */
+static const unsigned char *rdbReadPtr(RdbReader *r, size_t len) {
+    if ((size_t) (r->end - r->p) < len) {
+        return NULL;
+    }
+    const unsigned char *p = r->p;
+    r->p += len;
+    return p;
+}
+
+static int rdbRead(RdbReader *r, void *dst, size_t len) {
+    const unsigned char *p = rdbReadPtr(r, len);
+    if (p == NULL) {
+        return REDIS_ERR;
+    }
+    memcpy(dst, p, len);
+    return REDIS_OK;
+}
+
+static int rdbLoadType(RdbReader *r) {
+    unsigned char type;
+    if (rdbRead(r, &type, 1) == REDIS_ERR) {
+        return -1;
+    }
+    return type;
+}
+
+/**
+ * @param isencoded 不为NULL时, 遇到特殊编码的字符串设置为1, 返回值是编码类型
+ * @return REDIS_RDB_LENERR on error
+ */
+static uint64_t rdbLoadLen(RdbReader *r, int *isencoded) {
+    unsigned char buf[8];
+    if (isencoded != NULL) {
+        *isencoded = 0;
+    }
+    if (rdbRead(r, buf, 1) == REDIS_ERR) {
+        return REDIS_RDB_LENERR;
+    }
+    int type = (buf[0] & 0xc0) >> 6;
+    if (type == REDIS_RDB_ENCVAL) {
+        if (isencoded != NULL) {
+            *isencoded = 1;
+        }
+        return buf[0] & 0x3f;
+    } else if (type == REDIS_RDB_6BITLEN) {
+        return buf[0] & 0x3f;
+    } else if (type == REDIS_RDB_14BITLEN) {
+        uint64_t hi = buf[0] & 0x3f;
+        if (rdbRead(r, buf, 1) == REDIS_ERR) {
+            return REDIS_RDB_LENERR;
+        }
+        return (hi << 8) | buf[0];
+    } else if (buf[0] == REDIS_RDB_32BITLEN) {
+        uint32_t len32;
+        if (rdbRead(r, &len32, 4) == REDIS_ERR) {
+            return REDIS_RDB_LENERR;
+        }
+        return ntohl(len32);
+    } else if (buf[0] == REDIS_RDB_64BITLEN) {
+        if (rdbRead(r, buf, 8) == REDIS_ERR) {
+            return REDIS_RDB_LENERR;
+        }
+        uint64_t len = 0;
+        for (int i = 0; i < 8; i++) {
+            len = (len << 8) | buf[i];
+        }
+        return len;
+    }
+    return REDIS_RDB_LENERR;
+}
+
+static int rdbLoadMillisecondTime(RdbReader *r, long long *t) {
+    unsigned char buf[8];
+    if (rdbRead(r, buf, 8) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | buf[i];
+    }
+    *t = (long long) v;
+    return REDIS_OK;
+}
+
+static int rdbLoadBinaryDouble(RdbReader *r, double *value) {
+    unsigned char buf[8];
+    if (rdbRead(r, buf, 8) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+    uint64_t bits = 0;
+    for (int i = 7; i >= 0; i--) {
+        bits = (bits << 8) | buf[i];
+    }
+    memcpy(value, &bits, 8);
+    return REDIS_OK;
+}
+
+static int rdbLoadIntegerValue(RdbReader *r, int enctype, long long *value) {
+    unsigned char enc[4];
+    if (enctype == REDIS_RDB_ENC_INT8) {
+        if (rdbRead(r, enc, 1) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        *value = (int8_t) enc[0];
+    } else if (enctype == REDIS_RDB_ENC_INT16) {
+        if (rdbRead(r, enc, 2) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        *value = (int16_t) (enc[0] | (enc[1] << 8));
+    } else if (enctype == REDIS_RDB_ENC_INT32) {
+        if (rdbRead(r, enc, 4) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        *value = (int32_t) ((uint32_t) enc[0] | ((uint32_t) enc[1] << 8) | ((uint32_t) enc[2] << 16) | ((uint32_t) enc[3] << 24));
+    } else {
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 解码线程读出的字符串, 不申请内存, 直接指向文件中的数据或者buf
+ */
+typedef struct RdbString {
+    const char *ptr;
+    size_t len;
+    sds s;        // 超过EMBSTR长度的由解码线程创建好sds, 主线程直接使用
+    char buf[24]; // 整数编码的字符串转换成的十进制
+} RdbString;
+
+/**
+ * 加载时的一个key: 主线程切分出它在文件中的范围, 解码线程把value解码成不需要slab的中间结果,
+ * 最后由主线程创建对象加到db中(slab只能在主线程申请)
+ *
+ * 解码结果val:
+ *   STRING: 不使用val, 结果在str中
+ *   *_LISTPACK/SET_INTSET: zmalloc的listpack/intset
+ *   LIST_QUICKLIST: len个listpack的数组
+ *   SET/HASH: len个RdbString的数组, HASH是field和value交替
+ *   ZSET: 已经建好的ZSkiplist, 主线程只需要建dict
+ */
+typedef struct RdbLoadEntry {
+    const unsigned char *start; // key在文件中的位置
+    const unsigned char *end;   // value结束的位置
+    long long expire;
+    int dbid;
+    int type;
+    RdbString key;
+    RdbString str;
+    void *val;
+    unsigned long len;
+} RdbLoadEntry;
+
+/** 每批最多的key个数和字节数, 字节数限制大的value, 让每批的解码时间差不多 */
+#define REDIS_RDB_LOAD_BATCH_ENTRIES 1024
+#define REDIS_RDB_LOAD_BATCH_BYTES (1024*1024)
+
+/**
+ * 每个解码线程同时有两批: 一批在解码, 一批在等主线程插入
+ */
+#define REDIS_RDB_LOAD_BATCHES_PER_THREAD 2
+
+typedef struct RdbLoadBatch {
+    RdbLoadEntry entries[REDIS_RDB_LOAD_BATCH_ENTRIES];
+    int count;
+    int error; // 由解码线程设置, 主线程在bioWaitPendingJobsOfType之后读取
+} RdbLoadBatch;
+
+/**
+ * 读出LZF压缩的字符串的头部
+ * @param len 原来的长度
+ * @return 压缩的数据, 出错返回NULL
+ */
+static const unsigned char *rdbLoadLzfHeader(RdbReader *r, size_t *comprlen, size_t *len) {
+    uint64_t clen = rdbLoadLen(r, NULL);
+    uint64_t ulen = rdbLoadLen(r, NULL);
+    // LZF一个3字节的引用最多展开成264个字节, 超过这个比例的长度肯定是错的
+    if (clen == REDIS_RDB_LENERR || ulen == REDIS_RDB_LENERR || clen == 0 || ulen / 88 > clen) {
+        return NULL;
+    }
+    *comprlen = clen;
+    *len = ulen;
+    return rdbReadPtr(r, clen);
+}
+
+/**
+ * @return 解压到dst中, 长度必须刚好是len
+ */
+static int rdbLzfDecompress(const unsigned char *p, size_t comprlen, void *dst, size_t len) {
+    return lzfDecompress(p, comprlen, dst, len) == len ? REDIS_OK : REDIS_ERR;
+}
+
+static int rdbDecodeString(RdbReader *r, RdbString *str) {
+    int isencoded;
+    uint64_t len = rdbLoadLen(r, &isencoded);
+    if (len == REDIS_RDB_LENERR) {
+        return REDIS_ERR;
+    }
+    str->s = NULL;
+    if (isencoded && len == REDIS_RDB_ENC_LZF) {
+        size_t comprlen, ulen;
+        const unsigned char *p = rdbLoadLzfHeader(r, &comprlen, &ulen);
+        if (p == NULL || (str->s = sdsnewlen(NULL, ulen)) == NULL) {
+            return REDIS_ERR;
+        }
+        str->ptr = str->s;
+        str->len = ulen;
+        return rdbLzfDecompress(p, comprlen, str->s, ulen);
+    }
+    if (isencoded) {
+        long long value;
+        if (rdbLoadIntegerValue(r, len, &value) == REDIS_ERR) {
+            return REDIS_ERR;
+        }
+        str->len = ll2string(str->buf, sizeof(str->buf), value);
+        str->ptr = str->buf;
+        return REDIS_OK;
+    }
+    const unsigned char *p = rdbReadPtr(r, len);
+    if (p == NULL) {
+        return REDIS_ERR;
+    }
+    str->ptr = (const char*) p;
+    str->len = len;
+    if (len > REDIS_ENCODING_EMBSTR_SIZE_LIMIT) {
+        str->s = sdsnewlen(p, len);
+        if (str->s == NULL) {
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 跳过一个字符串, 只检查长度
+ */
+static int rdbSkipString(RdbReader *r) {
+    int isencoded;
+    uint64_t len = rdbLoadLen(r, &isencoded);
+    if (len == REDIS_RDB_LENERR) {
+        return REDIS_ERR;
+    }
+    if (isencoded && len == REDIS_RDB_ENC_LZF) {
+        size_t comprlen, ulen;
+        return rdbLoadLzfHeader(r, &comprlen, &ulen) == NULL ? REDIS_ERR : REDIS_OK;
+    }
+    if (isencoded) {
+        len = (len == REDIS_RDB_ENC_INT8) ? 1 : (len == REDIS_RDB_ENC_INT16 ? 2 : 4);
+    }
+    return rdbReadPtr(r, len) == NULL ? REDIS_ERR : REDIS_OK;
+}
+
+/**
+ * 主线程切分key用: 只读长度跳过value, 不解码
+ */
+static int rdbSkipObject(RdbReader *r, int rdbtype) {
+    uint64_t len;
+    switch (rdbtype) {
+        case REDIS_RDB_TYPE_STRING:
+        case REDIS_RDB_TYPE_LIST_LISTPACK:
+        case REDIS_RDB_TYPE_SET_INTSET:
+        case REDIS_RDB_TYPE_HASH_LISTPACK:
+        case REDIS_RDB_TYPE_ZSET_LISTPACK:
+            return rdbSkipString(r);
+        case REDIS_RDB_TYPE_LIST_QUICKLIST:
+        case REDIS_RDB_TYPE_SET:
+        case REDIS_RDB_TYPE_HASH:
+        case REDIS_RDB_TYPE_ZSET:
+            if ((len = rdbLoadLen(r, NULL)) == REDIS_RDB_LENERR) {
+                return REDIS_ERR;
+            }
+            if (rdbtype == REDIS_RDB_TYPE_HASH) {
+                if (len > UINT64_MAX / 2) {
+                    return REDIS_ERR;
+                }
+                len *= 2;
+            }
+            while (len--) {
+                if (rdbSkipString(r) == REDIS_ERR) {
+                    return REDIS_ERR;
+                }
+                if (rdbtype == REDIS_RDB_TYPE_ZSET && rdbReadPtr(r, 8) == NULL) {
+                    return REDIS_ERR;
+                }
+            }
+            return REDIS_OK;
+        default:
+            return REDIS_ERR;
+    }
+}
+
+/**
+ * 把整块listpack/intset复制(或者解压)出来, 长度必须和记录的一致
+ * @return zmalloc的内存, 出错返回NULL
+ */
+static unsigned char *rdbDecodeBlob(RdbReader *r, int rdbtype) {
+    int isencoded;
+    size_t len = rdbLoadLen(r, &isencoded);
+    size_t comprlen = 0;
+    const unsigned char *p;
+    if (len == REDIS_RDB_LENERR) {
+        return NULL;
+    }
+    if (isencoded) {
+        p = len == REDIS_RDB_ENC_LZF ? rdbLoadLzfHeader(r, &comprlen, &len) : NULL;
+    } else {
+        p = rdbReadPtr(r, len);
+    }
+    if (p == NULL) {
+        return NULL;
+    }
+    unsigned char *blob = zmalloc(len);
+    if (blob == NULL) {
+        return NULL;
+    }
+    if (isencoded) {
+        if (rdbLzfDecompress(p, comprlen, blob, len) == REDIS_ERR) {
+            zfree(blob);
+            return NULL;
+        }
+    } else {
+        memcpy(blob, p, len);
+    }
+
+    if (rdbtype == REDIS_RDB_TYPE_SET_INTSET) {
+        if (len < sizeof(Intset) || intsetBlobLen((Intset*) blob) != len) {
+            zfree(blob);
+            return NULL;
+        }
+    } else if (len < 7 || lpBytes(blob) != len) {
+        zfree(blob);
+        return NULL;
+    }
+    return blob;
+}
+
+/**
+ * 释放解码结果, 主线程已经使用的部分已经置为NULL
+ */
+static void rdbFreeLoadEntry(RdbLoadEntry *e) {
+    sdsfree(e->key.s);
+    sdsfree(e->str.s);
+    e->key.s = e->str.s = NULL;
+    if (e->val == NULL) {
+        return;
+    }
+    switch (e->type) {
+        case REDIS_RDB_TYPE_LIST_QUICKLIST:
+            for (unsigned long i = 0; i < e->len; i++) {
+                zfree(((unsigned char**) e->val)[i]);
+            }
+            break;
+        case REDIS_RDB_TYPE_SET:
+        case REDIS_RDB_TYPE_HASH:
+            for (unsigned long i = 0; i < e->len; i++) {
+                sdsfree(((RdbString*) e->val)[i].s);
+            }
+            break;
+        case REDIS_RDB_TYPE_ZSET:
+            zslFree(e->val);
+            e->val = NULL;
+            return;
+    }
+    zfree(e->val);
+    e->val = NULL;
+}
+
+/**
+ * 在解码线程执行, 只能用zmalloc, 不能用slab, 也不能访问server
+ */
+static int rdbDecodeLoadEntry(RdbLoadEntry *e) {
+    RdbReader r = {.p = e->start, .end = e->end};
+    if (rdbDecodeString(&r, &e->key) == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+    uint64_t len;
+    switch (e->type) {
+        case REDIS_RDB_TYPE_STRING:
+            return rdbDecodeString(&r, &e->str);
+        case REDIS_RDB_TYPE_LIST_LISTPACK:
+        case REDIS_RDB_TYPE_SET_INTSET:
+        case REDIS_RDB_TYPE_HASH_LISTPACK:
+        case REDIS_RDB_TYPE_ZSET_LISTPACK:
+            e->val = rdbDecodeBlob(&r, e->type);
+            return e->val == NULL ? REDIS_ERR : REDIS_OK;
+        case REDIS_RDB_TYPE_LIST_QUICKLIST: {
+            len = rdbLoadLen(&r, NULL);
+            unsigned char **lps = zmalloc(len * sizeof(*lps));
+            if (lps == NULL) {
+                return REDIS_ERR;
+            }
+            e->val = lps;
+            for (e->len = 0; e->len < len; e->len++) {
+                if ((lps[e->len] = rdbDecodeBlob(&r, REDIS_RDB_TYPE_LIST_LISTPACK)) == NULL) {
+                    return REDIS_ERR;
+                }
+            }
+            return REDIS_OK;
+        }
+        case REDIS_RDB_TYPE_SET:
+        case REDIS_RDB_TYPE_HASH: {
+            len = rdbLoadLen(&r, NULL);
+            if (e->type == REDIS_RDB_TYPE_HASH) {
+                len *= 2;
+            }
+            RdbString *eles = zmalloc(len * sizeof(*eles));
+            if (eles == NULL) {
+                return REDIS_ERR;
+            }
+            e->val = eles;
+            for (e->len = 0; e->len < len; e->len++) {
+                if (rdbDecodeString(&r, &eles[e->len]) == REDIS_ERR) {
+                    return REDIS_ERR;
+                }
+            }
+            return REDIS_OK;
+        }
+        case REDIS_RDB_TYPE_ZSET: {
+            len = rdbLoadLen(&r, NULL);
+            ZSkiplist *zsl = zslCreate();
+            if (zsl == NULL) {
+                return REDIS_ERR;
+            }
+            e->val = zsl;
+            while (len--) {
+                RdbString ele;
+                double score;
+                if (rdbDecodeString(&r, &ele) == REDIS_ERR) {
+                    return REDIS_ERR;
+                }
+                sds s = ele.s != NULL ? ele.s : sdsnewlen(ele.ptr, ele.len);
+                if (s == NULL || rdbLoadBinaryDouble(&r, &score) == REDIS_ERR || isnan(score) ||
+                    zslInsert(zsl, score, s) == NULL) {
+                    sdsfree(s);
+                    return REDIS_ERR;
+                }
+            }
+            return REDIS_OK;
+        }
+        default:
+            return REDIS_ERR;
+    }
+}
+
+/**
+ * 解码线程的任务: 解码一批key, 出错时停止并设置error
+ */
+static void rdbDecodeBatchJob(void *arg1, void *unused) {
+    RdbLoadBatch *batch = arg1;
+    REDIS_NOTUSED(unused);
+    for (int i = 0; i < batch->count; i++) {
+        if (rdbDecodeLoadEntry(&batch->entries[i]) == REDIS_ERR) {
+            batch->error = 1;
+            return;
+        }
+    }
+}
+
+static Robj *rdbCreateStringObject(RdbString *str) {
+    if (str->s != NULL && str->len > REDIS_ENCODING_EMBSTR_SIZE_LIMIT) {
+        Robj *o = createObject(REDIS_STRING, str->s);
+        str->s = NULL;
+        return o;
+    }
+    // 解压出来的短字符串也是sds, 同样创建成EMBSTR
+    Robj *o = createStringObject((char*) str->ptr, str->len);
+    sdsfree(str->s);
+    str->s = NULL;
+    return o;
+}
+
+/**
+ * 在主线程中把解码结果变成对象, 使用过的解码结果置为NULL
+ * @return NULL说明文件有错, 比如集合中有重复的元素
+ */
+static Robj *rdbCreateLoadedObject(RdbLoadEntry *e) {
+    Robj *o;
+    switch (e->type) {
+        case REDIS_RDB_TYPE_STRING:
+            return tryObjectEncoding(rdbCreateStringObject(&e->str));
+        case REDIS_RDB_TYPE_LIST_LISTPACK:
+        case REDIS_RDB_TYPE_HASH_LISTPACK:
+        case REDIS_RDB_TYPE_ZSET_LISTPACK: {
+            int type = e->type == REDIS_RDB_TYPE_LIST_LISTPACK ? REDIS_LIST :
+                (e->type == REDIS_RDB_TYPE_HASH_LISTPACK ? REDIS_HASH : REDIS_ZSET);
+            o = createObject(type, e->val);
+            o->encoding = REDIS_ENCODING_LISTPACK;
+            e->val = NULL;
+            // 按照当前的配置, 太大的转换成普通编码
+            if (type == REDIS_LIST && lpLength(o->ptr) > server.listMaxListpackEntries) {
+                listTypeConvert(o);
+            } else if (type == REDIS_HASH && hashTypeLength(o) > server.hashMaxListpackEntries) {
+                hashTypeConvert(o);
+            } else if (type == REDIS_ZSET && zsetLength(o) > server.zsetMaxListpackEntries) {
+                zsetConvert(o);
+            }
+            return o;
+        }
+        case REDIS_RDB_TYPE_SET_INTSET:
+            o = createObject(REDIS_SET, e->val);
+            o->encoding = REDIS_ENCODING_INTSET;
+            e->val = NULL;
+            if (intsetLen(o->ptr) > server.setMaxIntsetEntries) {
+                setTypeConvert(o);
+            }
+            return o;
+        case REDIS_RDB_TYPE_LIST_QUICKLIST: {
+            unsigned char **lps = e->val;
+            o = createQuicklistObject();
+            for (unsigned long i = 0; i < e->len; i++) {
+                if (!quicklistAppendListpack(o->ptr, lps[i])) {
+                    oom("quicklistAppendListpack");
+                }
+                lps[i] = NULL;
+            }
+            return o;
+        }
+        case REDIS_RDB_TYPE_SET:
+        case REDIS_RDB_TYPE_HASH: {
+            RdbString *eles = e->val;
+            Dict *d;
+            if (e->type == REDIS_RDB_TYPE_SET) {
+                o = createSetObject();
+                d = o->ptr;
+            } else {
+                d = dictCreate(&hashDictType, NULL);
+                if (d == NULL) {
+                    oom("dictCreate");
+                }
+                o = createObject(REDIS_HASH, d);
+                o->encoding = REDIS_ENCODING_HT;
+            }
+            // 元素个数已知, 一次分配好table, 避免加载过程中反复rehash
+            unsigned long size = e->type == REDIS_RDB_TYPE_SET ? e->len : e->len / 2;
+            if (size > DICT_INITIAL_SIZE && dictExpand(d, size) == DICT_ERR) {
+                oom("dictExpand");
+            }
+            // 和SADD/HSET一样保存成sds, setDictType/hashDictType按sds计算hash, 不能是整数编码
+            int step = e->type == REDIS_RDB_TYPE_SET ? 1 : 2;
+            for (unsigned long i = 0; i < e->len; i += step) {
+                Robj *ele = rdbCreateStringObject(&eles[i]);
+                Robj *val = step == 2 ? rdbCreateStringObject(&eles[i + 1]) : NULL;
+                if (dictAdd(d, ele, val) == DICT_ERR) {
+                    decrRefCount(ele);
+                    if (val != NULL) {
+                        decrRefCount(val);
+                    }
+                    decrRefCount(o);
+                    return NULL;
+                }
+            }
+            return o;
+        }
+        case REDIS_RDB_TYPE_ZSET: {
+            Zset *zs = zmalloc(sizeof(*zs));
+            if (zs == NULL) {
+                oom("createZsetObject");
+            }
+            zs->zsl = e->val;
+            zs->dict = dictCreate(&zsetDictType, NULL);
+            if (zs->dict == NULL) {
+                oom("createZsetObject");
+            }
+            e->val = NULL;
+            o = createObject(REDIS_ZSET, zs);
+            o->encoding = REDIS_ENCODING_SKIPLIST;
+            if (zs->zsl->length > DICT_INITIAL_SIZE && dictExpand(zs->dict, zs->zsl->length) == DICT_ERR) {
+                oom("dictExpand");
+            }
+            for (ZSkiplistNode *node = zs->zsl->header->level[0].forward; node != NULL; node = node->level[0].forward) {
+                if (dictAdd(zs->dict, node->ele, &node->score) == DICT_ERR) {
+                    decrRefCount(o);
+                    return NULL;
+                }
+            }
+            return o;
+        }
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * 把解码好的一批key加到db中
+ */
+static int rdbInsertLoadBatch(RdbLoadBatch *batch) {
+    if (batch->error) {
+        return REDIS_ERR;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        RdbLoadEntry *e = &batch->entries[i];
+        Robj *val = rdbCreateLoadedObject(e);
+        if (val == NULL) {
+            return REDIS_ERR;
+        }
+        Robj *key = rdbCreateStringObject(&e->key);
+        if (keyspaceDictAdd(server.dict[e->dbid], key, val) == DICT_ERR) {
+            redisLog(REDIS_WARNING, "Loading DB, duplicated key found!");
+            decrRefCount(key);
+            decrRefCount(val);
+            return REDIS_ERR;
+        }
+        if (e->expire != -1) {
+            setExpire(e->dbid, key, e->expire);
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 加载时使用的解码线程数: 主线程自己占一个CPU, 只有一个CPU时在主线程中解码, 线程切换只会更慢
+ */
+static int rdbLoadDecodeThreads(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu - 1 < BIO_RDB_DECODE_THREADS) {
+        return ncpu > 1 ? ncpu - 1 : 0;
+    }
+    return BIO_RDB_DECODE_THREADS;
+}
+
+/**
+ * 启动时加载快照, 文件不存在时什么都不加载返回REDIS_OK
+ * @return REDIS_ERR 文件损坏或者内存不足, db中可能只加载了一部分, 调用者需要退出
+ *
+ * 文件整个mmap进来顺序读; 主线程只读长度切分出每个key的范围, 分批交给解码线程,
+ * 解码线程申请value需要的内存、建跳表, 主线程同时创建对象插入前面已经解码好的批次
+ * 已经过期的key在切分时直接跳过
+ */
+static int loadDb(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return REDIS_OK;
+        }
+        redisLog(REDIS_WARNING, "Can't open the DB file: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || sb.st_size < 9) {
+        close(fd);
+        redisLog(REDIS_WARNING, "Wrong signature trying to load DB from file");
+        return REDIS_ERR;
+    }
+    void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        redisLog(REDIS_WARNING, "Can't mmap the DB file: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+    RdbReader r = {.p = map, .end = (unsigned char*) map + sb.st_size};
+
+    int threads = rdbLoadDecodeThreads();
+    int nbatches = threads > 0 ? threads * REDIS_RDB_LOAD_BATCHES_PER_THREAD : 1;
+    RdbLoadBatch *batches = zmalloc(sizeof(RdbLoadBatch) * nbatches);
+    if (batches == NULL) {
+        munmap(map, sb.st_size);
+        return REDIS_ERR;
+    }
+    long submitted = 0; // 已经提交的批数
+    long inserted = 0;  // 已经插入的批数
+    int ret = REDIS_ERR;
+
+    if (memcmp(rdbReadPtr(&r, 9), REDIS_RDB_SIGNATURE, 9) != 0) {
+        redisLog(REDIS_WARNING, "Wrong signature trying to load DB from file");
+        goto cleanup;
+    }
+
+    long long now = mstime();
+    int dbid = 0;
+    long long expire = -1;
+    int eof = 0;
+    while (!eof) {
+        RdbLoadBatch *batch = &batches[submitted % nbatches];
+        int thread = threads > 0 ? submitted % threads : 0;
+        // 这个位置上的批次还没有插入: 等对应的线程解码完成(同一个线程按提交顺序执行)
+        if (submitted - inserted == nbatches) {
+            if (threads > 0) {
+                bioWaitPendingJobsOfType(BIO_RDB_DECODE + thread, 1);
+            }
+            if (rdbInsertLoadBatch(batch) == REDIS_ERR) {
+                goto eoferr;
+            }
+            inserted++;
+            for (int i = 0; i < batch->count; i++) {
+                rdbFreeLoadEntry(&batch->entries[i]);
+            }
+        }
+        batch->count = 0;
+        batch->error = 0;
+
+        size_t bytes = 0;
+        while (batch->count < REDIS_RDB_LOAD_BATCH_ENTRIES && bytes < REDIS_RDB_LOAD_BATCH_BYTES) {
+            int type = rdbLoadType(&r);
+            if (type == -1) {
+                goto eoferr;
+            }
+            if (type == REDIS_EOF) {
+                eof = 1;
+                break;
+            }
+            if (type == REDIS_SELECTDB) {
+                uint64_t id = rdbLoadLen(&r, NULL);
+                if (id == REDIS_RDB_LENERR) {
+                    goto eoferr;
+                }
+                if (id >= (uint64_t) server.dbnum) {
+                    redisLog(REDIS_WARNING, "FATAL: Data file was created with a Redis server compiled to handle more than %d databases.", server.dbnum);
+                    goto cleanup;
+                }
+                dbid = id;
+                continue;
+            }
+            if (type == REDIS_RESIZEDB) {
+                // key的个数已知, 一次分配好table, 加载过程中不需要rehash
+                uint64_t dbsize = rdbLoadLen(&r, NULL);
+                uint64_t expiresize = rdbLoadLen(&r, NULL);
+                if (dbsize == REDIS_RDB_LENERR || expiresize == REDIS_RDB_LENERR) {
+                    goto eoferr;
+                }
+                Dict *d = server.dict[dbid];
+                if (dbsize > dictGetHashTableSize(d) && dbsize <= UINT_MAX) {
+                    dictExpand(d, dictGetHashTableUsed(d) + dbsize);
+                }
+                d = server.expires[dbid];
+                if (expiresize > dictGetHashTableSize(d) && expiresize <= UINT_MAX) {
+                    dictExpand(d, dictGetHashTableUsed(d) + expiresize);
+                }
+                continue;
+            }
+            if (type == REDIS_EXPIRETIME_MS) {
+                if (rdbLoadMillisecondTime(&r, &expire) == REDIS_ERR) {
+                    goto eoferr;
+                }
+                continue;
+            }
+
+            const unsigned char *start = r.p;
+            if (rdbSkipString(&r) == REDIS_ERR || rdbSkipObject(&r, type) == REDIS_ERR) {
+                goto eoferr;
+            }
+            if (expire == -1 || expire >= now) {
+                RdbLoadEntry *e = &batch->entries[batch->count++];
+                memset(e, 0, sizeof(*e));
+                e->start = start;
+                e->end = r.p;
+                e->expire = expire;
+                e->dbid = dbid;
+                e->type = type;
+                bytes += r.p - start;
+            }
+            expire = -1;
+        }
+        if (threads > 0) {
+            bioSubmitJob(BIO_RDB_DECODE + thread, rdbDecodeBatchJob, batch, NULL);
+        } else {
+            rdbDecodeBatchJob(batch, NULL);
+        }
+        submitted++;
+    }
+
+    // 插入剩下的批次
+    for (int j = 0; j < threads; j++) {
+        bioWaitPendingJobsOfType(BIO_RDB_DECODE + j, 0);
+    }
+    while (inserted < submitted) {
+        RdbLoadBatch *batch = &batches[inserted % nbatches];
+        if (rdbInsertLoadBatch(batch) == REDIS_ERR) {
+            goto eoferr;
+        }
+        inserted++;
+        for (int i = 0; i < batch->count; i++) {
+            rdbFreeLoadEntry(&batch->entries[i]);
+        }
+    }
+    ret = REDIS_OK;
+    goto cleanup;
+
+eoferr:
+    redisLog(REDIS_WARNING, "Short read or OOM loading DB. Unrecoverable error.");
+cleanup:
+    // 出错时还有批次可能在解码, 等它们结束之后才能释放
+    for (int j = 0; j < threads; j++) {
+        bioWaitPendingJobsOfType(BIO_RDB_DECODE + j, 0);
+    }
+    for (long k = inserted; k < submitted; k++) {
+        RdbLoadBatch *batch = &batches[k % nbatches];
+        for (int i = 0; i < batch->count; i++) {
+            rdbFreeLoadEntry(&batch->entries[i]);
+        }
+    }
+    zfree(batches);
+    munmap(map, sb.st_size);
+    return ret;
+}
+
+/*------------------------------ Append only file (AOF) ---------------*/
+
+/**
+ * 文件格式: 一条命令就是 *<参数个数>\r\n 加上每个参数的 $<长度>\r\n<内容>\r\n, 参数可以包含任意字节
+ * 写命令执行之后先追加到aofBuf, 同一轮事件循环中的命令在beforeSleep中一次write(group commit),
+ * 回复要到下一轮才发出去, 所以client收到回复时命令已经写进了AOF
+ */
+
+static sds catAppendOnlyBulk(sds buf, const char *p, size_t len) {
+    char hdr[32];
+    hdr[0] = '$';
+    int n = 1 + ll2string(hdr + 1, sizeof(hdr) - 1, len);
+    hdr[n++] = '\r';
+    hdr[n++] = '\n';
+    buf = sdscatlen(buf, hdr, n);
+    buf = sdscatlen(buf, (void*) p, len);
+    return sdscatlen(buf, "\r\n", 2);
+}
+
+static sds catAppendOnlyObject(sds buf, Robj *o) {
+    if (o->encoding == REDIS_ENCODING_INT) {
+        char num[32];
+        int len = ll2string(num, sizeof(num), (long) o->ptr);
+        return catAppendOnlyBulk(buf, num, len);
+    }
+    return catAppendOnlyBulk(buf, o->ptr, sdslen(o->ptr));
+}
+
+static sds catAppendOnlyGenericCommand(sds buf, int argc, Robj **argv) {
+    char hdr[32];
+    hdr[0] = '*';
+    int n = 1 + ll2string(hdr + 1, sizeof(hdr) - 1, argc);
+    hdr[n++] = '\r';
+    hdr[n++] = '\n';
+    buf = sdscatlen(buf, hdr, n);
+    for (int j = 0; j < argc; j++) {
+        buf = catAppendOnlyObject(buf, argv[j]);
+    }
+    return buf;
+}
+
+/**
+ * 命令执行之后key的过期时间写成PEXPIREAT, 过期时间已经过去被删掉的写成DEL
+ */
+static sds catAppendOnlyExpireAt(sds buf, int dictid, Robj *key) {
+    long long when = getExpire(dictid, key);
+    if (when == -1) {
+        buf = sdscatlen(buf, "*2\r\n$3\r\nDEL\r\n", 13);
+        return catAppendOnlyObject(buf, key);
+    }
+    char num[32];
+    int len = ll2string(num, sizeof(num), when);
+    buf = sdscatlen(buf, "*3\r\n$9\r\nPEXPIREAT\r\n", 19);
+    buf = catAppendOnlyObject(buf, key);
+    return catAppendOnlyBulk(buf, num, len);
+}
+
+/**
+ * 修改了数据的命令执行之后调用, 追加到aofBuf
+ * 相对的过期时间转换成绝对时间, 否则重放的时候过期时间会从重启时重新算起
+ */
+static void feedAppendOnlyFile(struct RedisCommand *cmd, int dictid, Robj **argv, int argc) {
+    sds buf = server.aofBuf;
+    size_t start = sdslen(buf);
+    if (dictid != server.aofSelectedDb) {
+        char seldb[32];
+        int len = ll2string(seldb, sizeof(seldb), dictid);
+        buf = sdscatlen(buf, "*2\r\n$6\r\nSELECT\r\n", 16);
+        buf = catAppendOnlyBulk(buf, seldb, len);
+        server.aofSelectedDb = dictid;
+    }
+
+    if (cmd->proc == expireCommand || cmd->proc == pexpireCommand || cmd->proc == pexpireatCommand) {
+        buf = catAppendOnlyExpireAt(buf, dictid, argv[1]);
+    } else if (cmd->proc == setCommand && argc > 3) {
+        // 带NX/EX/PX的SET执行成功之后就相当于普通的SET, 过期时间另外写
+        buf = catAppendOnlyGenericCommand(buf, 3, argv);
+        if (getExpire(dictid, argv[1]) != -1) {
+            buf = catAppendOnlyExpireAt(buf, dictid, argv[1]);
+        }
+    } else {
+        buf = catAppendOnlyGenericCommand(buf, argc, argv);
+    }
+    server.aofBuf = buf;
+
+    // rewrite期间的命令另外留一份, 发给子进程或者在rewrite结束时追加到新文件
+    if (server.aofChildPid != -1) {
+        server.aofRewriteBuf = sdscatlen(server.aofRewriteBuf, buf + start, sdslen(buf) - start);
+    }
+}
+
+/**
+ * 不是由命令直接删除的key(maxmemory淘汰、过期)重放命令时得不到, 要单独写一条DEL
+ */
+static void propagateDeletion(int dbid, Robj *key) {
+    Robj *argv[2] = {shared.del, key};
+    struct RedisCommand *cmd = lookupCommand("del");
+    if (server.appendonly) {
+        feedAppendOnlyFile(cmd, dbid, argv, 2);
+    }
+    if (listLength(server.slaves) > 0) {
+        replicationFeedSlaves(cmd, dbid, argv, 2);
+    }
+}
+
+static void aofFsyncJob(void *arg1, void *arg2) {
+    REDIS_NOTUSED(arg2);
+    int fd = (int) (intptr_t) arg1;
+    if (redisFsync(fd) == -1) {
+        redisLog(REDIS_WARNING, "Error syncing the AOF file in the background: %s", strerror(errno));
+    }
+}
+
+/**
+ * everysec: 上一次fsync之后有新写入并且过了1秒, 交给后台线程fsync
+ * 上一次的还没有结束时不再提交, 不会在队列里堆积
+ */
+static void aofBackgroundFsyncIfNeeded(time_t now) {
+    if (server.aofFsyncSize == server.aofCurrentSize || now - server.aofLastFsync < 1) {
+        return;
+    }
+    if (bioPendingJobsOfType(BIO_AOF_FSYNC) != 0) {
+        return;
+    }
+    bioSubmitJob(BIO_AOF_FSYNC, aofFsyncJob, (void*) (intptr_t) server.aofFd, NULL);
+    server.aofFsyncSize = server.aofCurrentSize;
+    server.aofLastFsync = now;
+}
+
+static ssize_t aofWrite(int fd, const char *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t nwritten = write(fd, buf + total, len - total);
+        if (nwritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return total > 0 ? (ssize_t) total : -1;
+        }
+        total += nwritten;
+    }
+    return total;
+}
+
+/**
+ * 把aofBuf写到文件, 每次事件循环进入等待之前调用
+ * everysec时如果后台的fsync还没有结束, 同一个文件的write可能会被它阻塞住, 所以先攒着,
+ * 最多推迟REDIS_AOF_MAX_POSTPONE秒; force为1时不推迟(比如shutdown之前)
+ */
+static void flushAppendOnlyFile(int force) {
+    if (server.aofFd == -1) {
+        return;
+    }
+    time_t now = time(NULL);
+    size_t len = sdslen(server.aofBuf);
+    if (len == 0) {
+        // 没有新的命令, 但是之前写的可能还没有fsync
+        if (server.appendfsync == REDIS_AOF_FSYNC_EVERYSEC) {
+            aofBackgroundFsyncIfNeeded(now);
+        }
+        return;
+    }
+
+    if (server.appendfsync == REDIS_AOF_FSYNC_EVERYSEC && !force && bioPendingJobsOfType(BIO_AOF_FSYNC) != 0) {
+        if (server.aofFlushPostponedStart == 0) {
+            server.aofFlushPostponedStart = now;
+            return;
+        } else if (now - server.aofFlushPostponedStart < REDIS_AOF_MAX_POSTPONE) {
+            return;
+        }
+        server.stat_aof_delayed_fsync++;
+        redisLog(REDIS_NOTICE, "Asynchronous AOF fsync is taking too long (disk is busy?). "
+            "Writing the AOF buffer without waiting for fsync to complete.");
+    }
+    server.aofFlushPostponedStart = 0;
+
+    ssize_t nwritten = aofWrite(server.aofFd, server.aofBuf, len);
+    if (nwritten != (ssize_t) len) {
+        if (nwritten == -1) {
+            redisLog(REDIS_WARNING, "Error writing to the AOF file: %s", strerror(errno));
+        } else {
+            redisLog(REDIS_WARNING, "Short write while writing to the AOF file (written %zd of %zu bytes)", nwritten, len);
+            // 写了一半的命令去掉, 下次整条重写; 去不掉的话写进去的部分就算写成功了
+            if (ftruncate(server.aofFd, server.aofCurrentSize) == -1) {
+                server.aofCurrentSize += nwritten;
+                sdsrange(server.aofBuf, nwritten, -1);
+            }
+        }
+        if (server.appendfsync == REDIS_AOF_FSYNC_ALWAYS) {
+            // 已经执行的命令没法保证落盘, 不能再回复client
+            redisLog(REDIS_WARNING, "Can't recover from AOF write error when the AOF fsync policy is 'always'. Exiting...");
+            exit(1);
+        }
+        // 留在aofBuf中下一轮重试
+        return;
+    }
+    server.aofCurrentSize += nwritten;
+
+    // 常见大小的buffer留着下次用, 偶尔一次很大的写入之后释放掉
+    if (sdsalloc(server.aofBuf) <= REDIS_AOF_BUF_REUSE_MAX) {
+        sdssetlen(server.aofBuf, 0);
+        server.aofBuf[0] = '\0';
+    } else {
+        sdsfree(server.aofBuf);
+        server.aofBuf = sdsempty();
+    }
+
+    if (server.appendfsync == REDIS_AOF_FSYNC_ALWAYS) {
+        if (redisFsync(server.aofFd) == -1) {
+            redisLog(REDIS_WARNING, "Can't persist AOF for fsync error when the AOF fsync policy is 'always': %s. Exiting...",
+                strerror(errno));
+            exit(1);
+        }
+        server.aofFsyncSize = server.aofCurrentSize;
+        server.aofLastFsync = now;
+    } else if (server.appendfsync == REDIS_AOF_FSYNC_EVERYSEC) {
+        aofBackgroundFsyncIfNeeded(now);
+    }
+}
+
+/**
+ * AOF rewrite: 子进程按照fork那一刻的数据每个key写最少的命令, 父进程把rewrite期间的写命令(diff)
+ * 一边执行一边通过pipe发给子进程; 子进程写完数据之后和父进程握手, 父进程停止发送, 子进程把收到的diff
+ * 写到文件末尾。父进程在子进程结束之后只需要追加握手之后的少量命令, 再rename替换旧文件
+ */
+
+static void aofRewriteTempFileName(char *buf, size_t len, pid_t pid) {
+    snprintf(buf, len, "temp-rewriteaof-bg-%d.aof", (int) pid);
+}
+
+/**
+ * 一个key的元素攒成一条命令, RPUSH/SADD一条最多REDIS_AOF_REWRITE_ITEMS_PER_CMD个元素;
+ * HSET/ZADD只接受一个field/member, 每条命令一对参数
+ */
+typedef struct AofRewriteCmd {
+    const char *name;
+    Robj *key;
+    int maxargs; // key后面的参数个数上限
+    int argc;
+    sds args; // 已经编码好的参数
+} AofRewriteCmd;
+
+static int aofRewriteFlushCmd(RdbWriter *w, AofRewriteCmd *rc) {
+    if (rc->argc == 0) {
+        return REDIS_OK;
+    }
+    char hdr[32];
+    hdr[0] = '*';
+    int n = 1 + ll2string(hdr + 1, sizeof(hdr) - 1, rc->argc + 2);
+    hdr[n++] = '\r';
+    hdr[n++] = '\n';
+    sds buf = catAppendOnlyBulk(sdsnewlen(hdr, n), rc->name, strlen(rc->name));
+    buf = catAppendOnlyObject(buf, rc->key);
+    int ret = rdbWrite(w, buf, sdslen(buf));
+    if (ret == REDIS_OK) {
+        ret = rdbWrite(w, rc->args, sdslen(rc->args));
+    }
+    sdsfree(buf);
+    sdssetlen(rc->args, 0);
+    rc->args[0] = '\0';
+    rc->argc = 0;
+    return ret;
+}
+
+static int aofRewriteAddArg(RdbWriter *w, AofRewriteCmd *rc, const char *p, size_t len) {
+    rc->args = catAppendOnlyBulk(rc->args, p, len);
+    if (++rc->argc >= rc->maxargs) {
+        return aofRewriteFlushCmd(w, rc);
+    }
+    return REDIS_OK;
+}
+
+static int aofRewriteAddObject(RdbWriter *w, AofRewriteCmd *rc, Robj *o) {
+    if (o->encoding == REDIS_ENCODING_INT) {
+        char num[32];
+        int len = ll2string(num, sizeof(num), (long) o->ptr);
+        return aofRewriteAddArg(w, rc, num, len);
+    }
+    return aofRewriteAddArg(w, rc, o->ptr, sdslen(o->ptr));
+}
+
+/**
+ * 依次把listpack中的元素加到命令中; swap为1时每两个元素交换顺序(zset的listpack是member在前, ZADD是score在前)
+ */
+static int aofRewriteAddListpack(RdbWriter *w, AofRewriteCmd *rc, unsigned char *lp, int swap) {
+    unsigned char buf[2][LP_INTBUF_SIZE];
+    unsigned char *ele[2];
+    int64_t len[2];
+    int k = 0;
+    for (unsigned char *p = lpFirst(lp); p != NULL; p = lpNext(lp, p)) {
+        if (!swap) {
+            ele[0] = lpGet(p, &len[0], buf[0]);
+            if (aofRewriteAddArg(w, rc, (char*) ele[0], len[0]) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+            continue;
+        }
+        ele[k] = lpGet(p, &len[k], buf[k]);
+        if (++k == 2) {
+            if (aofRewriteAddArg(w, rc, (char*) ele[1], len[1]) == REDIS_ERR ||
+                aofRewriteAddArg(w, rc, (char*) ele[0], len[0]) == REDIS_ERR) {
+                return REDIS_ERR;
+            }
+            k = 0;
+        }
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 写出重建key需要的命令
+ */
+static int aofRewriteObject(RdbWriter *w, Robj *key, Robj *o) {
+    if (o->type == REDIS_STRING) {
+        sds buf = sdsnewlen("*3\r\n$3\r\nSET\r\n", 13);
+        buf = catAppendOnlyObject(buf, key);
+        buf = catAppendOnlyObject(buf, o);
+        int ret = rdbWrite(w, buf, sdslen(buf));
+        sdsfree(buf);
+        return ret;
+    }
+
+    AofRewriteCmd rc = {.key = key, .argc = 0, .args = sdsempty()};
+    int ret = REDIS_OK;
+    if (o->type == REDIS_LIST) {
+        rc.name = "RPUSH";
+        rc.maxargs = REDIS_AOF_REWRITE_ITEMS_PER_CMD;
+        if (o->encoding == REDIS_ENCODING_LISTPACK) {
+            ret = aofRewriteAddListpack(w, &rc, o->ptr, 0);
+        } else {
+            Quicklist *ql = o->ptr;
+            for (QuicklistNode *node = ql->head; ret == REDIS_OK && node != NULL; node = node->next) {
+                ret = aofRewriteAddListpack(w, &rc, node->entry, 0);
+            }
+        }
+    } else if (o->type == REDIS_SET) {
+        rc.name = "SADD";
+        rc.maxargs = REDIS_AOF_REWRITE_ITEMS_PER_CMD;
+        if (o->encoding == REDIS_ENCODING_INTSET) {
+            int64_t ll;
+            for (uint32_t j = 0; ret == REDIS_OK && intsetGet(o->ptr, j, &ll); j++) {
+                char num[32];
+                int len = ll2string(num, sizeof(num), ll);
+                ret = aofRewriteAddArg(w, &rc, num, len);
+            }
+        } else {
+            DictIterator *it = dictGetIterator(o->ptr);
+            DictEntry *de;
+            while (ret == REDIS_OK && (de = dictNext(it)) != NULL) {
+                ret = aofRewriteAddObject(w, &rc, dictGetEntryKey(de));
+            }
+            dictReleaseIterator(it);
+        }
+    } else if (o->type == REDIS_HASH) {
+        rc.name = "HSET";
+        rc.maxargs = 2;
+        if (o->encoding == REDIS_ENCODING_LISTPACK) {
+            ret = aofRewriteAddListpack(w, &rc, o->ptr, 0);
+        } else {
+            DictIterator *it = dictGetIterator(o->ptr);
+            DictEntry *de;
+            while (ret == REDIS_OK && (de = dictNext(it)) != NULL) {
+                ret = aofRewriteAddObject(w, &rc, dictGetEntryKey(de));
+                if (ret == REDIS_OK) {
+                    ret = aofRewriteAddObject(w, &rc, dictGetEntryVal(de));
+                }
+            }
+            dictReleaseIterator(it);
+        }
+    } else if (o->type == REDIS_ZSET) {
+        rc.name = "ZADD";
+        rc.maxargs = 2;
+        if (o->encoding == REDIS_ENCODING_LISTPACK) {
+            ret = aofRewriteAddListpack(w, &rc, o->ptr, 1);
+        } else {
+            ZSkiplist *zsl = ((Zset*) o->ptr)->zsl;
+            for (ZSkiplistNode *node = zsl->header->level[0].forward; ret == REDIS_OK && node != NULL;
+                 node = node->level[0].forward) {
+                char score[128];
+                int len = d2string(score, sizeof(score), node->score);
+                ret = aofRewriteAddArg(w, &rc, score, len);
+                if (ret == REDIS_OK) {
+                    ret = aofRewriteAddArg(w, &rc, node->ele, sdslen(node->ele));
+                }
+            }
+        }
+    } else {
+        ret = REDIS_ERR;
+    }
+    if (ret == REDIS_OK) {
+        ret = aofRewriteFlushCmd(w, &rc);
+    }
+    sdsfree(rc.args);
+    return ret;
+}
+
+/**
+ * 子进程: 读出父进程已经发过来的diff, pipe是非阻塞的
+ */
+static void aofReadDiffFromParent(sds *diff) {
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(server.aofPipeToChild[0], buf, sizeof(buf))) > 0) {
+        *diff = sdscatlen(*diff, buf, n);
+    }
+}
+
+/**
+ * 在子进程中调用, 写到filename(临时文件), 父进程在子进程结束之后rename
+ */
+static int rewriteAppendOnlyFile(char *filename) {
+    int fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        redisLog(REDIS_WARNING, "Opening the temp file for AOF rewrite failed: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+    RdbWriter w = {.fd = fd, .buf = zmalloc(REDIS_RDB_BUFFER_SIZE), .len = 0, .written = 0, .synced = 0, .cbuf = NULL, .cbuflen = 0};
+    sds diff = sdsempty();
+    sds buf = sdsempty();
+    if (w.buf == NULL) {
+        goto werr;
+    }
+
+    long long now = mstime();
+    long long keys = 0;
+    for (int j = 0; j < server.dbnum; j++) {
+        Dict *d = server.dict[j];
+        if (dictGetHashTableUsed(d) == 0) {
+            continue;
+        }
+        char seldb[32];
+        int len = ll2string(seldb, sizeof(seldb), j);
+        sdssetlen(buf, 0);
+        buf = sdscatlen(buf, "*2\r\n$6\r\nSELECT\r\n", 16);
+        buf = catAppendOnlyBulk(buf, seldb, len);
+        if (rdbWrite(&w, buf, sdslen(buf)) == REDIS_ERR) {
+            goto werr;
+        }
+
+        DictIterator *it = dictGetIterator(d);
+        DictEntry *de;
+        while ((de = dictNext(it)) != NULL) {
+            Robj *key = dictGetEntryKey(de);
+            long long expire = getExpire(j, key);
+            // 已经过期的key不用写
+            if (expire != -1 && expire < now) {
+                continue;
+            }
+            if (aofRewriteObject(&w, key, dictGetEntryVal(de)) == REDIS_ERR) {
+                dictReleaseIterator(it);
+                goto werr;
+            }
+            if (expire != -1) {
+                sdssetlen(buf, 0);
+                buf = catAppendOnlyExpireAt(buf, j, key);
+                if (rdbWrite(&w, buf, sdslen(buf)) == REDIS_ERR) {
+                    dictReleaseIterator(it);
+                    goto werr;
+                }
+            }
+            // 边写边读, pipe不会写满, 父进程也不用在自己的内存里攒着
+            if (++keys % REDIS_AOF_REWRITE_DIFF_KEYS == 0) {
+                aofReadDiffFromParent(&diff);
+            }
+        }
+        dictReleaseIterator(it);
+    }
+    // 数据部分先落盘, 最后握手之后只需要fsync少量的diff
+    if (rdbFlush(&w) == REDIS_ERR || redisFsync(fd) == -1) {
+        goto werr;
+    }
+
+    // 父进程还在不断地发送diff, 再读一会儿: 连续20ms没有新数据或者最多1秒
+    long long start = mstime();
+    int nodata = 0;
+    while (mstime() - start < 1000 && nodata < 20) {
+        if (aeWait(server.aofPipeToChild[0], AE_READBLE, 1) <= 0) {
+            nodata++;
+            continue;
+        }
+        nodata = 0;
+        aofReadDiffFromParent(&diff);
+    }
+
+    // 请父进程停止发送, 收到确认之后pipe中剩下的就是全部的diff
+    char byte;
+    if (write(server.aofPipeAckToParent[1], "!", 1) != 1 ||
+        aeWait(server.aofPipeAckToChild[0], AE_READBLE, 5000) <= 0 ||
+        read(server.aofPipeAckToChild[0], &byte, 1) != 1 || byte != '!') {
+        redisLog(REDIS_WARNING, "The parent didn't acknowledge the end of the AOF rewrite diff");
+        goto werr;
+    }
+    aofReadDiffFromParent(&diff);
+    redisLog(REDIS_NOTICE, "Concatenating %.2f MB of AOF diff received from parent", (double) sdslen(diff) / (1024*1024));
+    if (rdbWrite(&w, diff, sdslen(diff)) == REDIS_ERR || rdbFlush(&w) == REDIS_ERR) {
+        goto werr;
+    }
+    if (redisFsync(fd) == -1) {
+        goto werr;
+    }
+    if (close(fd) == -1) {
+        // close失败时fd也已经释放了, 不能再close一次
+        fd = -1;
+        goto werr;
+    }
+    fd = -1;
+    zfree(w.buf);
+    sdsfree(diff);
+    sdsfree(buf);
+    redisLog(REDIS_NOTICE, "SYNC append only file rewrite performed");
+    return REDIS_OK;
+
+werr:
+    redisLog(REDIS_WARNING, "Write error writing append only file on disk: %s", strerror(errno));
+    if (fd != -1) {
+        close(fd);
+    }
+    unlink(filename);
+    zfree(w.buf);
+    sdsfree(diff);
+    sdsfree(buf);
+    return REDIS_ERR;
+}
+
+/**
+ * 父进程: 把rewrite buffer中还没有发送的部分写到pipe, 写满了就等下一轮
+ */
+static void aofChildWriteDiffData(void) {
+    size_t len = sdslen(server.aofRewriteBuf);
+    while (server.aofRewriteBufSent < len) {
+        ssize_t n = write(server.aofPipeToChild[1], server.aofRewriteBuf + server.aofRewriteBufSent,
+            len - server.aofRewriteBufSent);
+        if (n <= 0) {
+            break;
+        }
+        server.aofRewriteBufSent += n;
+    }
+    if (server.aofRewriteBufSent == len) {
+        sdssetlen(server.aofRewriteBuf, 0);
+        server.aofRewriteBuf[0] = '\0';
+        server.aofRewriteBufSent = 0;
+    } else if (server.aofRewriteBufSent > REDIS_AOF_REWRITE_BUF_COMPACT && server.aofRewriteBufSent > len / 2) {
+        // 子进程读得慢时不能让已经发送的部分一直占着内存
+        sdsrange(server.aofRewriteBuf, server.aofRewriteBufSent, -1);
+        server.aofRewriteBufSent = 0;
+    }
+}
+
+/**
+ * 子进程请求停止发送diff: 之后的写命令只留在rewrite buffer中, 由父进程在rewrite结束时追加
+ */
+static void aofChildPipeReadable(struct aeEventLoop *el, int fd, void *privdata, int mask) {
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(privdata);
+    REDIS_NOTUSED(mask);
+    char byte;
+    if (read(fd, &byte, 1) == 1 && byte == '!') {
+        redisLog(REDIS_NOTICE, "AOF rewrite child asks to stop sending diffs.");
+        server.aofStopSendingDiff = 1;
+        if (write(server.aofPipeAckToChild[1], "!", 1) != 1) {
+            redisLog(REDIS_WARNING, "Can't send ACK to AOF child: %s", strerror(errno));
+        }
+    }
+    aeDeleteFileEvent(server.el, fd, AE_READBLE);
+}
+
+static void aofClosePipes(void) {
+    int *fds[3] = {server.aofPipeToChild, server.aofPipeAckToParent, server.aofPipeAckToChild};
+    if (server.aofPipeAckToParent[0] != -1) {
+        aeDeleteFileEvent(server.el, server.aofPipeAckToParent[0], AE_READBLE);
+    }
+    for (int j = 0; j < 3; j++) {
+        if (fds[j][0] != -1) {
+            close(fds[j][0]);
+            close(fds[j][1]);
+        }
+        fds[j][0] = fds[j][1] = -1;
+    }
+}
+
+static int aofCreatePipes(void) {
+    if (pipe(server.aofPipeToChild) == -1 || pipe(server.aofPipeAckToParent) == -1 ||
+        pipe(server.aofPipeAckToChild) == -1) {
+        redisLog(REDIS_WARNING, "Error opening the AOF rewrite pipes: %s", strerror(errno));
+        aofClosePipes();
+        return REDIS_ERR;
+    }
+    // 父进程写diff和子进程读diff都不能阻塞
+    fcntl(server.aofPipeToChild[0], F_SETFL, O_NONBLOCK);
+    fcntl(server.aofPipeToChild[1], F_SETFL, O_NONBLOCK);
+    return REDIS_OK;
+}
+
+static int rewriteAppendOnlyFileBackground(void) {
+    if (server.bgsaveInProgress || hasActiveChildProcess()) {
+        return REDIS_ERR;
+    }
+    if (aofCreatePipes() == REDIS_ERR) {
+        return REDIS_ERR;
+    }
+    pid_t childpid = fork();
+    if (childpid == 0) {
+        // 子进程: 不需要监听端口
+        close(server.fd);
+        char tmpfile[256];
+        aofRewriteTempFileName(tmpfile, sizeof(tmpfile), getpid());
+        _exit(rewriteAppendOnlyFile(tmpfile) == REDIS_OK ? 0 : 1);
+    }
+    if (childpid == -1) {
+        redisLog(REDIS_WARNING, "Can't rewrite append only file in background: fork: %s", strerror(errno));
+        aofClosePipes();
+        return REDIS_ERR;
+    }
+    redisLog(REDIS_NOTICE, "Background append only file rewriting started by pid %d", (int) childpid);
+    server.aofChildPid = childpid;
+    server.aofRewriteScheduled = 0;
+    server.aofRewriteTimeStart = time(NULL);
+    server.aofStopSendingDiff = 0;
+    // 下一条命令前一定写SELECT, rewrite buffer中的命令才不依赖子进程最后写的是哪个db
+    server.aofSelectedDb = -1;
+    aeCreateFileEvent(server.el, server.aofPipeAckToParent[0], AE_READBLE, aofChildPipeReadable, NULL, NULL);
+    updateDictResizePolicy();
+    return REDIS_OK;
+}
+
+static void aofCloseJob(void *arg1, void *arg2) {
+    REDIS_NOTUSED(arg2);
+    close((int) (intptr_t) arg1);
+}
+
+/**
+ * 子进程结束之后调用: 追加握手之后的命令, rename替换旧的AOF
+ */
+static void backgroundRewriteDoneHandler(int ok) {
+    char tmpfile[256];
+    aofRewriteTempFileName(tmpfile, sizeof(tmpfile), server.aofChildPid);
+    if (!ok) {
+        redisLog(REDIS_WARNING, "Background AOF rewrite terminated with error");
+        unlink(tmpfile);
+        goto cleanup;
+    }
+
+    int newfd = open(tmpfile, O_WRONLY|O_APPEND);
+    if (newfd == -1) {
+        redisLog(REDIS_WARNING, "Unable to open the temporary AOF produced by the child: %s", strerror(errno));
+        unlink(tmpfile);
+        goto cleanup;
+    }
+    size_t len = sdslen(server.aofRewriteBuf) - server.aofRewriteBufSent;
+    long long start = ustime();
+    if (aofWrite(newfd, server.aofRewriteBuf + server.aofRewriteBufSent, len) != (ssize_t) len ||
+        (server.appendfsync == REDIS_AOF_FSYNC_ALWAYS && redisFsync(newfd) == -1)) {
+        redisLog(REDIS_WARNING, "Error trying to flush the parent diff to the rewritten AOF: %s", strerror(errno));
+        close(newfd);
+        unlink(tmpfile);
+        goto cleanup;
+    }
+    if (rename(tmpfile, server.appendfilename) == -1) {
+        redisLog(REDIS_WARNING, "Error trying to rename the temporary AOF file: %s", strerror(errno));
+        close(newfd);
+        unlink(tmpfile);
+        goto cleanup;
+    }
+
+    if (server.aofFd == -1) {
+        // 没有开启AOF, 只是生成文件
+        close(newfd);
+    } else {
+        // 旧文件已经被rename删掉, 最后一次close要释放它所有的块, 可能很慢, 交给fsync的后台线程:
+        // 同一种任务按顺序执行, 之前提交的对旧文件的fsync一定已经结束了
+        bioSubmitJob(BIO_AOF_FSYNC, aofCloseJob, (void*) (intptr_t) server.aofFd, NULL);
+        server.aofFd = newfd;
+        server.aofSelectedDb = -1;
+        // aofBuf中fork之后的命令都在rewrite buffer中, 已经写进了新文件; fork之前的已经包含在子进程的数据中
+        sdssetlen(server.aofBuf, 0);
+        server.aofBuf[0] = '\0';
+        server.aofFlushPostponedStart = 0;
+        struct stat sb;
+        server.aofCurrentSize = fstat(newfd, &sb) == 0 ? sb.st_size : 0;
+        server.aofRewriteBaseSize = server.aofCurrentSize;
+        if (server.appendfsync == REDIS_AOF_FSYNC_ALWAYS) {
+            server.aofFsyncSize = server.aofCurrentSize;
+        } else {
+            server.aofFsyncSize = 0;
+            if (server.appendfsync == REDIS_AOF_FSYNC_EVERYSEC) {
+                server.aofLastFsync = 0;
+                aofBackgroundFsyncIfNeeded(time(NULL));
+            }
+        }
+    }
+    redisLog(REDIS_NOTICE, "Background AOF rewrite finished successfully, %zu bytes of diff written by the parent in %lld us",
+        len, ustime() - start);
+
+cleanup:
+    aofClosePipes();
+    if (sdsalloc(server.aofRewriteBuf) <= REDIS_AOF_BUF_REUSE_MAX) {
+        sdssetlen(server.aofRewriteBuf, 0);
+        server.aofRewriteBuf[0] = '\0';
+    } else {
+        sdsfree(server.aofRewriteBuf);
+        server.aofRewriteBuf = sdsempty();
+    }
+    server.aofRewriteBufSent = 0;
+    server.aofStopSendingDiff = 0;
+    server.aofChildPid = -1;
+    server.aofRewriteTimeLast = time(NULL) - server.aofRewriteTimeStart;
+    server.aofRewriteTimeStart = -1;
+}
+
+/**
+ * 每次事件循环进入等待之前调用
+ */
+static void beforeSleep(AeEventLoop *eventLoop) {
+    REDIS_NOTUSED(eventLoop);
+    flushAppendOnlyFile(0);
+    // rewrite期间的写命令尽快发给子进程, rewrite结束时父进程自己要写的就少了
+    if (server.aofChildPid != -1 && !server.aofStopSendingDiff) {
+        aofChildWriteDiffData();
+    }
+}
+
+static void freeFakeClientArgv(RedisClient *c) {
+    for (int j = 0; j < c->argc; j++) {
+        decrRefCount(c->argv[j]);
+    }
+    c->argc = 0;
+}
+
+/**
+ * 启动时重放AOF中的命令
+ * 末尾不完整的命令(write到一半时宕机)丢掉并且把文件截断到最后一条完整的命令, 其它格式错误直接退出
+ * @return REDIS_ERR 文件打不开
+ */
+static int loadAppendOnlyFile(char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            server.aofCurrentSize = server.aofFsyncSize = server.aofRewriteBaseSize = 0;
+            return REDIS_OK;
+        }
+        redisLog(REDIS_WARNING, "Fatal error: can't open the append log file for reading: %s", strerror(errno));
+        return REDIS_ERR;
+    }
+
+    // 命令的回复没有用, 写到fake client的reply中之后丢掉
+    RedisClient fake;
+    memset(&fake, 0, sizeof(fake));
+    fake.fd = -1;
+    fake.dict = server.dict[0];
+    fake.dictid = 0;
+    fake.bulklen = -1;
+    fake.reply = listCreate();
+    if (fake.reply == NULL) {
+        oom("loadAppendOnlyFile");
+    }
+    listSetFreeMethod(fake.reply, decrRefCount);
+
+    char line[128];
+    size_t argbuflen = 1024;
+    char *argbuf = zmalloc(argbuflen);
+    if (argbuf == NULL) {
+        oom("loadAppendOnlyFile");
+    }
+    long long valid = 0; // 最后一条完整的命令结束的位置
+    long long loaded = 0;
+    while (1) {
+        if (fgets(line, sizeof(line), fp) == NULL) {
+            if (feof(fp)) {
+                break;
+            }
+            goto readerr;
+        }
+        if (line[0] != '*') {
+            goto fmterr;
+        }
+        long argc = strtol(line + 1, NULL, 10);
+        if (argc < 1 || argc > REDIS_MAX_ARGS) {
+            goto fmterr;
+        }
+
+        for (int j = 0; j < argc; j++) {
+            if (fgets(line, sizeof(line), fp) == NULL) {
+                goto truncated;
+            }
+            if (line[0] != '$') {
+                goto fmterr;
+            }
+            long len = strtol(line + 1, NULL, 10);
+            if (len < 0) {
+                goto fmterr;
+            }
+            if ((size_t) len + 2 > argbuflen) {
+                argbuflen = len + 2;
+                argbuf = zrealloc(argbuf, argbuflen);
+                if (argbuf == NULL) {
+                    oom("loadAppendOnlyFile");
+                }
+            }
+            if (fread(argbuf, len + 2, 1, fp) != 1) {
+                goto truncated;
+            }
+            if (argbuf[len] != '\r' || argbuf[len + 1] != '\n') {
+                goto fmterr;
+            }
+            fake.argv[fake.argc++] = createStringObject(argbuf, len);
+        }
+
+        char *name = fake.argv[0]->ptr;
+        if (strcasecmp(name, "select") == 0 && argc == 2) {
+            int dbid = atoi(fake.argv[1]->ptr);
+            if (dbid < 0 || dbid >= server.dbnum) {
+                goto fmterr;
+            }
+            fake.dict = server.dict[dbid];
+            fake.dictid = dbid;
+        } else {
+            struct RedisCommand *cmd = lookupCommand(name);
+            if (cmd == NULL) {
+                redisLog(REDIS_WARNING, "Unknown command '%s' reading the append only file", name);
+                exit(1);
+            }
+            if ((cmd->arity > 0 && cmd->arity != argc) || argc < -cmd->arity) {
+                goto fmterr;
+            }
+            cmd->proc(&fake);
+            while (listLength(fake.reply) > 0) {
+                listDelNode(fake.reply, listFirst(fake.reply));
+            }
+        }
+        freeFakeClientArgv(&fake);
+        valid = ftello(fp);
+        loaded++;
+    }
+
+    fclose(fp);
+    zfree(argbuf);
+    listRelease(fake.reply);
+    server.aofCurrentSize = server.aofFsyncSize = server.aofRewriteBaseSize = valid;
+    redisLog(REDIS_NOTICE, "%lld commands loaded from the append only file", loaded);
+    return REDIS_OK;
+
+truncated:
+    if (ferror(fp)) {
+        goto readerr;
+    }
+    freeFakeClientArgv(&fake);
+    fclose(fp);
+    zfree(argbuf);
+    listRelease(fake.reply);
+    redisLog(REDIS_WARNING, "Unexpected end of the append only file after %lld commands, truncating it to %lld bytes",
+        loaded, valid);
+    if (truncate(filename, valid) == -1) {
+        redisLog(REDIS_WARNING, "Error truncating the append only file: %s", strerror(errno));
+        exit(1);
+    }
+    server.aofCurrentSize = server.aofFsyncSize = server.aofRewriteBaseSize = valid;
+    return REDIS_OK;
+
+readerr:
+    redisLog(REDIS_WARNING, "Unrecoverable error reading the append only file: %s", strerror(errno));
+    exit(1);
+
+fmterr:
+    redisLog(REDIS_WARNING, "Bad file format reading the append only file at offset %lld", valid);
+    exit(1);
+}
+
+/**
+ * 开启AOF时它的数据比快照新, 只从AOF恢复
+ */
+static void loadDataFromDisk(void) {
+    long long start = ustime();
+    server.loading = 1;
+    if (server.appendonly) {
+        if (loadAppendOnlyFile(server.appendfilename) == REDIS_ERR) {
+            exit(1);
+        }
+        redisLog(REDIS_NOTICE, "DB loaded from append only file: %.3f seconds", (ustime() - start) / 1000000.0);
+    } else {
+        if (loadDb(server.dbfilename) == REDIS_ERR) {
+            redisLog(REDIS_WARNING, "Fatal error loading the DB, exiting now.");
+            exit(1);
+        }
+        redisLog(REDIS_NOTICE, "DB loaded from disk: %.3f seconds", (ustime() - start) / 1000000.0);
+    }
+    server.loading = 0;
+}
+
+/*------------------------------ Commands -----------------------------*/
+
+static struct RedisCommand *lookupCommand(char *name) {
+    for (size_t j = 0; j < sizeof(cmdTable) / sizeof(cmdTable[0]); j++) {
+        if (strcasecmp(name, cmdTable[j].name) == 0) {
+            return &cmdTable[j];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 执行命令, processCommand检查完参数和内存之后调用
+ * 修改了数据(server.dirty增加了)的命令传播给AOF和slave
+ */
+static void call(RedisClient *c, struct RedisCommand *cmd) {
+    long long dirty = server.dirty;
+    cmd->proc(c);
+    dirty = server.dirty - dirty;
+    if (dirty > 0 && server.appendonly) {
+        feedAppendOnlyFile(cmd, c->dictid, c->argv, c->argc);
+    }
+    if (dirty > 0 && listLength(server.slaves) > 0) {
+        replicationFeedSlaves(cmd, c->dictid, c->argv, c->argc);
+    }
+    server.stat_numcommands++;
+}
+
+/**
+ * 执行client中已经解析好的一条命令: 检查命令名和参数个数,
+ * 设置了maxmemory时会增加内存的写命令先淘汰key, 淘汰不出空间就回复OOM错误不执行
+ * argv由调用者释放
+ */
+static void processCommand(RedisClient *c) {
+    struct RedisCommand *cmd = lookupCommand(c->argv[0]->ptr);
+    if (cmd == NULL) {
+        addReplaySds(c, sdsnew("-ERR unknown command\r\n"));
+        return;
+    }
+    if ((cmd->arity > 0 && cmd->arity != c->argc) || c->argc < -cmd->arity) {
+        addReplaySds(c, sdsnew("-ERR wrong number of arguments\r\n"));
+        return;
+    }
+    if (!checkMaxmemoryBeforeCommand(c, cmd)) {
+        return;
+    }
+    call(c, cmd);
+}
+
+/**
+ * SET/SETNX: 保存之前尝试把value编码成整数
+ * 覆盖已有的key时清除它的过期时间
+ * @param expire 过期的unix时间(毫秒), -1表示不过期
+ */
+static void setGenericCommand(RedisClient *c, int nx, long long expire) {
+    snapshotBeforeWrite(c->dictid, c->argv[1]);
+    // 已经过期的key当作不存在, 否则SETNX会失败
+    expireIfNeeded(c->dictid, c->argv[1]);
+    c->argv[2] = tryObjectEncoding(c->argv[2]);
+    if (keyspaceDictAdd(c->dict, c->argv[1], c->argv[2]) == DICT_ERR) {
+        if (nx) {
+            addReply(c, shared.zero);
+            return;
+        }
+        keyspaceDictReplace(c->dict, c->argv[1], c->argv[2]);
+        incrRefCount(c->argv[2]);
+        removeExpire(c->dictid, c->argv[1]);
+    } else {
+        incrRefCount(c->argv[1]);
+        incrRefCount(c->argv[2]);
+    }
+    if (expire != -1) {
+        setExpire(c->dictid, c->argv[1], expire);
+    }
+    server.dirty++;
+    addReply(c, nx ? shared.one : shared.ok);
+}
+
+/**
+ * SET key value [EX seconds|PX milliseconds] [NX]
+ */
+static void setCommand(RedisClient *c) {
+    long long expire = -1;
+    int nx = 0;
+    for (int j = 3; j < c->argc; j++) {
+        char *opt = c->argv[j]->ptr;
+        if (strcasecmp(opt, "nx") == 0) {
+            nx = 1;
+        } else if ((strcasecmp(opt, "ex") == 0 || strcasecmp(opt, "px") == 0) && expire == -1 && j + 1 < c->argc) {
+            long long ttl;
+            long long unit = strcasecmp(opt, "ex") == 0 ? 1000 : 1;
+            if (getLongLongFromObject(c->argv[j + 1], &ttl) == REDIS_ERR || ttl <= 0 || ttl > LLONG_MAX / unit - mstime()) {
+                addReply(c, shared.invalidExpireErr);
+                return;
+            }
+            expire = mstime() + ttl * unit;
+            j++;
+        } else {
+            addReply(c, shared.syntaxErr);
+            return;
+        }
+    }
+    setGenericCommand(c, nx, expire);
+}
+
+static void setnxCommand(RedisClient *c) {
+    setGenericCommand(c, 1, -1);
+}
+
+/**
+ * DEL/UNLINK key [key ...]
+ * UNLINK只是把key从keyspace中摘掉, 大的value交给后台线程释放
+ */
+static void delGenericCommand(RedisClient *c, int lazy) {
+    long long deleted = 0;
+    for (int j = 1; j < c->argc; j++) {
+        expireIfNeeded(c->dictid, c->argv[j]);
+        if (lazy ? dbAsyncDelete(c->dictid, c->argv[j]) : dbDelete(c->dictid, c->argv[j])) {
+            deleted++;
+        }
+    }
+    server.dirty += deleted;
+    addReplyLongLong(c, deleted);
+}
+
+static void delCommand(RedisClient *c) {
+    delGenericCommand(c, 0);
+}
+
+static void unlinkCommand(RedisClient *c) {
+    delGenericCommand(c, 1);
+}
+
+/**
+ * FLUSHDB/FLUSHALL的可选参数ASYNC
+ * @return 参数错误时回复错误并返回-1
+ */
+static int getFlushAsyncFromArgs(RedisClient *c) {
+    if (c->argc == 1) {
+        return 0;
+    }
+    if (c->argc == 2 && strcasecmp(c->argv[1]->ptr, "async") == 0) {
+        return 1;
+    }
+    addReply(c, shared.syntaxErr);
+    return -1;
+}
+
+static void flushdbCommand(RedisClient *c) {
+    int async = getFlushAsyncFromArgs(c);
+    if (async == -1) {
+        return;
+    }
+    emptyDbIndex(c->dictid, async);
+    server.dirty++;
+    addReply(c, shared.ok);
+}
+
+static void flushallCommand(RedisClient *c) {
+    int async = getFlushAsyncFromArgs(c);
+    if (async == -1) {
+        return;
+    }
+    emptyDb(async);
+    server.dirty++;
+    addReply(c, shared.ok);
+}
+
+/**
+ * SAVE: 在主进程中同步写快照, 写完之前不会处理其它请求
+ */
+static void saveCommand(RedisClient *c) {
+    if (server.bgsaveInProgress) {
+        addReplaySds(c, sdsnew("-ERR background save in progress\r\n"));
+        return;
+    }
+    addReply(c, saveDb(server.dbfilename) == REDIS_OK ? shared.ok : shared.err);
+}
+
+static void bgsaveCommand(RedisClient *c) {
+    if (server.bgsaveInProgress) {
+        addReplaySds(c, sdsnew("-ERR background save already in progress\r\n"));
+        return;
+    }
+    if (server.aofChildPid != -1) {
+        addReplaySds(c, sdsnew("-ERR background append only file rewriting in progress\r\n"));
+        return;
+    }
+    addReply(c, saveDbBackground(server.dbfilename) == REDIS_OK ? shared.ok : shared.err);
+}
+
+/**
+ * BGREWRITEAOF: 在子进程中按照当前的数据生成一个最小的AOF; 正在bgsave时推迟到它结束之后
+ */
+static void bgrewriteaofCommand(RedisClient *c) {
+    if (server.aofChildPid != -1) {
+        addReplaySds(c, sdsnew("-ERR background append only file rewriting already in progress\r\n"));
+        return;
+    }
+    if (server.bgsaveInProgress) {
+        server.aofRewriteScheduled = 1;
+        addReplaySds(c, sdsnew("+Background append only file rewriting scheduled\r\n"));
+        return;
+    }
+    if (rewriteAppendOnlyFileBackground() == REDIS_OK) {
+        addReplaySds(c, sdsnew("+Background append only file rewriting started\r\n"));
+    } else {
+        addReply(c, shared.err);
+    }
+}
+
+/**
+ * LASTSAVE: 上一次成功保存快照的unix时间
+ */
+static void lastsaveCommand(RedisClient *c) {
+    addReplyLongLong(c, server.lastsave);
+}
+
+/**
+ * EXPIRE/PEXPIRE/PEXPIREAT: 过期时间已经过去的话直接删除key(重放AOF时除外)
+ * @param basetime 参数相对于哪个时间(毫秒), PEXPIREAT是0
+ * @param unit 参数的单位(毫秒)
+ */
+static void expireGenericCommand(RedisClient *c, long long basetime, long long unit) {
+    long long ttl;
+    if (getLongLongFromObject(c->argv[2], &ttl) == REDIS_ERR) {
+        addReply(c, shared.notIntErr);
+        return;
+    }
+    long long now = mstime();
+    if (ttl > (LLONG_MAX - basetime) / unit || ttl < (LLONG_MIN + basetime) / unit) {
+        addReply(c, shared.invalidExpireErr);
+        return;
+    }
+    if (lookupKeyWrite(c->dictid, c->argv[1]) == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+
+    long long when = basetime + ttl * unit;
+    // 重放AOF时只设置过期时间, 和expireIfNeeded一样等后面记录下来的DEL删除
+    if (when <= now && !server.loading) {
+        dbDelete(c->dictid, c->argv[1]);
+    } else {
+        setExpire(c->dictid, c->argv[1], when);
+    }
+    server.dirty++;
+    addReply(c, shared.one);
+}
+
+static void expireCommand(RedisClient *c) {
+    expireGenericCommand(c, mstime(), 1000);
+}
+
+static void pexpireCommand(RedisClient *c) {
+    expireGenericCommand(c, mstime(), 1);
+}
+
+/**
+ * PEXPIREAT key <unix时间(毫秒)>: AOF中的过期时间都写成这个命令, 重放时不受重启用掉的时间影响
+ */
+static void pexpireatCommand(RedisClient *c) {
+    expireGenericCommand(c, 0, 1);
+}
+
+/**
+ * TTL/PTTL: key不存在返回-2, 没有过期时间返回-1
+ */
+static void ttlGenericCommand(RedisClient *c, int ms) {
+    if (lookupKeyRead(c->dictid, c->argv[1]) == NULL) {
+        addReply(c, shared.minus2);
+        return;
+    }
+    long long expire = getExpire(c->dictid, c->argv[1]);
+    if (expire == -1) {
+        addReply(c, shared.minus1);
+        return;
+    }
+    long long ttl = expire - mstime();
+    if (ttl < 0) {
+        ttl = 0;
+    }
+    addReplyLongLong(c, ms ? ttl : (ttl + 500) / 1000);
+}
+
+static void ttlCommand(RedisClient *c) {
+    ttlGenericCommand(c, 0);
+}
+
+static void pttlCommand(RedisClient *c) {
+    ttlGenericCommand(c, 1);
+}
+
+static void persistCommand(RedisClient *c) {
+    if (lookupKeyWrite(c->dictid, c->argv[1]) == NULL || !removeExpire(c->dictid, c->argv[1])) {
+        addReply(c, shared.zero);
+        return;
+    }
+    server.dirty++;
+    addReply(c, shared.one);
+}
+
+static void getCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_STRING) {
+        addReply(c, shared.wrongTypeErrBulk);
+        return;
+    }
+    addReplyBulk(c, o);
+}
+
+/**
+ * INCR/DECR: 不存在的key当作0, 已有的值必须是严格的整数字符串，结果不能溢出
+ * 值是整数编码且没有被共享时直接原地修改ptr, 不需要申请任何内存
+ */
+static void incrDecrCommand(RedisClient *c, long long incr) {
+    long long value = 0;
+    Robj *o = NULL;
+    DictEntry *de = lookupKeyWrite(c->dictid, c->argv[1]);
+    if (de != NULL) {
+        o = dictGetEntryVal(de);
+        if (o->type != REDIS_STRING) {
+            addReply(c, shared.wrongTypeErr);
+            return;
+        }
+        if (getLongLongFromObject(o, &value) == REDIS_ERR) {
+            addReply(c, shared.notIntErr);
+            return;
+        }
+    }
+
+    if ((incr < 0 && value < LLONG_MIN - incr) || (incr > 0 && value > LLONG_MAX - incr)) {
+        addReply(c, shared.notIntErr);
+        return;
+    }
+    value += incr;
+
+    if (o != NULL && o->encoding == REDIS_ENCODING_INT && o->refcount == 1 &&
+        (value < 0 || value >= REDIS_SHARED_INTEGERS) && value >= LONG_MIN && value <= LONG_MAX) {
+        o->ptr = (void*) (long) value;
+    } else {
+        o = createStringObjectFromLongLong(value);
+        if (keyspaceDictAdd(c->dict, c->argv[1], o) == DICT_ERR) {
+            keyspaceDictReplace(c->dict, c->argv[1], o);
+        } else {
+            incrRefCount(c->argv[1]);
+        }
+    }
+    server.dirty++;
+    addReplyLongLong(c, value);
+}
+
+static void incrCommand(RedisClient *c) {
+    incrDecrCommand(c, 1);
+}
+
+static void decrCommand(RedisClient *c) {
+    incrDecrCommand(c, -1);
+}
+
+static void pushGenericCommand(RedisClient *c, int where) {
+    Robj *lobj;
+    DictEntry *de = lookupKeyWrite(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        lobj = createListpackListObject();
+        keyspaceDictAdd(c->dict, c->argv[1], lobj);
+        incrRefCount(c->argv[1]);
+    } else {
+        lobj = dictGetEntryVal(de);
+        if (lobj->type != REDIS_LIST) {
+            addReply(c, shared.wrongTypeErr);
+            return;
+        }
+    }
+    for (int j = 2; j < c->argc; j++) {
+        listTypePush(lobj, c->argv[j], where);
+    }
+    server.dirty += c->argc - 2;
+    addReply(c, shared.ok);
+}
+
+static void lpushCommand(RedisClient *c) {
+    pushGenericCommand(c, REDIS_HEAD);
+}
+
+static void rpushCommand(RedisClient *c) {
+    pushGenericCommand(c, REDIS_TAIL);
+}
+
+static void llenCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.minus2);
+        return;
+    }
+    addReplyLongLong(c, listTypeLength(o));
+}
+
+static void lindexCommand(RedisClient *c) {
+    int index = atoi(c->argv[2]->ptr);
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongTypeErrBulk);
+        return;
+    }
+
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *p = lpSeek(o->ptr, index);
+        if (p == NULL) {
+            addReply(c, shared.nil);
+        } else {
+            addReplyListpackEntry(c, p);
+        }
+    } else {
+        QuicklistEntry entry;
+        if (!quicklistIndex(o->ptr, index, &entry)) {
+            addReply(c, shared.nil);
+        } else {
+            addReplyQuicklistEntry(c, &entry);
+        }
+    }
+}
+
+static void lsetCommand(RedisClient *c) {
+    int index = atoi(c->argv[2]->ptr);
+    DictEntry *de = lookupKeyWrite(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.noKeyErr);
+        return;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongTypeErr);
+        return;
+    }
+
+    Robj *value = getDecodedObject(c->argv[3]);
+    int found = 0;
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *p = lpSeek(o->ptr, index);
+        found = p != NULL;
+        if (found && sdslen(value->ptr) > server.listMaxListpackValue) {
+            // 新的值太长了, 先转换成quicklist再替换
+            listTypeConvert(o);
+        } else if (found) {
+            o->ptr = lpInsert(o->ptr, (unsigned char*) value->ptr, sdslen(value->ptr), p, LP_REPLACE, NULL);
+            if (o->ptr == NULL) {
+                oom("lsetCommand");
+            }
+        }
+    }
+    if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        found = quicklistReplaceAtIndex(o->ptr, index, value->ptr, sdslen(value->ptr));
+        if (found == -1) {
+            oom("quicklistReplaceAtIndex");
+        }
+    }
+    decrRefCount(value);
+
+    if (!found) {
+        addReply(c, shared.outOfRangeErr);
+        return;
+    }
+    server.dirty++;
+    addReply(c, shared.ok);
+}
+
+static void ltrimCommand(RedisClient *c) {
+    int start = atoi(c->argv[2]->ptr);
+    int end = atoi(c->argv[3]->ptr);
+    DictEntry *de = lookupKeyWrite(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.noKeyErr);
+        return;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongTypeErr);
+        return;
+    }
+
+    // 负数表示从后往前数
+    int llen = listTypeLength(o);
+    if (start < 0) {
+        start = llen + start;
+    }
+    if (end < 0) {
+        end = llen + end;
+    }
+    if (start < 0) {
+        start = 0;
+    }
+    if (end < 0) {
+        end = 0;
+    }
+    // start超出范围或者start > end时清空整个list
+    int ltrim, rtrim;
+    if (start > end || start >= llen) {
+        ltrim = llen;
+        rtrim = 0;
+    } else {
+        if (end >= llen) {
+            end = llen - 1;
+        }
+        ltrim = start;
+        rtrim = llen - end - 1;
+    }
+
+    // 两端各一次范围删除, 不需要逐个元素删除
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        o->ptr = lpDeleteRange(o->ptr, 0, ltrim);
+        o->ptr = lpDeleteRange(o->ptr, -rtrim, rtrim);
+    } else {
+        quicklistDelRange(o->ptr, 0, ltrim);
+        quicklistDelRange(o->ptr, -rtrim, rtrim);
+    }
+    server.dirty++;
+    addReply(c, shared.ok);
+}
+
+static void lrangeCommand(RedisClient *c) {
+    int start = atoi(c->argv[2]->ptr);
+    int end = atoi(c->argv[3]->ptr);
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_LIST) {
+        addReply(c, shared.wrongTypeErrBulk);
+        return;
+    }
+
+    // 负数表示从后往前数
+    int llen = listTypeLength(o);
+    if (start < 0) {
+        start = llen + start;
+    }
+    if (end < 0) {
+        end = llen + end;
+    }
+    if (start < 0) {
+        start = 0;
+    }
+    if (end < 0) {
+        end = 0;
+    }
+    // start超出范围或者start > end时返回空list
+    if (start > end || start >= llen) {
+        addReply(c, shared.zero);
+        return;
+    }
+    if (end >= llen) {
+        end = llen - 1;
+    }
+    int rangelen = (end - start) + 1;
+
+    addReplyLongLong(c, rangelen);
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *p = lpSeek(o->ptr, start);
+        while (rangelen--) {
+            addReplyListpackEntry(c, p);
+            p = lpNext(o->ptr, p);
+        }
+    } else {
+        QuicklistIter *iter = quicklistGetIteratorAtIdx(o->ptr, AL_START_HEAD, start);
+        if (iter == NULL) {
+            oom("quicklistGetIteratorAtIdx");
+        }
+        QuicklistEntry entry;
+        while (rangelen-- && quicklistNext(iter, &entry)) {
+            addReplyQuicklistEntry(c, &entry);
+        }
+        quicklistReleaseIterator(iter);
+    }
+}
+
+static void saddCommand(RedisClient *c) {
+    Robj *set;
+    DictEntry *de = lookupKeyWrite(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        set = setTypeCreate(c->argv[2]);
+        keyspaceDictAdd(c->dict, c->argv[1], set);
+        incrRefCount(c->argv[1]);
+    } else {
+        set = dictGetEntryVal(de);
+        if (set->type != REDIS_SET) {
+            addReply(c, shared.wrongTypeErr);
+            return;
+        }
+    }
+    int added = 0;
+    for (int j = 2; j < c->argc; j++) {
+        added += setTypeAdd(set, c->argv[j]);
+    }
+    server.dirty += added;
+    addReplyLongLong(c, added);
+}
+
+static void sremCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyWrite(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    Robj *set = dictGetEntryVal(de);
+    if (set->type != REDIS_SET) {
+        addReply(c, shared.wrongTypeErr);
+        return;
+    }
+    if (setTypeRemove(set, c->argv[2])) {
+        server.dirty++;
+        addReply(c, shared.one);
+    } else {
+        addReply(c, shared.zero);
+    }
+}
+
+/**
+ * intset编码时是二分查找
+ */
+static void sismemberCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    Robj *set = dictGetEntryVal(de);
+    if (set->type != REDIS_SET) {
+        addReply(c, shared.wrongTypeErr);
+        return;
+    }
+    addReply(c, setTypeIsMember(set, c->argv[2]) ? shared.one : shared.zero);
+}
+
+static void scardCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    Robj *set = dictGetEntryVal(de);
+    if (set->type != REDIS_SET) {
+        addReply(c, shared.minus2);
+        return;
+    }
+    addReplyLongLong(c, setTypeSize(set));
+}
+
+static int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
+    unsigned long l1 = setTypeSize(*(Robj**) s1);
+    unsigned long l2 = setTypeSize(*(Robj**) s2);
+    return (l1 > l2) - (l1 < l2);
+}
+
+/**
+ * 计算sets的交集, sets已经按元素个数从小到大排好序
+ * 全部都是intset时两两做SIMD merge, 结果仍然是intset;
+ * 否则遍历最小的set, 逐个检查是否在其它set中
+ */
+static Robj *setTypeIntersect(Robj **sets, int setsnum) {
+    int allIntset = 1;
+    for (int j = 0; j < setsnum; j++) {
+        if (sets[j]->encoding != REDIS_ENCODING_INTSET) {
+            allIntset = 0;
+            break;
+        }
+    }
+
+    if (allIntset) {
+        Intset *is = intsetIntersect(sets[0]->ptr, sets[setsnum > 1 ? 1 : 0]->ptr);
+        for (int j = 2; j < setsnum && is != NULL && intsetLen(is) > 0; j++) {
+            Intset *next = intsetIntersect(is, sets[j]->ptr);
+            intsetFree(is);
+            is = next;
+        }
+        if (is == NULL) {
+            oom("intsetIntersect");
+        }
+        Robj *dstset = createObject(REDIS_SET, is);
+        dstset->encoding = REDIS_ENCODING_INTSET;
+        return dstset;
+    }
+
+    Robj *dstset = createIntsetObject();
+    SetTypeIterator *si = setTypeInitIterator(sets[0]);
+    Robj *objele;
+    int64_t llele;
+    int encoding;
+    while ((encoding = setTypeNext(si, &objele, &llele)) != -1) {
+        Robj *ele = encoding == REDIS_ENCODING_INTSET ? createStringObjectFromLongLong(llele) : objele;
+        int j;
+        for (j = 1; j < setsnum; j++) {
+            if (!setTypeIsMember(sets[j], ele)) {
+                break;
+            }
+        }
+        if (j == setsnum) {
+            setTypeAdd(dstset, ele);
+        }
+        if (encoding == REDIS_ENCODING_INTSET) {
+            decrRefCount(ele);
+        }
+    }
+    setTypeReleaseIterator(si);
+    return dstset;
+}
+
+/**
+ * SINTER/SINTERSTORE: 不存在的key当作空集合
+ * dstkey为NULL时回复交集的元素, 否则把交集保存到dstkey
+ */
+static void sinterGenericCommand(RedisClient *c, Robj **setkeys, int setsnum, Robj *dstkey) {
+    Robj **sets = zmalloc(sizeof(Robj*) * setsnum);
+    if (sets == NULL) {
+        oom("sinterGenericCommand");
+    }
+
+    int empty = 0;
+    for (int j = 0; j < setsnum; j++) {
+        DictEntry *de = lookupKeyRead(c->dictid, setkeys[j]);
+        if (de == NULL) {
+            empty = 1;
+            continue;
+        }
+        sets[j] = dictGetEntryVal(de);
+        if (sets[j]->type != REDIS_SET) {
+            zfree(sets);
+            addReply(c, dstkey ? shared.wrongTypeErr : shared.wrongTypeErrBulk);
+            return;
+        }
+    }
+
+    Robj *dstset;
+    if (empty) {
+        dstset = createIntsetObject();
+    } else {
+        // 从最小的set开始, 需要检查的元素最少
+        qsort(sets, setsnum, sizeof(Robj*), qsortCompareSetsByCardinality);
+        dstset = setTypeIntersect(sets, setsnum);
+    }
+    zfree(sets);
+
+    if (dstkey != NULL) {
+        snapshotBeforeWrite(c->dictid, dstkey);
+        if (keyspaceDictAdd(c->dict, dstkey, dstset) == DICT_ERR) {
+            keyspaceDictReplace(c->dict, dstkey, dstset);
+            removeExpire(c->dictid, dstkey);
+        } else {
+            incrRefCount(dstkey);
+        }
+        server.dirty++;
+        addReply(c, shared.ok);
+        return;
+    }
+
+    addReplyLongLong(c, setTypeSize(dstset));
+    SetTypeIterator *si = setTypeInitIterator(dstset);
+    Robj *objele;
+    int64_t llele;
+    int encoding;
+    while ((encoding = setTypeNext(si, &objele, &llele)) != -1) {
+        if (encoding == REDIS_ENCODING_INTSET) {
+            addReplyBulkLongLong(c, llele);
+        } else {
+            addReplyBulk(c, objele);
+        }
+    }
+    setTypeReleaseIterator(si);
+    decrRefCount(dstset);
+}
+
+static void sinterCommand(RedisClient *c) {
+    sinterGenericCommand(c, c->argv + 1, c->argc - 1, NULL);
+}
+
+static void sinterstoreCommand(RedisClient *c) {
+    sinterGenericCommand(c, c->argv + 2, c->argc - 2, c->argv[1]);
+}
+
+static void hsetCommand(RedisClient *c) {
+    Robj *o = hashTypeLookupWriteOrCreate(c, c->argv[1]);
+    if (o == NULL) {
+        return;
+    }
+    hashTypeTryConversion(o, c->argv, 2, 3);
+    int created = hashTypeSet(o, c->argv[2], c->argv[3]);
+    server.dirty++;
+    addReply(c, created ? shared.one : shared.zero);
+}
+
+static void hgetCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    Robj *o = de == NULL ? NULL : dictGetEntryVal(de);
+    if (o != NULL && o->type != REDIS_HASH) {
+        addReply(c, shared.wrongTypeErrBulk);
+        return;
+    }
+    addHashFieldToReply(c, o, c->argv[2]);
+}
+
+static void hmgetCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    Robj *o = de == NULL ? NULL : dictGetEntryVal(de);
+    if (o != NULL && o->type != REDIS_HASH) {
+        addReply(c, shared.wrongTypeErrBulk);
+        return;
+    }
+    addReplyLongLong(c, c->argc - 2);
+    for (int j = 2; j < c->argc; j++) {
+        addHashFieldToReply(c, o, c->argv[j]);
+    }
+}
+
+static void hgetallCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyRead(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_HASH) {
+        addReply(c, shared.wrongTypeErrBulk);
+        return;
+    }
+
+    addReplyLongLong(c, hashTypeLength(o) * 2);
+    if (o->encoding == REDIS_ENCODING_LISTPACK) {
+        for (unsigned char *p = lpFirst(o->ptr); p != NULL; p = lpNext(o->ptr, p)) {
+            addReplyListpackEntry(c, p);
+        }
+    } else {
+        DictIterator *di = dictGetIterator(o->ptr);
+        if (di == NULL) {
+            oom("dictGetIterator");
+        }
+        while ((de = dictNext(di)) != NULL) {
+            addReplyBulk(c, dictGetEntryKey(de));
+            addReplyBulk(c, dictGetEntryVal(de));
+        }
+        dictReleaseIterator(di);
+    }
+}
+
+/**
+ * 不存在的field当作0, 规则和INCR/DECR一样
+ */
+static void hincrbyCommand(RedisClient *c) {
+    long long incr, value = 0;
+    if (getLongLongFromObject(c->argv[3], &incr) == REDIS_ERR) {
+        addReply(c, shared.notIntErr);
+        return;
+    }
+    Robj *o = hashTypeLookupWriteOrCreate(c, c->argv[1]);
+    if (o == NULL) {
+        return;
+    }
+
+    Robj *current = hashTypeGetValueObject(o, c->argv[2]);
+    if (current != NULL) {
+        int ret = getLongLongFromObject(current, &value);
+        decrRefCount(current);
+        if (ret == REDIS_ERR) {
+            addReply(c, shared.notIntErr);
+            return;
+        }
+    }
+    if ((incr < 0 && value < LLONG_MIN - incr) || (incr > 0 && value > LLONG_MAX - incr)) {
+        addReply(c, shared.notIntErr);
+        return;
+    }
+    value += incr;
+
+    hashTypeTryConversion(o, c->argv, 2, 2);
+    Robj *newobj = createStringObjectFromLongLong(value);
+    hashTypeSet(o, c->argv[2], newobj);
+    decrRefCount(newobj);
+    server.dirty++;
+    addReplyLongLong(c, value);
+}
+
+static void hdelCommand(RedisClient *c) {
+    DictEntry *de = lookupKeyWrite(c->dictid, c->argv[1]);
+    if (de == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    Robj *o = dictGetEntryVal(de);
+    if (o->type != REDIS_HASH) {
+        addReply(c, shared.wrongTypeErr);
+        return;
+    }
+    if (hashTypeDelete(o, c->argv[2])) {
+        server.dirty++;
+        addReply(c, shared.one);
+    } else {
+        addReply(c, shared.zero);
+    }
+}
+
+/**
+ * ZADD/ZINCRBY key score member
+ */
+static void zaddGenericCommand(RedisClient *c, int incr) {
+    double score;
+    if (getDoubleFromObject(c->argv[2], &score) == REDIS_ERR) {
+        addReply(c, shared.notFloatErr);
+        return;
+    }
+
+    int wrongtype;
+    Robj *member = getDecodedObject(c->argv[3]);
+    Robj *zobj = zsetLookup(c, c->argv[1], 1, &wrongtype);
+    if (wrongtype) {
+        decrRefCount(member);
+        addReply(c, shared.wrongTypeErr);
+        return;
+    }
+    if (zobj == NULL) {
+        if (server.zsetMaxListpackEntries == 0 || sdslen(member->ptr) > server.zsetMaxListpackValue) {
+            zobj = createZsetObject();
+        } else {
+            zobj = createZsetListpackObject();
+        }
+        keyspaceDictAdd(c->dict, c->argv[1], zobj);
+        incrRefCount(c->argv[1]);
+    }
+
+    double newscore;
+    int added = zsetAdd(zobj, score, member->ptr, incr, &newscore);
+    decrRefCount(member);
+    if (added == -1) {
+        addReply(c, shared.nanErr);
+        return;
+    }
+    server.dirty++;
+    if (incr) {
+        addReplyDouble(c, newscore);
+    } else {
+        addReply(c, added ? shared.one : shared.zero);
+    }
+}
+
+static void zaddCommand(RedisClient *c) {
+    zaddGenericCommand(c, 0);
+}
+
+static void zincrbyCommand(RedisClient *c) {
+    zaddGenericCommand(c, 1);
+}
+
+/**
+ * ZRANGE key start end [WITHSCORES]
+ * 跳表先按rank定位到start(O(log n)), 然后沿着level[0]往后走
+ */
+static void zrangeCommand(RedisClient *c) {
+    int withscores = 0;
+    if (c->argc == 5 && strcasecmp(c->argv[4]->ptr, "withscores") == 0) {
+        withscores = 1;
+    } else if (c->argc != 4) {
+        addReply(c, shared.syntaxErr);
+        return;
+    }
+
+    int start = atoi(c->argv[2]->ptr);
+    int end = atoi(c->argv[3]->ptr);
+    int wrongtype;
+    Robj *zobj = zsetLookup(c, c->argv[1], 0, &wrongtype);
+    if (wrongtype) {
+        addReply(c, shared.wrongTypeErrBulk);
+        return;
+    }
+    if (zobj == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+
+    // 负数表示从后往前数
+    int llen = zsetLength(zobj);
+    if (start < 0) {
+        start = llen + start;
+    }
+    if (end < 0) {
+        end = llen + end;
+    }
+    if (start < 0) {
+        start = 0;
+    }
+    if (end < 0) {
+        end = 0;
+    }
+    if (start > end || start >= llen) {
+        addReply(c, shared.zero);
+        return;
+    }
+    if (end >= llen) {
+        end = llen - 1;
+    }
+    int rangelen = (end - start) + 1;
+
+    addReplyLongLong(c, withscores ? rangelen * 2 : rangelen);
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *lp = zobj->ptr;
+        unsigned char *eptr = lpSeek(lp, 2 * start);
+        while (rangelen--) {
+            unsigned char *sptr = lpNext(lp, eptr);
+            addReplyListpackEntry(c, eptr);
+            if (withscores) {
+                addReplyDouble(c, zzlGetScore(sptr));
+            }
+            eptr = lpNext(lp, sptr);
+        }
+    } else {
+        ZSkiplistNode *ln = zslGetElementByRank(((Zset*) zobj->ptr)->zsl, start + 1);
+        while (rangelen--) {
+            addReplyBulkCBuffer(c, ln->ele, sdslen(ln->ele));
+            if (withscores) {
+                addReplyDouble(c, ln->score);
+            }
+            ln = ln->level[0].forward;
+        }
+    }
+}
+
+/**
+ * ZRANGEBYSCORE key min max [WITHSCORES]
+ * 跳表的结果个数通过区间两端的rank相减得到, 不需要先遍历一遍
+ */
+static void zrangebyscoreCommand(RedisClient *c) {
+    int withscores = 0;
+    if (c->argc == 5 && strcasecmp(c->argv[4]->ptr, "withscores") == 0) {
+        withscores = 1;
+    } else if (c->argc != 4) {
+        addReply(c, shared.syntaxErr);
+        return;
+    }
+
+    ZRangeSpec range;
+    if (zslParseRange(c->argv[2], c->argv[3], &range) == REDIS_ERR) {
+        addReply(c, shared.notFloatErr);
+        return;
+    }
+    int wrongtype;
+    Robj *zobj = zsetLookup(c, c->argv[1], 0, &wrongtype);
+    if (wrongtype) {
+        addReply(c, shared.wrongTypeErrBulk);
+        return;
+    }
+    if (zobj == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+
+    if (zobj->encoding == REDIS_ENCODING_LISTPACK) {
+        unsigned char *lp = zobj->ptr;
+        unsigned char *first = NULL;
+        unsigned long count = 0;
+        for (unsigned char *eptr = lpFirst(lp); eptr != NULL; eptr = lpNext(lp, lpNext(lp, eptr))) {
+            double score = zzlGetScore(lpNext(lp, eptr));
+            if (!zslValueLteMax(score, &range)) {
+                break;
+            }
+            if (zslValueGteMin(score, &range)) {
+                if (first == NULL) {
+                    first = eptr;
+                }
+                count++;
+            }
+        }
+
+        addReplyLongLong(c, withscores ? count * 2 : count);
+        unsigned char *eptr = first;
+        while (count--) {
+            unsigned char *sptr = lpNext(lp, eptr);
+            addReplyListpackEntry(c, eptr);
+            if (withscores) {
+                addReplyDouble(c, zzlGetScore(sptr));
+            }
+            eptr = lpNext(lp, sptr);
+        }
+        return;
+    }
+
+    ZSkiplist *zsl = ((Zset*) zobj->ptr)->zsl;
+    ZSkiplistNode *first = zslFirstInRange(zsl, &range);
+    if (first == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+    ZSkiplistNode *last = zslLastInRange(zsl, &range);
+    unsigned long count = zslGetRank(zsl, last->score, last->ele) - zslGetRank(zsl, first->score, first->ele) + 1;
+
+    addReplyLongLong(c, withscores ? count * 2 : count);
+    for (ZSkiplistNode *ln = first; count--; ln = ln->level[0].forward) {
+        addReplyBulkCBuffer(c, ln->ele, sdslen(ln->ele));
+        if (withscores) {
+            addReplyDouble(c, ln->score);
+        }
+    }
+}
+
+static void zrankCommand(RedisClient *c) {
+    int wrongtype;
+    Robj *zobj = zsetLookup(c, c->argv[1], 0, &wrongtype);
+    if (wrongtype) {
+        addReply(c, shared.wrongTypeErr);
+        return;
+    }
+    if (zobj == NULL) {
+        addReply(c, shared.nil);
+        return;
+    }
+
+    Robj *member = getDecodedObject(c->argv[2]);
+    long rank = zsetRank(zobj, member->ptr);
+    decrRefCount(member);
+    if (rank < 0) {
+        addReply(c, shared.nil);
+    } else {
+        addReplyLongLong(c, rank);
+    }
+}
+
+static void zremCommand(RedisClient *c) {
+    int wrongtype;
+    Robj *zobj = zsetLookup(c, c->argv[1], 1, &wrongtype);
+    if (wrongtype) {
+        addReply(c, shared.wrongTypeErr);
+        return;
+    }
+    if (zobj == NULL) {
+        addReply(c, shared.zero);
+        return;
+    }
+
+    Robj *member = getDecodedObject(c->argv[2]);
+    int deleted = zsetDel(zobj, member->ptr);
+    decrRefCount(member);
+    if (deleted) {
+        server.dirty++;
+        addReply(c, shared.one);
+    } else {
+        addReply(c, shared.zero);
+    }
+}
+
+/**
+ * 把db的hash table统计信息以field:value的形式追加到s后面
+ * 需要遍历整个table, O(size), 因此只在DEBUG HTSTATS中使用
+ */
+static sds catDbHtStats(sds s, int dbid) {
+    DictStats stats;
+    dictGetStats(server.dict[dbid], &stats);
+    return sdscatprintf(s,
+        "table_size:%u\r\n"
+        "keys:%u\r\n"
+        "fill_ratio:%.2f\r\n"
+        "nonempty_slots:%u\r\n"
+        "max_chain_len:%u\r\n"
+        "avg_chain_len:%.2f\r\n"
+        "bytes_used:%zu\r\n",
+        stats.size,
+        stats.used,
+        stats.size ? (float) stats.used / stats.size : 0,
+        stats.nonEmptySlots,
+        stats.maxChainLen,
+        stats.nonEmptySlots ? (float) stats.totalChainLen / stats.nonEmptySlots : 0,
+        stats.bytes);
+}
+
+static const char *maxmemoryPolicyName(int policy) {
+    switch (policy) {
+        case REDIS_MAXMEMORY_VOLATILE_LRU:
+            return "volatile-lru";
+        case REDIS_MAXMEMORY_ALLKEYS_LRU:
+            return "allkeys-lru";
+        case REDIS_MAXMEMORY_ALLKEYS_LFU:
+            return "allkeys-lfu";
+        case REDIS_MAXMEMORY_ALLKEYS_RANDOM:
+            return "allkeys-random";
+        default:
+            return "noeviction";
+    }
+}
+
+static void infoCommand(RedisClient *c) {
+    time_t uptime = time(NULL) - server.stat_starttime;
+    size_t used = zmalloc_used_memory();
+    size_t rss = zmalloc_get_rss();
+    size_t allocated, active, resident;
+    zmalloc_get_allocator_info(&allocated, &active, &resident);
+    sds info = sdscatprintf(sdsempty(),
+        "redis_version:%s\r\n"
+        "connected_clients:%d\r\n"
+        "connected_slaves:%d\r\n"
+        "used_memory:%d\r\n"
+        "mem_allocator:%s\r\n"
+        "used_memory_rss:%zu\r\n"
+        "mem_fragmentation_ratio:%.2f\r\n"
+        "allocator_allocated:%zu\r\n"
+        "allocator_active:%zu\r\n"
+        "allocator_resident:%zu\r\n"
+        "allocator_frag_ratio:%.2f\r\n"
+        "slab_count:%zu\r\n"
+        "slab_free_bytes:%zu\r\n"
+        "active_defrag_running:%d\r\n"
+        "active_defrag_hits:%lld\r\n"
+        "active_defrag_misses:%lld\r\n"
+        "active_defrag_scanned:%lld\r\n"
+        "active_defrag_cpu_milliseconds:%lld\r\n"
+        "maxmemory:%llu\r\n"
+        "maxmemory_policy:%s\r\n"
+        "evicted_keys:%lld\r\n"
+        "expired_keys:%lld\r\n"
+        "expire_cycle_cpu_milliseconds:%lld\r\n"
+        "expire_cycle_last_usec:%lld\r\n"
+        "expire_cycle_max_usec:%lld\r\n"
+        "expire_cycle_time_cap_reached:%lld\r\n"
+        "lazyfree_pending_objects:%llu\r\n"
+        "lazyfreed_objects:%lld\r\n"
+        "changes_since_last_save:%lld\r\n"
+        "last_save_time:%ld\r\n"
+        "bgsave_in_progress:%d\r\n"
+        "last_bgsave_cow_bytes:%zu\r\n"
+        "snapshot_mode:%s\r\n"
+        "last_bgsave_start_usec:%lld\r\n"
+        "snapshot_main_buckets:%lld\r\n"
+        "snapshot_main_usec:%lld\r\n"
+        "snapshot_main_max_usec:%lld\r\n"
+        "aof_enabled:%d\r\n"
+        "aof_current_size:%lld\r\n"
+        "aof_buffer_length:%zu\r\n"
+        "aof_pending_bio_fsync:%llu\r\n"
+        "aof_delayed_fsync:%lld\r\n"
+        "aof_rewrite_in_progress:%d\r\n"
+        "aof_rewrite_scheduled:%d\r\n"
+        "aof_base_size:%lld\r\n"
+        "aof_rewrite_buffer_length:%zu\r\n"
+        "aof_last_rewrite_time_sec:%ld\r\n"
+        "total_connections_received:%lld\r\n"
+        "total_commands_processed:%lld\r\n"
+        "uptime_in_seconds:%ld\r\n"
+        "uptime_in_days:%ld\r\n",
+        REDIS_VERSION,
+        listLength(server.clients) - listLength(server.slaves),
+        listLength(server.slaves),
+        server.usedmemory,
+        ZMALLOC_LIB,
+        rss,
+        used ? (double) rss / used : 0,
+        allocated,
+        active,
+        resident,
+        allocated ? (double) active / allocated : 0,
+        slabCount(),
+        slabFreeBytes(),
+        server.defragRunning,
+        server.stat_active_defrag_hits,
+        server.stat_active_defrag_misses,
+        server.stat_active_defrag_scanned,
+        server.stat_active_defrag_time_used / 1000,
+        server.maxmemory,
+        maxmemoryPolicyName(server.maxmemoryPolicy),
+        server.stat_evictedkeys,
+        server.stat_expiredkeys,
+        server.stat_expire_cycle_time_used / 1000,
+        server.stat_expire_cycle_last_us,
+        server.stat_expire_cycle_max_us,
+        server.stat_expire_cycle_time_cap_reached,
+        bioPendingJobsOfType(BIO_LAZY_FREE),
+        __atomic_load_n(&server.stat_lazyfreed_objects, __ATOMIC_RELAXED),
+        server.dirty,
+        server.lastsave,
+        server.bgsaveInProgress,
+        server.stat_bgsave_cow_bytes,
+        server.snapshotMode == REDIS_SNAPSHOT_THREAD ? "thread" : "fork",
+        server.stat_bgsave_start_us,
+        server.stat_snapshot_main_buckets,
+        server.stat_snapshot_main_us,
+        server.stat_snapshot_main_max_us,
+        server.appendonly,
+        server.aofCurrentSize,
+        sdslen(server.aofBuf),
+        bioPendingJobsOfType(BIO_AOF_FSYNC),
+        server.stat_aof_delayed_fsync,
+        server.aofChildPid != -1,
+        server.aofRewriteScheduled,
+        server.aofRewriteBaseSize,
+        sdslen(server.aofRewriteBuf) - server.aofRewriteBufSent,
+        (long) server.aofRewriteTimeLast,
+        server.stat_numconnections,
+        server.stat_numcommands,
+        uptime,
+        uptime / (3600*24));
+
+    /** keyspace: 只输出O(1)能拿到的字段，chain长度分布用DEBUG HTSTATS <db>查看 */
+    for (int j = 0; j < server.dbnum; j++) {
+        Dict *d = server.dict[j];
+        unsigned int size = dictGetHashTableSize(d);
+        unsigned int used = dictGetHashTableUsed(d);
+        if (used == 0) {
+            continue;
+        }
+        info = sdscatprintf(info, "db%d:keys=%u,expires=%u,slots=%u,fill_ratio=%.2f,bytes_used=%zu\r\n",
+            j, used, dictGetHashTableUsed(server.expires[j]), size, (float) used / size,
+            dictGetHashTableBytes(d));
+    }
+
+    addReplyBulkLen(c, sdslen(info));
+    addReplaySds(c, info);
+    addReply(c, shared.crlf);
+}
+
+/**
+ * DEBUG HTSTATS <db>: 返回db的hash table统计信息
+ */
+static void debugCommand(RedisClient *c) {
+    if (strcasecmp(c->argv[1]->ptr, "htstats") == 0) {
+        long long dbid;
+        if (getLongLongFromObject(c->argv[2], &dbid) == REDIS_ERR || dbid < 0 || dbid >= server.dbnum) {
+            addReplaySds(c, sdsnew("-ERR invalid DB index\r\n"));
+            return;
+        }
+        sds stats = catDbHtStats(sdsempty(), (int) dbid);
+        addReplyBulkLen(c, sdslen(stats));
+        addReplaySds(c, stats);
+        addReply(c, shared.crlf);
+    } else {
+        addReply(c, shared.syntaxErr);
+    }
+}
+
+/**
+ * 一个比较初级的用来从文件中读取配置的实现
+ */
+static void loadServerConfig(char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        redisLog(REDIS_WARNING, "Fatal error, can't open config file");
+        exit(1);
+    }
+
+    char buf[REDIS_CONFIGLINE_MAX+1];
+    char *err = NULL;
+    int linenum = 0;
+    sds line = NULL;
+    while (fgets(buf, REDIS_CONFIGLINE_MAX+1, fp) != NULL) {
+        linenum++;
+        line = sdsnew(buf);
+        line = sdstrim(line, "\t\r\n");
+        if (line[0] == '#' || line[0] == '\0') {
+            sdsfree(line);
+            continue;
+        }
+
+        int argc;
+        sds *argv = sdssplitlen(line, sdslen(line), " ", 1, &argc);
+        sdstolower(argv[0]);
+
+        if (strcmp(argv[0], "timeout") == 0 && argc == 2) {
+            server.maxIdleTime = atoi(argv[1]);
+            if (server.maxIdleTime < 1) {
+                err = "Invalid timeout value";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "port") == 0 && argc == 2) {
+            server.port = atoi(argv[1]);
+            if (server.port < 1 || server.port > 65535) {
+                err = "Invalid port";
+                goto loaderr;
+            } 
+        } else if (strcmp(argv[0], "bind") == 0 && argc == 2) {
+            server.bindaddr = zstrdup(argv[1]);
+        } else if (strcmp(argv[0], "save") == 0 && argc == 3) {
+            int seconds = atoi(argv[1]);
+            int changes = atoi(argv[2]);
             if (seconds < 1 || changes < 0) {
                 err = "Invalid save paramaters";
                 goto loaderr;
             }
             appendServerSaveParams(seconds, changes);
-        } else if (strcmp(argv[0], "dir") && argc == 2) {
+        } else if (strcmp(argv[0], "dir") == 0 && argc == 2) {
             if (chdir(argv[1]) == -1) {
                 redisLog(REDIS_WARNING, "Can't chdir to '%s': '%s'", argv[1], strerror(errno));
                 exit(1);
             }
-        } else if (strcmp(argv[0], "loglevel") && argc == 2) {
+        } else if (strcmp(argv[0], "loglevel") == 0 && argc == 2) {
             if (strcmp(argv[1], "debug") == 0) {
                 server.verbosity = REDIS_DEBUG;
             } else if (strcmp(argv[1], "notice") == 0) {
@@ -733,11 +7099,145 @@ static void loadServerConfig(char *filename) {
                 err = "Invalid number of databases";
                 goto loaderr;
             }
+        } else if (strcmp(argv[0], "list-max-listpack-entries") == 0 && argc == 2) {
+            server.listMaxListpackEntries = atoi(argv[1]);
+        } else if (strcmp(argv[0], "list-max-listpack-value") == 0 && argc == 2) {
+            server.listMaxListpackValue = atoi(argv[1]);
+        } else if (strcmp(argv[0], "set-max-intset-entries") == 0 && argc == 2) {
+            server.setMaxIntsetEntries = atoi(argv[1]);
+        } else if (strcmp(argv[0], "hash-max-listpack-entries") == 0 && argc == 2) {
+            server.hashMaxListpackEntries = atoi(argv[1]);
+        } else if (strcmp(argv[0], "hash-max-listpack-value") == 0 && argc == 2) {
+            server.hashMaxListpackValue = atoi(argv[1]);
+        } else if (strcmp(argv[0], "zset-max-listpack-entries") == 0 && argc == 2) {
+            server.zsetMaxListpackEntries = atoi(argv[1]);
+        } else if (strcmp(argv[0], "zset-max-listpack-value") == 0 && argc == 2) {
+            server.zsetMaxListpackValue = atoi(argv[1]);
+        } else if (strcmp(argv[0], "maxmemory") == 0 && argc == 2) {
+            int memerr;
+            long long maxmemory = memtoll(argv[1], &memerr);
+            if (memerr || maxmemory < 0) {
+                err = "Invalid maxmemory value";
+                goto loaderr;
+            }
+            server.maxmemory = maxmemory;
+        } else if (strcmp(argv[0], "maxmemory-policy") == 0 && argc == 2) {
+            sdstolower(argv[1]);
+            if (strcmp(argv[1], "volatile-lru") == 0) {
+                server.maxmemoryPolicy = REDIS_MAXMEMORY_VOLATILE_LRU;
+            } else if (strcmp(argv[1], "allkeys-lru") == 0) {
+                server.maxmemoryPolicy = REDIS_MAXMEMORY_ALLKEYS_LRU;
+            } else if (strcmp(argv[1], "allkeys-lfu") == 0) {
+                server.maxmemoryPolicy = REDIS_MAXMEMORY_ALLKEYS_LFU;
+            } else if (strcmp(argv[1], "allkeys-random") == 0) {
+                server.maxmemoryPolicy = REDIS_MAXMEMORY_ALLKEYS_RANDOM;
+            } else if (strcmp(argv[1], "noeviction") == 0) {
+                server.maxmemoryPolicy = REDIS_MAXMEMORY_NO_EVICTION;
+            } else {
+                err = "Invalid maxmemory policy";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "maxmemory-samples") == 0 && argc == 2) {
+            server.maxmemorySamples = atoi(argv[1]);
+            if (server.maxmemorySamples <= 0) {
+                err = "maxmemory-samples must be 1 or greater";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "lazyfree-threshold") == 0 && argc == 2) {
+            server.lazyfreeThreshold = strtoul(argv[1], NULL, 10);
+        } else if (strcmp(argv[0], "rdbcompression") == 0 && argc == 2) {
+            sdstolower(argv[1]);
+            if (strcmp(argv[1], "yes") == 0) {
+                server.rdbCompression = 1;
+            } else if (strcmp(argv[1], "no") == 0) {
+                server.rdbCompression = 0;
+            } else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "appendonly") == 0 && argc == 2) {
+            sdstolower(argv[1]);
+            if (strcmp(argv[1], "yes") == 0) {
+                server.appendonly = 1;
+            } else if (strcmp(argv[1], "no") == 0) {
+                server.appendonly = 0;
+            } else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "snapshot-mode") == 0 && argc == 2) {
+            sdstolower(argv[1]);
+            if (strcmp(argv[1], "fork") == 0) {
+                server.snapshotMode = REDIS_SNAPSHOT_FORK;
+            } else if (strcmp(argv[1], "thread") == 0) {
+                server.snapshotMode = REDIS_SNAPSHOT_THREAD;
+            } else {
+                err = "argument must be 'fork' or 'thread'";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "appendfilename") == 0 && argc == 2) {
+            server.appendfilename = zstrdup(argv[1]);
+        } else if (strcmp(argv[0], "appendfsync") == 0 && argc == 2) {
+            sdstolower(argv[1]);
+            if (strcmp(argv[1], "no") == 0) {
+                server.appendfsync = REDIS_AOF_FSYNC_NO;
+            } else if (strcmp(argv[1], "always") == 0) {
+                server.appendfsync = REDIS_AOF_FSYNC_ALWAYS;
+            } else if (strcmp(argv[1], "everysec") == 0) {
+                server.appendfsync = REDIS_AOF_FSYNC_EVERYSEC;
+            } else {
+                err = "argument must be 'no', 'always' or 'everysec'";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "auto-aof-rewrite-percentage") == 0 && argc == 2) {
+            server.autoAofRewritePerc = atoi(argv[1]);
+            if (server.autoAofRewritePerc < 0) {
+                err = "Invalid negative percentage for AOF auto rewrite";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "auto-aof-rewrite-min-size") == 0 && argc == 2) {
+            int memerr;
+            long long size = memtoll(argv[1], &memerr);
+            if (memerr || size < 0) {
+                err = "Invalid auto-aof-rewrite-min-size value";
+                goto loaderr;
+            }
+            server.autoAofRewriteMinSize = size;
+        } else if (strcmp(argv[0], "activedefrag") == 0 && argc == 2) {
+            sdstolower(argv[1]);
+            if (strcmp(argv[1], "yes") == 0) {
+                server.activeDefrag = 1;
+            } else if (strcmp(argv[1], "no") == 0) {
+                server.activeDefrag = 0;
+            } else {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "active-defrag-ignore-bytes") == 0 && argc == 2) {
+            int memerr;
+            long long bytes = memtoll(argv[1], &memerr);
+            if (memerr || bytes < 0) {
+                err = "Invalid active-defrag-ignore-bytes value";
+                goto loaderr;
+            }
+            server.activeDefragIgnoreBytes = bytes;
+        } else if (strcmp(argv[0], "active-defrag-threshold") == 0 && argc == 2) {
+            server.activeDefragThreshold = atoi(argv[1]);
+            if (server.activeDefragThreshold < 0) {
+                err = "active-defrag-threshold must be 0 or greater";
+                goto loaderr;
+            }
+        } else if (strcmp(argv[0], "active-defrag-cycle") == 0 && argc == 2) {
+            server.activeDefragCyclePerc = atoi(argv[1]);
+            if (server.activeDefragCyclePerc < 1 || server.activeDefragCyclePerc > 100) {
+                err = "active-defrag-cycle must be between 1 and 100";
+                goto loaderr;
+            }
         } else if (strcmp(argv[0], "slaveof") == 0 && argc == 3) {
             server.masterhost = sdsnew(argv[1]);
             server.masterport = atoi(argv[2]);
             server.replState = REDIS_REPL_CONNECT;
-        } else if (strcmp(argv[0], "glueoutputbuf" && argc == 2)) {
+        } else if (strcmp(argv[0], "glueoutputbuf") == 0 && argc == 2) {
             sdstolower(argv[1]);
             if (strcmp(argv[1], "yes") == 0) {
                 server.glueOutputBuf = 1;
@@ -747,7 +7247,7 @@ static void loadServerConfig(char *filename) {
                 err = "argument must be 'yes' or 'no'";
                 goto loaderr;
             }
-        } else if (strcmp(argv[0], "daemonize") == 0 && argc == 0) {
+        } else if (strcmp(argv[0], "daemonize") == 0 && argc == 2) {
             sdstolower(argv[1]);
             if (strcmp(argv[1], "yes") == 0) {
                 server.daemonize = 1;
@@ -768,6 +7268,8 @@ static void loadServerConfig(char *filename) {
         zfree(argv);
         sdsfree(line);
     }
+    fclose(fp);
+    return;
 
     loaderr: 
         fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
@@ -779,4 +7281,16 @@ static void loadServerConfig(char *filename) {
 
 int main(int argc, char **argv) {
     initServerConfig();
+    if (argc == 2) {
+        resetServerSaveParams();
+        loadServerConfig(argv[1]);
+    } else if (argc > 2) {
+        fprintf(stderr, "Usage: ./redis-server [/path/to/redis.conf]\n");
+        exit(1);
+    }
+    initServer();
+    loadDataFromDisk();
+    aeMain(server.el);
+    aeDeleteEventLoop(server.el);
+    return 0;
 }
@@ -13,6 +13,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <sys/time.h>
 
 static void sdsOOMAbort(void) {
     fprintf(stderr, "SDS: Out Of Memory (SDS_ABORT_ON_OOM defined)\n");
@@ -35,10 +36,29 @@ void* malloc_or_abort(size_t size) {
 }
 
 /**
- * 获取sds的header
+ * 能容纳size个字节的最小header类型
  */
-struct sdshdr *header(const sds s) {
-    return (void*) (s - (sizeof(struct sdshdr)));
+static inline char sdsReqType(size_t size) {
+    if (size < 1 << 8) {
+        return SDS_TYPE_8;
+    }
+    if (size < 1 << 16) {
+        return SDS_TYPE_16;
+    }
+    if (size < 1ll << 32) {
+        return SDS_TYPE_32;
+    }
+    return SDS_TYPE_64;
+}
+
+static inline int sdsHdrSize(char type) {
+    switch (type & SDS_TYPE_MASK) {
+        case SDS_TYPE_8: return sizeof(struct sdshdr8);
+        case SDS_TYPE_16: return sizeof(struct sdshdr16);
+        case SDS_TYPE_32: return sizeof(struct sdshdr32);
+        case SDS_TYPE_64: return sizeof(struct sdshdr64);
+    }
+    return 0;
 }
 
 /**
@@ -46,24 +66,28 @@ struct sdshdr *header(const sds s) {
  * 不会对init和initlen做check, 因为是一个server而不是一个lib，所有的调用都在可控范围内?
  */
 sds sdsnewlen(const void *init, size_t initlen) {
-    struct sdshdr *sh = malloc_or_abort(sizeof(struct sdshdr) + initlen + 1);
+    char type = sdsReqType(initlen);
+    int hdrlen = sdsHdrSize(type);
+    char *sh = malloc_or_abort(hdrlen + initlen + 1);
     if (sh == NULL) {
         return NULL;
     }
 
-    sh->len = initlen;
-    sh->free = 0;
+    // 注意: 返回的是buf, buf减去header的长度就得到header, 而header的类型保存在s[-1]中
+    sds s = sh + hdrlen;
+    s[-1] = type;
+    sdssetlen(s, initlen);
+    sdssetalloc(s, initlen);
     if (initlen) {
         if (init) {
-            memcpy(sh->buf, init, initlen);
+            memcpy(s, init, initlen);
         } else {
-            memset(sh->buf, 0, initlen);
+            memset(s, 0, initlen);
         }
     }
 
-    sh->buf[initlen] = '\0';
-    // 注意: 返回的是buf, buf减去sdshdr的长度就得到sdshdr。heap中的内存是往上增长的
-    return (char*) sh->buf;
+    s[initlen] = '\0';
+    return s;
 }
 
 sds sdsempty(void) {
@@ -75,11 +99,6 @@ sds sdsnew(const char *init) {
     return sdsnewlen(init, initlen);
 }
 
-size_t sdslen(const sds s) {
-    struct sdshdr *sh = header(s);
-    return sh->len;
-}
-
 sds sdsdup(const sds s) {
     return sdsnewlen(s, sdslen(s));
 }
@@ -91,24 +110,17 @@ void sdsfree(sds s) {
     if (s == NULL) {
         return;
     }
-    zfree(s - sizeof(struct sdshdr));
-}
-
-size_t sdsavail(sds s) {
-    struct sdshdr *sh = header(s);
-    return sh->free;
+    zfree(s - sdsHdrSize(s[-1]));
 }
 
 void sdsupdatelen(sds s) {
-    struct sdshdr *sh = header(s);
-    int reallen = strlen(s);
-    sh->free += (sh->len - reallen);
-    sh->len = reallen;
+    sdssetlen(s, strlen(s));
 }
 
 /**
  * 如果s free空间大于addlen，则什么也不做
- * 否则话扩大为(len+addlen)的两倍, len+addlen就是接下来要存储的数据的长度
+ * 否则话扩大为(len+addlen)的两倍, len+addlen就是接下来要存储的数据的长度;
+ * 但超过SDS_MAX_PREALLOC后只多预留SDS_MAX_PREALLOC, 避免64MB的写入预留128MB
  * @Notice free字段会被正确更新
  * @param addlen 新增的空间大小
  */
@@ -119,10 +131,29 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
     }
 
     size_t len = sdslen(s);
-    struct sdshdr *sh = header(s);
-    size_t newLen = (len + addlen) * 2;
+    char oldtype = s[-1] & SDS_TYPE_MASK;
+    int oldhdrlen = sdsHdrSize(oldtype);
+    size_t newLen = len + addlen;
+    if (newLen < SDS_MAX_PREALLOC) {
+        newLen *= 2;
+    } else {
+        newLen += SDS_MAX_PREALLOC;
+    }
+    char type = sdsReqType(newLen);
+    int hdrlen = sdsHdrSize(type);
+    char *newsh;
 
-    struct sdshdr *newsh = zrealloc(sh, sizeof(struct sdshdr) + newLen + 1);
+    if (type == oldtype) {
+        // header类型不变, 直接realloc
+        newsh = zrealloc(s - oldhdrlen, hdrlen + newLen + 1);
+    } else {
+        // header变大了, buf要整体往后挪, 只能重新申请
+        newsh = malloc_or_abort(hdrlen + newLen + 1);
+        if (newsh != NULL) {
+            memcpy(newsh + hdrlen, s, len + 1);
+            zfree(s - oldhdrlen);
+        }
+    }
 #ifdef SDS_ABORT_ON_OOM
     if (newsh == NULL) {
         sdsOOMAbort();
@@ -132,8 +163,58 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
         return NULL;
     }
 #endif
-    newsh->free = newLen - len;
-    return newsh->buf;
+    s = newsh + hdrlen;
+    s[-1] = type;
+    sdssetlen(s, len);
+    sdssetalloc(s, newLen);
+    return s;
+}
+
+/**
+ * 释放掉s中所有的free空间，调用之后sdsavail(s) == 0
+ * 如果len变小了，header也可能换成更小的类型
+ */
+sds sdsRemoveFreeSpace(sds s) {
+    size_t len = sdslen(s);
+    if (sdsavail(s) == 0) {
+        return s;
+    }
+
+    char oldtype = s[-1] & SDS_TYPE_MASK;
+    int oldhdrlen = sdsHdrSize(oldtype);
+    char type = sdsReqType(len);
+    int hdrlen = sdsHdrSize(type);
+    char *newsh;
+
+    if (type == oldtype) {
+        newsh = zrealloc(s - oldhdrlen, hdrlen + len + 1);
+    } else {
+        newsh = malloc_or_abort(hdrlen + len + 1);
+        if (newsh != NULL) {
+            memcpy(newsh + hdrlen, s, len + 1);
+            zfree(s - oldhdrlen);
+        }
+    }
+    if (newsh == NULL) {
+        // 收缩失败不影响s本身
+        return s;
+    }
+    s = newsh + hdrlen;
+    s[-1] = type;
+    sdssetlen(s, len);
+    sdssetalloc(s, len);
+    return s;
+}
+
+/**
+ * s实际占用的内存: header + buf + 结尾的'\0'
+ */
+size_t sdsAllocSize(sds s) {
+    return sdsHdrSize(s[-1]) + sdsalloc(s) + 1;
+}
+
+void *sdsAllocPtr(sds s) {
+    return s - sdsHdrSize(s[-1]);
 }
 
 /**
@@ -145,10 +226,8 @@ sds sdscatlen(sds s, void *t, size_t len) {
         return NULL;
     }
     size_t curlen = sdslen(s);
-    struct sdshdr *sh = header(s);
     memcpy(s+curlen, t, len);
-    sh->len = curlen + len;
-    sh->free = sh->free - len;
+    sdssetlen(s, curlen + len);
     s[curlen+len] = '\0';
     return s;
 }
@@ -165,22 +244,18 @@ sds sdscpy(sds s, char *t) {
  * 从t中拷贝len个字节覆盖s原来的值
  */
 sds sdscpylen(sds s, char *t, size_t len) {
-    struct sdshdr *sh = header(s);
-    size_t totallen = sh->free + sh->len;
+    size_t totallen = sdsalloc(s);
     
     if (totallen < len) {
-        s = sdsMakeRoomFor(s, len-totallen);
+        s = sdsMakeRoomFor(s, len-sdslen(s));
         if (s == NULL) {
             return NULL;
         }
-        sh = header(s);
-        totallen = sh->free + sh->len;
     }
 
     memcpy(s, t, len);
     s[len] = '\0';
-    sh->len = len;
-    sh->free = totallen - len;
+    sdssetlen(s, len);
     return s;
 }
 
@@ -215,13 +290,148 @@ sds sdscatprintf(sds s, const char *fmt, ...) {
     return t;
 }
 
+/**
+ * 把value的十进制表示写到s中，s至少要有SDS_LLSTR_SIZE个字节
+ * 从低位开始写，最后再反转
+ * @return 写入的长度
+ */
+static int sdsll2str(char *s, long long value) {
+    char *p, aux;
+    unsigned long long v;
+
+    // 负数先转成unsigned，这样LLONG_MIN也不会溢出
+    v = (value < 0) ? ((unsigned long long) -(value + 1)) + 1 : value;
+    p = s;
+    do {
+        *p++ = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    if (value < 0) {
+        *p++ = '-';
+    }
+
+    int len = p - s;
+    *p = '\0';
+
+    p--;
+    while (s < p) {
+        aux = *s;
+        *s = *p;
+        *p = aux;
+        s++;
+        p--;
+    }
+    return len;
+}
+
+static int sdsull2str(char *s, unsigned long long v) {
+    char *p, aux;
+
+    p = s;
+    do {
+        *p++ = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+
+    int len = p - s;
+    *p = '\0';
+
+    p--;
+    while (s < p) {
+        aux = *s;
+        *s = *p;
+        *p = aux;
+        s++;
+        p--;
+    }
+    return len;
+}
+
+/**
+ * 用整数创建一个sds, 比sdscatprintf(sdsempty(), "%lld", value)快得多
+ */
+sds sdsfromlonglong(long long value) {
+    char buf[SDS_LLSTR_SIZE];
+    int len = sdsll2str(buf, value);
+    return sdsnewlen(buf, len);
+}
+
+/**
+ * 类似于sdscatprintf, 但是不经过libc的printf, 也不需要额外的buffer, 只支持:
+ *   %s - C string
+ *   %S - sds
+ *   %i - signed int
+ *   %I - long long
+ *   %u - unsigned int
+ *   %U - unsigned long long
+ *   %% - '%'
+ */
+sds sdscatfmt(sds s, const char *fmt, ...) {
+    va_list ap;
+    const char *f = fmt;
+    char *str;
+    long long num;
+    unsigned long long unum;
+    char buf[SDS_LLSTR_SIZE];
+    int len;
+
+    va_start(ap, fmt);
+    while (*f != '\0' && s != NULL) {
+        // 普通字符一段一段地拷贝
+        const char *start = f;
+        while (*f != '\0' && *f != '%') {
+            f++;
+        }
+        if (f != start) {
+            s = sdscatlen(s, (void*) start, f - start);
+            continue;
+        }
+
+        // 跳过'%'
+        f++;
+        switch (*f) {
+            case 's':
+                str = va_arg(ap, char*);
+                s = sdscatlen(s, str, strlen(str));
+                break;
+            case 'S':
+                str = va_arg(ap, sds);
+                s = sdscatlen(s, str, sdslen(str));
+                break;
+            case 'i':
+            case 'I':
+                num = (*f == 'i') ? va_arg(ap, int) : va_arg(ap, long long);
+                len = sdsll2str(buf, num);
+                s = sdscatlen(s, buf, len);
+                break;
+            case 'u':
+            case 'U':
+                unum = (*f == 'u') ? va_arg(ap, unsigned int) : va_arg(ap, unsigned long long);
+                len = sdsull2str(buf, unum);
+                s = sdscatlen(s, buf, len);
+                break;
+            case '\0':
+                // 结尾的单个'%'原样保留
+                s = sdscatlen(s, "%", 1);
+                f--;
+                break;
+            default:
+                // %%和不认识的格式都原样输出
+                s = sdscatlen(s, (void*) f, 1);
+                break;
+        }
+        f++;
+    }
+    va_end(ap);
+    return s;
+}
+
 /**
  * 去除sds前面和后面的cset部分
  * 使用了strchr函数, 因此只要连续的开头和结尾字符在cset里面，就会trim掉，而不需要跟cset的顺序一致
  * 所以cset这个名字起的还是很有意义的
  */
 sds sdstrim(sds s, const char *cset) {
-    struct sdshdr *sh = header(s);
     char *start, *end;
     char *sp, *ep;
 
@@ -236,13 +446,12 @@ sds sdstrim(sds s, const char *cset) {
     size_t len = (sp > ep) ? 0 : (ep-sp + 1);
 
     // 前面trim
-    if (sh->buf != sp) {
-        memmove(sh->buf, sp, len);
+    if (s != sp) {
+        memmove(s, sp, len);
     }
 
-    sh->buf[len] = '\0';
-    sh->free = sh->free + (sh->len - len);
-    sh->len = len;
+    s[len] = '\0';
+    sdssetlen(s, len);
     return s;
 }
 
@@ -267,7 +476,6 @@ long backwardOrZeor(long index, long totalSize) {
  * start和end如果小于0,意味着下标是从后往前数
  */
 sds sdsrange(sds s, long start, long end) {
-    struct sdshdr *sh = header(s);
     size_t len = sdslen(s);
     if (len == 0) {
         return s;
@@ -292,11 +500,10 @@ sds sdsrange(sds s, long start, long end) {
     }
 
     if (start != 0) {
-        memmove(sh->buf, sh->buf + start, newlen);
+        memmove(s, s + start, newlen);
     }
-    sh->buf[newlen] = 0;
-    sh->free += sh->len - newlen;
-    sh->len = newlen;
+    s[newlen] = 0;
+    sdssetlen(s, newlen);
 
     return s;
 }
@@ -391,25 +598,90 @@ sds *sdssplitlen(char *s, int len, char *sep, int seplen, int *count) {
 
 /** debug */
 void display(sds s) {
-    struct sdshdr *sh = header(s);
-    printf("s value  : %s\n", sh->buf);
-    printf("s length : %ld\n", sh->len);
-    printf("s free   : %ld\n", sh->free);
+    printf("s value  : %s\n", s);
+    printf("s length : %zu\n", sdslen(s));
+    printf("s free   : %zu\n", sdsavail(s));
+    printf("s header : %d\n", sdsHdrSize(s[-1]));
+}
+
+/**
+ * 创建count个小key, 统计header的开销
+ * 旧的struct sdshdr是两个long, 每个sds固定16字节的header
+ */
+void benchmarkSmallKeys(int count) {
+    sds *keys = malloc_or_abort(sizeof(sds) * count);
+    size_t before = zmalloc_used_memory();
+    size_t hdrbytes = 0;
+    char buf[32];
+    for (int i = 0; i < count; i++) {
+        int len = snprintf(buf, sizeof(buf), "key:%d", i);
+        keys[i] = sdsnewlen(buf, len);
+        hdrbytes += sdsHdrSize(keys[i][-1]);
+    }
+    size_t used = zmalloc_used_memory() - before;
+    printf("%d small keys: %zu bytes used, %zu header bytes (16-byte headers: %zu bytes)\n",
+        count, used, hdrbytes, (size_t) count * 16);
+
+    for (int i = 0; i < count; i++) {
+        sdsfree(keys[i]);
+    }
+    zfree(keys);
+}
+
+/**
+ * 对比sdscatprintf和sdsfromlonglong/sdscatfmt转换整数的开销
+ */
+void benchmarkLongLong(int count) {
+    struct timeval start, end;
+    sds s;
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < count; i++) {
+        s = sdscatprintf(sdsempty(), "%lld", (long long) i * 7919);
+        sdsfree(s);
+    }
+    gettimeofday(&end, NULL);
+    printf("sdscatprintf:    %ld us\n", (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec));
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < count; i++) {
+        s = sdsfromlonglong((long long) i * 7919);
+        sdsfree(s);
+    }
+    gettimeofday(&end, NULL);
+    printf("sdsfromlonglong: %ld us\n", (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec));
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < count; i++) {
+        s = sdscatfmt(sdsempty(), "%I\r\n", (long long) i * 7919);
+        sdsfree(s);
+    }
+    gettimeofday(&end, NULL);
+    printf("sdscatfmt:       %ld us\n", (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec));
+
+    sds arg = sdsnew("sds");
+    s = sdscatfmt(sdsempty(), "%s|%S|%i|%I|%u|%U|%%|%", "str", arg, -1, -9223372036854775807LL - 1, 4294967295U, 18446744073709551615ULL);
+    printf("sdscatfmt check: %s\n", s);
+    sdsfree(arg);
+    sdsfree(s);
 }
 
 int main() {
+    benchmarkSmallKeys(10000000);
+    benchmarkLongLong(5000000);
+
     sds s = sdsempty();
     display(s);
 
-    sdscpy(s, "caoxy");
+    s = sdscpy(s, "caoxy");
     printf("\nafter copy caoxy\n");
     display(s);
 
-    sdscat(s, "email");
+    s = sdscat(s, "email");
     printf("\n after concat email\n");
     display(s);
 
-    sdscatlen(s, "@email.combalabala", 10);
+    s = sdscatlen(s, "@email.combalabala", 10);
     printf("\n after concat @email.combalala front 10 chars\n");
     display(s);
 
@@ -432,6 +704,10 @@ int main() {
     printf("\n after range\n");
     display(s);
 
+    s = sdsRemoveFreeSpace(s);
+    printf("\n after remove free space, alloc size: %zu\n", sdsAllocSize(s));
+    display(s);
+
     return 0;
 }
 
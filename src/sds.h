@@ -9,19 +9,115 @@
 #define __SDS_H
 
 #include <sys/types.h>
+#include <stdint.h>
 
 /**
  * Notice: remember sds is a char pointer
  */
 typedef char *sds;
 
-struct sdshdr {
-    long len;
-    long free;
+/**
+ * 根据字符串的容量选择不同宽度的header，小字符串只需要3个字节的header
+ * flags的低3位表示header的类型，flags总是紧挨着buf，因此s[-1]就是flags
+ * packed是为了去掉padding, 否则flags和buf之间可能会有空隙
+ */
+struct __attribute__ ((__packed__)) sdshdr8 {
+    uint8_t len;
+    uint8_t alloc; // 不包括header和结尾的'\0'
+    unsigned char flags;
     // flexible array
-    char buf[0];
+    char buf[];
+};
+
+struct __attribute__ ((__packed__)) sdshdr16 {
+    uint16_t len;
+    uint16_t alloc;
+    unsigned char flags;
+    char buf[];
+};
+
+struct __attribute__ ((__packed__)) sdshdr32 {
+    uint32_t len;
+    uint32_t alloc;
+    unsigned char flags;
+    char buf[];
 };
 
+struct __attribute__ ((__packed__)) sdshdr64 {
+    uint64_t len;
+    uint64_t alloc;
+    unsigned char flags;
+    char buf[];
+};
+
+#define SDS_TYPE_8  0
+#define SDS_TYPE_16 1
+#define SDS_TYPE_32 2
+#define SDS_TYPE_64 3
+#define SDS_TYPE_MASK 7
+
+/** 超过这个大小后不再翻倍预留空间, 而是只多预留这么多 */
+#define SDS_MAX_PREALLOC (1024*1024)
+
+/** long long转成字符串最多需要的字节数, 包括符号和'\0' */
+#define SDS_LLSTR_SIZE 21
+
+#define SDS_HDR(T, s) ((struct sdshdr##T *)((s) - (sizeof(struct sdshdr##T))))
+
+/**
+ * @return length of s
+ */
+static inline size_t sdslen(const sds s) {
+    switch (s[-1] & SDS_TYPE_MASK) {
+        case SDS_TYPE_8: return SDS_HDR(8, s)->len;
+        case SDS_TYPE_16: return SDS_HDR(16, s)->len;
+        case SDS_TYPE_32: return SDS_HDR(32, s)->len;
+        case SDS_TYPE_64: return SDS_HDR(64, s)->len;
+    }
+    return 0;
+}
+
+/**
+ * s的容量, 不包括header和结尾的'\0'
+ */
+static inline size_t sdsalloc(const sds s) {
+    switch (s[-1] & SDS_TYPE_MASK) {
+        case SDS_TYPE_8: return SDS_HDR(8, s)->alloc;
+        case SDS_TYPE_16: return SDS_HDR(16, s)->alloc;
+        case SDS_TYPE_32: return SDS_HDR(32, s)->alloc;
+        case SDS_TYPE_64: return SDS_HDR(64, s)->alloc;
+    }
+    return 0;
+}
+
+/**
+ * left space of s
+ */
+static inline size_t sdsavail(const sds s) {
+    return sdsalloc(s) - sdslen(s);
+}
+
+/**
+ * 只修改header中的len, 调用者需要保证newlen <= alloc
+ */
+static inline void sdssetlen(sds s, size_t newlen) {
+    switch (s[-1] & SDS_TYPE_MASK) {
+        case SDS_TYPE_8: SDS_HDR(8, s)->len = newlen; break;
+        case SDS_TYPE_16: SDS_HDR(16, s)->len = newlen; break;
+        case SDS_TYPE_32: SDS_HDR(32, s)->len = newlen; break;
+        case SDS_TYPE_64: SDS_HDR(64, s)->len = newlen; break;
+    }
+}
+
+static inline void sdssetalloc(sds s, size_t newalloc) {
+    switch (s[-1] & SDS_TYPE_MASK) {
+        case SDS_TYPE_8: SDS_HDR(8, s)->alloc = newalloc; break;
+        case SDS_TYPE_16: SDS_HDR(16, s)->alloc = newalloc; break;
+        case SDS_TYPE_32: SDS_HDR(32, s)->alloc = newalloc; break;
+        case SDS_TYPE_64: SDS_HDR(64, s)->alloc = newalloc; break;
+    }
+}
+
 /**
  * use init to initialize a new sds, the sds size is initlen
  */
@@ -36,11 +132,6 @@ sds sdsnew(const char *init);
  */
 sds sdsempty();
 
-/**
- * @return length of s
- */
-size_t sdslen(const sds s);
-
 /**
  * deep copy s
  */
@@ -49,9 +140,19 @@ sds sdsdup(sds s);
 void sdsfree(sds s);
 
 /**
- * left space of s
+ * 释放s的free空间, 返回的sds可能和s不同
  */
-size_t sdsavail(sds s);
+sds sdsRemoveFreeSpace(sds s);
+
+/**
+ * s占用的总字节数, 包括header和free空间
+ */
+size_t sdsAllocSize(sds s);
+
+/**
+ * s的header的地址, 也就是zmalloc返回的指针
+ */
+void *sdsAllocPtr(sds s);
 
 /**
  * 将t的len字节追加到s后面
@@ -69,6 +170,13 @@ sds sdscpy(sds s, char *t);
 
 sds sdscatprintf(sds s, const char *fmt, ...);
 
+/**
+ * 不经过printf的格式化, 支持%s %S %i %I %u %U %%
+ */
+sds sdscatfmt(sds s, const char *fmt, ...);
+
+sds sdsfromlonglong(long long value);
+
 sds sdstrim(sds s, const char *cset);
 
 sds sdsrange(sds s, long start, long end);
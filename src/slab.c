@@ -0,0 +1,260 @@
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "slab.h"
+#include "zmalloc.h"
+
+struct SlabCache;
+
+/**
+ * slab的header放在slab的开头, 后面是切分好的对象
+ * 空闲对象的前8个字节用来串成freelist
+ */
+typedef struct Slab {
+    struct Slab *prev;
+    struct Slab *next;
+    struct SlabCache *cache;
+    void *freelist;  // 释放过的对象
+    char *bump;      // 从来没有分配过的区域的起始位置, 避免一开始就touch整个slab
+    unsigned int inuse;
+} Slab;
+
+typedef struct SlabCache {
+    size_t objsize;
+    Slab *partial; // 还有空闲对象的slab, 满了的slab不在任何链表上
+    Slab *partialTail;
+    Slab *empty;   // 缓存一个空slab, 避免在边界上反复申请释放
+    size_t nslabs; // 这个size class的slab个数(包括缓存的空slab)
+    size_t inuse;  // 这个size class正在使用的对象个数
+    size_t nfull;  // 满了的slab个数
+} SlabCache;
+
+/** 按8字节划分的size class: 8, 16, ..., SLAB_MAX_OBJSIZE */
+#define SLAB_CLASSES (SLAB_MAX_OBJSIZE / 8)
+static SlabCache caches[SLAB_CLASSES];
+static size_t slabs = 0;
+static size_t inuseBytes = 0; // 所有slab中正在使用的对象的字节数
+
+/**
+ * 后台线程释放的对象先放到这个无锁的栈上, 由主线程归还到各自的slab
+ * 只有主线程会pop(一次取走整个栈), 所以不存在ABA问题
+ */
+static void *remoteFrees = NULL;
+static __thread int remoteFreeThread = 0;
+
+/** header之后第一个对象的偏移, 16字节对齐 */
+#define SLAB_HDR_SIZE ((sizeof(Slab) + 15) & ~((size_t) 15))
+
+static Slab *slabOf(void *ptr) {
+    return (Slab*) ((uintptr_t) ptr & ~((uintptr_t) SLAB_SIZE - 1));
+}
+
+static void slabUnlink(SlabCache *cache, Slab *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    } else {
+        cache->partialTail = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+}
+
+static void slabLinkHead(SlabCache *cache, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial != NULL) {
+        cache->partial->prev = slab;
+    } else {
+        cache->partialTail = slab;
+    }
+    cache->partial = slab;
+}
+
+static void slabLinkTail(SlabCache *cache, Slab *slab) {
+    slab->next = NULL;
+    slab->prev = cache->partialTail;
+    if (cache->partialTail != NULL) {
+        cache->partialTail->next = slab;
+    } else {
+        cache->partial = slab;
+    }
+    cache->partialTail = slab;
+}
+
+static Slab *slabCreate(SlabCache *cache) {
+    Slab *slab;
+    if (cache->empty != NULL) {
+        slab = cache->empty;
+        cache->empty = NULL;
+    } else {
+        slab = zmalloc_aligned(SLAB_SIZE, SLAB_SIZE);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slabs++;
+        cache->nslabs++;
+    }
+    slab->prev = slab->next = NULL;
+    slab->cache = cache;
+    slab->freelist = NULL;
+    slab->bump = (char*) slab + SLAB_HDR_SIZE;
+    slab->inuse = 0;
+    return slab;
+}
+
+/**
+ * 从一个partial slab中切出一个对象, slab满了就从partial中摘掉
+ */
+static void *slabAllocFrom(SlabCache *cache, Slab *slab) {
+    void *obj;
+    if (slab->freelist != NULL) {
+        obj = slab->freelist;
+        slab->freelist = *(void**) obj;
+    } else {
+        obj = slab->bump;
+        slab->bump += cache->objsize;
+    }
+    slab->inuse++;
+    inuseBytes += cache->objsize;
+    cache->inuse++;
+
+    // slab满了就从partial中摘掉
+    if (slab->freelist == NULL && slab->bump + cache->objsize > (char*) slab + SLAB_SIZE) {
+        slabUnlink(cache, slab);
+        cache->nfull++;
+    }
+    return obj;
+}
+
+void *slabMalloc(size_t size) {
+    assert(size > 0 && size <= SLAB_MAX_OBJSIZE);
+    if (__atomic_load_n(&remoteFrees, __ATOMIC_RELAXED) != NULL) {
+        slabDrainRemoteFrees();
+    }
+    SlabCache *cache = &caches[(size - 1) / 8];
+    if (cache->objsize == 0) {
+        cache->objsize = ((size + 7) / 8) * 8;
+    }
+
+    Slab *slab = cache->partial;
+    if (slab == NULL) {
+        slab = slabCreate(cache);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slabLinkHead(cache, slab);
+    }
+    return slabAllocFrom(cache, slab);
+}
+
+void slabFree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (remoteFreeThread) {
+        void *head = __atomic_load_n(&remoteFrees, __ATOMIC_RELAXED);
+        do {
+            *(void**) ptr = head;
+        } while (!__atomic_compare_exchange_n(&remoteFrees, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return;
+    }
+
+    Slab *slab = slabOf(ptr);
+    SlabCache *cache = slab->cache;
+    int wasFull = slab->freelist == NULL && slab->bump + cache->objsize > (char*) slab + SLAB_SIZE;
+
+    *(void**) ptr = slab->freelist;
+    slab->freelist = ptr;
+    slab->inuse--;
+    inuseBytes -= cache->objsize;
+    cache->inuse--;
+
+    if (wasFull) {
+        slabLinkHead(cache, slab);
+        cache->nfull--;
+    }
+    if (slab->inuse == 0) {
+        slabUnlink(cache, slab);
+        if (cache->empty == NULL) {
+            cache->empty = slab;
+        } else {
+            zfree_aligned(slab, SLAB_SIZE);
+            slabs--;
+            cache->nslabs--;
+        }
+    }
+}
+
+/** slabDefragAlloc每次最多检查partial链表开头的这么多个slab */
+#define SLAB_DEFRAG_CANDIDATES 8
+
+/**
+ * slab是否比这个size class的partial slab的平均占用率低
+ * 满的slab不算在平均值里面, 否则它们会把平均值拉高, 所有partial slab都低于平均值
+ */
+static int slabBelowPartialAverage(SlabCache *cache, Slab *slab) {
+    size_t capacity = (SLAB_SIZE - SLAB_HDR_SIZE) / cache->objsize;
+    size_t npartial = cache->nslabs - cache->nfull - (cache->empty != NULL);
+    size_t partialInuse = cache->inuse - cache->nfull * capacity;
+    return slab->inuse * npartial < partialInuse;
+}
+
+void *slabDefragAlloc(void *ptr) {
+    Slab *src = slabOf(ptr);
+    SlabCache *cache = src->cache;
+
+    // 同一个size class的slab容量都一样, inuse就是占用率
+    // 只从低于平均占用率的slab搬到不低于平均的slab, 一个slab不会既搬出又搬入, 对象不会被来回搬
+    if (!slabBelowPartialAverage(cache, src)) {
+        return NULL;
+    }
+    // 检查过的低于平均的slab挪到链表末尾, 几次之后开头就都是比较满的slab,
+    // 接下来的搬动和slabMalloc都先用它们, 稀疏的slab只出不进
+    Slab *dst = NULL;
+    for (int n = 0; n < SLAB_DEFRAG_CANDIDATES && cache->partial != NULL; n++) {
+        Slab *slab = cache->partial;
+        if (!slabBelowPartialAverage(cache, slab)) {
+            dst = slab;
+            break;
+        }
+        if (slab == cache->partialTail) {
+            break;
+        }
+        slabUnlink(cache, slab);
+        slabLinkTail(cache, slab);
+    }
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    void *obj = slabAllocFrom(cache, dst);
+    memcpy(obj, ptr, cache->objsize);
+    slabFree(ptr);
+    return obj;
+}
+
+size_t slabCount(void) {
+    return slabs;
+}
+
+size_t slabFreeBytes(void) {
+    return slabs * SLAB_SIZE - inuseBytes;
+}
+
+void slabSetRemoteFreeThread(void) {
+    remoteFreeThread = 1;
+}
+
+void slabDrainRemoteFrees(void) {
+    void *ptr = __atomic_exchange_n(&remoteFrees, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        void *next = *(void**) ptr;
+        slabFree(ptr);
+        ptr = next;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+
+/**
+ * 小对象的slab分配器
+ *
+ * Robj, DictEntry, ListNode, AeFileEvent这些固定大小的结构体占了heap的绝大部分,
+ * 每个都单独malloc的话会有额外的header开销和碎片。这里按8字节为一级划分size class,
+ * 每个size class从SLAB_SIZE大小(并且按SLAB_SIZE对齐)的slab中切分对象:
+ *   1. 每个slab有自己的freelist, 释放时通过地址对齐直接找到所属的slab
+ *   2. slab全部空闲后归还给系统(每个size class最多缓存一个空slab)
+ *   3. slab的内存通过zmalloc申请, 计入zmalloc_used_memory()
+ *   4. 只有主线程可以申请; 后台线程调用slabSetRemoteFreeThread之后可以释放, 对象由主线程延迟归还
+ */
+#define SLAB_SIZE (64*1024)
+#define SLAB_MAX_OBJSIZE 64
+
+/**
+ * 申请size个字节, size不能超过SLAB_MAX_OBJSIZE
+ * @return NULL if out of memory
+ */
+void *slabMalloc(size_t size);
+
+/**
+ * 释放slabMalloc申请的内存, 不能用于其他方式申请的内存
+ */
+void slabFree(void *ptr);
+
+/**
+ * 当前线程之后的slabFree只把对象放到一个无锁的栈上, 给后台线程使用
+ */
+void slabSetRemoteFreeThread(void);
+
+/**
+ * 把后台线程释放的对象归还到slab, 只能在主线程调用
+ * slabMalloc发现有待归还的对象时也会调用
+ */
+void slabDrainRemoteFrees(void);
+
+/**
+ * 碎片整理: ptr所在的slab比同一个size class的其他partial slab更空时, 把对象复制到更满的slab中
+ * 这样空的slab可以整个还给系统; 只能在主线程调用
+ * @return 新的地址(ptr已经释放), 不需要搬动时返回NULL
+ */
+void *slabDefragAlloc(void *ptr);
+
+/**
+ * @return 当前从系统申请的slab个数
+ */
+size_t slabCount(void);
+
+/**
+ * 已经从系统申请、但是没有分配出去的字节数
+ * 释放的对象只是回到slab的freelist, 不会减少zmalloc_used_memory(), 需要按实际使用量计算内存时减去这部分
+ */
+size_t slabFreeBytes(void);
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <math.h>
+
+#include "util.h"
+
+/**
+ * 先计算出位数，然后每次处理两位数字(查表), 从后往前写
+ * 比snprintf("%lld")快很多，也不需要申请内存
+ */
+int ll2string(char *dst, size_t dstlen, long long svalue) {
+    static const char digits[201] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    // 负数先转成unsigned，这样LLONG_MIN也不会溢出
+    unsigned long long value;
+    int negative;
+    if (svalue < 0) {
+        value = ((unsigned long long) -(svalue + 1)) + 1;
+        negative = 1;
+    } else {
+        value = svalue;
+        negative = 0;
+    }
+
+    int length = 1;
+    unsigned long long v = value;
+    while (v >= 10) {
+        length++;
+        v /= 10;
+    }
+    length += negative;
+    if ((size_t) length >= dstlen) {
+        return 0;
+    }
+
+    dst[length] = '\0';
+    int next = length - 1;
+    while (value >= 100) {
+        int const i = (value % 100) * 2;
+        value /= 100;
+        dst[next] = digits[i + 1];
+        dst[next - 1] = digits[i];
+        next -= 2;
+    }
+    if (value < 10) {
+        dst[next] = '0' + (char) value;
+    } else {
+        int i = (int) value * 2;
+        dst[next] = digits[i + 1];
+        dst[next - 1] = digits[i];
+    }
+    if (negative) {
+        dst[0] = '-';
+    }
+    return length;
+}
+
+int string2ll(const char *s, size_t slen, long long *value) {
+    const char *p = s;
+    size_t plen = 0;
+    int negative = 0;
+    unsigned long long v;
+
+    // 空字符串，或者超过了long long的最大长度(20位数字加一个符号)
+    if (slen == 0 || slen > 20) {
+        return 0;
+    }
+
+    if (slen == 1 && p[0] == '0') {
+        if (value != NULL) {
+            *value = 0;
+        }
+        return 1;
+    }
+
+    if (p[0] == '-') {
+        negative = 1;
+        p++;
+        plen++;
+        if (plen == slen) {
+            return 0;
+        }
+    }
+
+    // 第一个数字必须是1-9, 不允许前导0
+    if (p[0] >= '1' && p[0] <= '9') {
+        v = p[0] - '0';
+        p++;
+        plen++;
+    } else {
+        return 0;
+    }
+
+    while (plen < slen && p[0] >= '0' && p[0] <= '9') {
+        if (v > (ULLONG_MAX / 10)) {
+            return 0;
+        }
+        v *= 10;
+        if (v > (ULLONG_MAX - (p[0] - '0'))) {
+            return 0;
+        }
+        v += p[0] - '0';
+        p++;
+        plen++;
+    }
+
+    // 还有非数字的字符
+    if (plen < slen) {
+        return 0;
+    }
+
+    if (negative) {
+        if (v > ((unsigned long long) (-(LLONG_MIN + 1)) + 1)) {
+            return 0;
+        }
+        if (value != NULL) {
+            *value = -v;
+        }
+    } else {
+        if (v > LLONG_MAX) {
+            return 0;
+        }
+        if (value != NULL) {
+            *value = v;
+        }
+    }
+    return 1;
+}
+
+int d2string(char *buf, size_t len, double value) {
+    if (isnan(value)) {
+        return snprintf(buf, len, "nan");
+    } else if (isinf(value)) {
+        return snprintf(buf, len, value > 0 ? "inf" : "-inf");
+    } else if (value == 0) {
+        // -0也输出0
+        return snprintf(buf, len, "0");
+    }
+
+    // 2^52以内的整数可以精确地用long long表示
+    double min = -4503599627370495.0;
+    double max = 4503599627370496.0;
+    if (value > min && value < max && value == (double) (long long) value) {
+        return ll2string(buf, len, (long long) value);
+    }
+    return snprintf(buf, len, "%.17g", value);
+}
+
+long long memtoll(const char *p, int *err) {
+    long long mul = 1;
+    if (err != NULL) {
+        *err = 0;
+    }
+
+    // 单位: b, k/kb(1000/1024), m/mb, g/gb
+    const char *unit = p;
+    while (*unit == '-' || (*unit >= '0' && *unit <= '9')) {
+        unit++;
+    }
+    if (*unit == '\0' || strcasecmp(unit, "b") == 0) {
+        mul = 1;
+    } else if (strcasecmp(unit, "k") == 0) {
+        mul = 1000;
+    } else if (strcasecmp(unit, "kb") == 0) {
+        mul = 1024;
+    } else if (strcasecmp(unit, "m") == 0) {
+        mul = 1000*1000;
+    } else if (strcasecmp(unit, "mb") == 0) {
+        mul = 1024*1024;
+    } else if (strcasecmp(unit, "g") == 0) {
+        mul = 1000LL*1000*1000;
+    } else if (strcasecmp(unit, "gb") == 0) {
+        mul = 1024LL*1024*1024;
+    } else {
+        if (err != NULL) {
+            *err = 1;
+        }
+        return 0;
+    }
+
+    long long value;
+    if (unit == p || !string2ll(p, unit - p, &value)) {
+        if (err != NULL) {
+            *err = 1;
+        }
+        return 0;
+    }
+    return value * mul;
+}
+
+/** debug */
+int main() {
+    char *cases[] = {"0", "1", "-1", "12345", "007", "+1", " 1", "1 ", "-",
+        "9223372036854775807", "9223372036854775808", "-9223372036854775808", "-9223372036854775809", ""};
+    char buf[32];
+
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        long long v;
+        if (string2ll(cases[i], strlen(cases[i]), &v)) {
+            ll2string(buf, sizeof(buf), v);
+            printf("'%s' -> %lld -> '%s'\n", cases[i], v, buf);
+        } else {
+            printf("'%s' -> invalid\n", cases[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef __UTIL_H
+#define __UTIL_H
+
+#include <stddef.h>
+
+/**
+ * 把value转换成十进制字符串写到dst中(会以'\0'结尾)
+ * @return 写入的长度, dst空间不够时返回0
+ */
+int ll2string(char *dst, size_t dstlen, long long value);
+
+/**
+ * 严格地把s解析成long long: 不允许前后空格，不允许前导0, 不允许'+', 不能溢出
+ * 这样解析成功的字符串和ll2string转换回去的结果是完全相同的
+ * @return 1 if success, or else 0
+ */
+int string2ll(const char *s, size_t slen, long long *value);
+
+/**
+ * 把double转换成字符串, 整数值不带小数点和指数, 其它值保留17位有效数字, 可以无损地解析回来
+ * @return 写入的长度
+ */
+int d2string(char *buf, size_t len, double value);
+
+/**
+ * 解析配置文件中的内存大小, 例如"100mb", "1gb", "1024"
+ * k/m/g是1000的倍数, kb/mb/gb是1024的倍数
+ * @param err 不为NULL时, 格式错误设置为1
+ */
+long long memtoll(const char *p, int *err);
+
+#endif
@@ -28,45 +28,180 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "zmalloc.h"
 
-static size_t used_memory = 0;
+#ifdef HAVE_MALLOC_SIZE
+#define PREFIX_SIZE (0)
+#else
+#define PREFIX_SIZE (sizeof(size_t))
+#endif
+
+/* Used memory is kept in per-thread counters, each in its own cache line,
+ * so background threads can allocate without a lock and without bouncing
+ * a shared counter between cores. zmalloc_used_memory() sums them lazily.
+ * Memory freed by another thread than the one that allocated it makes the
+ * single counters drift (even wrap around), but the sum stays exact.
+ *
+ * Up to ZMALLOC_MAX_THREADS-1 live threads own a slot and update it with
+ * a plain load/store; any further thread shares the last slot and has to
+ * use an atomic add. A thread gives its slot back when it exits (through
+ * a pthread key destructor), so threads started per BGSAVE do not use up
+ * the private slots. The counter of a released slot is not reset: the
+ * next owner keeps adding to it and the sum stays exact. */
+#define ZMALLOC_MAX_THREADS 16
+#define ZMALLOC_CACHE_LINE 64
+
+static struct {
+    size_t used;
+    char pad[ZMALLOC_CACHE_LINE-sizeof(size_t)];
+} __attribute__((aligned(ZMALLOC_CACHE_LINE))) used_memory[ZMALLOC_MAX_THREADS];
+
+/* Bit j set means private slot j is free. */
+static uint32_t free_thread_slots = (1u<<(ZMALLOC_MAX_THREADS-1))-1;
+static pthread_key_t thread_slot_key;
+static pthread_once_t thread_slot_key_once = PTHREAD_ONCE_INIT;
+static __thread int thread_slot = -1;
+
+static void release_thread_slot(void *value) {
+    int slot = (int)(intptr_t)value-1;
+
+    /* Frees done by destructors that run after this one must not touch
+     * the slot any more, another thread may already own it. */
+    thread_slot = ZMALLOC_MAX_THREADS-1;
+    /* Release: the next owner sees our last store to the counter. */
+    __atomic_fetch_or(&free_thread_slots,1u<<slot,__ATOMIC_RELEASE);
+}
+
+static void create_thread_slot_key(void) {
+    pthread_key_create(&thread_slot_key,release_thread_slot);
+}
+
+static int acquire_thread_slot(void) {
+    uint32_t free_slots = __atomic_load_n(&free_thread_slots,__ATOMIC_RELAXED);
+
+    while (free_slots) {
+        int slot = __builtin_ctz(free_slots);
+        if (__atomic_compare_exchange_n(&free_thread_slots,&free_slots,
+                free_slots&~(1u<<slot),0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)) {
+            pthread_once(&thread_slot_key_once,create_thread_slot_key);
+            pthread_setspecific(thread_slot_key,(void*)(intptr_t)(slot+1));
+            return slot;
+        }
+    }
+    return ZMALLOC_MAX_THREADS-1;
+}
+
+static void update_zmalloc_stat(size_t delta) {
+    size_t *counter;
+
+    if (thread_slot == -1) thread_slot = acquire_thread_slot();
+    counter = &used_memory[thread_slot].used;
+    if (thread_slot < ZMALLOC_MAX_THREADS-1)
+        __atomic_store_n(counter,__atomic_load_n(counter,__ATOMIC_RELAXED)+delta,__ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(counter,delta,__ATOMIC_RELAXED);
+}
+
+#define update_zmalloc_stat_alloc(n) update_zmalloc_stat(n)
+#define update_zmalloc_stat_free(n) update_zmalloc_stat(-(size_t)(n))
 
 void *zmalloc(size_t size) {
-    void *ptr = malloc(size+sizeof(size_t));
+    void *ptr = malloc(size+PREFIX_SIZE);
 
+    if (!ptr) return NULL;
+#ifdef HAVE_MALLOC_SIZE
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+#else
     *((size_t*)ptr) = size;
-    used_memory += size+sizeof(size_t);
-    return ptr+sizeof(size_t);
+    update_zmalloc_stat_alloc(size+PREFIX_SIZE);
+    return (char*)ptr+PREFIX_SIZE;
+#endif
 }
 
 void *zrealloc(void *ptr, size_t size) {
+#ifndef HAVE_MALLOC_SIZE
     void *realptr;
+#endif
     size_t oldsize;
     void *newptr;
 
     if (ptr == NULL) return zmalloc(size);
-    realptr = ptr-sizeof(size_t);
+#ifdef HAVE_MALLOC_SIZE
+    oldsize = zmalloc_size(ptr);
+    newptr = realloc(ptr,size);
+    if (!newptr) return NULL;
+
+    update_zmalloc_stat_free(oldsize);
+    update_zmalloc_stat_alloc(zmalloc_size(newptr));
+    return newptr;
+#else
+    realptr = (char*)ptr-PREFIX_SIZE;
     oldsize = *((size_t*)realptr);
-    newptr = realloc(realptr,size+sizeof(size_t));
+    newptr = realloc(realptr,size+PREFIX_SIZE);
     if (!newptr) return NULL;
 
     *((size_t*)newptr) = size;
-    used_memory -= oldsize;
-    used_memory += size;
-    return newptr+sizeof(size_t);
+    update_zmalloc_stat_free(oldsize);
+    update_zmalloc_stat_alloc(size);
+    return (char*)newptr+PREFIX_SIZE;
+#endif
+}
+
+#ifndef HAVE_MALLOC_SIZE
+size_t zmalloc_size(void *ptr) {
+    void *realptr = (char*)ptr-PREFIX_SIZE;
+
+    return *((size_t*)realptr)+PREFIX_SIZE;
 }
+#endif
 
 void zfree(void *ptr) {
+#ifndef HAVE_MALLOC_SIZE
     void *realptr;
     size_t oldsize;
+#endif
 
     if (ptr == NULL) return;
-    realptr = ptr-sizeof(size_t);
+#ifdef HAVE_MALLOC_SIZE
+    update_zmalloc_stat_free(zmalloc_size(ptr));
+    free(ptr);
+#else
+    realptr = (char*)ptr-PREFIX_SIZE;
     oldsize = *((size_t*)realptr);
-    used_memory -= oldsize+sizeof(size_t);
+    update_zmalloc_stat_free(oldsize+PREFIX_SIZE);
     free(realptr);
+#endif
+}
+
+/* Aligned allocations can't carry the size prefix, so in prefix mode the
+ * caller has to pass the same size back to zfree_aligned(). When the
+ * allocator knows the usable size the argument is ignored. */
+void *zmalloc_aligned(size_t alignment, size_t size) {
+    void *ptr;
+
+    if (posix_memalign(&ptr,alignment,size) != 0) return NULL;
+#ifdef HAVE_MALLOC_SIZE
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+#else
+    update_zmalloc_stat_alloc(size);
+#endif
+    return ptr;
+}
+
+void zfree_aligned(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+#ifdef HAVE_MALLOC_SIZE
+    size = zmalloc_size(ptr);
+#endif
+    update_zmalloc_stat_free(size);
+    free(ptr);
 }
 
 char *zstrdup(const char *s) {
@@ -78,5 +213,160 @@ char *zstrdup(const char *s) {
 }
 
 size_t zmalloc_used_memory(void) {
-    return used_memory;
+    size_t um = 0;
+    int j;
+
+    for (j = 0; j < ZMALLOC_MAX_THREADS; j++)
+        um += __atomic_load_n(&used_memory[j].used,__ATOMIC_RELAXED);
+    return um;
+}
+
+/**
+ * 当前进程所有映射中Private_Dirty的总和(字节)
+ * 在fork出来的子进程中调用, 就是子进程自己写过、必须和父进程分开的页, 也就是这次COW的代价
+ * 只有linux有/proc/self/smaps, 其他平台返回0
+ */
+size_t zmalloc_get_private_dirty(void) {
+#if defined(__linux__)
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[1024];
+    size_t bytes = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "Private_Dirty:", 14) == 0) {
+            bytes += strtoul(line + 14, NULL, 10) * 1024;
+        }
+    }
+    fclose(fp);
+    return bytes;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * 进程的RSS(字节), 和zmalloc_used_memory()的比值就是碎片率
+ * 没有/proc的平台拿不到, 返回zmalloc_used_memory(), 碎片率就是1
+ */
+size_t zmalloc_get_rss(void) {
+#if defined(__linux__)
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return zmalloc_used_memory();
+    }
+    unsigned long size, resident;
+    int n = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    if (n != 2) {
+        return zmalloc_used_memory();
+    }
+    return (size_t) resident * sysconf(_SC_PAGESIZE);
+#else
+    return zmalloc_used_memory();
+#endif
+}
+
+/**
+ * allocator自己的统计
+ * allocated: 分配给应用的字节数; active: allocator占着的页(含页内的空洞); resident: 其中常驻内存的部分
+ * active - allocated就是allocator内部的碎片
+ * @return 1 if the allocator has these stats, otherwise 0 and all zeros
+ */
+int zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident) {
+    *allocated = *active = *resident = 0;
+#if defined(USE_JEMALLOC)
+    // stats是在epoch更新时才刷新的快照
+    uint64_t epoch = 1;
+    size_t sz = sizeof(epoch);
+    mallctl("epoch", &epoch, &sz, &epoch, sz);
+    sz = sizeof(size_t);
+    mallctl("stats.allocated", allocated, &sz, NULL, 0);
+    mallctl("stats.active", active, &sz, NULL, 0);
+    mallctl("stats.resident", resident, &sz, NULL, 0);
+    return 1;
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    // glibc没有常驻内存的统计, resident用RSS代替
+    struct mallinfo2 mi = mallinfo2();
+    *allocated = mi.uordblks + mi.hblkhd;
+    *active = mi.arena + mi.hblkhd;
+    *resident = zmalloc_get_rss();
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * 让allocator把空闲的页还给系统
+ * allocator一般只会把堆顶的空闲内存还回去, 碎片整理空出来的页在堆的中间, 需要主动通知
+ */
+void zmalloc_release_free_memory(void) {
+#if defined(USE_JEMALLOC)
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "arena.%d.purge", MALLCTL_ARENAS_ALL);
+    mallctl(cmd, NULL, NULL, NULL, 0);
+#elif defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+}
+
+#if defined(USE_JEMALLOC)
+/* experimental.utilization.query的输出, 见jemalloc的ctl.c */
+typedef struct {
+    void *slabcur_addr; // 这个bin下一次分配使用的slab
+    size_t nfree;       // ptr所在的slab的空闲region个数
+    size_t nregs;       // ptr所在的slab的region个数
+    size_t size;        // ptr所在的slab的字节数
+    size_t bin_nfree;   // 整个bin的空闲region个数
+    size_t bin_nregs;   // 整个bin的region个数
+} jemallocUtilization;
+
+/**
+ * ptr所在的slab比它所在的bin的平均占用率低时值得搬走
+ * 满的slab和bin当前正在用来分配的slab不用搬, large分配(没有bin)也不用
+ */
+static int zmalloc_defrag_hint(void *ptr) {
+    jemallocUtilization u;
+    size_t sz = sizeof(u);
+    if (mallctl("experimental.utilization.query", &u, &sz, &ptr, sizeof(ptr)) != 0) {
+        return 0;
+    }
+    if (u.nregs <= 1 || u.bin_nregs == 0 || u.nfree == 0) {
+        return 0;
+    }
+    if ((char*) ptr >= (char*) u.slabcur_addr && (char*) ptr < (char*) u.slabcur_addr + u.size) {
+        return 0;
+    }
+    // (nregs - nfree) / nregs < (bin_nregs - bin_nfree) / bin_nregs
+    return (u.nregs - u.nfree) * u.bin_nregs < (u.bin_nregs - u.bin_nfree) * u.nregs;
+}
+
+/**
+ * 如果ptr在一个比较空的slab中, 把它复制到新的内存中(绕过tcache, 否则拿回来的可能还是刚释放的那一块)
+ * 大小不变, used memory不需要更新
+ * @return 新的地址, ptr已经释放; 不需要搬动时返回NULL
+ */
+void *zmalloc_defrag_move(void *ptr) {
+    if (ptr == NULL || !zmalloc_defrag_hint(ptr)) {
+        return NULL;
+    }
+    size_t size = zmalloc_size(ptr);
+    void *newptr = mallocx(size, MALLOCX_TCACHE_NONE);
+    if (newptr == NULL) {
+        return NULL;
+    }
+    memcpy(newptr, ptr, size);
+    dallocx(ptr, MALLOCX_TCACHE_NONE);
+    return newptr;
+}
+#else
+/**
+ * 其他allocator拿不到ptr所在页的占用率, 不搬动
+ */
+void *zmalloc_defrag_move(void *ptr) {
+    (void) ptr;
+    return NULL;
 }
+#endif
@@ -31,10 +31,55 @@
 #ifndef _ZMALLOC_H
 #define _ZMALLOC_H
 
+#include <stddef.h>
+
+/* Allocator selection:
+ *  - USE_JEMALLOC: link against the system jemalloc (-DUSE_JEMALLOC -ljemalloc)
+ *  - otherwise glibc / macOS malloc, whose usable size we can query
+ *  - NO_MALLOC_SIZE forces the old mode that prefixes every block with
+ *    its size (also used on platforms without a usable size query)
+ * When the allocator can tell us the usable size we don't need the
+ * prefix, saving sizeof(size_t) per allocation, and used memory is the
+ * real footprint of the blocks instead of the requested sizes. */
+#if defined(USE_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#define ZMALLOC_LIB ("jemalloc-" JEMALLOC_VERSION)
+#define HAVE_MALLOC_SIZE 1
+#define zmalloc_size(p) malloc_usable_size(p)
+/* jemalloc can tell how full the run holding a pointer is, so blocks in
+ * sparse runs can be moved by zmalloc_defrag_move(). */
+#define HAVE_DEFRAG 1
+#elif defined(NO_MALLOC_SIZE)
+#define ZMALLOC_LIB "libc-prefix"
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#define ZMALLOC_LIB "libc"
+#define HAVE_MALLOC_SIZE 1
+#define zmalloc_size(p) malloc_usable_size(p)
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define ZMALLOC_LIB "libc"
+#define HAVE_MALLOC_SIZE 1
+#define zmalloc_size(p) malloc_size(p)
+#else
+#define ZMALLOC_LIB "libc-prefix"
+#endif
+
+#ifndef HAVE_MALLOC_SIZE
+size_t zmalloc_size(void *ptr);
+#endif
+
 void *zmalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
-void *zfree(void *ptr);
+void zfree(void *ptr);
+void *zmalloc_aligned(size_t alignment, size_t size);
+void zfree_aligned(void *ptr, size_t size);
 char *zstrdup(const char *s);
 size_t zmalloc_used_memory(void);
+size_t zmalloc_get_private_dirty(void);
+size_t zmalloc_get_rss(void);
+int zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident);
+void *zmalloc_defrag_move(void *ptr);
+void zmalloc_release_free_memory(void);
 
 #endif /* _ZMALLOC_H */
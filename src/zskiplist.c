@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zskiplist.h"
+#include "zmalloc.h"
+
+static ZSkiplistNode *zslCreateNode(int level, double score, sds ele) {
+    ZSkiplistNode *node = zmalloc(sizeof(*node) + level * sizeof(struct ZSkiplistLevel));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->score = score;
+    node->ele = ele;
+    return node;
+}
+
+ZSkiplist *zslCreate(void) {
+    ZSkiplist *zsl = zmalloc(sizeof(*zsl));
+    if (zsl == NULL) {
+        return NULL;
+    }
+    zsl->level = 1;
+    zsl->length = 0;
+    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL, 0, NULL);
+    if (zsl->header == NULL) {
+        zfree(zsl);
+        return NULL;
+    }
+    for (int j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
+        zsl->header->level[j].forward = NULL;
+        zsl->header->level[j].span = 0;
+    }
+    zsl->header->backward = NULL;
+    zsl->tail = NULL;
+    return zsl;
+}
+
+void zslFreeNode(ZSkiplistNode *node) {
+    sdsfree(node->ele);
+    zfree(node);
+}
+
+void zslFree(ZSkiplist *zsl) {
+    ZSkiplistNode *node = zsl->header->level[0].forward;
+    zfree(zsl->header);
+    while (node != NULL) {
+        ZSkiplistNode *next = node->level[0].forward;
+        zslFreeNode(node);
+        node = next;
+    }
+    zfree(zsl);
+}
+
+/**
+ * 每升高一层的概率是ZSKIPLIST_P
+ */
+static int zslRandomLevel(void) {
+    int level = 1;
+    while ((random() & 0xFFFF) < (ZSKIPLIST_P * 0xFFFF)) {
+        level++;
+    }
+    return level < ZSKIPLIST_MAXLEVEL ? level : ZSKIPLIST_MAXLEVEL;
+}
+
+/**
+ * (score, ele)是否排在node前面
+ */
+static int zslNodeBefore(ZSkiplistNode *node, double score, sds ele) {
+    return node->score < score || (node->score == score && sdscmp(node->ele, ele) < 0);
+}
+
+ZSkiplistNode *zslInsert(ZSkiplist *zsl, double score, sds ele) {
+    ZSkiplistNode *update[ZSKIPLIST_MAXLEVEL];
+    unsigned long rank[ZSKIPLIST_MAXLEVEL];
+
+    // 从最高层往下找, 记录每一层最后经过的节点和它的rank
+    ZSkiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        rank[i] = (i == zsl->level - 1) ? 0 : rank[i + 1];
+        while (x->level[i].forward != NULL && zslNodeBefore(x->level[i].forward, score, ele)) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+
+    int level = zslRandomLevel();
+    if (level > zsl->level) {
+        for (int i = zsl->level; i < level; i++) {
+            rank[i] = 0;
+            update[i] = zsl->header;
+            update[i]->level[i].span = zsl->length;
+        }
+        zsl->level = level;
+    }
+
+    x = zslCreateNode(level, score, ele);
+    if (x == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < level; i++) {
+        x->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = x;
+        // update[i]原来的span被x分成两段
+        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+    }
+    // 比x高的层只是多跨过了一个节点
+    for (int i = level; i < zsl->level; i++) {
+        update[i]->level[i].span++;
+    }
+
+    x->backward = (update[0] == zsl->header) ? NULL : update[0];
+    if (x->level[0].forward != NULL) {
+        x->level[0].forward->backward = x;
+    } else {
+        zsl->tail = x;
+    }
+    zsl->length++;
+    return x;
+}
+
+static void zslDeleteNode(ZSkiplist *zsl, ZSkiplistNode *x, ZSkiplistNode **update) {
+    for (int i = 0; i < zsl->level; i++) {
+        if (update[i]->level[i].forward == x) {
+            update[i]->level[i].span += x->level[i].span - 1;
+            update[i]->level[i].forward = x->level[i].forward;
+        } else {
+            update[i]->level[i].span -= 1;
+        }
+    }
+    if (x->level[0].forward != NULL) {
+        x->level[0].forward->backward = x->backward;
+    } else {
+        zsl->tail = x->backward;
+    }
+    while (zsl->level > 1 && zsl->header->level[zsl->level - 1].forward == NULL) {
+        zsl->level--;
+    }
+    zsl->length--;
+}
+
+/**
+ * 找到(score, ele)每一层的前驱节点
+ * @return (score, ele)对应的节点, 不存在时返回NULL
+ */
+static ZSkiplistNode *zslFindUpdate(ZSkiplist *zsl, double score, sds ele, ZSkiplistNode **update) {
+    ZSkiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL && zslNodeBefore(x->level[i].forward, score, ele)) {
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+    x = x->level[0].forward;
+    if (x != NULL && x->score == score && sdscmp(x->ele, ele) == 0) {
+        return x;
+    }
+    return NULL;
+}
+
+int zslDelete(ZSkiplist *zsl, double score, sds ele, ZSkiplistNode **node) {
+    ZSkiplistNode *update[ZSKIPLIST_MAXLEVEL];
+    ZSkiplistNode *x = zslFindUpdate(zsl, score, ele, update);
+    if (x == NULL) {
+        return 0;
+    }
+    zslDeleteNode(zsl, x, update);
+    if (node == NULL) {
+        zslFreeNode(x);
+    } else {
+        *node = x;
+    }
+    return 1;
+}
+
+ZSkiplistNode *zslUpdateScore(ZSkiplist *zsl, double curscore, sds ele, double newscore) {
+    ZSkiplistNode *update[ZSKIPLIST_MAXLEVEL];
+    ZSkiplistNode *x = zslFindUpdate(zsl, curscore, ele, update);
+    if (x == NULL) {
+        return NULL;
+    }
+
+    // 修改之后仍然在前驱和后继之间, 原地修改即可
+    if ((x->backward == NULL || x->backward->score < newscore) &&
+        (x->level[0].forward == NULL || x->level[0].forward->score > newscore)) {
+        x->score = newscore;
+        return x;
+    }
+
+    zslDeleteNode(zsl, x, update);
+    ZSkiplistNode *newnode = zslInsert(zsl, newscore, x->ele);
+    // ele已经被新节点使用了, 只释放旧节点本身
+    x->ele = NULL;
+    zfree(x);
+    return newnode;
+}
+
+unsigned long zslGetRank(ZSkiplist *zsl, double score, sds ele) {
+    unsigned long rank = 0;
+    ZSkiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL &&
+               (zslNodeBefore(x->level[i].forward, score, ele) ||
+                (x->level[i].forward->score == score && sdscmp(x->level[i].forward->ele, ele) == 0))) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (x->ele != NULL && x->score == score && sdscmp(x->ele, ele) == 0) {
+            return rank;
+        }
+    }
+    return 0;
+}
+
+ZSkiplistNode *zslGetElementByRank(ZSkiplist *zsl, unsigned long rank) {
+    unsigned long traversed = 0;
+    ZSkiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL && traversed + x->level[i].span <= rank) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        if (traversed == rank) {
+            return x == zsl->header ? NULL : x;
+        }
+    }
+    return NULL;
+}
+
+int zslValueGteMin(double value, ZRangeSpec *spec) {
+    return spec->minex ? (value > spec->min) : (value >= spec->min);
+}
+
+int zslValueLteMax(double value, ZRangeSpec *spec) {
+    return spec->maxex ? (value < spec->max) : (value <= spec->max);
+}
+
+/**
+ * 跳表和range是否有交集
+ */
+static int zslIsInRange(ZSkiplist *zsl, ZRangeSpec *range) {
+    if (range->min > range->max || (range->min == range->max && (range->minex || range->maxex))) {
+        return 0;
+    }
+    ZSkiplistNode *x = zsl->tail;
+    if (x == NULL || !zslValueGteMin(x->score, range)) {
+        return 0;
+    }
+    x = zsl->header->level[0].forward;
+    if (x == NULL || !zslValueLteMax(x->score, range)) {
+        return 0;
+    }
+    return 1;
+}
+
+ZSkiplistNode *zslFirstInRange(ZSkiplist *zsl, ZRangeSpec *range) {
+    if (!zslIsInRange(zsl, range)) {
+        return NULL;
+    }
+    ZSkiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL && !zslValueGteMin(x->level[i].forward->score, range)) {
+            x = x->level[i].forward;
+        }
+    }
+    x = x->level[0].forward;
+    return (x != NULL && zslValueLteMax(x->score, range)) ? x : NULL;
+}
+
+ZSkiplistNode *zslLastInRange(ZSkiplist *zsl, ZRangeSpec *range) {
+    if (!zslIsInRange(zsl, range)) {
+        return NULL;
+    }
+    ZSkiplistNode *x = zsl->header;
+    for (int i = zsl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward != NULL && zslValueLteMax(x->level[i].forward->score, range)) {
+            x = x->level[i].forward;
+        }
+    }
+    return (x != zsl->header && zslValueGteMin(x->score, range)) ? x : NULL;
+}
+
+/** debug */
+typedef struct ModelEntry {
+    double score;
+    char ele[16];
+} ModelEntry;
+
+static int modelCompare(const void *a, const void *b) {
+    const ModelEntry *x = a;
+    const ModelEntry *y = b;
+    if (x->score != y->score) {
+        return x->score < y->score ? -1 : 1;
+    }
+    return strcmp(x->ele, y->ele);
+}
+
+static int nodeEquals(ZSkiplistNode *node, ModelEntry *e) {
+    return node != NULL && node->score == e->score && strcmp(node->ele, e->ele) == 0;
+}
+
+/**
+ * 按level 0的顺序和backward指针遍历, 每个元素的rank和按rank查找都要和排好序的model一致
+ */
+static int checkRank(ZSkiplist *zsl, ModelEntry *model, unsigned long n) {
+    if (zsl->length != n) {
+        printf("length %lu/%lu FAIL\n", zsl->length, n);
+        return 0;
+    }
+    ZSkiplistNode *x = zsl->header->level[0].forward;
+    ZSkiplistNode *prev = NULL;
+    for (unsigned long i = 0; i < n; i++, prev = x, x = x->level[0].forward) {
+        if (!nodeEquals(x, &model[i]) || x->backward != prev) {
+            printf("order %lu FAIL\n", i);
+            return 0;
+        }
+        sds ele = sdsnew(model[i].ele);
+        unsigned long rank = zslGetRank(zsl, model[i].score, ele);
+        sdsfree(ele);
+        if (rank != i + 1 || zslGetElementByRank(zsl, i + 1) != x) {
+            printf("rank %lu: %lu FAIL\n", i + 1, rank);
+            return 0;
+        }
+    }
+    if (x != NULL || zsl->tail != prev || zslGetElementByRank(zsl, n + 1) != NULL) {
+        return 0;
+    }
+    sds missing = sdsnew("missing");
+    int ok = zslGetRank(zsl, 1.5, missing) == 0;
+    sdsfree(missing);
+    return ok;
+}
+
+/**
+ * 随机的开/闭区间, FirstInRange/LastInRange要和在model上线性扫描的结果一致
+ */
+static int checkRange(ZSkiplist *zsl, ModelEntry *model, unsigned long n, int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        ZRangeSpec range;
+        range.min = random() % 1100 - 50;
+        range.max = range.min + random() % 200 - 20;
+        range.minex = random() % 2;
+        range.maxex = random() % 2;
+
+        long first = -1;
+        long last = -1;
+        for (unsigned long i = 0; i < n; i++) {
+            if (zslValueGteMin(model[i].score, &range) && zslValueLteMax(model[i].score, &range)) {
+                if (first == -1) {
+                    first = i;
+                }
+                last = i;
+            }
+        }
+        ZSkiplistNode *f = zslFirstInRange(zsl, &range);
+        ZSkiplistNode *l = zslLastInRange(zsl, &range);
+        int ok = first == -1 ? (f == NULL && l == NULL) : (nodeEquals(f, &model[first]) && nodeEquals(l, &model[last]));
+        if (!ok) {
+            printf("range %s%g, %g%s FAIL\n", range.minex ? "(" : "[", range.min, range.max, range.maxex ? ")" : "]");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    unsigned long n = 10000;
+    ModelEntry *model = malloc(sizeof(ModelEntry) * n);
+    ZSkiplist *zsl = zslCreate();
+    srandom(1);
+    // score只有1000种, 很多元素score相同, 需要按ele排序
+    for (unsigned long i = 0; i < n; i++) {
+        model[i].score = random() % 1000;
+        snprintf(model[i].ele, sizeof(model[i].ele), "m%lu", i);
+        zslInsert(zsl, model[i].score, sdsnew(model[i].ele));
+    }
+    qsort(model, n, sizeof(ModelEntry), modelCompare);
+    printf("insert %lu, level %d: rank %s, range %s\n", n, zsl->level,
+        checkRank(zsl, model, n) ? "ok" : "FAIL", checkRange(zsl, model, n, 1000) ? "ok" : "FAIL");
+
+    // 删除一半, span要跟着更新
+    unsigned long kept = 0;
+    int ok = 1;
+    for (unsigned long i = 0; i < n; i++) {
+        if (random() % 2) {
+            sds ele = sdsnew(model[i].ele);
+            ok = ok && zslDelete(zsl, model[i].score, ele, NULL);
+            sdsfree(ele);
+        } else {
+            model[kept++] = model[i];
+        }
+    }
+    n = kept;
+    sds missing = sdsnew("missing");
+    ok = ok && !zslDelete(zsl, 1, missing, NULL);
+    sdsfree(missing);
+    printf("delete to %lu: %s, rank %s, range %s\n", n, ok ? "ok" : "FAIL",
+        checkRank(zsl, model, n) ? "ok" : "FAIL", checkRange(zsl, model, n, 1000) ? "ok" : "FAIL");
+
+    // 一部分原地修改, 一部分需要移动位置
+    ok = 1;
+    for (unsigned long i = 0; i < n; i += 3) {
+        double newscore = (i % 2) ? model[i].score + 0.5 : random() % 1000;
+        sds ele = sdsnew(model[i].ele);
+        ZSkiplistNode *node = zslUpdateScore(zsl, model[i].score, ele, newscore);
+        sdsfree(ele);
+        ok = ok && node != NULL && node->score == newscore;
+        model[i].score = newscore;
+    }
+    qsort(model, n, sizeof(ModelEntry), modelCompare);
+    printf("update score: %s, rank %s, range %s\n", ok ? "ok" : "FAIL",
+        checkRank(zsl, model, n) ? "ok" : "FAIL", checkRange(zsl, model, n, 1000) ? "ok" : "FAIL");
+
+    zslFree(zsl);
+    free(model);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef __ZSKIPLIST_H
+#define __ZSKIPLIST_H
+
+#include "sds.h"
+
+/**
+ * 有序集合使用的跳表, 按(score, ele)排序
+ *
+ * 每一层的forward指针都记录了span(跨过的节点个数), 查找时把经过的span累加起来就是rank,
+ * 所以按score查找、按rank查找、计算rank都是O(log n)
+ * ele是sds, 由跳表负责释放
+ */
+
+#define ZSKIPLIST_MAXLEVEL 32
+#define ZSKIPLIST_P 0.25
+
+typedef struct ZSkiplistNode {
+    sds ele;
+    double score;
+    struct ZSkiplistNode *backward;
+    struct ZSkiplistLevel {
+        struct ZSkiplistNode *forward;
+        unsigned long span;
+    } level[];
+} ZSkiplistNode;
+
+typedef struct ZSkiplist {
+    ZSkiplistNode *header;
+    ZSkiplistNode *tail;
+    unsigned long length;
+    int level;
+} ZSkiplist;
+
+/**
+ * score区间, minex/maxex为1时表示开区间
+ */
+typedef struct ZRangeSpec {
+    double min;
+    double max;
+    int minex;
+    int maxex;
+} ZRangeSpec;
+
+ZSkiplist *zslCreate(void);
+void zslFree(ZSkiplist *zsl);
+
+/**
+ * 插入之前需要保证ele不在跳表中
+ */
+ZSkiplistNode *zslInsert(ZSkiplist *zsl, double score, sds ele);
+
+/**
+ * @param node 不为NULL时不释放节点, 而是通过*node返回给调用者
+ * @return 1 if found and deleted
+ */
+int zslDelete(ZSkiplist *zsl, double score, sds ele, ZSkiplistNode **node);
+void zslFreeNode(ZSkiplistNode *node);
+
+/**
+ * 修改ele的score, 如果新的score不影响顺序就原地修改, 否则删除之后重新插入(复用ele)
+ * @return 修改之后的节点, 重新插入时没有内存返回NULL
+ */
+ZSkiplistNode *zslUpdateScore(ZSkiplist *zsl, double curscore, sds ele, double newscore);
+
+/**
+ * @return 1-based的rank, 不存在时返回0
+ */
+unsigned long zslGetRank(ZSkiplist *zsl, double score, sds ele);
+
+/**
+ * @param rank 1-based
+ */
+ZSkiplistNode *zslGetElementByRank(ZSkiplist *zsl, unsigned long rank);
+
+int zslValueGteMin(double value, ZRangeSpec *spec);
+int zslValueLteMax(double value, ZRangeSpec *spec);
+ZSkiplistNode *zslFirstInRange(ZSkiplist *zsl, ZRangeSpec *range);
+ZSkiplistNode *zslLastInRange(ZSkiplist *zsl, ZRangeSpec *range);
+
+#endif